@@ -0,0 +1,90 @@
+#!/bin/sh
+
+# End-to-end MojoPatch benchmark. "make bench" runs this for you.
+#
+# Generates a synthetic old/new tree pair with mktree, then times --create
+#  and an apply of the result with runbench. Each phase appends one JSON
+#  line to $BENCHRESULTS (default: bench_results.jsonl), tagged with the git
+#  revision and the mktree options, so you can compare runs over time.
+#
+# usage: bench/bench.sh <bindir> [mktree options]
+#  (bindir needs mojopatch, xdelta, mktree and runbench in it.)
+
+BINDIR="$1"
+if [ -z "$BINDIR" ]; then
+    echo "usage: $0 <bindir> [mktree options]" 1>&2
+    exit 1
+fi
+shift
+
+TREEARGS="$*"
+RESULTS="${BENCHRESULTS:-bench_results.jsonl}"
+REV=`git rev-parse --short HEAD 2>/dev/null || echo unknown`
+NOW=`date -u +%Y-%m-%dT%H:%M:%SZ`
+
+for bin in mojopatch xdelta mktree runbench; do
+    if [ ! -x "$BINDIR/$bin" ]; then
+        echo "$BINDIR/$bin is missing." 1>&2
+        if [ "$bin" = "xdelta" ]; then
+            echo "Build xdelta-1.1.3 and copy the binary next to mojopatch." 1>&2
+        fi
+        exit 1
+    fi
+done
+
+WORKDIR=`mktemp -d "${TMPDIR:-/tmp}/mojobench.XXXXXX"` || exit 1
+trap 'rm -rf "$WORKDIR"' 0 1 2 15
+
+echo "Generating trees ($TREEARGS)..."
+"$BINDIR/mktree" "$@" "$WORKDIR/tree" || exit 1
+
+OLDKB=`du -sk "$WORKDIR/tree/old" | cut -f1`
+NEWKB=`du -sk "$WORKDIR/tree/new" | cut -f1`
+NEWFILES=`find "$WORKDIR/tree/new" -type f | wc -l | tr -d ' '`
+
+# --create asks to confirm the blank version strings; say yes twice.
+printf "yy" > "$WORKDIR/answers.txt"
+touch "$WORKDIR/bench.mojopatch"
+
+echo "Timing --create..."
+"$BINDIR/runbench" --results "$RESULTS" --log "$WORKDIR/create.log" \
+    --stdin "$WORKDIR/answers.txt" \
+    --tag rev="$REV" --tag time="$NOW" --tag phase=create \
+    --tag tree="$TREEARGS" --num old_kb="$OLDKB" --num new_kb="$NEWKB" \
+    --num new_files="$NEWFILES" \
+    --size archive_bytes="$WORKDIR/bench.mojopatch" \
+    -- "$BINDIR/mojopatch" --quietonsuccess --product bench \
+       --identifier bench --create "$WORKDIR/bench.mojopatch" \
+       "$WORKDIR/tree/old" "$WORKDIR/tree/new"
+if [ $? -ne 0 ]; then
+    echo "--create failed! Log follows." 1>&2
+    cat "$WORKDIR/create.log" 1>&2
+    exit 1
+fi
+
+cp -R "$WORKDIR/tree/old" "$WORKDIR/installed" || exit 1
+
+echo "Timing apply..."
+"$BINDIR/runbench" --results "$RESULTS" --log "$WORKDIR/apply.log" \
+    --tag rev="$REV" --tag time="$NOW" --tag phase=apply \
+    --tag tree="$TREEARGS" --num old_kb="$OLDKB" --num new_kb="$NEWKB" \
+    --num new_files="$NEWFILES" \
+    --size archive_bytes="$WORKDIR/bench.mojopatch" \
+    -- "$BINDIR/mojopatch" --quietonsuccess \
+       --installdir "$WORKDIR/installed" "$WORKDIR/bench.mojopatch"
+if [ $? -ne 0 ]; then
+    echo "apply failed! Log follows." 1>&2
+    cat "$WORKDIR/apply.log" 1>&2
+    exit 1
+fi
+
+if ! diff -r "$WORKDIR/installed" "$WORKDIR/tree/new" > /dev/null; then
+    echo "Patched tree doesn't match the new tree!" 1>&2
+    exit 1
+fi
+
+echo "Results appended to $RESULTS:"
+tail -n 2 "$RESULTS"
+exit 0
+
+# end of bench.sh ...
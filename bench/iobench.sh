@@ -0,0 +1,75 @@
+#!/bin/sh
+
+# Compare MojoPatch's stdio and io_uring file i/o engines.
+#
+# This runs --create between two identical copies of a directory tree, so
+#  the time spent is all directory scanning and md5summing (no xdelta calls,
+#  and the patchfile stays tiny). Build with "make platform=unix
+#  use_io_uring=true" first, or both columns will say stdio.
+#
+# If we're root, the page cache is dropped before every run, so you're
+#  measuring the disk; otherwise you're measuring warm-cache overhead.
+#
+# usage: bench/iobench.sh <path/to/mojopatch> <source tree> [runs]
+
+MOJOPATCH="$1"
+SRCTREE="$2"
+RUNS="${3:-5}"
+
+if [ -z "$MOJOPATCH" ] || [ -z "$SRCTREE" ] || [ ! -d "$SRCTREE" ]; then
+    echo "usage: $0 <path/to/mojopatch> <source tree> [runs]" 1>&2
+    exit 1
+fi
+
+WORKDIR=`mktemp -d "${TMPDIR:-/tmp}/iobench.XXXXXX"` || exit 1
+trap 'rm -rf "$WORKDIR"' 0 1 2 15
+
+echo "Copying $SRCTREE twice..."
+cp -R "$SRCTREE" "$WORKDIR/old" || exit 1
+cp -R "$SRCTREE" "$WORKDIR/new" || exit 1
+touch "$WORKDIR/bench.mojopatch"
+
+FILES=`find "$WORKDIR/new" -type f | wc -l`
+BYTES=`du -sk "$WORKDIR/new" | cut -f1`
+echo "Tree is $FILES files, ${BYTES}KB. $RUNS runs per engine."
+
+drop_caches()
+{
+    sync
+    if [ -w /proc/sys/vm/drop_caches ]; then
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+}
+
+for engine in stdio io_uring; do
+    total=0
+    best=0
+    i=0
+    while [ $i -lt $RUNS ]; do
+        drop_caches
+        start=`date +%s%N`
+        "$MOJOPATCH" --ioengine $engine --quietonsuccess \
+                     --product iobench --identifier iobench \
+                     --version 1 --newversion 2 \
+                     --create "$WORKDIR/bench.mojopatch" \
+                     "$WORKDIR/old" "$WORKDIR/new" \
+                     < /dev/null > "$WORKDIR/log.txt" 2>&1
+        if [ $? -ne 0 ]; then
+            echo "mojopatch failed! Log follows." 1>&2
+            cat "$WORKDIR/log.txt" 1>&2
+            exit 1
+        fi
+        end=`date +%s%N`
+        ms=$(( (end - start) / 1000000 ))
+        total=$((total + ms))
+        if [ $best -eq 0 ] || [ $ms -lt $best ]; then
+            best=$ms
+        fi
+        i=$((i + 1))
+    done
+    printf "%-10s best %6dms   mean %6dms\n" $engine $best $((total / RUNS))
+done
+
+exit 0
+
+# end of iobench.sh ...
@@ -0,0 +1,228 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+/*
+ * Microbenchmark for xdelta's match extension (xdelta-1.1.3/xdmatch.h),
+ *  against the byte loop try_match() used to run (it only went int-wise
+ *  when both sides happened to share an alignment). The input is two
+ *  nearly identical buffers, like a big binary and its patched version:
+ *  a differing byte every --gap bytes, nothing else. Both directions and
+ *  a few relative alignments are timed, and the results are checked
+ *  against each other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "xdmatch.h"
+
+typedef int (*MatchFunc)(const unsigned char *x, const unsigned char *y, int len);
+
+static size_t bufsize = 64 * 1024 * 1024;
+static size_t gap = 1024 * 1024;
+static int runs = 5;
+
+
+/* try_match()'s old forward loop, more or less verbatim. */
+static int old_forward(const unsigned char *x, const unsigned char *y, int len)
+{
+    int n = 0;
+
+    if ((len > (int) (4 * sizeof (int))) &&
+        ((((size_t) x) % sizeof (int)) == (((size_t) y) % sizeof (int))))
+    {
+        const int *xi;
+        const int *yi;
+        int words;
+
+        for (; ((size_t) (x + n)) % sizeof (int); n++)
+        {
+            if (x[n] != y[n])
+                return(n);
+        } /* for */
+
+        xi = (const int *) (x + n);
+        yi = (const int *) (y + n);
+        for (words = (len - n) / sizeof (int); (words > 0) && (*xi == *yi); words--)
+        {
+            xi++;
+            yi++;
+            n += sizeof (int);
+        } /* for */
+    } /* if */
+
+    for (; (n < len) && (x[n] == y[n]); n++)
+        /* no-op */ ;
+
+    return(n);
+} /* old_forward */
+
+
+/* ...and its old backward loop, which was always bytewise. */
+static int old_backward(const unsigned char *x, const unsigned char *y, int len)
+{
+    int n;
+    for (n = 0; (n < len) && (x[-n-1] == y[-n-1]); n++)
+        /* no-op */ ;
+    return(n);
+} /* old_backward */
+
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return(((double) tv.tv_sec) + (((double) tv.tv_usec) / 1000000.0));
+} /* now */
+
+
+/* walks the whole buffer the way try_match() would; returns bytes matched. */
+static size_t scan(MatchFunc fn, int backward,
+                   const unsigned char *x, const unsigned char *y, size_t len)
+{
+    size_t total = 0;
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        size_t left = len - pos;
+        int chunk = (left > 0x7FFFFFFF) ? 0x7FFFFFFF : (int) left;
+        int same;
+
+        if (backward)
+            same = fn(x + (len - pos), y + (len - pos), chunk);
+        else
+            same = fn(x + pos, y + pos, chunk);
+
+        total += same;
+        pos += same + 1;  /* step over the mismatch. */
+    } /* while */
+
+    return(total);
+} /* scan */
+
+
+static size_t run_one(const char *name, MatchFunc fn, int backward,
+                      const unsigned char *x, const unsigned char *y,
+                      size_t len, int misalign)
+{
+    double best = 0.0;
+    size_t matched = 0;
+    int i;
+
+    for (i = 0; i < runs; i++)
+    {
+        double start = now();
+        double elapsed;
+        matched = scan(fn, backward, x, y, len);
+        elapsed = now() - start;
+        if ((i == 0) || (elapsed < best))
+            best = elapsed;
+    } /* for */
+
+    printf("%-14s %-9s misalign %d   %9.1f MB/s\n", name,
+           backward ? "backward" : "forward", misalign,
+           (best > 0.0) ? ((((double) len) / best) / (1024.0 * 1024.0)) : 0.0);
+
+    return(matched);
+} /* run_one */
+
+
+static int usage(const char *argv0)
+{
+    fprintf(stderr,
+        "USAGE: %s [--size N] [--gap N] [--runs N]\n"
+        "  --size N   (bytes per buffer; default 67108864)\n"
+        "  --gap N    (bytes between differences; default 1048576)\n"
+        "  --runs N   (best of N runs is reported; default 5)\n"
+        "\n", argv0);
+    return(1);
+} /* usage */
+
+
+int main(int argc, char **argv)
+{
+    static const int misaligns[] = { 0, 1, 3 };
+    unsigned char *xbuf;
+    unsigned char *ybuf;
+    unsigned long long rng = 1;
+    size_t i;
+    int m;
+    int retval = 0;
+
+    for (i = 1; i < (size_t) argc; i++)
+    {
+        if (i + 1 >= (size_t) argc)
+            return(usage(argv[0]));
+        else if (strcmp(argv[i], "--size") == 0)
+            bufsize = (size_t) strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--gap") == 0)
+            gap = (size_t) strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--runs") == 0)
+            runs = atoi(argv[++i]);
+        else
+            return(usage(argv[0]));
+    } /* for */
+
+    if ((bufsize == 0) || (gap == 0) || (runs <= 0))
+        return(usage(argv[0]));
+
+    /* room to slide (y) off (x)'s alignment. */
+    xbuf = (unsigned char *) malloc(bufsize + 16);
+    ybuf = (unsigned char *) malloc(bufsize + 16);
+    if ((xbuf == NULL) || (ybuf == NULL))
+    {
+        fprintf(stderr, "matchbench: out of memory.\n");
+        return(1);
+    } /* if */
+
+    for (i = 0; i < bufsize + 16; i++)
+    {
+        rng = (rng * 6364136223846793005ULL) + 1442695040888963407ULL;
+        xbuf[i] = (unsigned char) (rng >> 56);
+    } /* for */
+
+    printf("%lu byte buffers, a difference every %lu bytes, best of %d.\n",
+           (unsigned long) bufsize, (unsigned long) gap, runs);
+
+    for (m = 0; m < (int) (sizeof (misaligns) / sizeof (misaligns[0])); m++)
+    {
+        const unsigned char *x = xbuf;
+        unsigned char *y = ybuf + misaligns[m];
+        size_t a, b;
+
+        memcpy(y, x, bufsize);
+        for (i = gap - 1; i < bufsize; i += gap)
+            y[i] ^= 0xFF;
+
+        a = run_one("byte/int loop", old_forward, 0, x, y, bufsize, misaligns[m]);
+        b = run_one("xdmatch", xdmatch_forward, 0, x, y, bufsize, misaligns[m]);
+        if (a != b)
+        {
+            fprintf(stderr, "matchbench: forward results differ!\n");
+            retval = 1;
+        } /* if */
+
+        a = run_one("byte loop", old_backward, 1, x, y, bufsize, misaligns[m]);
+        b = run_one("xdmatch", xdmatch_backward, 1, x, y, bufsize, misaligns[m]);
+        if (a != b)
+        {
+            fprintf(stderr, "matchbench: backward results differ!\n");
+            retval = 1;
+        } /* if */
+    } /* for */
+
+    free(xbuf);
+    free(ybuf);
+    return(retval);
+} /* main */
+
+/* end of matchbench.c ... */
@@ -0,0 +1,396 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+/*
+ * Builds a pair of synthetic directory trees ("old" and "new") for
+ *  benchmarking. Same options and seed always give byte-for-byte
+ *  identical trees, so runs on different days/builds are comparable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+typedef enum
+{
+    EDIT_SCATTERED,  /* overwrite a few small runs all over the file. */
+    EDIT_INSERT,     /* insert a few small runs, shifting everything after. */
+    EDIT_APPEND,     /* tack data onto the end. */
+    EDIT_TRUNCATE,   /* chop some data off the end. */
+    EDIT_REWRITE     /* new data with the same size; worst case for deltas. */
+} EditPattern;
+
+static const char *edit_names[] =
+{
+    "scattered", "insert", "append", "truncate", "rewrite", NULL
+};
+
+static unsigned long long seed = 1;
+static unsigned long long rngstate = 0;
+static int filecount = 1000;
+static int dircount = -1;  /* -1 == (filecount / 20) */
+static unsigned int minsize = 512;
+static unsigned int maxsize = 4 * 1024 * 1024;
+static int logsizes = 1;
+static double added = 0.05;
+static double deleted = 0.05;
+static double modified = 0.20;
+static EditPattern editpattern = EDIT_SCATTERED;
+static int edits = 8;
+static unsigned int editsize = 64;
+static const char *outdir = NULL;
+
+static char **dirnames = NULL;
+static unsigned char *scratch = NULL;
+
+
+/* splitmix64: tiny, fast, and the same everywhere. */
+static unsigned long long rng(void)
+{
+    unsigned long long z = (rngstate += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return(z ^ (z >> 31));
+} /* rng */
+
+
+static double rng_unit(void)
+{
+    return((double) (rng() >> 11) * (1.0 / 9007199254740992.0));
+} /* rng_unit */
+
+
+static void rng_fill(unsigned char *buf, size_t len)
+{
+    while (len >= 8)
+    {
+        unsigned long long x = rng();
+        memcpy(buf, &x, 8);
+        buf += 8;
+        len -= 8;
+    } /* while */
+
+    if (len > 0)
+    {
+        unsigned long long x = rng();
+        memcpy(buf, &x, len);
+    } /* if */
+} /* rng_fill */
+
+
+static unsigned int pick_size(void)
+{
+    double range;
+    if (maxsize <= minsize)
+        return(minsize);
+
+    if (!logsizes)
+        return(minsize + (unsigned int) (rng_unit() * (maxsize - minsize)));
+
+    /* log-uniform: lots of small files, a few big ones. Like real life. */
+    range = log((double) maxsize) - log((double) (minsize ? minsize : 1));
+    return((unsigned int) exp(log((double) (minsize ? minsize : 1)) +
+                              (rng_unit() * range)));
+} /* pick_size */
+
+
+static int make_dir(const char *path)
+{
+    if ((mkdir(path, 0755) == -1) && (errno != EEXIST))
+    {
+        fprintf(stderr, "mktree: mkdir(%s) failed: %s\n", path, strerror(errno));
+        return(0);
+    } /* if */
+    return(1);
+} /* make_dir */
+
+
+static int write_file(const char *path, const unsigned char *buf, size_t len)
+{
+    FILE *io = fopen(path, "wb");
+    if (io == NULL)
+    {
+        fprintf(stderr, "mktree: can't create %s: %s\n", path, strerror(errno));
+        return(0);
+    } /* if */
+
+    if ((len > 0) && (fwrite(buf, len, 1, io) != 1))
+    {
+        fprintf(stderr, "mktree: write to %s failed: %s\n", path, strerror(errno));
+        fclose(io);
+        return(0);
+    } /* if */
+
+    if (fclose(io) == EOF)
+    {
+        fprintf(stderr, "mktree: close of %s failed: %s\n", path, strerror(errno));
+        return(0);
+    } /* if */
+
+    return(1);
+} /* write_file */
+
+
+static int make_dirs(const char *root)
+{
+    char path[1024];
+    int i;
+
+    dirnames = (char **) calloc(dircount, sizeof (char *));
+    if (dirnames == NULL)
+        return(0);
+
+    dirnames[0] = strdup("");
+    for (i = 1; i < dircount; i++)
+    {
+        /* random parent among the dirs we already have: gives a ragged tree. */
+        const char *parent = dirnames[rng() % i];
+        snprintf(path, sizeof (path), "%s%sdir%04d", parent, *parent ? "/" : "", i);
+        dirnames[i] = strdup(path);
+    } /* for */
+
+    for (i = 0; i < dircount; i++)
+    {
+        snprintf(path, sizeof (path), "%s/old/%s", root, dirnames[i]);
+        if (!make_dir(path))
+            return(0);
+        snprintf(path, sizeof (path), "%s/new/%s", root, dirnames[i]);
+        if (!make_dir(path))
+            return(0);
+    } /* for */
+
+    return(1);
+} /* make_dirs */
+
+
+/* edit (buf) in place for the new tree; returns the new length. */
+static size_t apply_edits(unsigned char *buf, size_t len, size_t bufsize)
+{
+    int i;
+    size_t run;
+
+    switch (editpattern)
+    {
+        case EDIT_SCATTERED:
+            for (i = 0; (i < edits) && (len > 0); i++)
+            {
+                size_t pos = (size_t) (rng() % len);
+                run = (editsize < (len - pos)) ? editsize : (len - pos);
+                rng_fill(buf + pos, run);
+            } /* for */
+            return(len);
+
+        case EDIT_INSERT:
+            for (i = 0; i < edits; i++)
+            {
+                size_t pos = (len > 0) ? (size_t) (rng() % len) : 0;
+                run = editsize;
+                if ((len + run) > bufsize)
+                    break;
+                memmove(buf + pos + run, buf + pos, len - pos);
+                rng_fill(buf + pos, run);
+                len += run;
+            } /* for */
+            return(len);
+
+        case EDIT_APPEND:
+            run = (size_t) edits * editsize;
+            if ((len + run) > bufsize)
+                run = bufsize - len;
+            rng_fill(buf + len, run);
+            return(len + run);
+
+        case EDIT_TRUNCATE:
+            run = (size_t) edits * editsize;
+            return((run < len) ? (len - run) : 0);
+
+        case EDIT_REWRITE:
+            rng_fill(buf, len);
+            return(len);
+    } /* switch */
+
+    return(len);
+} /* apply_edits */
+
+
+static int make_files(const char *root)
+{
+    size_t bufsize = (size_t) maxsize + ((size_t) edits * editsize) + 1;
+    int newfiles = (int) (filecount * added);
+    int total = filecount + newfiles;
+    char path[1024];
+    int i;
+
+    scratch = (unsigned char *) malloc(bufsize);
+    if (scratch == NULL)
+    {
+        fprintf(stderr, "mktree: out of memory.\n");
+        return(0);
+    } /* if */
+
+    for (i = 0; i < total; i++)
+    {
+        const char *dir = dirnames[rng() % dircount];
+        size_t len = pick_size();
+        int in_old = (i < filecount);
+        int in_new = 1;
+        int changed = 0;
+        double roll = rng_unit();
+
+        if (in_old)
+        {
+            if (roll < deleted)
+                in_new = 0;
+            else if (roll < (deleted + modified))
+                changed = 1;
+        } /* if */
+
+        rng_fill(scratch, len);
+
+        if (in_old)
+        {
+            snprintf(path, sizeof (path), "%s/old/%s%sfile%06d.dat",
+                     root, dir, *dir ? "/" : "", i);
+            if (!write_file(path, scratch, len))
+                return(0);
+        } /* if */
+
+        if (in_new)
+        {
+            if (changed)
+                len = apply_edits(scratch, len, bufsize);
+            snprintf(path, sizeof (path), "%s/new/%s%sfile%06d.dat",
+                     root, dir, *dir ? "/" : "", i);
+            if (!write_file(path, scratch, len))
+                return(0);
+        } /* if */
+    } /* for */
+
+    return(1);
+} /* make_files */
+
+
+static int usage(const char *argv0)
+{
+    fprintf(stderr,
+        "USAGE: %s [options] <outdir>\n"
+        "  Writes <outdir>/old and <outdir>/new.\n"
+        "\n"
+        "  --seed N          (PRNG seed; default 1)\n"
+        "  --files N         (files in the old tree; default 1000)\n"
+        "  --dirs N          (directories; default files/20)\n"
+        "  --minsize N       (smallest file, in bytes; default 512)\n"
+        "  --maxsize N       (biggest file, in bytes; default 4194304)\n"
+        "  --sizes log|uniform  (size distribution; default log)\n"
+        "  --added F         (fraction of new files to add; default 0.05)\n"
+        "  --deleted F       (fraction of old files to delete; default 0.05)\n"
+        "  --modified F      (fraction of old files to change; default 0.20)\n"
+        "  --edit PATTERN    (scattered, insert, append, truncate, rewrite)\n"
+        "  --edits N         (edits per changed file; default 8)\n"
+        "  --editsize N      (bytes per edit; default 64)\n"
+        "\n", argv0);
+    return(1);
+} /* usage */
+
+
+int main(int argc, char **argv)
+{
+    char path[1024];
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strncmp(arg, "--", 2) != 0)
+        {
+            if (outdir != NULL)
+                return(usage(argv[0]));
+            outdir = arg;
+            continue;
+        } /* if */
+
+        if (val == NULL)
+            return(usage(argv[0]));
+        i++;
+
+        if (strcmp(arg, "--seed") == 0)
+            seed = strtoull(val, NULL, 10);
+        else if (strcmp(arg, "--files") == 0)
+            filecount = atoi(val);
+        else if (strcmp(arg, "--dirs") == 0)
+            dircount = atoi(val);
+        else if (strcmp(arg, "--minsize") == 0)
+            minsize = (unsigned int) strtoul(val, NULL, 10);
+        else if (strcmp(arg, "--maxsize") == 0)
+            maxsize = (unsigned int) strtoul(val, NULL, 10);
+        else if (strcmp(arg, "--sizes") == 0)
+            logsizes = (strcmp(val, "uniform") != 0);
+        else if (strcmp(arg, "--added") == 0)
+            added = atof(val);
+        else if (strcmp(arg, "--deleted") == 0)
+            deleted = atof(val);
+        else if (strcmp(arg, "--modified") == 0)
+            modified = atof(val);
+        else if (strcmp(arg, "--edits") == 0)
+            edits = atoi(val);
+        else if (strcmp(arg, "--editsize") == 0)
+            editsize = (unsigned int) strtoul(val, NULL, 10);
+        else if (strcmp(arg, "--edit") == 0)
+        {
+            int e;
+            for (e = 0; edit_names[e] != NULL; e++)
+            {
+                if (strcmp(edit_names[e], val) == 0)
+                    break;
+            } /* for */
+
+            if (edit_names[e] == NULL)
+                return(usage(argv[0]));
+            editpattern = (EditPattern) e;
+        } /* else if */
+        else
+        {
+            fprintf(stderr, "mktree: Unknown option [%s].\n", arg);
+            return(usage(argv[0]));
+        } /* else */
+    } /* for */
+
+    if ((outdir == NULL) || (filecount < 0) || (edits < 0))
+        return(usage(argv[0]));
+
+    if (dircount < 0)
+        dircount = filecount / 20;
+    if (dircount < 1)
+        dircount = 1;
+
+    rngstate = seed;
+
+    snprintf(path, sizeof (path), "%s/old", outdir);
+    if ((!make_dir(outdir)) || (!make_dir(path)))
+        return(1);
+    snprintf(path, sizeof (path), "%s/new", outdir);
+    if (!make_dir(path))
+        return(1);
+
+    if ((!make_dirs(outdir)) || (!make_files(outdir)))
+        return(1);
+
+    for (i = 0; i < dircount; i++)
+        free(dirnames[i]);
+    free(dirnames);
+    free(scratch);
+    return(0);
+} /* main */
+
+/* end of mktree.c ... */
@@ -0,0 +1,298 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+/*
+ * Runs one command and appends a JSON line to a results file with what it
+ *  cost: wall time, CPU time, peak RSS and bytes moved. Child processes
+ *  (like xdelta) are counted too, as long as the command waits for them.
+ *
+ * This is Linux-flavored: byte counts come from /proc/<pid>/io, which we
+ *  read while the command is a zombie, before reaping it. Elsewhere those
+ *  fields are left out and you just get the getrusage() numbers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAX_FIELDS 64
+
+typedef struct
+{
+    const char *key;
+    const char *val;
+    int is_number;
+} Field;
+
+static Field fields[MAX_FIELDS];
+static int fieldcount = 0;
+
+
+static int add_field(const char *keyval, int is_number)
+{
+    char *eq = strchr(keyval, '=');
+    char *key;
+
+    if ((eq == NULL) || (fieldcount >= MAX_FIELDS))
+        return(0);
+
+    key = strdup(keyval);
+    key[eq - keyval] = '\0';
+    fields[fieldcount].key = key;
+    fields[fieldcount].val = key + (eq - keyval) + 1;
+    fields[fieldcount].is_number = is_number;
+    fieldcount++;
+    return(1);
+} /* add_field */
+
+
+static void json_string(FILE *io, const char *str)
+{
+    fputc('"', io);
+    for (; *str; str++)
+    {
+        unsigned char ch = (unsigned char) *str;
+        if ((ch == '"') || (ch == '\\'))
+            fprintf(io, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(io, "\\u%04x", ch);
+        else
+            fputc(ch, io);
+    } /* for */
+    fputc('"', io);
+} /* json_string */
+
+
+static double timeval_ms(const struct timeval *tv)
+{
+    return((tv->tv_sec * 1000.0) + (tv->tv_usec / 1000.0));
+} /* timeval_ms */
+
+
+/* (io) gets the /proc/<pid>/io counters, if we can get them. */
+static int read_proc_io(pid_t pid, long long *rchar, long long *wchar,
+                        long long *rbytes, long long *wbytes)
+{
+    char buf[128];
+    FILE *io;
+    int found = 0;
+
+    snprintf(buf, sizeof (buf), "/proc/%d/io", (int) pid);
+    io = fopen(buf, "r");
+    if (io == NULL)
+        return(0);
+
+    while (fgets(buf, sizeof (buf), io) != NULL)
+    {
+        long long val;
+        if (sscanf(buf, "rchar: %lld", &val) == 1)
+            *rchar = val, found++;
+        else if (sscanf(buf, "wchar: %lld", &val) == 1)
+            *wchar = val, found++;
+        else if (sscanf(buf, "read_bytes: %lld", &val) == 1)
+            *rbytes = val, found++;
+        else if (sscanf(buf, "write_bytes: %lld", &val) == 1)
+            *wbytes = val, found++;
+    } /* while */
+
+    fclose(io);
+    return(found == 4);
+} /* read_proc_io */
+
+
+static int usage(const char *argv0)
+{
+    fprintf(stderr,
+        "USAGE: %s [options] -- <command> [args...]\n"
+        "\n"
+        "  --results FILE    (append the JSON line here; default stdout)\n"
+        "  --tag KEY=VAL     (add a string field to the record)\n"
+        "  --num KEY=VAL     (add a numeric field to the record)\n"
+        "  --size KEY=PATH   (after the run, record PATH's size in bytes)\n"
+        "  --stdin FILE      (feed FILE to the command's stdin)\n"
+        "  --log FILE        (send the command's stdout/stderr here)\n"
+        "\n", argv0);
+    return(2);
+} /* usage */
+
+
+int main(int argc, char **argv)
+{
+    const char *resultsfname = NULL;
+    const char *stdinfname = "/dev/null";
+    const char *logfname = "/dev/null";
+    const char *sizes[MAX_FIELDS];
+    int sizecount = 0;
+    struct timespec start, end;
+    struct rusage ru;
+    siginfo_t info;
+    long long rchar = 0, wchar = 0, rbytes = 0, wbytes = 0;
+    int have_io = 0;
+    int status = 0;
+    FILE *out = stdout;
+    pid_t pid;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--") == 0)
+        {
+            i++;
+            break;
+        } /* if */
+
+        if (i + 1 >= argc)
+            return(usage(argv[0]));
+
+        if (strcmp(argv[i], "--results") == 0)
+            resultsfname = argv[++i];
+        else if (strcmp(argv[i], "--stdin") == 0)
+            stdinfname = argv[++i];
+        else if (strcmp(argv[i], "--log") == 0)
+            logfname = argv[++i];
+        else if (strcmp(argv[i], "--tag") == 0)
+        {
+            if (!add_field(argv[++i], 0))
+                return(usage(argv[0]));
+        } /* else if */
+        else if (strcmp(argv[i], "--num") == 0)
+        {
+            if (!add_field(argv[++i], 1))
+                return(usage(argv[0]));
+        } /* else if */
+        else if (strcmp(argv[i], "--size") == 0)
+        {
+            if ((sizecount >= MAX_FIELDS) || (strchr(argv[i+1], '=') == NULL))
+                return(usage(argv[0]));
+            sizes[sizecount++] = argv[++i];
+        } /* else if */
+        else
+        {
+            fprintf(stderr, "runbench: Unknown option [%s].\n", argv[i]);
+            return(usage(argv[0]));
+        } /* else */
+    } /* for */
+
+    if (i >= argc)
+        return(usage(argv[0]));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid = fork();
+    if (pid == -1)
+    {
+        fprintf(stderr, "runbench: fork() failed: %s\n", strerror(errno));
+        return(2);
+    } /* if */
+
+    else if (pid == 0)  /* child process. */
+    {
+        int infd = open(stdinfname, O_RDONLY);
+        int logfd = open(logfname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if ((infd == -1) || (logfd == -1))
+            _exit(127);
+        dup2(infd, 0);
+        dup2(logfd, 1);
+        dup2(logfd, 2);
+        close(infd);
+        close(logfd);
+        execvp(argv[i], argv + i);
+        _exit(127);
+    } /* else if */
+
+    /* wait for it to die, but leave the zombie so /proc/<pid>/io is there. */
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1)
+    {
+        if (errno != EINTR)
+        {
+            fprintf(stderr, "runbench: waitid() failed: %s\n", strerror(errno));
+            return(2);
+        } /* if */
+    } /* while */
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    have_io = read_proc_io(pid, &rchar, &wchar, &rbytes, &wbytes);
+
+    if (wait4(pid, &status, 0, &ru) == -1)
+    {
+        fprintf(stderr, "runbench: wait4() failed: %s\n", strerror(errno));
+        return(2);
+    } /* if */
+
+    if (resultsfname != NULL)
+    {
+        out = fopen(resultsfname, "a");
+        if (out == NULL)
+        {
+            fprintf(stderr, "runbench: can't open %s: %s\n",
+                    resultsfname, strerror(errno));
+            return(2);
+        } /* if */
+    } /* if */
+
+    fprintf(out, "{");
+    for (i = 0; i < fieldcount; i++)
+    {
+        json_string(out, fields[i].key);
+        fputc(':', out);
+        if (fields[i].is_number)
+            fputs(fields[i].val, out);
+        else
+            json_string(out, fields[i].val);
+        fputs(", ", out);
+    } /* for */
+
+    fprintf(out, "\"exit\": %d, ",
+            WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+    fprintf(out, "\"wall_ms\": %.3f, ",
+            ((end.tv_sec - start.tv_sec) * 1000.0) +
+            ((end.tv_nsec - start.tv_nsec) / 1000000.0));
+    fprintf(out, "\"user_ms\": %.3f, ", timeval_ms(&ru.ru_utime));
+    fprintf(out, "\"sys_ms\": %.3f, ", timeval_ms(&ru.ru_stime));
+    fprintf(out, "\"max_rss_kb\": %ld", ru.ru_maxrss);
+
+    if (have_io)
+    {
+        fprintf(out, ", \"read_bytes\": %lld, \"write_bytes\": %lld", rchar, wchar);
+        fprintf(out, ", \"disk_read_bytes\": %lld, \"disk_write_bytes\": %lld",
+                rbytes, wbytes);
+    } /* if */
+
+    for (i = 0; i < sizecount; i++)
+    {
+        struct stat statbuf;
+        const char *eq = strchr(sizes[i], '=');
+        char *key = strdup(sizes[i]);
+        key[eq - sizes[i]] = '\0';
+        fputs(", ", out);
+        json_string(out, key);
+        if (stat(eq + 1, &statbuf) == 0)
+            fprintf(out, ": %lld", (long long) statbuf.st_size);
+        else
+            fputs(": null", out);
+        free(key);
+    } /* for */
+
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    return(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+} /* main */
+
+/* end of runbench.c ... */
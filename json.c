@@ -0,0 +1,28 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include "json.h"
+
+void json_string(FILE *io, const char *str)
+{
+    fputc('"', io);
+    for (; *str; str++)
+    {
+        unsigned char ch = (unsigned char) *str;
+        if ((ch == '"') || (ch == '\\'))
+            fprintf(io, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(io, "\\u%04x", ch);
+        else
+            fputc(ch, io);
+    } /* for */
+    fputc('"', io);
+} /* json_string */
+
+/* end of json.c ... */
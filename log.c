@@ -0,0 +1,225 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if USE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#include "ringbuf.h"
+#endif
+
+#include "platform.h"
+#include "log.h"
+
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+static FILE *log_io = NULL;
+static char *log_fname = NULL;
+static char *log_iobuf = NULL;
+static double log_epoch = 0.0;
+static LogLevel log_level = LOGLEVEL_INFO;
+static int log_failed = 0;  /* writer can't _fatal(); tell log_close(). */
+
+static const char *level_prefix[] = { "fatal: ", "", "debug: " };
+
+static void write_line(double ts, LogLevel level, const char *str)
+{
+    if (fprintf(log_io, "[%10.3f] %s%s\n", ts, level_prefix[level], str) < 0)
+        log_failed = 1;
+} /* write_line */
+
+
+#if USE_PTHREAD
+#define LOG_QUEUE_SLOTS 512
+#define LOG_IDLE_USECS 10000
+
+static RingBuffer *log_queue = NULL;
+static pthread_t log_thread;
+static int log_thread_quit = 0;  /* use atomics on this. */
+
+typedef struct
+{
+    double ts;
+    LogLevel level;
+    char str[LOG_LINE_MAX];
+} LogRecord;
+
+
+static void *log_thread_main(void *arg)
+{
+    LogRecord rec;
+
+    while (1)
+    {
+        if (ringbuf_pop(log_queue, &rec))
+            write_line(rec.ts, rec.level, rec.str);
+        else if (__atomic_load_n(&log_thread_quit, __ATOMIC_ACQUIRE))
+        {
+            /* quit was set after the last push, so one more pass gets all. */
+            while (ringbuf_pop(log_queue, &rec))
+                write_line(rec.ts, rec.level, rec.str);
+            break;
+        } /* else if */
+        else
+        {
+            /* ran dry: a good time to push out what we have. */
+            if (fflush(log_io) == EOF)
+                log_failed = 1;
+            usleep(LOG_IDLE_USECS);
+        } /* else */
+    } /* while */
+
+    return(NULL);
+} /* log_thread_main */
+
+
+static int start_log_thread(void)
+{
+    log_queue = ringbuf_create(LOG_QUEUE_SLOTS, sizeof (LogRecord));
+    if (log_queue == NULL)
+        return(0);
+
+    log_thread_quit = 0;
+    if (pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0)
+    {
+        ringbuf_destroy(log_queue);
+        log_queue = NULL;
+        return(0);
+    } /* if */
+
+    return(1);
+} /* start_log_thread */
+
+
+static void stop_log_thread(void)
+{
+    __atomic_store_n(&log_thread_quit, 1, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+    ringbuf_destroy(log_queue);
+    log_queue = NULL;
+} /* stop_log_thread */
+#endif
+
+
+int log_init(const char *fname, LogLevel level)
+{
+    if (fname == NULL)
+        return(1);
+
+    log_io = fopen(fname, "w");
+    if (log_io == NULL)
+    {
+        _fatal("Couldn't open [%s] for writing log.", fname);
+        return(0);
+    } /* if */
+
+    log_fname = (char *) malloc(strlen(fname) + 1);
+    log_iobuf = (char *) malloc(LOG_BUFFER_SIZE);
+    if ((log_fname == NULL) || (log_iobuf == NULL))
+    {
+        fclose(log_io);
+        log_io = NULL;
+        free(log_fname);
+        log_fname = NULL;
+        free(log_iobuf);
+        log_iobuf = NULL;
+        _fatal("Out of memory.");
+        return(0);
+    } /* if */
+
+    strcpy(log_fname, fname);
+    setvbuf(log_io, log_iobuf, _IOFBF, LOG_BUFFER_SIZE);
+    log_epoch = get_monotonic_time();
+    log_level = level;
+    log_failed = 0;
+
+    #if USE_PTHREAD
+    if (!start_log_thread())
+    {
+        FILE *io = log_io;
+        log_io = NULL;  /* so _fatal() doesn't come back here. */
+        fclose(io);
+        free(log_fname);
+        log_fname = NULL;
+        free(log_iobuf);
+        log_iobuf = NULL;
+        _fatal("Couldn't start log writer thread.");
+        return(0);
+    } /* if */
+    #endif
+
+    return(1);
+} /* log_init */
+
+
+int log_wants(LogLevel level)
+{
+    return((log_io != NULL) && (level <= log_level));
+} /* log_wants */
+
+
+void log_write(LogLevel level, const char *str)
+{
+    double ts;
+
+    if (!log_wants(level))
+        return;
+
+    ts = get_monotonic_time() - log_epoch;
+
+    #if USE_PTHREAD
+    {
+        LogRecord rec;
+        size_t len = strlen(str);
+        if (len >= sizeof (rec.str))
+            len = sizeof (rec.str) - 1;
+        memcpy(rec.str, str, len);  /* not strncpy(); don't pad 512 bytes. */
+        rec.str[len] = '\0';
+        rec.ts = ts;
+        rec.level = level;
+        while (!ringbuf_push(log_queue, &rec))
+            usleep(1000);  /* writer's behind; don't lose lines. */
+    }
+    #else
+    write_line(ts, level, str);
+    if (level == LOGLEVEL_FATAL)  /* we might not get a chance later. */
+        fflush(log_io);
+    #endif
+} /* log_write */
+
+
+int log_close(void)
+{
+    FILE *io = log_io;
+    int retval = 1;
+
+    if (io == NULL)
+        return(1);
+
+    #if USE_PTHREAD
+    stop_log_thread();
+    #endif
+
+    log_io = NULL;
+    if ((fclose(io) == EOF) || (log_failed))
+    {
+        _fatal("Couldn't write log to [%s].", log_fname);
+        retval = 0;
+    } /* if */
+
+    free(log_fname);
+    log_fname = NULL;
+    free(log_iobuf);
+    log_iobuf = NULL;
+    return(retval);
+} /* log_close */
+
+/* end of log.c ... */
@@ -0,0 +1,46 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#ifndef _INCL_LOG_H_
+#define _INCL_LOG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The --logfile sink behind _log(), _dlog() and _fatal(). The UI still gets
+ *  its copy straight from those; this is just the file. In pthread builds,
+ *  lines go onto a lock-free ring and a writer thread does the actual
+ *  (buffered) file i/o, so logging costs the caller a vsnprintf and a copy.
+ *  Lines above the level given to log_init() are dropped; ask log_wants()
+ *  before formatting them, so they cost nothing at all.
+ *  Everything here is a no-op until log_init() gets a filename.
+ */
+
+typedef enum
+{
+    LOGLEVEL_FATAL,
+    LOGLEVEL_INFO,
+    LOGLEVEL_DEBUG
+} LogLevel;
+
+#define LOG_LINE_MAX 512
+
+int log_init(const char *fname, LogLevel level);
+int log_wants(LogLevel level);  /* check before formatting anything. */
+void log_write(LogLevel level, const char *str);
+int log_close(void);  /* drains anything still queued. */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* include-once blocker. */
+
+/* end of log.h ... */
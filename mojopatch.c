@@ -40,6 +40,9 @@
 #include "platform.h"
 #include "ui.h"
 #include "md5.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
 
 #define VER_EXT_ZLIB
 
@@ -54,11 +57,12 @@
  *  This is to prevent incompatible builds of the program from (mis)processing
  *  a patchfile.
  */
-#define VERSION "0.0.7" VER_EXT_ZLIB
+#define VERSION "0.0.9" VER_EXT_ZLIB
 
 #define DEFAULT_PATCHFILENAME "default.mojopatch"
 
 #define MOJOPATCHSIG "mojopatch " VERSION ": http://icculus.org/mojopatch/\r\n"
+#define MOJOSIGNATURESIG "mojopatch " VERSION " signature\r\n"
 
 #define STATIC_STRING_SIZE 1024
 
@@ -84,6 +88,7 @@ typedef struct
     char renamedir[STATIC_STRING_SIZE];
     char titlebar[STATIC_STRING_SIZE];
     char startupmsg[STATIC_STRING_SIZE];
+    unsigned long long workbytes;  /* see operation_work(). */
 } PatchHeader;
 
 typedef enum
@@ -95,6 +100,7 @@ typedef enum
     OPERATION_PATCH,
     OPERATION_REPLACE,
     OPERATION_DONE,
+    OPERATION_MULTIPATCH,
     OPERATION_TOTAL /* must be last! */
 } OperationType;
 
@@ -114,7 +120,7 @@ typedef struct
 {
     OperationType operation;
     char fname[STATIC_STRING_SIZE];
-    unsigned int fsize;
+    unsigned long long fsize;
     md5_byte_t md5[16];
     unsigned int mode;
 } AddOperation;
@@ -132,8 +138,10 @@ typedef struct
     char fname[STATIC_STRING_SIZE];
     md5_byte_t md5_1[16];
     md5_byte_t md5_2[16];
-    unsigned int fsize;
-    unsigned int deltasize;
+    unsigned long long oldfsize;
+    unsigned long long fsize;
+    unsigned long long deltasize;
+    unsigned long long window;  /* 0 == one delta for the whole file. */
     unsigned int mode;
 } PatchOperation;
 
@@ -142,6 +150,33 @@ typedef struct
     OperationType operation;
 } DoneOperation;
 
+#define MULTIPATCH_MAX_BASES 16
+
+typedef struct
+{
+    md5_byte_t md5[16];
+    unsigned long long oldfsize;
+    unsigned long long deltasize;
+} MultiPatchBase;
+
+/*
+ * A PATCH with a delta for each old version of the file we know about, and
+ *  maybe the whole new file too (compressed, like an ADD), for anything
+ *  else. The deltas follow in the order of (bases), then the fallback.
+ */
+typedef struct
+{
+    OperationType operation;
+    char fname[STATIC_STRING_SIZE];
+    md5_byte_t md5[16];
+    unsigned long long fsize;
+    unsigned int mode;
+    unsigned int basecount;
+    MultiPatchBase bases[MULTIPATCH_MAX_BASES];
+    unsigned int hasfallback;
+    unsigned long long fallbacksize;  /* bytes in the patchfile. */
+} MultiPatchOperation;
+
 typedef union
 {
     OperationType operation;
@@ -152,6 +187,7 @@ typedef union
     PatchOperation patch;
     AddOperation replace;
     DoneOperation done;
+    MultiPatchOperation multipatch;
 } Operations;
 
 typedef struct
@@ -166,6 +202,7 @@ typedef enum
     COMMAND_CREATE,
     COMMAND_INFO,
     COMMAND_DOPATCHING,
+    COMMAND_SIGNATURE,
 
     COMMAND_TOTAL
 } PatchCommands;
@@ -186,6 +223,7 @@ typedef enum
 } IsPatchable;
 
 static int debug = 0;
+static int loglevel = -1;  /* --loglevel, for the logfile. -1 == not given yet. */
 static int interactive = 0;
 static int replace = 0;
 static int appending = 0;
@@ -193,11 +231,34 @@ static int alwaysadd = 0;
 static int quietonsuccess = 0;
 static int skip_patch = 0;  /* global flag to skip current patch. */
 static int zliblevel = 9;
+static int fromsignature = 0;  /* dir1 is a --signature file, not a dir. */
+static int createmulti = 0;  /* --createmulti: one patch per old tree. */
+static const char **multidirs = NULL;  /* --createmulti's old trees... */
+static const char **multiversions = NULL;  /* ...and what version each is. */
+static int multicount = 0;
+static int multibase = 0;  /* one patch, with a delta per old version. */
+static int fullfallback = 0;  /* multi-version PATCHes carry the new file. */
+static int nojournal = 0;
+static FILE *journal = NULL;  /* see journal_begin(). */
+static int preparing = 0;  /* --prepare: build everything in STAGING_DIR. */
+static int committing = 0;  /* --commit: install what --prepare built. */
+static FILE *stagemanifest = NULL;  /* see stage_begin(). */
+static unsigned int stage_index = 0;  /* op we're on, to name its file. */
+static file_list *stagedeletes = NULL;  /* what --commit will delete. */
+static char **multireal1 = NULL;  /* old trees' realpaths, for multibase. */
 static PatchCommands command = COMMAND_NONE;
 
 static const char *patchfile = NULL;
 static const char *dir1 = NULL;
 static const char *dir2 = NULL;
+static char *installdir = NULL;
+static char *tempdir = NULL;  /* --tempdir, made absolute. */
+static char *outdir = NULL;  /* --outdir: patch a linked copy here, made absolute. */
+static int reflink = 0;
+static char *indexcache = NULL;  /* xdelta's --indexcache dir, made absolute. */
+static const char *statsfile = NULL;
+static const char *tracefile = NULL;
+static const char *logfile = NULL;
 
 static char *patchtmpfile = NULL;
 static char *patchtmpfile2 = NULL;
@@ -207,10 +268,44 @@ static PatchHeader header;
 static char **ignorelist = NULL;
 static int ignorecount = 0;
 
+/*
+ * --ignore entries get sorted into these by compile_ignore_list().
+ *  Plain paths go in a hashtable, and match the path and everything under
+ *  it. A path ending in a "**" element goes in the same table, but only
+ *  matches things under that dir. Anything else with a '*' or '?' is a
+ *  glob, checked one at a time.
+ */
+typedef struct
+{
+    const char *path;
+    size_t pathlen;
+    int descendants_only;
+} IgnoreEntry;
+
+typedef struct
+{
+    const char *pattern;
+    size_t prefixlen;  /* literal chars before the first wildcard. */
+    int basename_only;  /* no separator in pattern? Match final element. */
+} IgnoreGlob;
+
+static IgnoreEntry *ignorehash = NULL;
+static size_t ignorehashsize = 0;  /* always a power of two. */
+static IgnoreGlob *ignoreglobs = NULL;
+static int ignoreglobcount = 0;
+
 char *patchfiledir = NULL;
 
 static unsigned int maxxdeltamem = 128;  /* in megabytes. */
 
+/*
+ * --deltaspeed picks xdelta's block size: 0 finds the shortest matches,
+ *  3 is the fastest and needs the least memory. -1 lets xdelta pick one
+ *  from each old file's size.
+ */
+static int deltaspeed = -1;
+static const char *deltaspeed_args[] = { "-s 16 ", "-s 32 ", "-s 64 ", "-s 128 " };
+
 static unsigned char iobuf[512 * 1024];
 
 #if USE_ZLIB
@@ -273,6 +368,22 @@ static int serialize_uint32(SerialArchive *ar, unsigned int *val)
 } /* serialize_uint32 */
 
 
+/* low 32 bits first, same byte order as serialize_uint32(). */
+static int serialize_uint64(SerialArchive *ar, unsigned long long *val)
+{
+    unsigned int lo = (unsigned int) (*val & 0xFFFFFFFF);
+    unsigned int hi = (unsigned int) (*val >> 32);
+
+    if (!serialize_uint32(ar, &lo))
+        return(0);
+    if (!serialize_uint32(ar, &hi))
+        return(0);
+
+    *val = (((unsigned long long) hi) << 32) | ((unsigned long long) lo);
+    return(1);
+} /* serialize_uint64 */
+
+
 static int serialize_static_string(SerialArchive *ar, char *val)
 {
     unsigned int len = 0;
@@ -388,6 +499,7 @@ static int serialize_header(SerialArchive *ar, PatchHeader *h, int *legitEOF)
     if (serialize_static_string_if_empty(ar, h->renamedir))
     if (serialize_static_string_if_empty(ar, h->titlebar))
     if (serialize_static_string_if_empty(ar, h->startupmsg))
+    if (serialize_uint64(ar, &h->workbytes))
         return(flush_archive(ar));
 
     return(0);
@@ -419,7 +531,7 @@ static int serialize_add_op(SerialArchive *ar, void *d)
     assert((add->operation == OPERATION_ADD) ||
            (add->operation == OPERATION_REPLACE));
     if (serialize_static_string(ar, add->fname))
-    if (serialize_uint32(ar, &add->fsize))
+    if (serialize_uint64(ar, &add->fsize))
     if (SERIALIZE(ar, add->md5))
     if (serialize_uint32(ar, &add->mode))
         return(1);
@@ -445,8 +557,10 @@ static int serialize_patch_op(SerialArchive *ar, void *d)
     if (serialize_static_string(ar, patch->fname))
     if (SERIALIZE(ar, patch->md5_1))
     if (SERIALIZE(ar, patch->md5_2))
-    if (serialize_uint32(ar, &patch->fsize))
-    if (serialize_uint32(ar, &patch->deltasize))
+    if (serialize_uint64(ar, &patch->oldfsize))
+    if (serialize_uint64(ar, &patch->fsize))
+    if (serialize_uint64(ar, &patch->deltasize))
+    if (serialize_uint64(ar, &patch->window))
     if (serialize_uint32(ar, &patch->mode))
         return(1);
 
@@ -467,6 +581,41 @@ static int serialize_done_op(SerialArchive *ar, void *d)
     return(1);
 } /* serialize_done_op */
 
+static int serialize_multipatch_op(SerialArchive *ar, void *d)
+{
+    MultiPatchOperation *mp = (MultiPatchOperation *) d;
+    unsigned int i;
+
+    assert(mp->operation == OPERATION_MULTIPATCH);
+    if (serialize_static_string(ar, mp->fname))
+    if (SERIALIZE(ar, mp->md5))
+    if (serialize_uint64(ar, &mp->fsize))
+    if (serialize_uint32(ar, &mp->mode))
+    if (serialize_uint32(ar, &mp->basecount))
+    {
+        if (mp->basecount > MULTIPATCH_MAX_BASES)
+        {
+            _fatal("Too many versions in multi-version PATCH.");
+            return(0);
+        } /* if */
+
+        for (i = 0; i < mp->basecount; i++)
+        {
+            MultiPatchBase *base = &mp->bases[i];
+            if ( (!SERIALIZE(ar, base->md5)) ||
+                 (!serialize_uint64(ar, &base->oldfsize)) ||
+                 (!serialize_uint64(ar, &base->deltasize)) )
+                return(0);
+        } /* for */
+
+        if (serialize_uint32(ar, &mp->hasfallback))
+        if (serialize_uint64(ar, &mp->fallbacksize))
+            return(1);
+    } /* if */
+
+    return(0);
+} /* serialize_multipatch_op */
+
 
 typedef int (*OpSerializers)(SerialArchive *ar, void *data);
 static OpSerializers serializers[OPERATION_TOTAL] =
@@ -479,6 +628,7 @@ static OpSerializers serializers[OPERATION_TOTAL] =
     serialize_patch_op,
     serialize_replace_op,
     serialize_done_op,
+    serialize_multipatch_op,
 };
 
 
@@ -490,6 +640,20 @@ static int handle_adddir_op(SerialArchive *ar, OperationType op, void *data);
 static int handle_patch_op(SerialArchive *ar, OperationType op, void *data);
 static int handle_replace_op(SerialArchive *ar, OperationType op, void *data);
 static int handle_done_op(SerialArchive *ar, OperationType op, void *data);
+static int handle_multipatch_op(SerialArchive *ar, OperationType op, void *data);
+
+static const char *operation_names[OPERATION_TOTAL] =
+{
+    /* Must match OperationType order! */
+    "DELETE",
+    "DELETEDIRECTORY",
+    "ADD",
+    "ADDDIRECTORY",
+    "PATCH",
+    "REPLACE",
+    "DONE",
+    "MULTIPATCH",
+};
 
 typedef int (*OpHandlers)(SerialArchive *ar, OperationType op, void *data);
 static OpHandlers operation_handlers[OPERATION_TOTAL] =
@@ -502,10 +666,54 @@ static OpHandlers operation_handlers[OPERATION_TOTAL] =
     handle_patch_op,
     handle_replace_op,
     handle_done_op,
+    handle_multipatch_op,
 };
 
 
 
+/*
+ * Bytes of work an op will be to apply, for the progress bar: everything
+ *  we write out, plus everything we md5sum. PATCH is verify the original,
+ *  copy the delta out, xdelta writes the new file, verify the new file.
+ *  MULTIPATCH only does one of its choices, so it counts the biggest.
+ *  Both ends must agree on this, since create puts the total in the header.
+ */
+static unsigned long long operation_work(const Operations *ops)
+{
+    const MultiPatchOperation *mp = &ops->multipatch;
+    unsigned long long work = 0;
+    unsigned int i;
+
+    switch (ops->operation)
+    {
+        case OPERATION_ADD:
+        case OPERATION_REPLACE:
+            return(ops->add.fsize * 2);
+
+        case OPERATION_PATCH:
+            return(ops->patch.oldfsize + ops->patch.deltasize +
+                   (ops->patch.fsize * 2));
+
+        case OPERATION_MULTIPATCH:
+            if (mp->hasfallback)
+                work = mp->fsize * 2;
+            for (i = 0; i < mp->basecount; i++)
+            {
+                unsigned long long w = mp->bases[i].oldfsize +
+                                       mp->bases[i].deltasize + (mp->fsize * 2);
+                if (w > work)
+                    work = w;
+            } /* for */
+            return(work);
+
+        default:
+            break;
+    } /* switch */
+
+    return(0);
+} /* operation_work */
+
+
 static int serialize_operation(SerialArchive *ar, Operations *ops)
 {
     unsigned char op = (unsigned char) ops->operation;
@@ -522,6 +730,9 @@ static int serialize_operation(SerialArchive *ar, Operations *ops)
     if (!serializers[ops->operation](ar, ops))
         return(0);
 
+    if (!ar->reading)
+        header.workbytes += operation_work(ops);
+
     return(flush_archive(ar));
 } /* serialize_operation */
 
@@ -530,7 +741,7 @@ static int open_serialized_archive(SerialArchive *ar,
                                    const char *fname,
                                    int is_reading,
                                    int *sizeok,
-                                   unsigned int *file_size)
+                                   unsigned long long *file_size)
 {
     memset(ar, '\0', sizeof (*ar));
     if (strcmp(fname, "-") == 0)  /* read from stdin? */
@@ -538,8 +749,9 @@ static int open_serialized_archive(SerialArchive *ar,
     else
 	{
         const char *fopenstr = "rb";
+        /* not "ab": we seek back to fill in the header when we're done. */
         if (!is_reading)
-            fopenstr = ((appending) ? "ab" : "wb");
+            fopenstr = ((appending) ? "r+b" : "wb");
 
         if (file_size != NULL)
         {
@@ -554,6 +766,14 @@ static int open_serialized_archive(SerialArchive *ar,
             _fatal("Couldn't open [%s]: %s.", patchfile, strerror(errno));
             return(PATCHERROR);
         } /* if */
+
+        if ((!is_reading) && (appending) && (fseek(ar->io, 0, SEEK_END) < 0))
+        {
+            _fatal("Couldn't seek in [%s]: %s.", patchfile, strerror(errno));
+            fclose(ar->io);
+            ar->io = NULL;
+            return(PATCHERROR);
+        } /* if */
 	} /* else */
 
     ar->reading = is_reading;
@@ -578,12 +798,13 @@ static inline int close_serialized_archive(SerialArchive *ar)
 /* printf-style: makes string for UI to put in the log. */
 void _fatal(const char *fmt, ...)
 {
-    char buf[512];
+    char buf[LOG_LINE_MAX];
     va_list ap;
     va_start(ap, fmt);
     vsnprintf(buf, sizeof (buf), fmt, ap);
     va_end(ap);
     buf[sizeof(buf)-1] = '\0';
+    log_write(LOGLEVEL_FATAL, buf);
     ui_fatal(buf);
     ui_pump();
 } /* _fatal */
@@ -591,47 +812,151 @@ void _fatal(const char *fmt, ...)
 /* printf-style: makes string for UI to put in the log. */
 void _log(const char *fmt, ...)
 {
-    char buf[512];
+    char buf[LOG_LINE_MAX];
     va_list ap;
     va_start(ap, fmt);
     vsnprintf(buf, sizeof (buf), fmt, ap);
     va_end(ap);
     buf[sizeof(buf)-1] = '\0';
+    log_write(LOGLEVEL_INFO, buf);
     ui_add_to_log(buf, 0);
     ui_pump();
 } /* _log */
 
 
-/* printf-style: makes string for UI to put in the log if debugging enabled. */
+/*
+ * printf-style: makes string for UI to put in the log if debugging enabled.
+ *  "--logfile x --loglevel debug" gets it into the file without the UI
+ *  having to show it, which is what you'd leave on in the field. If nobody
+ *  wants the string, we don't even format it.
+ */
 void _dlog(const char *fmt, ...)
 {
-    if (debug)
+    if ((debug) || (log_wants(LOGLEVEL_DEBUG)))
     {
-        char buf[512];
+        char buf[LOG_LINE_MAX];
         va_list ap;
         va_start(ap, fmt);
         vsnprintf(buf, sizeof (buf), fmt, ap);
         va_end(ap);
         buf[sizeof(buf)-1] = '\0';
-        ui_add_to_log(buf, 1);
-        ui_pump();
+        log_write(LOGLEVEL_DEBUG, buf);
+        if (debug)
+        {
+            ui_add_to_log(buf, 1);
+            ui_pump();
+        } /* if */
     } /* if */
 } /* _dlog */
 
+/*
+ * Progress is counted in bytes of work (see operation_work()), not ops,
+ *  so one huge file doesn't sit at 0% until it's done. The I/O loops report
+ *  bytes through progress_add(), but the UI only hears about it a few times
+ *  a second, no matter how small the reads are.
+ */
+#define PROGRESS_UPDATES_PER_SECOND 10
+#define STATUS_UPDATES_PER_SECOND 1
+
+static unsigned long long progress_total = 0;  /* 0 == don't know. */
+static unsigned long long progress_done = 0;
+static unsigned long long progress_opend = 0;  /* progress_done after this op. */
+static double progress_starttime = 0.0;
+static double progress_lastpump = 0.0;
+static double progress_laststatus = 0.0;
+static char current_operation[512];
+
+static void show_status(void)
+{
+    char buf[sizeof (current_operation) + 64];
+    double elapsed = get_monotonic_time() - progress_starttime;
+    double rate;
+    unsigned long long eta;
+
+    progress_laststatus = get_monotonic_time();
+
+    /* wait a second before guessing; the first numbers are garbage. */
+    if ((progress_total == 0) || (elapsed < 1.0) || (progress_done == 0))
+    {
+        ui_status(current_operation);
+        return;
+    } /* if */
+
+    rate = ((double) progress_done) / elapsed;
+    eta = (unsigned long long) (((double) (progress_total - progress_done)) / rate);
+    snprintf(buf, sizeof (buf), "%s (%.1f MB/s, %llu:%02llu left)",
+             current_operation, rate / (1024.0 * 1024.0), eta / 60, eta % 60);
+    ui_status(buf);
+} /* show_status */
+
+
+static void progress_update(int force)
+{
+    double now = get_monotonic_time();
+
+    if ((!force) && ((now - progress_lastpump) < (1.0 / PROGRESS_UPDATES_PER_SECOND)))
+        return;
+
+    progress_lastpump = now;
+
+    if (progress_total > 0)
+    {
+        ui_total_progress((int) ((progress_done * 100) / progress_total));
+        if ((now - progress_laststatus) >= (1.0 / STATUS_UPDATES_PER_SECOND))
+            show_status();
+    } /* if */
+
+    ui_pump();
+} /* progress_update */
+
+
+static void progress_begin(unsigned long long total)
+{
+    progress_total = total;
+    progress_done = progress_opend = 0;
+    progress_starttime = progress_laststatus = get_monotonic_time();
+    ui_total_progress((total > 0) ? 0 : -1);
+} /* progress_begin */
+
+
+/* I/O loops call this as they go; it's also our rate-limited ui_pump(). */
+static void progress_add(unsigned long long bytes)
+{
+    progress_done += bytes;
+    if ((progress_opend > 0) && (progress_done > progress_opend))
+        progress_done = progress_opend;  /* don't run past the current op. */
+    progress_update(0);
+} /* progress_add */
+
+
+static void progress_op_begin(const Operations *ops)
+{
+    progress_opend = progress_done + operation_work(ops);
+} /* progress_op_begin */
+
+
+/* skipped or short-circuited ops still count as done. */
+static void progress_op_end(void)
+{
+    if (progress_done < progress_opend)
+        progress_done = progress_opend;
+    progress_update(0);
+} /* progress_op_end */
+
+
 static void _current_operation(const char *fmt, ...)
 {
-    char buf[512];
     if (skip_patch)
-        strcpy(buf, "Skipping ahead...");
+        strcpy(current_operation, "Skipping ahead...");
     else
     {
         va_list ap;
         va_start(ap, fmt);
-        vsnprintf(buf, sizeof (buf), fmt, ap);
+        vsnprintf(current_operation, sizeof (current_operation), fmt, ap);
         va_end(ap);
-        buf[sizeof(buf)-1] = '\0';
+        current_operation[sizeof(current_operation)-1] = '\0';
     } /* else */
-    ui_status(buf);
+    show_status();
     ui_pump();
 } /* _current_operation */
 
@@ -725,1393 +1050,3975 @@ static IsPatchable check_product_version(const char *ident,
 
 static int _do_xdelta(const char *fmt, ...)
 {
-    char buf[512];
+    char buf[MAX_PATH * 5];  /* room for the three files and --indexcache. */
+    double start;
+    int rc;
     va_list ap;
     va_start(ap, fmt);
     vsnprintf(buf, sizeof (buf), fmt, ap);
     va_end(ap);
     buf[sizeof(buf)-1] = '\0';
 	_dlog("(xdelta call: [%s].)", buf);
-    return(spawn_xdelta(buf) == SPAWN_RETURNGOOD);
+    start = stats_start(STATS_PHASE_XDELTA);
+    rc = (spawn_xdelta(buf) == SPAWN_RETURNGOOD);
+    stats_phase(STATS_PHASE_XDELTA, start, 0, 0);
+    return(rc);
 } /* _do_xdelta */
 
 
-static int in_ignore_list(const char *fname)
-{
-    int i;
-    for (i = 0; i < ignorecount; i++)
-    {
-        if (strcmp(fname, ignorelist[i]) == 0)
-        {
-            _log("Ignoring %s on user's instructions.", fname);
-            return(1);
-        } /* if */
-    } /* for */
-
-    return(0);
-} /* in_ignore_list */
-
-
-static inline int info_only(void)
+static size_t ignore_hash(const char *str, size_t len)
 {
-    return((command == COMMAND_INFO) || (skip_patch));
-} /* info_only */
+    size_t retval = 2166136261u;  /* FNV-1a. */
+    while (len--)
+        retval = (retval ^ (unsigned char) *(str++)) * 16777619u;
+    return(retval);
+} /* ignore_hash */
 
 
-static void free_filelist(file_list *list)
+static IgnoreEntry *ignore_hash_slot(const char *path, size_t len)
 {
-    file_list *next;
-    while (list != NULL)
+    size_t i = ignore_hash(path, len) & (ignorehashsize - 1);
+    while (1)  /* table is never more than half full, so this ends. */
     {
-        next = list->next;
-        free(list->fname);
-        free(list);
-        list = next;
+        IgnoreEntry *ent = &ignorehash[i];
+        if (ent->path == NULL)
+            return(ent);
+        if ((ent->pathlen == len) && (memcmp(ent->path, path, len) == 0))
+            return(ent);
+        i = (i + 1) & (ignorehashsize - 1);
     } /* while */
-} /* free_filelist */
+} /* ignore_hash_slot */
 
 
-#if USE_ZLIB
-static int write_between_files_compress(FILE *in, FILE *out, long fsize)
+/* '*' and '?' stop at path separators, '**' doesn't. */
+static int glob_match(const char *p, const char *s, const char *send)
 {
-    uLongf compsize;
-    uLongf uncompsize;
-    unsigned int uncompsizeui32;
-    unsigned int compsizeui32;
+    const char sep = PATH_SEP[0];
 
-    while (fsize > 0)
+    while (*p)
     {
-        uncompsize = sizeof (iobuf);
-        if (uncompsize > fsize)
-            uncompsize = fsize;
-
-        if (fread(iobuf, uncompsize, 1, in) != 1)
+        if ((p[0] == '*') && (p[1] == '*'))
         {
-            _fatal("read error: %s.", strerror(errno));
-            return(PATCHERROR);
-        } /* if */
-        ui_pump();
-
-        fsize -= uncompsize;
+            int slash = (p[2] == sep);
+            p += (slash) ? 3 : 2;
+            if (*p == '\0')
+                return(1);
 
-        compsize = sizeof (compbuf);
-        if (compress2(compbuf, &compsize, iobuf, uncompsize, zliblevel)!=Z_OK)
-        {
-            _fatal("zlib compression error.");
-            return(PATCHERROR);
+            while (1)
+            {
+                if (glob_match(p, s, send))
+                    return(1);
+                else if (s == send)
+                    return(0);
+                else if (!slash)
+                    s++;
+                else  /* "**" + sep only resumes at the start of an element. */
+                {
+                    while ((s < send) && (*s != sep))
+                        s++;
+                    if (s == send)
+                        return(0);
+                    s++;
+                } /* else */
+            } /* while */
         } /* if */
-        ui_pump();
 
-        /* !!! FIXME: serialize? */
-        uncompsizeui32 = swapui32(uncompsize);
-        compsizeui32 = swapui32(compsize);
-        if ( (fwrite(&uncompsizeui32, sizeof (uncompsizeui32), 1, out) != 1) ||
-             (fwrite(&compsizeui32, sizeof (compsizeui32), 1, out) != 1) ||
-             (fwrite(compbuf, compsize, 1, out) != 1) )
+        else if (*p == '*')
         {
-            _fatal("write error: %s.", strerror(errno));
-            return(PATCHERROR);
-        } /* if */
-        ui_pump();
+            p++;
+            while (1)
+            {
+                if (glob_match(p, s, send))
+                    return(1);
+                if ((s == send) || (*s == sep))
+                    return(0);
+                s++;
+            } /* while */
+        } /* else if */
+
+        else if (s == send)
+            return(0);
+        else if ((*p == '?') && (*s == sep))
+            return(0);
+        else if ((*p != '?') && (*p != *s))
+            return(0);
+
+        p++;
+        s++;
     } /* while */
 
-    return(fflush(out) == 0 ? PATCHSUCCESS : PATCHERROR);
-} /* write_between_files_compress */
+    return(s == send);
+} /* glob_match */
 
 
-static int write_between_files_uncompress(FILE *in, FILE *out,
-                                          long fsize, int skip)
+/* (len) lets us check a parent dir of (fname) without copying it. */
+static int ignore_glob_match(const IgnoreGlob *g, const char *fname, size_t len)
 {
-    uLongf compsize;
-    uLongf uncompsize;
-    unsigned int uncompsizeui32;
-    unsigned int compsizeui32;
+    const char *send = fname + len;
+    const char *s = fname;
 
-    while (fsize > 0)
+    if (g->basename_only)
     {
-        if ( (fread(&uncompsizeui32, sizeof (uncompsizeui32), 1, in) != 1) ||
-             (fread(&compsizeui32, sizeof (compsizeui32), 1, in) != 1) )
+        const char *ptr;
+        for (ptr = fname; ptr < send; ptr++)
         {
-            _fatal("read error: %s.", strerror(errno));
-            return(PATCHERROR);
-        } /* if */
+            if (*ptr == PATH_SEP[0])
+                s = ptr + 1;
+        } /* for */
+    } /* if */
 
-        /* !!! FIXME: serialize? */
-        uncompsize = swapui32(uncompsizeui32);
-        compsize = swapui32(compsizeui32);
+    if ( ((size_t) (send - s) < g->prefixlen) ||
+         (memcmp(s, g->pattern, g->prefixlen) != 0) )
+        return(0);
+
+    return(glob_match(g->pattern + g->prefixlen, s + g->prefixlen, send));
+} /* ignore_glob_match */
+
+
+static int compile_ignore_list(void)
+{
+    int i;
+
+    if (ignorecount == 0)
+        return(1);
 
-        if ( (compsize > sizeof (compbuf)) || (uncompsize > sizeof (iobuf)) )
+    ignorehashsize = 16;
+    while (ignorehashsize < (ignorecount * 2))
+        ignorehashsize <<= 1;
+
+    ignorehash = (IgnoreEntry *) calloc(ignorehashsize, sizeof (IgnoreEntry));
+    ignoreglobs = (IgnoreGlob *) malloc(sizeof (IgnoreGlob) * ignorecount);
+    if ((ignorehash == NULL) || (ignoreglobs == NULL))
+    {
+        _fatal("Out of memory.");
+        return(0);
+    } /* if */
+
+    for (i = 0; i < ignorecount; i++)
+    {
+        const char *str = ignorelist[i];
+        size_t len;
+        size_t globlen;
+        size_t wild;
+        int descendants_only = 0;
+
+        if ((str[0] == '.') && (str[1] == PATH_SEP[0]))
+            str += 2;  /* "./dir" is just "dir". */
+
+        len = strlen(str);
+        while ((len > 1) && (str[len - 1] == PATH_SEP[0]))
+            len--;  /* "dir/" is just "dir", too. */
+        globlen = len;  /* globs keep a trailing "**"; they match it. */
+
+        if ( (len > 3) && (str[len-3] == PATH_SEP[0]) &&
+             (str[len-2] == '*') && (str[len-1] == '*') )
         {
-            _fatal("bogus compression data.");
-            return(PATCHERROR);
+            len -= 3;  /* chop the "**" element; keep the dir. */
+            descendants_only = 1;
         } /* if */
 
-        /* fsize is the uncompressed file size... */
-        fsize -= uncompsize;
-
-        if (skip)
+        wild = strcspn(str, "*?");
+        if (wild >= len)  /* no wildcards left: goes in the hashtable. */
         {
-            if (fseek(in, compsize, SEEK_CUR) < 0)
+            IgnoreEntry *ent = ignore_hash_slot(str, len);
+            if (ent->path == NULL)
             {
-                _fatal("seek error: %s.", strerror(errno));
-                return(PATCHERROR);
+                ent->path = str;
+                ent->pathlen = len;
+                ent->descendants_only = descendants_only;
             } /* if */
+            else if (!descendants_only)
+            {
+                ent->descendants_only = 0;  /* plain "dir" covers more. */
+            } /* else if */
         } /* if */
 
         else
         {
-            if (fread(compbuf, compsize, 1, in) != 1)
+            IgnoreGlob *g = &ignoreglobs[ignoreglobcount++];
+            char *pattern = (char *) malloc(globlen + 1);
+            if (pattern == NULL)
             {
-                _fatal("read error: %s.", strerror(errno));
-                return(PATCHERROR);
+                _fatal("Out of memory.");
+                return(0);
             } /* if */
-            ui_pump();
+            memcpy(pattern, str, globlen);
+            pattern[globlen] = '\0';
+            g->pattern = pattern;
+            g->prefixlen = wild;
+            g->basename_only = (strchr(pattern, PATH_SEP[0]) == NULL);
+        } /* else */
+    } /* for */
 
-            if (uncompress(iobuf, &uncompsize, compbuf, compsize) != Z_OK)
-            {
-                _fatal("zlib decompression error.");
-                return(PATCHERROR);
-            } /* if */
-            ui_pump();
+    return(1);
+} /* compile_ignore_list */
 
-            if (fwrite(iobuf, uncompsize, 1, out) != 1)
-            {
-                _fatal("write error: %s.", strerror(errno));
-                return(PATCHERROR);
-            } /* if */
-        } /* else */
 
-        ui_pump();
-    } /* while */
+static int ignore_match(const char *fname)
+{
+    size_t len = strlen(fname);
+    IgnoreEntry *ent;
+    size_t i;
+    int g;
 
-    return(fflush(out) == 0 ? PATCHSUCCESS : PATCHERROR);
-} /* write_between_files_uncompress */
-#endif
+    if (ignorecount == 0)
+        return(0);
 
+    /* the path itself... */
+    ent = ignore_hash_slot(fname, len);
+    if ((ent->path != NULL) && (!ent->descendants_only))
+        return(1);
 
-static int write_between_files(FILE *in, FILE *out, long fsize, ZlibOptions z)
-{
-    #if USE_ZLIB
-    if (z == ZLIB_COMPRESS)
-        return(write_between_files_compress(in, out, fsize));
-    else if (z == ZLIB_UNCOMPRESS)
-        return(write_between_files_uncompress(in, out, fsize, 0));
-    else
-        assert(z == ZLIB_NONE);
-    #endif
-
-    while (fsize > 0)
+    for (g = 0; g < ignoreglobcount; g++)
     {
-        int max = sizeof (iobuf);
-        if (max > fsize)
-            max = fsize;
+        if (ignore_glob_match(&ignoreglobs[g], fname, len))
+            return(1);
+    } /* for */
 
-        if (fread(iobuf, max, 1, in) != 1)
-        {
-            _fatal("read error: %s.", strerror(errno));
-            return(PATCHERROR);
-        } /* if */
-        ui_pump();
+    /* ...then every directory it lives under. */
+    for (i = len; i > 0; i--)
+    {
+        if (fname[i - 1] != PATH_SEP[0])
+            continue;
 
-        fsize -= max;
+        if (ignore_hash_slot(fname, i - 1)->path != NULL)
+            return(1);
 
-        if (fwrite(iobuf, max, 1, out) != 1)
+        for (g = 0; g < ignoreglobcount; g++)
         {
-            _fatal("write error: %s.", strerror(errno));
-            return(PATCHERROR);
-        } /* if */
-        ui_pump();
-    } /* while */
+            if (ignore_glob_match(&ignoreglobs[g], fname, i - 1))
+                return(1);
+        } /* for */
+    } /* for */
 
-    return(fflush(out) == 0 ? PATCHSUCCESS : PATCHERROR);
-} /* write_between_files */
+    return(0);
+} /* ignore_match */
 
 
-static int do_rename(const char *from, const char *to)
+static int in_ignore_list(const char *fname)
 {
-    FILE *in;
-    FILE *out;
-    unsigned int fsize;
-    int rc;
-
-    unlink(to);  /* just in case. */
-    if (rename(from, to) != -1)
-        return(PATCHSUCCESS);
-
-    /* rename() might fail if from and to are on seperate filesystems. */
-
-    rc = get_file_size(from, &fsize);
-    in = fopen(from, "rb");
-    out = fopen(to, "wb");
-    if ((!rc) || (!in) || (!out))
+    if (ignore_match(fname))
     {
-        if (in)
-            fclose(in);
-        if (out)
-            fclose(out);
-        unlink(to);
-        _fatal("File copy failed.");
-        return(PATCHERROR);
+        _log("Ignoring %s on user's instructions.", fname);
+        return(1);
     } /* if */
 
-    rc = write_between_files(in, out, fsize, ZLIB_NONE);
+    return(0);
+} /* in_ignore_list */
 
-    fclose(in);
-    if ((fclose(out) == -1) && (rc != PATCHERROR))
-    {
-        _fatal("File copy failed.");
-        return(PATCHERROR);
-    } /* if */
 
-    unlink(from);
+static inline int info_only(void)
+{
+    return((command == COMMAND_INFO) || (skip_patch));
+} /* info_only */
 
-    return(rc);
-} /* do_rename */
 
+/*
+ * --prepare does all the slow work of a patch into STAGING_DIR, inside the
+ *  install dir so renames out of it are atomic, and lists what's left to do
+ *  in its manifest: renames, deletes and mkdirs, in op order. --commit just
+ *  runs that list. Each built file is named for the index of its op.
+ */
+#define STAGING_DIR ".mojopatch.staging"
+#define STAGING_MANIFEST STAGING_DIR PATH_SEP "manifest"
+#define STAGING_SIG "mojopatch staging"
 
-static int md5sum(FILE *in, md5_byte_t *digest, int output)
+static const char *stage_name(void)
 {
-    md5_state_t md5state;
-    long br;
-
-    _dlog("md5summing...");
+    static char buf[64];
+    snprintf(buf, sizeof (buf), "%s%s%u", STAGING_DIR, PATH_SEP, stage_index);
+    return(buf);
+} /* stage_name */
 
-    memset(digest, '\0', 16);
-    md5_init(&md5state);
 
-    if (fseek(in, 0, SEEK_SET) == -1)
+/* add a line to the manifest, for --commit to do later. */
+static int stage_step(const char *step, unsigned int mode, const char *fname)
+{
+    if (fprintf(stagemanifest, "%s %o %u %s\n", step, mode, stage_index, fname) < 0)
     {
-        _fatal("Couldn't seek in file: %s.", strerror(errno));
+        _fatal("Couldn't write [%s]: %s.", STAGING_MANIFEST, strerror(errno));
         return(PATCHERROR);
     } /* if */
 
-    while (1)
+    /* later ops have to see these as gone, like a real apply would. */
+    if ((strcmp(step, "delete") == 0) || (strcmp(step, "deletedir") == 0))
     {
-        ui_pump();
-
-        br = fread(iobuf, 1, sizeof (iobuf), in);
-        if (br == 0)
+        file_list *item = (file_list *) malloc(sizeof (file_list));
+        if (item != NULL)
+            item->fname = (char *) malloc(strlen(fname) + 1);
+        if ((item == NULL) || (item->fname == NULL))
         {
-            int err = errno;
-            if (feof(in))
-                break;
-            else
-            {
-                _fatal("Read error: %s.", strerror(err));
-                return(PATCHERROR);
-            } /* else */
+            free(item);
+            _fatal("Out of memory.");
+            return(PATCHERROR);
         } /* if */
-        md5_append(&md5state, (const md5_byte_t *) iobuf, br);
-    } /* while */
-
-    md5_finish(&md5state, digest);
-
-    if ((output) || (debug))
-    {
-      /* ugly, but want to print it all on one line... */
-        _log("  (md5sum: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x)",
-              digest[0],  digest[1],  digest[2],  digest[3],
-              digest[4],  digest[5],  digest[6],  digest[7],
-              digest[8],  digest[9],  digest[10], digest[11],
-              digest[12], digest[13], digest[14], digest[15]);
-    } /* if */
 
-    if (fseek(in, 0, SEEK_SET) == -1)
-    {
-        _fatal("Couldn't seek in file: %s.", strerror(errno));
-        return(PATCHERROR);
+        strcpy(item->fname, fname);
+        item->next = stagedeletes;
+        stagedeletes = item;
     } /* if */
 
     return(PATCHSUCCESS);
-} /* md5sum */
+} /* stage_step */
 
 
-static int verify_md5sum(md5_byte_t *md5, md5_byte_t *result, FILE *in, int isfatal)
+/* file_exists(), but --prepare sees the tree as it has staged it so far. */
+static int op_file_exists(const char *fname)
 {
-    md5_byte_t thismd5[16];
-
-    if (md5sum(in, thismd5, 0) == PATCHERROR)
-        return(PATCHERROR);
+    file_list *i;
 
-    if (result != NULL)
-		memcpy(result, thismd5, sizeof (thismd5));
+    if (!file_exists(fname))
+        return(0);
 
-    if (memcmp(thismd5, md5, sizeof (thismd5)) != 0)
+    for (i = stagedeletes; i != NULL; i = i->next)
     {
-        if (isfatal)
-            _fatal("md5sum doesn't match original!");
-        return(PATCHERROR);
-    } /* if */
-    
-    return(PATCHSUCCESS);
-} /* verify_md5sum */
-
+        size_t len = strlen(i->fname);
+        if ( (strncmp(fname, i->fname, len) == 0) &&
+             ((fname[len] == '\0') || (fname[len] == PATH_SEP[0])) )
+            return(0);  /* it, or a dir it's in, is going away. */
+    } /* for */
 
-/* !!! FIXME: This should be in the UI abstraction. */
-static int confirm(void)
-{
-    char buf[256];
-    char *ptr;
+    return(1);
+} /* op_file_exists */
 
-    if (!interactive)
-        return(1);
 
-    while (1)
+static void free_filelist(file_list *list)
+{
+    file_list *next;
+    while (list != NULL)
     {
-        printf("Confirm [Y/n] : ");
-        fgets(buf, sizeof (buf) - 1, stdin);
-        if ( (ptr = strchr(buf, '\r')) != NULL )
-            *ptr = '\0';
-        if ( (ptr = strchr(buf, '\n')) != NULL )
-            *ptr = '\0';
-
-        if (strlen(buf) <= 1)
-        {
-            int ch = tolower((int) buf[0]);
-            if ((ch == '\0') || (ch == 'y'))
-            {
-                printf("Answered YES\n");
-                return(1);
-            } /* if */
-            else if (ch == 'n')
-            {
-                printf("Answered NO\n");
-                return(0);
-            } /* else if */
-        } /* if */
+        next = list->next;
+        free(list->fname);
+        free(list);
+        list = next;
     } /* while */
-} /* confirm */
+} /* free_filelist */
 
 
-static const char *final_path_element(const char *fname)
+static file_list *list_directory(const char *base)
 {
-    const char *ptr = (const char *) strrchr(fname, PATH_SEP[0]);
-    assert( (sizeof (PATH_SEP)) == (sizeof (char) * 2) );
-    return(ptr ? ptr + 1 : fname);
-} /* final_path_element */
+    double start = stats_start(STATS_PHASE_WALK);
+    file_list *retval = make_filelist(base);
+    stats_phase(STATS_PHASE_WALK, start, 0, 0);
+    return(retval);
+} /* list_directory */
 
 
-/* put a DELETE operation in the mojopatch file... */
-static int put_delete(SerialArchive *ar, const char *fname)
+/*
+ * --createmulti makes one patch per old tree, all against the same new
+ *  tree, so it remembers what it learned about the new tree the first
+ *  time: dir listings, md5sums, and where an ADD's (compressed) data went
+ *  in the patchfile, so a later ADD of the same file copies it from there
+ *  instead of compressing it again. Keyed by the path compare_directories()
+ *  uses, which is relative to the new tree. Unused for one patch.
+ */
+typedef struct NEWTREEENTRY
 {
-    Operations ops;
+    char *fname;
+    file_list *listing;  /* dirs only; NULL until listed. */
+    int listed;
+    int have_md5;
+    md5_byte_t md5[16];
+    off_t addpos;  /* -1 until an ADD of it is in the patchfile. */
+    unsigned long long addlen;
+    struct NEWTREEENTRY *next;
+} NewTreeEntry;
 
-    _current_operation("DELETE %s", final_path_element(fname));
-    _log("DELETE %s", fname);
+static NewTreeEntry **newtree = NULL;
+static size_t newtreesize = 0;  /* always a power of two. */
+static size_t newtreecount = 0;
+static FILE *newtreereader = NULL;  /* the patchfile, to copy ADDs from. */
 
-    if (in_ignore_list(fname))
-        return(PATCHSUCCESS);
 
-    if (!confirm())
-        return(PATCHSUCCESS);
+static file_list *copy_filelist(const file_list *list)
+{
+    file_list *retval = NULL;
+    file_list **tail = &retval;
 
-    ops.operation = OPERATION_DELETE;
-    make_static_string(ops.del.fname, fname);
-    return(serialize_operation(ar, &ops));
-} /* put_delete */
+    for (; list != NULL; list = list->next)
+    {
+        file_list *item = (file_list *) malloc(sizeof (file_list));
+        if (item == NULL)
+            break;
 
+        item->fname = (char *) malloc(strlen(list->fname) + 1);
+        if (item->fname == NULL)
+        {
+            free(item);
+            break;
+        } /* if */
 
-/* get a DELETE operation from the mojopatch file... */
-static int handle_delete_op(SerialArchive *ar, OperationType op, void *d)
-{
-    DeleteOperation *del = (DeleteOperation *) d;
-    assert(op == OPERATION_DELETE);
+        strcpy(item->fname, list->fname);
+        item->next = NULL;
+        *tail = item;
+        tail = &item->next;
+    } /* for */
 
-    _current_operation("DELETE %s", final_path_element(del->fname));
-    _log("DELETE %s", del->fname);
+    return(retval);
+} /* copy_filelist */
 
-    if ( (info_only()) || (!confirm()) )
-        return(PATCHSUCCESS);
 
-    if (in_ignore_list(del->fname))
-        return(PATCHSUCCESS);
+/* NULL if we aren't caching, or we're out of memory. */
+static NewTreeEntry *newtree_entry(const char *fname)
+{
+    size_t len = strlen(fname);
+    NewTreeEntry *ent;
+    size_t bucket;
+
+    if (multicount <= 1)
+        return(NULL);
 
-    if (!file_exists(del->fname))
+    if (newtreecount >= newtreesize)  /* grow it; keep chains short. */
     {
-        _log("file seems to be gone already.");
-        return(PATCHSUCCESS);
+        size_t newsize = (newtreesize == 0) ? 1024 : newtreesize * 2;
+        NewTreeEntry **table = (NewTreeEntry **) calloc(newsize, sizeof (NewTreeEntry *));
+        size_t i;
+
+        if (table == NULL)
+            return(NULL);
+
+        for (i = 0; i < newtreesize; i++)
+        {
+            while (newtree[i] != NULL)
+            {
+                ent = newtree[i];
+                newtree[i] = ent->next;
+                bucket = ignore_hash(ent->fname, strlen(ent->fname)) & (newsize - 1);
+                ent->next = table[bucket];
+                table[bucket] = ent;
+            } /* while */
+        } /* for */
+
+        free(newtree);
+        newtree = table;
+        newtreesize = newsize;
     } /* if */
 
-    if (file_is_directory(del->fname))
+    bucket = ignore_hash(fname, len) & (newtreesize - 1);
+    for (ent = newtree[bucket]; ent != NULL; ent = ent->next)
     {
-        _fatal("Expected file, found directory!");
-        return(PATCHERROR);
-    } /* if */
+        if (strcmp(ent->fname, fname) == 0)
+            return(ent);
+    } /* for */
 
-    if (remove(del->fname) == -1)
+    ent = (NewTreeEntry *) calloc(1, sizeof (NewTreeEntry));
+    if (ent == NULL)
+        return(NULL);
+
+    ent->fname = (char *) malloc(len + 1);
+    if (ent->fname == NULL)
     {
-        _fatal("Error removing [%s]: %s.", del->fname, strerror(errno));
-        return(PATCHERROR);
+        free(ent);
+        return(NULL);
     } /* if */
 
-    _log("done DELETE.");
-    return(PATCHSUCCESS);
-} /* handle_delete_op */
+    strcpy(ent->fname, fname);
+    ent->addpos = -1;
+    ent->next = newtree[bucket];
+    newtree[bucket] = ent;
+    newtreecount++;
+    return(ent);
+} /* newtree_entry */
 
 
-/* put a DELETEDIRECTORY operation in the mojopatch file... */
-static int put_delete_dir(SerialArchive *ar, const char *fname)
+static void free_newtree(void)
 {
-    Operations ops;
-
-    _current_operation("DELETEDIRECTORY %s", final_path_element(fname));
-    _log("DELETEDIRECTORY %s", fname);
-
-    if (!confirm())
-        return(PATCHSUCCESS);
+    size_t i;
+    for (i = 0; i < newtreesize; i++)
+    {
+        while (newtree[i] != NULL)
+        {
+            NewTreeEntry *ent = newtree[i];
+            newtree[i] = ent->next;
+            free_filelist(ent->listing);
+            free(ent->fname);
+            free(ent);
+        } /* while */
+    } /* for */
 
-    if (in_ignore_list(fname))
-        return(PATCHSUCCESS);
+    free(newtree);
+    newtree = NULL;
+    newtreesize = newtreecount = 0;
 
-    ops.operation = OPERATION_DELETEDIRECTORY;
-    make_static_string(ops.deldir.fname, fname);
-    return(serialize_operation(ar, &ops));
-} /* put_delete_dir */
+    if (newtreereader != NULL)
+    {
+        fclose(newtreereader);
+        newtreereader = NULL;
+    } /* if */
+} /* free_newtree */
 
 
-static int delete_dir_tree(const char *fname)
+static file_list *new_list_directory(const char *base)
 {
-    char filebuf[MAX_PATH];
-    file_list *files = make_filelist(fname);
-    file_list *i;
-    int rc = 0;
+    NewTreeEntry *ent = newtree_entry(base);
 
-    _log("Deleting directory tree %s", fname);
+    if (ent == NULL)
+        return(list_directory(base));
 
-    for (i = files; i != NULL; i = i->next)
+    if (!ent->listed)
     {
-        snprintf(filebuf, sizeof (filebuf), "%s%s%s", fname, PATH_SEP, i->fname);
-        if (file_is_directory(filebuf))
-            rc = delete_dir_tree(filebuf);
-        else
-        {
-            _log("Deleting file %s from dir tree", filebuf);
-            rc = (remove(filebuf) == -1) ? PATCHERROR : PATCHSUCCESS;
-            if (rc == PATCHERROR)
-                _fatal("failed to delete %s: %s.", filebuf, strerror(errno));
-        } /* else */
+        ent->listing = list_directory(base);
+        ent->listed = 1;
+    } /* if */
 
-        if (rc == PATCHERROR)
+    return(copy_filelist(ent->listing));
+} /* new_list_directory */
+
+
+#if USE_ZLIB
+static int write_between_files_compress(FILE *in, FILE *out,
+                                        unsigned long long fsize)
+{
+    uLongf compsize;
+    uLongf uncompsize;
+    unsigned int uncompsizeui32;
+    unsigned int compsizeui32;
+    unsigned long long packed = 0;
+    unsigned long long rawsize = fsize;
+    double start = stats_start(STATS_PHASE_COMPRESS);
+
+    while (fsize > 0)
+    {
+        uncompsize = sizeof (iobuf);
+        if (uncompsize > fsize)
+            uncompsize = fsize;
+
+        if (fread(iobuf, uncompsize, 1, in) != 1)
         {
-            free_filelist(files);
+            _fatal("read error: %s.", strerror(errno));
             return(PATCHERROR);
         } /* if */
-    } /* for */
 
-    free_filelist(files);
+        fsize -= uncompsize;
 
-    if (rmdir(fname) == -1)
+        compsize = sizeof (compbuf);
+        if (compress2(compbuf, &compsize, iobuf, uncompsize, zliblevel)!=Z_OK)
+        {
+            _fatal("zlib compression error.");
+            return(PATCHERROR);
+        } /* if */
+
+        /* !!! FIXME: serialize? */
+        uncompsizeui32 = swapui32(uncompsize);
+        compsizeui32 = swapui32(compsize);
+        if ( (fwrite(&uncompsizeui32, sizeof (uncompsizeui32), 1, out) != 1) ||
+             (fwrite(&compsizeui32, sizeof (compsizeui32), 1, out) != 1) ||
+             (fwrite(compbuf, compsize, 1, out) != 1) )
+        {
+            _fatal("write error: %s.", strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+
+        packed += sizeof (uncompsizeui32) + sizeof (compsizeui32) + compsize;
+        progress_add(uncompsize);
+    } /* while */
+
+    stats_phase(STATS_PHASE_COMPRESS, start, rawsize, packed);
+    return(fflush(out) == 0 ? PATCHSUCCESS : PATCHERROR);
+} /* write_between_files_compress */
+
+
+static int write_between_files_uncompress(FILE *in, FILE *out,
+                                          unsigned long long fsize, int skip)
+{
+    uLongf compsize;
+    uLongf uncompsize;
+    unsigned int uncompsizeui32;
+    unsigned int compsizeui32;
+    unsigned long long packed = 0;
+    unsigned long long rawsize = fsize;
+    double start = 0.0;
+
+    if (!skip)
+        start = stats_start(STATS_PHASE_UNCOMPRESS);
+
+    while (fsize > 0)
     {
-        _fatal("Error removing directory [%s]: %s.", fname, strerror(errno));
-        return(PATCHERROR);
-    } /* if */
+        if ( (fread(&uncompsizeui32, sizeof (uncompsizeui32), 1, in) != 1) ||
+             (fread(&compsizeui32, sizeof (compsizeui32), 1, in) != 1) )
+        {
+            _fatal("read error: %s.", strerror(errno));
+            return(PATCHERROR);
+        } /* if */
 
-    return(PATCHSUCCESS);
-} /* delete_dir_tree */
+        /* !!! FIXME: serialize? */
+        uncompsize = swapui32(uncompsizeui32);
+        compsize = swapui32(compsizeui32);
 
+        if ( (compsize > sizeof (compbuf)) || (uncompsize > sizeof (iobuf)) ||
+             (uncompsize > fsize) )
+        {
+            _fatal("bogus compression data.");
+            return(PATCHERROR);
+        } /* if */
 
-/* get a DELETEDIRECTORY operation from the mojopatch file... */
-static int handle_deldir_op(SerialArchive *ar, OperationType op, void *d)
+        /* fsize is the uncompressed file size... */
+        fsize -= uncompsize;
+        packed += sizeof (uncompsizeui32) + sizeof (compsizeui32) + compsize;
+
+        if (skip)
+        {
+            if (fseek(in, compsize, SEEK_CUR) < 0)
+            {
+                _fatal("seek error: %s.", strerror(errno));
+                return(PATCHERROR);
+            } /* if */
+        } /* if */
+
+        else
+        {
+            if (fread(compbuf, compsize, 1, in) != 1)
+            {
+                _fatal("read error: %s.", strerror(errno));
+                return(PATCHERROR);
+            } /* if */
+
+            if (uncompress(iobuf, &uncompsize, compbuf, compsize) != Z_OK)
+            {
+                _fatal("zlib decompression error.");
+                return(PATCHERROR);
+            } /* if */
+
+            if (fwrite(iobuf, uncompsize, 1, out) != 1)
+            {
+                _fatal("write error: %s.", strerror(errno));
+                return(PATCHERROR);
+            } /* if */
+        } /* else */
+
+        progress_add((skip) ? 0 : uncompsize);
+    } /* while */
+
+    if (!skip)
+        stats_phase(STATS_PHASE_UNCOMPRESS, start, packed, rawsize);
+    return(fflush(out) == 0 ? PATCHSUCCESS : PATCHERROR);
+} /* write_between_files_uncompress */
+#endif
+
+
+static int write_between_files(FILE *in, FILE *out,
+                               unsigned long long fsize, ZlibOptions z)
 {
-    DeleteDirOperation *deldir = (DeleteDirOperation *) d;
-    assert(op == OPERATION_DELETEDIRECTORY);
+    unsigned long long total = fsize;
+    double start;
 
-    _current_operation("DELETEDIRECTORY %s", final_path_element(deldir->fname));
-    _log("DELETEDIRECTORY %s", deldir->fname);
+    #if USE_ZLIB
+    if (z == ZLIB_COMPRESS)
+        return(write_between_files_compress(in, out, fsize));
+    else if (z == ZLIB_UNCOMPRESS)
+        return(write_between_files_uncompress(in, out, fsize, 0));
+    else
+        assert(z == ZLIB_NONE);
+    #endif
 
-    if ( (info_only()) || (!confirm()) )
-        return(PATCHSUCCESS);
+    start = stats_start(STATS_PHASE_COPY);
+    while (fsize > 0)
+    {
+        int max = sizeof (iobuf);
+        if (max > fsize)
+            max = fsize;
 
-    if (in_ignore_list(deldir->fname))
+        if (fread(iobuf, max, 1, in) != 1)
+        {
+            _fatal("read error: %s.", strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+
+        fsize -= max;
+
+        if (fwrite(iobuf, max, 1, out) != 1)
+        {
+            _fatal("write error: %s.", strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+        progress_add(max);
+    } /* while */
+
+    stats_phase(STATS_PHASE_COPY, start, total, total);
+    return(fflush(out) == 0 ? PATCHSUCCESS : PATCHERROR);
+} /* write_between_files */
+
+
+static int do_rename(const char *from, const char *to)
+{
+    unsigned long long fsize = 0;
+    double start;
+    int rc;
+
+    unlink(to);  /* just in case. */
+    if (rename(from, to) != -1)
         return(PATCHSUCCESS);
 
-    if (!file_exists(deldir->fname))
+    /*
+     * rename() might fail if from and to are on seperate filesystems.
+     *  Temp files live next to the install now, so this should be rare
+     *  (--tempdir elsewhere, a mount inside the install, etc).
+     */
+    _dlog("Can't rename [%s] to [%s]; copying instead.", from, to);
+    get_file_size(from, &fsize);
+    start = stats_start(STATS_PHASE_COPY);
+    rc = copy_file(from, to);
+    stats_phase(STATS_PHASE_COPY, start, fsize, fsize);
+    if (!rc)
     {
-        _log("directory seems to be gone already.");
-        return(PATCHSUCCESS);
+        _fatal("File copy failed.");
+        return(PATCHERROR);
     } /* if */
 
-    if (!file_is_directory(deldir->fname))
+    unlink(from);
+
+    return(PATCHSUCCESS);
+} /* do_rename */
+
+
+/* put a finished, verified file where it goes, or in staging for later. */
+static int install_file(const char *tmpfname, const char *fname,
+                        unsigned int mode)
+{
+    const char *target = (preparing) ? stage_name() : fname;
+
+    /* the journal will say this op is done; make sure the data is there. */
+    if ((journal != NULL) && (!sync_path(tmpfname)))
     {
-        _fatal("Expected directory, found file!");
+        _fatal("Couldn't sync [%s]: %s.", tmpfname, strerror(errno));
         return(PATCHERROR);
     } /* if */
 
-    if (!delete_dir_tree(deldir->fname))
+    if (do_rename(tmpfname, target) == PATCHERROR)
+    {
+        _fatal("Error replacing [%s] with tempfile: %s.", target, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    chmod(target, (mode_t) mode);  /* !!! FIXME: fatal error? */
+
+    /* do_rename() may have copied across filesystems; sync what landed. */
+    if ((journal != NULL) && (!sync_path(target)))
+    {
+        _fatal("Couldn't sync [%s]: %s.", target, strerror(errno));
         return(PATCHERROR);
+    } /* if */
+
+    drop_file_cache(target);  /* verified already; we're done with it. */
+
+    if (preparing)
+        return(stage_step("install", mode, fname));
 
-    _log("done DELETEDIRECTORY.");
     return(PATCHSUCCESS);
-} /* handle_deldir_op */
+} /* install_file */
 
 
-/* put an ADD operation in the mojopatch file... */
-static int put_add(SerialArchive *ar, const char *fname)
+static void log_md5sum(const md5_byte_t *digest)
 {
-    Operations ops;
-    FILE *in = NULL;
-    struct stat statbuf;
-    int retval = PATCHERROR;
+    /* ugly, but want to print it all on one line... */
+    _log("  (md5sum: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x)",
+          digest[0],  digest[1],  digest[2],  digest[3],
+          digest[4],  digest[5],  digest[6],  digest[7],
+          digest[8],  digest[9],  digest[10], digest[11],
+          digest[12], digest[13], digest[14], digest[15]);
+} /* log_md5sum */
 
-    _current_operation("%s %s", (replace) ? "ADDORREPLACE" : "ADD",
-                        final_path_element(fname));
-    _log("%s %s", (replace) ? "ADDORREPLACE" : "ADD", fname);
 
-    if (!confirm())
-        return(PATCHSUCCESS);
+static void md5_to_string(const md5_byte_t *digest, char *buf)
+{
+    int i;
+    for (i = 0; i < 16; i++)
+        sprintf(buf + (i * 2), "%02x", digest[i]);
+} /* md5_to_string */
 
-    if (in_ignore_list(fname))
-        return(PATCHSUCCESS);
 
-    if (stat(fname, &statbuf) == -1)
+static int md5sum(FILE *in, md5_byte_t *digest, int output)
+{
+    md5_state_t md5state;
+    unsigned long long total = 0;
+    double start = stats_start(STATS_PHASE_MD5);
+    long br;
+
+    _dlog("md5summing...");
+
+    memset(digest, '\0', 16);
+    md5_init(&md5state);
+
+    if (fseek(in, 0, SEEK_SET) == -1)
     {
-        _fatal("Couldn't stat %s: %s.", fname, strerror(errno));
+        _fatal("Couldn't seek in file: %s.", strerror(errno));
         return(PATCHERROR);
     } /* if */
 
-    in = fopen(fname, "rb");
-    if (in == NULL)
+    while (1)
+    {
+        br = fread(iobuf, 1, sizeof (iobuf), in);
+        if (br == 0)
+        {
+            int err = errno;
+            if (feof(in))
+                break;
+            else
+            {
+                _fatal("Read error: %s.", strerror(err));
+                return(PATCHERROR);
+            } /* else */
+        } /* if */
+        md5_append(&md5state, (const md5_byte_t *) iobuf, br);
+        total += br;
+        progress_add(br);
+    } /* while */
+
+    md5_finish(&md5state, digest);
+
+    if ((output) || (debug))
+        log_md5sum(digest);
+
+    if (fseek(in, 0, SEEK_SET) == -1)
+    {
+        _fatal("Couldn't seek in file: %s.", strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    stats_phase(STATS_PHASE_MD5, start, total, 0);
+    return(PATCHSUCCESS);
+} /* md5sum */
+
+
+typedef struct
+{
+    md5_state_t states[2];
+    unsigned long long total;
+} MD5Files;
+
+static int md5sum_files_callback(void *data, int idx,
+                                 const void *buf, size_t len)
+{
+    MD5Files *md5files = (MD5Files *) data;
+    md5_append(&md5files->states[idx], (const md5_byte_t *) buf, len);
+    md5files->total += len;
+    progress_add(len);
+    return(1);
+} /* md5sum_files_callback */
+
+
+/*
+ * md5sum files by name. The platform layer gets the whole list at once,
+ *  so it can overlap the reads instead of doing one file after another.
+ */
+static int md5sum_files(const char **fnames, md5_byte_t **digests, int count)
+{
+    MD5Files md5files;
+    double start = stats_start(STATS_PHASE_MD5);
+    int i;
+
+    assert(count <= (sizeof (md5files.states) / sizeof (md5files.states[0])));
+
+    _dlog("md5summing...");
+
+    md5files.total = 0;
+    for (i = 0; i < count; i++)
+        md5_init(&md5files.states[i]);
+
+    if (!read_files(fnames, count, md5sum_files_callback, &md5files))
+        return(PATCHERROR);
+
+    for (i = 0; i < count; i++)
+    {
+        md5_finish(&md5files.states[i], digests[i]);
+        if (debug)
+            log_md5sum(digests[i]);
+    } /* for */
+
+    stats_phase(STATS_PHASE_MD5, start, md5files.total, 0);
+    return(PATCHSUCCESS);
+} /* md5sum_files */
+
+
+static int verify_md5sum(md5_byte_t *md5, md5_byte_t *result,
+                         const char *fname, int isfatal)
+{
+    md5_byte_t thismd5[16];
+    md5_byte_t *digest = thismd5;
+
+    if (md5sum_files(&fname, &digest, 1) == PATCHERROR)
+        return(PATCHERROR);
+
+    if (result != NULL)
+		memcpy(result, thismd5, sizeof (thismd5));
+
+    if (memcmp(thismd5, md5, sizeof (thismd5)) != 0)
+    {
+        if (isfatal)
+            _fatal("md5sum doesn't match original!");
+        return(PATCHERROR);
+    } /* if */
+    
+    return(PATCHSUCCESS);
+} /* verify_md5sum */
+
+
+/* !!! FIXME: This should be in the UI abstraction. */
+static int confirm(void)
+{
+    char buf[256];
+    char *ptr;
+
+    if (!interactive)
+        return(1);
+
+    while (1)
+    {
+        printf("Confirm [Y/n] : ");
+        fgets(buf, sizeof (buf) - 1, stdin);
+        if ( (ptr = strchr(buf, '\r')) != NULL )
+            *ptr = '\0';
+        if ( (ptr = strchr(buf, '\n')) != NULL )
+            *ptr = '\0';
+
+        if (strlen(buf) <= 1)
+        {
+            int ch = tolower((int) buf[0]);
+            if ((ch == '\0') || (ch == 'y'))
+            {
+                printf("Answered YES\n");
+                return(1);
+            } /* if */
+            else if (ch == 'n')
+            {
+                printf("Answered NO\n");
+                return(0);
+            } /* else if */
+        } /* if */
+    } /* while */
+} /* confirm */
+
+
+static const char *final_path_element(const char *fname)
+{
+    const char *ptr = (const char *) strrchr(fname, PATH_SEP[0]);
+    assert( (sizeof (PATH_SEP)) == (sizeof (char) * 2) );
+    return(ptr ? ptr + 1 : fname);
+} /* final_path_element */
+
+
+/* put a DELETE operation in the mojopatch file... */
+static int put_delete(SerialArchive *ar, const char *fname)
+{
+    Operations ops;
+
+    _current_operation("DELETE %s", final_path_element(fname));
+    _log("DELETE %s", fname);
+
+    if (in_ignore_list(fname))
+        return(PATCHSUCCESS);
+
+    if (!confirm())
+        return(PATCHSUCCESS);
+
+    stats_op_begin("DELETE", fname, ar->io);
+    ops.operation = OPERATION_DELETE;
+    make_static_string(ops.del.fname, fname);
+    return(stats_op_end(serialize_operation(ar, &ops)));
+} /* put_delete */
+
+
+/* get a DELETE operation from the mojopatch file... */
+static int handle_delete_op(SerialArchive *ar, OperationType op, void *d)
+{
+    DeleteOperation *del = (DeleteOperation *) d;
+    assert(op == OPERATION_DELETE);
+
+    _current_operation("DELETE %s", final_path_element(del->fname));
+    _log("DELETE %s", del->fname);
+
+    if ( (info_only()) || (!confirm()) )
+        return(PATCHSUCCESS);
+
+    if (in_ignore_list(del->fname))
+        return(PATCHSUCCESS);
+
+    if (!op_file_exists(del->fname))
+    {
+        _log("file seems to be gone already.");
+        return(PATCHSUCCESS);
+    } /* if */
+
+    if (file_is_directory(del->fname))
+    {
+        _fatal("Expected file, found directory!");
+        return(PATCHERROR);
+    } /* if */
+
+    if (preparing)
+        return(stage_step("delete", 0, del->fname));
+
+    if (remove(del->fname) == -1)
+    {
+        _fatal("Error removing [%s]: %s.", del->fname, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    _log("done DELETE.");
+    return(PATCHSUCCESS);
+} /* handle_delete_op */
+
+
+/* put a DELETEDIRECTORY operation in the mojopatch file... */
+static int put_delete_dir(SerialArchive *ar, const char *fname)
+{
+    Operations ops;
+
+    _current_operation("DELETEDIRECTORY %s", final_path_element(fname));
+    _log("DELETEDIRECTORY %s", fname);
+
+    if (!confirm())
+        return(PATCHSUCCESS);
+
+    if (in_ignore_list(fname))
+        return(PATCHSUCCESS);
+
+    stats_op_begin("DELETEDIRECTORY", fname, ar->io);
+    ops.operation = OPERATION_DELETEDIRECTORY;
+    make_static_string(ops.deldir.fname, fname);
+    return(stats_op_end(serialize_operation(ar, &ops)));
+} /* put_delete_dir */
+
+
+static int delete_dir_tree(const char *fname)
+{
+    char filebuf[MAX_PATH];
+    file_list *files = list_directory(fname);
+    file_list *i;
+    int rc = 0;
+
+    _log("Deleting directory tree %s", fname);
+
+    for (i = files; i != NULL; i = i->next)
+    {
+        snprintf(filebuf, sizeof (filebuf), "%s%s%s", fname, PATH_SEP, i->fname);
+        if (file_is_directory(filebuf))
+            rc = delete_dir_tree(filebuf);
+        else
+        {
+            _log("Deleting file %s from dir tree", filebuf);
+            rc = (remove(filebuf) == -1) ? PATCHERROR : PATCHSUCCESS;
+            if (rc == PATCHERROR)
+                _fatal("failed to delete %s: %s.", filebuf, strerror(errno));
+        } /* else */
+
+        if (rc == PATCHERROR)
+        {
+            free_filelist(files);
+            return(PATCHERROR);
+        } /* if */
+    } /* for */
+
+    free_filelist(files);
+
+    if (rmdir(fname) == -1)
+    {
+        _fatal("Error removing directory [%s]: %s.", fname, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    return(PATCHSUCCESS);
+} /* delete_dir_tree */
+
+
+/* get a DELETEDIRECTORY operation from the mojopatch file... */
+static int handle_deldir_op(SerialArchive *ar, OperationType op, void *d)
+{
+    DeleteDirOperation *deldir = (DeleteDirOperation *) d;
+    assert(op == OPERATION_DELETEDIRECTORY);
+
+    _current_operation("DELETEDIRECTORY %s", final_path_element(deldir->fname));
+    _log("DELETEDIRECTORY %s", deldir->fname);
+
+    if ( (info_only()) || (!confirm()) )
+        return(PATCHSUCCESS);
+
+    if (in_ignore_list(deldir->fname))
+        return(PATCHSUCCESS);
+
+    if (!op_file_exists(deldir->fname))
+    {
+        _log("directory seems to be gone already.");
+        return(PATCHSUCCESS);
+    } /* if */
+
+    if (!file_is_directory(deldir->fname))
+    {
+        _fatal("Expected directory, found file!");
+        return(PATCHERROR);
+    } /* if */
+
+    if (preparing)
+        return(stage_step("deletedir", 0, deldir->fname));
+
+    if (!delete_dir_tree(deldir->fname))
+        return(PATCHERROR);
+
+    _log("done DELETEDIRECTORY.");
+    return(PATCHSUCCESS);
+} /* handle_deldir_op */
+
+
+/* put an ADD operation in the mojopatch file... */
+static int put_add(SerialArchive *ar, const char *fname)
+{
+    Operations ops;
+    FILE *in = NULL;
+    struct stat statbuf;
+    int retval = PATCHERROR;
+    NewTreeEntry *ent = NULL;
+
+    _current_operation("%s %s", (replace) ? "ADDORREPLACE" : "ADD",
+                        final_path_element(fname));
+    _log("%s %s", (replace) ? "ADDORREPLACE" : "ADD", fname);
+
+    if (!confirm())
+        return(PATCHSUCCESS);
+
+    if (in_ignore_list(fname))
+        return(PATCHSUCCESS);
+
+    stats_op_begin((replace) ? "REPLACE" : "ADD", fname, ar->io);
+
+    if (stat(fname, &statbuf) == -1)
+    {
+        _fatal("Couldn't stat %s: %s.", fname, strerror(errno));
+        return(stats_op_end(PATCHERROR));
+    } /* if */
+
+    ops.operation = (replace) ? OPERATION_REPLACE : OPERATION_ADD;
+    ops.add.fsize = statbuf.st_size;
+    ops.add.mode = (unsigned int) statbuf.st_mode;
+    make_static_string(ops.add.fname, fname);
+
+    if (newtreereader != NULL)
+        ent = newtree_entry(fname);
+
+    /* already in an earlier patch? Copy it from there, still compressed. */
+    if ((ent != NULL) && (ent->addpos >= 0))
+    {
+        memcpy(ops.add.md5, ent->md5, sizeof (ops.add.md5));
+        if ( (serialize_operation(ar, &ops)) &&
+             (fflush(ar->io) == 0) &&
+             (fseeko(newtreereader, ent->addpos, SEEK_SET) == 0) &&
+             (write_between_files(newtreereader, ar->io, ent->addlen, ZLIB_NONE)) )
+            retval = PATCHSUCCESS;
+        return(stats_op_end(retval));
+    } /* if */
+
+    in = fopen(fname, "rb");
+    if (in == NULL)
+    {
+        _fatal("failed to open [%s]: %s.", fname, strerror(errno));
+        return(stats_op_end(PATCHERROR));
+    } /* if */
+
+    if (md5sum(in, ops.add.md5, debug) == PATCHERROR)
+        goto put_add_done;
+
+    if (!serialize_operation(ar, &ops))
+        goto put_add_done;
+
+    if (ent != NULL)
+        ent->addpos = ftello(ar->io);
+
+    if (!write_between_files(in, ar->io, ops.add.fsize, ZLIB_COMPRESS))
+        goto put_add_done;
+
+    assert(fgetc(in) == EOF);
+    retval = PATCHSUCCESS;
+
+    if ((ent != NULL) && (ent->addpos >= 0))
+    {
+        ent->addlen = (unsigned long long) (ftello(ar->io) - ent->addpos);
+        memcpy(ent->md5, ops.add.md5, sizeof (ent->md5));
+        ent->have_md5 = 1;
+    } /* if */
+
+put_add_done:
+    if (in != NULL)
+        fclose(in);
+    return(stats_op_end(retval));
+} /* put_add */
+
+
+/* get an ADD or REPLACE operation from the mojopatch file... */
+static int handle_add_op(SerialArchive *ar, OperationType op, void *d)
+{
+    AddOperation *add = (AddOperation *) d;
+    assert((op == OPERATION_ADD) || (op == OPERATION_REPLACE));
+    int replace_ok = (op == OPERATION_REPLACE);
+    const char *target = (preparing) ? stage_name() : add->fname;
+    int retval = PATCHERROR;
+    FILE *io = NULL;
+    int rc;
+
+    _current_operation("%s %s", (replace_ok) ? "ADDORREPLACE" : "ADD",
+                          final_path_element(add->fname));
+    _log("%s %s", (replace_ok) ? "ADDORREPLACE" : "ADD", add->fname);
+
+    if ( (info_only()) || (!confirm()) || (in_ignore_list(add->fname)) )
+    {
+        #if USE_ZLIB  /* skip through compressed file... */
+            return(write_between_files_uncompress(ar->io, NULL, add->fsize, 1));
+        #else
+        if (fseeko(ar->io, (off_t) add->fsize, SEEK_CUR) < 0)
+        {
+            _fatal("Seek error: %s.", strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+        #endif
+        return(PATCHSUCCESS);
+    } /* if */
+
+    if (op_file_exists(add->fname))
+    {
+        if (replace_ok)
+        {
+            if (!preparing)  /* --commit's rename will replace it. */
+                unlink(add->fname);
+        } /* if */
+        else
+        {
+            if (file_is_directory(add->fname))
+            {
+                _fatal("Error: [%s] already exists, but it's a directory!", add->fname);
+                return(PATCHERROR);
+            } /* if */
+
+            _log("[%s] already exists...looking at md5sum...", add->fname);
+            _current_operation("VERIFY %s", final_path_element(add->fname));
+            if (verify_md5sum(add->md5, NULL, add->fname, 1) == PATCHERROR)
+                goto handle_add_done;
+
+            _log("Okay; file matches what we expected.");
+
+            if (fseeko(ar->io, (off_t) add->fsize, SEEK_CUR) < 0)
+            {
+                _fatal("Seek error: %s.", strerror(errno));
+                return(PATCHERROR);
+            } /* if */
+
+            return(PATCHSUCCESS);
+        } /* else */
+    } /* if */
+
+    io = open_file_for_writing_sized(target, add->fsize);
+    if (io == NULL)
+    {
+        _fatal("Error creating [%s]: %s.", target, strerror(errno));
+        goto handle_add_done;
+    } /* if */
+
+    rc = write_between_files(ar->io, io, add->fsize, ZLIB_UNCOMPRESS);
+    if (rc == PATCHERROR)
+        goto handle_add_done;
+
+    rc = fclose(io);
+    io = NULL;
+    if ((rc == EOF) || ((journal != NULL) && (!sync_path(target))))
+    {
+        _fatal("Error: Couldn't flush output: %s.", strerror(errno));
+        goto handle_add_done;
+    } /* if */
+
+    chmod(target, (mode_t) add->mode);  /* !!! FIXME: Should this be an error condition? */
+
+    _current_operation("VERIFY %s", final_path_element(add->fname));
+    if (verify_md5sum(add->md5, NULL, target, 1) == PATCHERROR)
+        goto handle_add_done;
+
+    if ((preparing) && (stage_step("install", add->mode, add->fname) == PATCHERROR))
+        goto handle_add_done;
+
+    drop_file_cache(target);  /* written and verified; we're done with it. */
+    retval = PATCHSUCCESS;
+    _log("done %s.", (replace_ok) ? "ADDORREPLACE" : "ADD");
+
+handle_add_done:
+    if (io != NULL)
+        fclose(io);
+
+    return(retval);
+} /* handle_add_op */
+
+
+static int handle_replace_op(SerialArchive *ar, OperationType op, void *d)
+{
+    assert(op == OPERATION_REPLACE);
+    return(handle_add_op(ar, op, d));
+} /* handle_replace_op */
+
+
+static int put_add_for_wholedir(SerialArchive *ar, const char *base);
+
+
+/* put an ADDDIRECTORY operation in the mojopatch file... */
+static int put_add_dir(SerialArchive *ar, const char *fname)
+{
+    Operations ops;
+    struct stat statbuf;
+
+    _current_operation("ADDDIRECTORY %s", final_path_element(fname));
+    _log("ADDDIRECTORY %s", fname);
+
+    if (!confirm())
+        return(PATCHSUCCESS);
+
+    if (in_ignore_list(fname))
+        return(PATCHSUCCESS);
+
+    stats_op_begin("ADDDIRECTORY", fname, ar->io);
+
+    if (stat(fname, &statbuf) == -1)
+    {
+        _fatal("Couldn't stat %s: %s.", fname, strerror(errno));
+        return(stats_op_end(PATCHERROR));
+    } /* if */
+
+    ops.operation = OPERATION_ADDDIRECTORY;
+    ops.adddir.mode = (unsigned int) statbuf.st_mode;
+    make_static_string(ops.adddir.fname, fname);
+
+    /* end the op before the contents, so it isn't charged for them. */
+    if (!stats_op_end(serialize_operation(ar, &ops)))
+        return(PATCHERROR);
+
+    /* must add contents of dir after dir itself... */
+    if (put_add_for_wholedir(ar, fname) == PATCHERROR)
+        return(PATCHERROR);
+
+    return(PATCHSUCCESS);
+} /* put_add_dir */
+
+
+/* get an ADDDIRECTORY operation from the mojopatch file... */
+static int handle_adddir_op(SerialArchive *ar, OperationType op, void *d)
+{
+    AddDirOperation *adddir = (AddDirOperation *) d;
+    assert(op == OPERATION_ADDDIRECTORY);
+    
+    _current_operation("ADDDIRECTORY %s", final_path_element(adddir->fname));
+    _log("ADDDIRECTORY %s", adddir->fname);
+
+    if ( (info_only()) || (!confirm()) || (in_ignore_list(adddir->fname)) )
+        return(PATCHSUCCESS);
+
+    /* an earlier op might delete what's there now; --commit checks it. */
+    if (preparing)
+        return(stage_step("mkdir", adddir->mode, adddir->fname));
+
+    if (file_exists(adddir->fname))
+    {
+        if (file_is_directory(adddir->fname))
+        {
+            _log("[%s] already exists.", adddir->fname);
+            return(PATCHSUCCESS);
+        } /* if */
+        else
+        {
+            _fatal("[%s] already exists, but it's a file!", adddir->fname);
+            return(PATCHERROR);
+        } /* else */
+    } /* if */
+
+    if (mkdir(adddir->fname, S_IRWXU) == -1)
+    {
+        _fatal("Error making directory [%s]: %s.", adddir->fname, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    /* !!! FIXME: Pass this to mkdir? */
+    chmod(adddir->fname, (mode_t) adddir->mode);  /* !!! FIXME: Should this be an error condition? */
+
+    _log("done ADDDIRECTORY.");
+    return(PATCHSUCCESS);
+} /* handle_adddir_op */
+
+
+/* put add operations for each file in (base). Recurses into subdirs. */
+static int put_add_for_wholedir(SerialArchive *ar, const char *base)
+{
+    char filebuf[MAX_PATH];
+    file_list *files = new_list_directory(base);
+    file_list *i;
+    int rc = 0;
+
+    for (i = files; i != NULL; i = i->next)
+    {
+        snprintf(filebuf, sizeof (filebuf), "%s%s%s", base, PATH_SEP, i->fname);
+
+        if (in_ignore_list(filebuf))
+            continue;
+
+        /* put_add_dir recurses back into this function. */
+        if (file_is_directory(filebuf))
+            rc = put_add_dir(ar, filebuf);
+        else
+            rc = put_add(ar, filebuf);
+
+        if (rc == PATCHERROR)
+        {
+            free_filelist(files);
+            return(PATCHERROR);
+        } /* if */
+    } /* for */
+
+    free_filelist(files);
+    return(PATCHSUCCESS);
+} /* put_add_for_wholedir */
+
+/* put a DONE operation in the mojopatch file... */
+static int put_done(SerialArchive *ar)
+{
+    Operations ops;
+
+    _current_operation("DONE");
+    _log("DONE");
+
+    ops.operation = OPERATION_DONE;
+    return(serialize_operation(ar, &ops));
+} /* put_done */
+
+
+/* md5sum of a file in the new tree, remembered for --createmulti. */
+static int md5sum_newfile(const char *fname, md5_byte_t *digest)
+{
+    NewTreeEntry *ent = newtree_entry(fname);
+
+    if ((ent != NULL) && (ent->have_md5))
+        memcpy(digest, ent->md5, 16);
+    else
+    {
+        if (md5sum_files(&fname, &digest, 1) == PATCHERROR)
+            return(PATCHERROR);
+
+        if (ent != NULL)
+        {
+            memcpy(ent->md5, digest, 16);
+            ent->have_md5 = 1;
+        } /* if */
+    } /* else */
+
+    return(PATCHSUCCESS);
+} /* md5sum_newfile */
+
+
+static int md5sums_match(const char *fname1, const char *fname2,
+                         md5_byte_t *md5_1, md5_byte_t *md5_2)
+{
+    const char *fnames[2] = { fname1, fname2 };
+    md5_byte_t *digests[2] = { md5_1, md5_2 };
+    NewTreeEntry *ent = newtree_entry(fname2);
+
+    if ((ent != NULL) && (ent->have_md5))
+    {
+        memcpy(md5_2, ent->md5, 16);
+        if (md5sum_files(fnames, digests, 1) == PATCHERROR)
+            return(0);
+    } /* if */
+
+    else
+    {
+        if (md5sum_files(fnames, digests, 2) == PATCHERROR)
+            return(0);
+
+        if (ent != NULL)
+        {
+            memcpy(ent->md5, md5_2, 16);
+            ent->have_md5 = 1;
+        } /* if */
+    } /* else */
+
+    return(memcmp(md5_1, md5_2, 16) == 0);
+} /* md5sums_match */
+
+
+/*
+ * xdelta's lengths are 32-bit ints, so a file bigger than that is deltaed a
+ *  window at a time: window (k) of the new file is [k * window, (k + 1) *
+ *  window), made from the same stretch of the old file plus some slop on
+ *  each side, for data that moved a little. Each window's delta goes in the
+ *  patchfile as a 64-bit length and then the delta itself. Windows start on
+ *  xdelta's page boundaries, since it maps them.
+ */
+#define XDELTA_MAX_FSIZE 0x7FFFFFFFULL
+#define XDELTA_PAGE_SIZE (1024ULL * 1024ULL)  /* xdmain.c's XD_PAGE_SIZE. */
+#define PATCH_WINDOW_SIZE (1024ULL * 1024ULL * 1024ULL)
+#define PATCH_WINDOW_SLOP(w) ((w) / 4)
+
+typedef struct
+{
+    unsigned long long oldoff;
+    unsigned long long oldlen;
+    unsigned long long newoff;
+    unsigned long long newlen;
+} PatchWindow;
+
+static unsigned long long patch_window_count(const PatchOperation *patch)
+{
+    return((patch->fsize + patch->window - 1) / patch->window);
+} /* patch_window_count */
+
+
+static void patch_window(const PatchOperation *patch, unsigned long long k,
+                         PatchWindow *win)
+{
+    const unsigned long long slop = PATCH_WINDOW_SLOP(patch->window);
+    unsigned long long oldend;
+
+    win->newoff = k * patch->window;
+    win->newlen = patch->fsize - win->newoff;
+    if (win->newlen > patch->window)
+        win->newlen = patch->window;
+
+    win->oldoff = (win->newoff > slop) ? (win->newoff - slop) : 0;
+    oldend = win->newoff + win->newlen + slop;
+
+    /* new file grew past the end of the old one? Use the old one's tail. */
+    if (win->oldoff >= patch->oldfsize)
+    {
+        win->oldoff = 0;
+        if (patch->oldfsize > patch->window)
+            win->oldoff = (patch->oldfsize - patch->window) & ~(XDELTA_PAGE_SIZE - 1);
+        oldend = patch->oldfsize;
+    } /* if */
+
+    if (oldend > patch->oldfsize)
+        oldend = patch->oldfsize;
+
+    win->oldlen = oldend - win->oldoff;
+} /* patch_window */
+
+
+/* the window size came out of a patchfile; make sure it's one we'd write. */
+static int patch_window_valid(const PatchOperation *patch)
+{
+    const unsigned long long w = patch->window;
+    if (w == 0)
+        return(1);
+
+    return( (w % (XDELTA_PAGE_SIZE * 4) == 0) &&
+            (w + (PATCH_WINDOW_SLOP(w) * 2) <= XDELTA_MAX_FSIZE) );
+} /* patch_window_valid */
+
+
+/* delta (fname1) to (fname2) a window at a time, into patchtmpfile. */
+static int make_windowed_delta(PatchOperation *patch,
+                               const char *fname1, const char *fname2)
+{
+    const unsigned long long windows = patch_window_count(patch);
+    SerialArchive out;
+    FILE *deltaio = NULL;
+    unsigned long long k;
+    int retval = PATCHSUCCESS;
+
+    out.reading = 0;
+    out.io = open_file_for_writing(patchtmpfile);
+    if (out.io == NULL)
+    {
+        _fatal("Couldn't open [%s]: %s.", patchtmpfile, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    _dlog("(Deltaing in %llu windows of %llu bytes.)", windows, patch->window);
+
+    for (k = 0; (k < windows) && (retval != PATCHERROR); k++)
+    {
+        unsigned long long size;
+        PatchWindow win;
+
+        patch_window(patch, k, &win);
+        unlink(patchtmpfile2);
+        if ( (!_do_xdelta("delta -n %s--maxmem=%dM --indexmem=%dM "
+                          "--fromrange=%llu:%llu --torange=%llu:%llu "
+                          "\"%s\" \"%s\" \"%s\"",
+                          (deltaspeed < 0) ? "" : deltaspeed_args[deltaspeed],
+                          maxxdeltamem, maxxdeltamem, win.oldoff, win.oldlen,
+                          win.newoff, win.newlen, fname1, fname2,
+                          patchtmpfile2)) ||
+             (!get_file_size(patchtmpfile2, &size)) )
+        {
+            _fatal("there was a problem running xdelta.");
+            retval = PATCHERROR;
+            break;
+        } /* if */
+
+        deltaio = fopen(patchtmpfile2, "rb");
+        if (deltaio == NULL)
+        {
+            _fatal("couldn't read %s: %s.", patchtmpfile2, strerror(errno));
+            retval = PATCHERROR;
+            break;
+        } /* if */
+
+        if (!serialize_uint64(&out, &size))
+            retval = PATCHERROR;
+        else
+            retval = write_between_files(deltaio, out.io, size, ZLIB_NONE);
+
+        fclose(deltaio);
+    } /* for */
+
+    unlink(patchtmpfile2);
+
+    if ((fclose(out.io) == EOF) && (retval != PATCHERROR))
+    {
+        _fatal("Couldn't write [%s]: %s.", patchtmpfile, strerror(errno));
+        retval = PATCHERROR;
+    } /* if */
+
+    if ((retval != PATCHERROR) && (!get_file_size(patchtmpfile, &patch->deltasize)))
+        retval = PATCHERROR;
+
+    return(retval);
+} /* make_windowed_delta */
+
+
+
+/*
+ * A signature file stands in for the old tree when creating a patch, so the
+ *  build machine doesn't need the whole old release around. It's a list of
+ *  every file and dir under the old tree, in the order we walked it, with
+ *  paths built just like compare_directories() builds them from ".". Files
+ *  get their size and md5sum, and xdelta's rsync signature of the data,
+ *  which is enough to delta a new file against them without the old one.
+ */
+typedef enum
+{
+    SIGENTRY_END = 0,
+    SIGENTRY_FILE,
+    SIGENTRY_DIR
+} SigEntryType;
+
+typedef struct
+{
+    char *fname;
+    int isdir;
+    unsigned long long fsize;
+    md5_byte_t md5[16];
+    off_t sigpos;  /* where xdelta's signature is in the signature file. */
+    unsigned long long siglen;  /* 0 == no signature; file's too big. */
+    int firstchild;  /* index into sigentries, or -1. */
+    int nextsibling;
+} SigEntry;
+
+static FILE *sigio = NULL;
+static SigEntry *sigentries = NULL;  /* sorted by fname, for bsearch(). */
+static int sigcount = 0;
+static int sigrootchild = -1;
+
+
+static int sigentry_cmp(const void *a, const void *b)
+{
+    return(strcmp(((const SigEntry *) a)->fname, ((const SigEntry *) b)->fname));
+} /* sigentry_cmp */
+
+
+static SigEntry *find_sigentry(const char *fname)
+{
+    SigEntry key;
+    key.fname = (char *) fname;
+    return((SigEntry *) bsearch(&key, sigentries, sigcount,
+                                sizeof (SigEntry), sigentry_cmp));
+} /* find_sigentry */
+
+
+static void free_signature(void)
+{
+    int i;
+    for (i = 0; i < sigcount; i++)
+        free(sigentries[i].fname);
+    free(sigentries);
+    sigentries = NULL;
+    sigcount = 0;
+    sigrootchild = -1;
+
+    if (sigio != NULL)
+    {
+        fclose(sigio);
+        sigio = NULL;
+    } /* if */
+} /* free_signature */
+
+
+static int load_signature(const char *fname)
+{
+    SerialArchive ar;
+    char sig[sizeof (MOJOSIGNATURESIG)];
+    char path[STATIC_STRING_SIZE];
+    int allocated = 0;
+    int complete = 0;
+    int i;
+
+    ar.reading = 1;
+    ar.io = sigio = fopen(fname, "rb");
+    if (sigio == NULL)
+    {
+        _fatal("Couldn't open [%s]: %s.", fname, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    if ( (!SERIALIZE(&ar, sig)) ||
+         (memcmp(sig, MOJOSIGNATURESIG, sizeof (sig)) != 0) )
+    {
+        _fatal("[%s] is not a compatible mojopatch signature.", fname);
+        return(PATCHERROR);
+    } /* if */
+
+    while (1)
+    {
+        unsigned int type = SIGENTRY_END;
+        SigEntry *e;
+
+        if (!serialize_uint32(&ar, &type))
+            break;
+        else if ((type != SIGENTRY_FILE) && (type != SIGENTRY_DIR))
+        {
+            complete = (type == SIGENTRY_END);
+            break;
+        } /* else if */
+
+        if (sigcount == allocated)
+        {
+            void *ptr;
+            allocated = (allocated == 0) ? 1024 : allocated * 2;
+            ptr = realloc(sigentries, sizeof (SigEntry) * allocated);
+            if (ptr == NULL)
+            {
+                _fatal("Out of memory.");
+                return(PATCHERROR);
+            } /* if */
+            sigentries = (SigEntry *) ptr;
+        } /* if */
+
+        e = &sigentries[sigcount];
+        memset(e, '\0', sizeof (SigEntry));
+        if (!serialize_static_string(&ar, path))
+            break;
+
+        e->fname = (char *) malloc(strlen(path) + 1);
+        if (e->fname == NULL)
+        {
+            _fatal("Out of memory.");
+            return(PATCHERROR);
+        } /* if */
+        strcpy(e->fname, path);
+        e->isdir = (type == SIGENTRY_DIR);
+        e->firstchild = e->nextsibling = -1;
+        sigcount++;
+
+        if (e->isdir)
+            continue;
+
+        if ( (!serialize_uint64(&ar, &e->fsize)) ||
+             (!SERIALIZE(&ar, e->md5)) ||
+             (!serialize_uint64(&ar, &e->siglen)) )
+            break;
+
+        e->sigpos = ftello(sigio);
+        if (fseeko(sigio, (off_t) e->siglen, SEEK_CUR) < 0)
+            break;
+    } /* while */
+
+    if (!complete)
+    {
+        _fatal("[%s] is incomplete or corrupted.", fname);
+        return(PATCHERROR);
+    } /* if */
+
+    qsort(sigentries, sigcount, sizeof (SigEntry), sigentry_cmp);
+
+    /* hook every entry up to its dir, so we can list dirs like the disk. */
+    for (i = sigcount - 1; i >= 0; i--)
+    {
+        SigEntry *e = &sigentries[i];
+        char *ptr;
+        int *list = &sigrootchild;
+
+        strcpy(path, e->fname);
+        ptr = strrchr(path, PATH_SEP[0]);
+        if (ptr == NULL)
+        {
+            _fatal("[%s] is incomplete or corrupted.", fname);
+            return(PATCHERROR);
+        } /* if */
+
+        *ptr = '\0';
+        if (strcmp(path, ".") != 0)
+        {
+            SigEntry *parent = find_sigentry(path);
+            if ((parent == NULL) || (!parent->isdir))
+            {
+                _fatal("[%s] has [%s], but not its dir.", fname, e->fname);
+                return(PATCHERROR);
+            } /* if */
+            list = &parent->firstchild;
+        } /* if */
+
+        e->nextsibling = *list;
+        *list = i;
+    } /* for */
+
+    _dlog("(%d entries in signature [%s].)", sigcount, fname);
+    return(PATCHSUCCESS);
+} /* load_signature */
+
+
+/* these look at the signature instead of dir1 when we're creating from one. */
+static file_list *old_list_directory(const char *base)
+{
+    file_list *retval = NULL;
+    file_list *tail = NULL;
+    int child = sigrootchild;
+
+    if (!fromsignature)
+        return(list_directory(base));
+
+    if (strcmp(base, ".") != 0)
+    {
+        SigEntry *e = find_sigentry(base);
+        if (e == NULL)
+            return(NULL);
+        child = e->firstchild;
+    } /* if */
+
+    for (; child != -1; child = sigentries[child].nextsibling)
+    {
+        const char *fname = final_path_element(sigentries[child].fname);
+        file_list *item = (file_list *) malloc(sizeof (file_list));
+        if (item == NULL)
+            break;
+
+        item->fname = (char *) malloc(strlen(fname) + 1);
+        if (item->fname == NULL)
+        {
+            free(item);
+            break;
+        } /* if */
+
+        strcpy(item->fname, fname);
+        item->next = NULL;
+        if (tail == NULL)
+            retval = item;
+        else
+            tail->next = item;
+        tail = item;
+    } /* for */
+
+    return(retval);
+} /* old_list_directory */
+
+
+static int old_file_exists(const char *fname)
+{
+    if (!fromsignature)
+        return(file_exists(fname));
+    return(find_sigentry(fname) != NULL);
+} /* old_file_exists */
+
+
+static int old_file_is_directory(const char *fname)
+{
+    SigEntry *e;
+    if (!fromsignature)
+        return(file_is_directory(fname));
+    e = find_sigentry(fname);
+    return((e != NULL) && (e->isdir));
+} /* old_file_is_directory */
+
+
+/* copy (e)'s rsync signature out to patchtmpfile2, for xdelta. */
+static int extract_signature(const SigEntry *e)
+{
+    FILE *out;
+    int retval;
+
+    if (fseeko(sigio, e->sigpos, SEEK_SET) < 0)
+    {
+        _fatal("Couldn't seek in signature: %s.", strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    out = open_file_for_writing(patchtmpfile2);
+    if (out == NULL)
+    {
+        _fatal("Couldn't open [%s]: %s.", patchtmpfile2, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    retval = write_between_files(sigio, out, e->siglen, ZLIB_NONE);
+    if ((fclose(out) == EOF) && (retval != PATCHERROR))
+    {
+        _fatal("Couldn't write [%s]: %s.", patchtmpfile2, strerror(errno));
+        retval = PATCHERROR;
+    } /* if */
+
+    return(retval);
+} /* extract_signature */
+
+
+/* append (fname) to (out) and delete it; returns bytes copied, or -1. */
+static long long append_tmpfile(FILE *out, const char *fname)
+{
+    unsigned long long fsize;
+    FILE *in;
+    int rc;
+
+    if (!get_file_size(fname, &fsize))
+        return(-1);
+
+    in = fopen(fname, "rb");
+    if (in == NULL)
+        return(-1);
+
+    rc = write_between_files(in, out, fsize, ZLIB_NONE);
+    fclose(in);
+    unlink(fname);
+    return((rc == PATCHERROR) ? -1 : (long long) fsize);
+} /* append_tmpfile */
+
+
+/*
+ * --multibase: a PATCH for (fname) that works from any old tree's copy.
+ *  One delta per distinct old version (a tree that already has the new file
+ *  needs nothing), built up in patchtmpfile2 until we know all their sizes.
+ */
+static int put_multipatch(SerialArchive *ar, const char *fname)
+{
+    Operations ops;
+    MultiPatchOperation *mp = &ops.multipatch;
+    int src[MULTIPATCH_MAX_BASES];
+    char oldfname[MAX_PATH];
+    const char *oldptr = oldfname;
+    md5_byte_t digest[16];
+    md5_byte_t *digestptr = digest;
+    char cacheargs[MAX_PATH + 64];
+    char md5str[33];
+    struct stat statbuf;
+    FILE *payload = NULL;
+    FILE *in = NULL;
+    unsigned long long payloadsize = 0;
+    int mustadd = alwaysadd;
+    int retval = PATCHERROR;
+    unsigned int i;
+    int k;
+
+    _current_operation("VERIFY %s", final_path_element(fname));
+    stats_op_begin("VERIFY", fname, NULL);
+
+    memset(mp, '\0', sizeof (*mp));
+    if ( (stat(fname, &statbuf) == -1) ||
+         (md5sum_newfile(fname, mp->md5) == PATCHERROR) )
+    {
+        stats_op_end(0);
+        _fatal("Couldn't read [%s]: %s.", fname, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    mp->fsize = statbuf.st_size;
+    if (mp->fsize > XDELTA_MAX_FSIZE)
+        mustadd = 1;  /* no windowed deltas here; too big, just add it. */
+
+    for (k = 0; k < multicount; k++)
+    {
+        unsigned long long oldfsize = 0;
+
+        if (snprintf(oldfname, sizeof (oldfname), "%s%s%s", multireal1[k],
+                     PATH_SEP, fname) >= (int) sizeof (oldfname))
+        {
+            stats_op_end(0);
+            _fatal("Path is too long: [%s%s%s].", multireal1[k], PATH_SEP, fname);
+            return(PATCHERROR);
+        } /* if */
+
+        if ((!file_exists(oldfname)) || (file_is_directory(oldfname)))
+            continue;
+
+        if ( (md5sum_files(&oldptr, &digestptr, 1) == PATCHERROR) ||
+             (!get_file_size(oldfname, &oldfsize)) )
+        {
+            stats_op_end(0);
+            _fatal("Couldn't read [%s]: %s.", oldfname, strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+
+        if (memcmp(digest, mp->md5, 16) == 0)
+            continue;  /* this version is already up to date. */
+
+        for (i = 0; i < mp->basecount; i++)
+        {
+            if (memcmp(digest, mp->bases[i].md5, 16) == 0)
+                break;
+        } /* for */
+
+        if (i < mp->basecount)
+            continue;  /* same as some other version; one delta does both. */
+
+        if ((mp->basecount == MULTIPATCH_MAX_BASES) || (oldfsize > XDELTA_MAX_FSIZE))
+        {
+            mustadd = 1;
+            break;
+        } /* if */
+
+        src[mp->basecount] = k;
+        memcpy(mp->bases[mp->basecount].md5, digest, 16);
+        mp->bases[mp->basecount].oldfsize = oldfsize;
+        mp->basecount++;
+    } /* for */
+
+    if (stats_op_end((mp->basecount == 0) && (!mustadd)))
+        return(PATCHSUCCESS);  /* nothing to do from any version. */
+
+    if (mustadd)
+    {
+        int origreplace = replace;
+        replace = 1;  /* must ADDORREPLACE, as file may already exist. */
+        retval = put_add(ar, fname);
+        replace = origreplace;  /* reset original value. */
+        return(retval);
+    } /* if */
+
+    _current_operation("PATCH %s", final_path_element(fname));
+    _log("PATCH %s (from %u versions)", fname, mp->basecount);
+
+    if (!confirm())
+        return(PATCHSUCCESS);
+
+    if (in_ignore_list(fname))
+        return(PATCHSUCCESS);
+
+    stats_op_begin("MULTIPATCH", fname, ar->io);
+
+    unlink(patchtmpfile2);  /* just in case. */
+    payload = open_file_for_writing(patchtmpfile2);
+    if (payload == NULL)
+    {
+        _fatal("Couldn't open [%s]: %s.", patchtmpfile2, strerror(errno));
+        return(stats_op_end(PATCHERROR));
+    } /* if */
+
+    for (i = 0; i < mp->basecount; i++)
+    {
+        long long deltasize;
+
+        if (snprintf(oldfname, sizeof (oldfname), "%s%s%s", multireal1[src[i]],
+                     PATH_SEP, fname) >= (int) sizeof (oldfname))
+            goto put_multipatch_done;  /* can't happen; we checked above. */
+
+        cacheargs[0] = '\0';
+        if (indexcache != NULL)
+        {
+            md5_to_string(mp->bases[i].md5, md5str);
+            snprintf(cacheargs, sizeof (cacheargs),
+                     "--indexcache=\"%s\" --frommd5=%s ", indexcache, md5str);
+        } /* if */
+
+        if (!_do_xdelta("delta -n %s%s--maxmem=%dM --indexmem=%dM \"%s\" \"%s\" \"%s\"",
+                        (deltaspeed < 0) ? "" : deltaspeed_args[deltaspeed],
+                        cacheargs, maxxdeltamem, maxxdeltamem,
+                        oldfname, fname, patchtmpfile))
+        {
+            _fatal("there was a problem running xdelta.");
+            goto put_multipatch_done;
+        } /* if */
+
+        deltasize = append_tmpfile(payload, patchtmpfile);
+        if (deltasize < 0)
+        {
+            _fatal("Couldn't copy delta to [%s]: %s.", patchtmpfile2, strerror(errno));
+            goto put_multipatch_done;
+        } /* if */
+
+        mp->bases[i].deltasize = (unsigned long long) deltasize;
+        payloadsize += mp->bases[i].deltasize;
+    } /* for */
+
+    if (fullfallback)
+    {
+        in = fopen(fname, "rb");
+        if (in == NULL)
+        {
+            _fatal("failed to open [%s]: %s.", fname, strerror(errno));
+            goto put_multipatch_done;
+        } /* if */
+
+        if (!write_between_files(in, payload, mp->fsize, ZLIB_COMPRESS))
+            goto put_multipatch_done;
+
+        mp->hasfallback = 1;
+    } /* if */
+
+    if (fclose(payload) == EOF)
+    {
+        payload = NULL;
+        _fatal("Couldn't write [%s]: %s.", patchtmpfile2, strerror(errno));
+        goto put_multipatch_done;
+    } /* if */
+
+    payload = NULL;
+
+    /*
+     * the fallback is whatever the compressor left after the deltas. An
+     *  empty file writes nothing, so only a non-empty one can come up short.
+     */
+    if (mp->hasfallback)
+    {
+        unsigned long long total = 0;
+        if (!get_file_size(patchtmpfile2, &total))
+            goto put_multipatch_done;
+
+        if ( (total < payloadsize) ||
+             ((total == payloadsize) && (mp->fsize != 0)) )
+        {
+            _fatal("Fallback for [%s] is missing from [%s].", fname, patchtmpfile2);
+            goto put_multipatch_done;
+        } /* if */
+
+        mp->fallbacksize = total - payloadsize;
+        payloadsize = total;
+    } /* if */
+    mp->operation = OPERATION_MULTIPATCH;
+    mp->mode = (unsigned int) statbuf.st_mode;
+    make_static_string(mp->fname, fname);
+    if (!serialize_operation(ar, &ops))
+        goto put_multipatch_done;
+
+    payload = fopen(patchtmpfile2, "rb");
+    if (payload == NULL)
+    {
+        _fatal("couldn't read %s: %s.", patchtmpfile2, strerror(errno));
+        goto put_multipatch_done;
+    } /* if */
+
+    retval = write_between_files(payload, ar->io, payloadsize, ZLIB_NONE);
+
+put_multipatch_done:
+    if (in != NULL)
+        fclose(in);
+    if (payload != NULL)
+        fclose(payload);
+    unlink(patchtmpfile);
+    unlink(patchtmpfile2);
+    return(stats_op_end(retval));
+} /* put_multipatch */
+
+
+/* put a PATCH operation in the mojopatch file... */
+static int put_patch(SerialArchive *ar, const char *fname1, const char *fname2)
+{
+    Operations ops;
+    FILE *deltaio = NULL;
+    int retval = PATCHERROR;
+    struct stat statbuf;
+    SigEntry *sigentry = NULL;
+    int mustadd = alwaysadd;
+    char cacheargs[MAX_PATH + 64];
+    char md5str[33];
+
+    if (multibase)
+        return(put_multipatch(ar, fname2));
+
+    _current_operation("VERIFY %s", final_path_element(fname2));
+    stats_op_begin("VERIFY", fname2, NULL);
+
+    if (!fromsignature)
+    {
+        if (stats_op_end(md5sums_match(fname1, fname2, ops.patch.md5_1, ops.patch.md5_2)))
+            return(PATCHSUCCESS);
+    } /* if */
+
+    else
+    {
+        unsigned long long fsize = 0;
+
+        sigentry = find_sigentry(fname1);
+        assert(sigentry != NULL);  /* old_file_exists() said it was there. */
+        if ( (md5sum_newfile(fname2, ops.patch.md5_2) == PATCHERROR) ||
+             (!get_file_size(fname2, &fsize)) )
+        {
+            stats_op_end(0);
+            _fatal("Couldn't read [%s]: %s.", fname2, strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+
+        memcpy(ops.patch.md5_1, sigentry->md5, sizeof (ops.patch.md5_1));
+        if (stats_op_end(memcmp(ops.patch.md5_1, ops.patch.md5_2, 16) == 0))
+            return(PATCHSUCCESS);
+
+        /* signatures can't do windowed deltas; big files just get added. */
+        if ((sigentry->siglen == 0) || (fsize > XDELTA_MAX_FSIZE))
+            mustadd = 1;
+    } /* else */
+
+    if (mustadd)  /* add it instead of patch it... */
+    {
+        int origreplace = replace;
+        replace = 1;  /* must ADDORREPLACE, as file will definitely exist. */
+        retval = put_add(ar, fname2);
+        replace = origreplace;  /* reset original value. */
+        return(retval);
+    } /* if */
+
+    _current_operation("PATCH %s", final_path_element(fname2));
+    _log("PATCH %s", fname2);
+
+    if (!confirm())
+        return(PATCHSUCCESS);
+
+    if (in_ignore_list(fname2))
+        return(PATCHSUCCESS);
+
+    stats_op_begin("PATCH", fname2, ar->io);
+
+    if (stat(fname2, &statbuf) == -1)
+    {
+        _fatal("Couldn't stat %s: %s.", fname2, strerror(errno));
+        return(stats_op_end(PATCHERROR));
+    } /* if */
+
+    if (sigentry != NULL)
+        ops.patch.oldfsize = sigentry->fsize;
+    else if (!get_file_size(fname1, &ops.patch.oldfsize))
+    {
+        _fatal("Couldn't get size of [%s]: %s.", fname1, strerror(errno));
+        return(stats_op_end(PATCHERROR));
+    } /* else if */
+
+    ops.patch.fsize = statbuf.st_size;
+    ops.patch.window = 0;
+
+    cacheargs[0] = '\0';
+    if (indexcache != NULL)
+    {
+        md5_to_string(ops.patch.md5_1, md5str);
+        snprintf(cacheargs, sizeof (cacheargs),
+                 "--indexcache=\"%s\" --frommd5=%s ", indexcache, md5str);
+    } /* if */
+    if ( (ops.patch.oldfsize > XDELTA_MAX_FSIZE) ||
+         (ops.patch.fsize > XDELTA_MAX_FSIZE) )
+    {
+        ops.patch.window = PATCH_WINDOW_SIZE;
+        if (make_windowed_delta(&ops.patch, fname1, fname2) == PATCHERROR)
+            return(stats_op_end(PATCHERROR));
+    } /* if */
+
+    else if (sigentry != NULL)
+    {
+        if ( (extract_signature(sigentry) == PATCHERROR) ||
+             (!_do_xdelta("sigdelta -n \"%s\" \"%s\" \"%s\"",
+                          patchtmpfile2, fname2, patchtmpfile)) ||
+             (!get_file_size(patchtmpfile, &ops.patch.deltasize)) )
+        {
+            unlink(patchtmpfile2);
+            _fatal("there was a problem running xdelta.");
+            return(stats_op_end(PATCHERROR));
+        } /* if */
+        unlink(patchtmpfile2);
+    } /* else if */
+
+    /*
+     * the index gets its own budget, so huge files sample it instead of
+     *  swapping. We just md5summed the old file, so xdelta can trust that
+     *  instead of reading it all again to look it up in the index cache.
+     */
+    else if ( (!_do_xdelta("delta -n %s%s--maxmem=%dM --indexmem=%dM \"%s\" \"%s\" \"%s\"",
+                      (deltaspeed < 0) ? "" : deltaspeed_args[deltaspeed],
+                      cacheargs, maxxdeltamem, maxxdeltamem,
+                      fname1, fname2, patchtmpfile)) ||
+         (!get_file_size(patchtmpfile, &ops.patch.deltasize)) )
+    {
+        /* !!! FIXME: Not necessarily true. */
+        _fatal("there was a problem running xdelta.");
+        return(stats_op_end(PATCHERROR));
+    } /* else if */
+
+    ops.operation = OPERATION_PATCH;
+    ops.patch.mode = (unsigned int) statbuf.st_mode;
+    make_static_string(ops.patch.fname, fname2);
+    if (!serialize_operation(ar, &ops))
+        return(stats_op_end(PATCHERROR));
+
+    deltaio = fopen(patchtmpfile, "rb");
+    if (deltaio == NULL)
+    {
+        _fatal("couldn't read %s: %s.", patchtmpfile, strerror(errno));
+        return(stats_op_end(PATCHERROR));
+    } /* if */
+
+    retval = write_between_files(deltaio, ar->io,
+                                 ops.patch.deltasize,
+                                 ZLIB_NONE);
+
+    assert(fgetc(deltaio) == EOF);
+    fclose(deltaio);
+    unlink(patchtmpfile);
+    return(stats_op_end(retval));
+} /* put_patch */
+
+
+/* copy (size) bytes of delta out of the patchfile, into patchtmpfile2. */
+static int extract_delta(SerialArchive *ar, unsigned long long size)
+{
+    FILE *deltaio;
+    int rc;
+
+    unlink(patchtmpfile2); /* just in case... */
+
+    deltaio = open_file_for_writing(patchtmpfile2);
+    if (deltaio == NULL)
+    {
+        _fatal("Failed to open [%s]: %s.", patchtmpfile2, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    rc = write_between_files(ar->io, deltaio, size, ZLIB_NONE);
+    if ((fclose(deltaio) == EOF) && (rc != PATCHERROR))
+    {
+        _fatal("Error: Couldn't flush output: %s.", strerror(errno));
+        rc = PATCHERROR;
+    } /* if */
+
+    if (rc == PATCHERROR)
+        unlink(patchtmpfile2);
+
+    return(rc);
+} /* extract_delta */
+
+
+/* build patchtmpfile from a windowed delta, one window at a time. */
+static int apply_windowed_delta(SerialArchive *ar, const PatchOperation *patch)
+{
+    const unsigned long long windows = patch_window_count(patch);
+    unsigned long long remaining = patch->deltasize;
+    unsigned long long k;
+    FILE *io;
+
+    /* every window appends, so start with an empty (but reserved) file. */
+    io = open_file_for_writing_sized(patchtmpfile, patch->fsize);
+    if ((io == NULL) || (fclose(io) == EOF))
+    {
+        _fatal("Failed to open [%s]: %s.", patchtmpfile, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    for (k = 0; k < windows; k++)
+    {
+        unsigned long long size;
+        PatchWindow win;
+
+        if ( (remaining < sizeof (size)) || (!serialize_uint64(ar, &size)) ||
+             (size > remaining - sizeof (size)) )
+        {
+            _fatal("Bogus windowed delta in patchfile.");
+            return(PATCHERROR);
+        } /* if */
+
+        remaining -= sizeof (size) + size;
+        progress_add(sizeof (size));
+
+        if (extract_delta(ar, size) == PATCHERROR)
+            return(PATCHERROR);
+
+        patch_window(patch, k, &win);
+        if (!_do_xdelta("patch --maxmem=%dM --append --fromrange=%llu:%llu "
+                        "\"%s\" \"%s\" \"%s\"", maxxdeltamem,
+                        win.oldoff, win.oldlen, patchtmpfile2,
+                        patch->fname, patchtmpfile))
+        {
+            _fatal("xdelta failed.");
+            return(PATCHERROR);
+        } /* if */
+        progress_add(win.newlen);
+    } /* for */
+
+    unlink(patchtmpfile2);  /* ditch temp delta file... */
+
+    if (remaining != 0)
+    {
+        _fatal("Bogus windowed delta in patchfile.");
+        return(PATCHERROR);
+    } /* if */
+
+    return(PATCHSUCCESS);
+} /* apply_windowed_delta */
+
+
+/* get a PATCH operation from the mojopatch file... */
+static int handle_patch_op(SerialArchive *ar, OperationType op, void *d)
+{
+    PatchOperation *patch = (PatchOperation *) d;
+	md5_byte_t md5result[16];
+    int rc;
+
+    assert(op == OPERATION_PATCH);
+
+    _log("PATCH %s", patch->fname);
+
+    if (!patch_window_valid(patch))
+    {
+        _fatal("Bogus window size in patchfile.");
+        return(PATCHERROR);
+    } /* if */
+
+    if ( (info_only()) || (!confirm()) || (in_ignore_list(patch->fname)) )
+    {
+        if (fseeko(ar->io, (off_t) patch->deltasize, SEEK_CUR) < 0)
+        {
+            _fatal("Seek error: %s.", strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+        return(PATCHSUCCESS);
+    } /* if */
+
+    _current_operation("VERIFY %s", final_path_element(patch->fname));
+    memset(md5result, '\0', sizeof (md5result));
+    rc = verify_md5sum(patch->md5_1, md5result, patch->fname, 0);
+    if (rc == PATCHERROR)
+    {
+        if (memcmp(patch->md5_2, md5result, sizeof (patch->md5_2)) == 0)
+        {
+            _log("Okay; file matches patched md5sum. It's already patched.");
+            if (fseeko(ar->io, (off_t) patch->deltasize, SEEK_CUR) < 0)
+            {
+                _fatal("Seek error: %s.", strerror(errno));
+                return(PATCHERROR);
+            } /* if */
+            return(PATCHSUCCESS);
+        } /* if */
+        return(PATCHERROR);
+    } /* if */
+
+    _current_operation("PATCH %s", final_path_element(patch->fname));
+    if (patch->window != 0)
+    {
+        if (apply_windowed_delta(ar, patch) == PATCHERROR)
+            return(PATCHERROR);
+    } /* if */
+
+    else
+    {
+        if (extract_delta(ar, patch->deltasize) == PATCHERROR)
+            return(PATCHERROR);
+
+        if (!_do_xdelta("patch --maxmem=%dM \"%s\" \"%s\" \"%s\"", maxxdeltamem, patchtmpfile2, patch->fname, patchtmpfile))
+        {
+            _fatal("xdelta failed.");
+            return(PATCHERROR);
+        } /* if */
+        progress_add(patch->fsize);  /* xdelta wrote the whole new file. */
+
+        unlink(patchtmpfile2);  /* ditch temp delta file... */
+    } /* else */
+
+    _current_operation("VERIFY %s", final_path_element(patch->fname));
+    rc = verify_md5sum(patch->md5_2, NULL, patchtmpfile, 1);
+    if (rc == PATCHERROR)
+        return(PATCHERROR);
+
+    if (install_file(patchtmpfile, patch->fname, patch->mode) == PATCHERROR)
+        return(PATCHERROR);
+
+    _log("done PATCH.");
+    return(PATCHSUCCESS);
+} /* handle_patch_op */
+
+/* get a MULTIPATCH operation from the mojopatch file... */
+static int handle_multipatch_op(SerialArchive *ar, OperationType op, void *d)
+{
+    MultiPatchOperation *mp = (MultiPatchOperation *) d;
+    unsigned long long skipped = 0;  /* payload before our pick. */
+    unsigned long long total = mp->fallbacksize;
+    md5_byte_t md5result[16];
+    unsigned int pick;
+    unsigned int i;
+    FILE *io = NULL;
+    int rc;
+
+    assert(op == OPERATION_MULTIPATCH);
+
+    _log("PATCH %s (from %u versions)", mp->fname, mp->basecount);
+
+    for (i = 0; i < mp->basecount; i++)
+        total += mp->bases[i].deltasize;
+
+    if ( (info_only()) || (!confirm()) || (in_ignore_list(mp->fname)) )
+    {
+        if (fseeko(ar->io, (off_t) total, SEEK_CUR) < 0)
+        {
+            _fatal("Seek error: %s.", strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+        return(PATCHSUCCESS);
+    } /* if */
+
+    /* one md5sum of what's installed decides which delta we want. */
+    pick = mp->basecount;
+    if ((file_exists(mp->fname)) && (!file_is_directory(mp->fname)))
+    {
+        _current_operation("VERIFY %s", final_path_element(mp->fname));
+        memset(md5result, '\0', sizeof (md5result));
+        if (verify_md5sum(mp->md5, md5result, mp->fname, 0) == PATCHSUCCESS)
+        {
+            _log("Okay; file matches patched md5sum. It's already patched.");
+            if (fseeko(ar->io, (off_t) total, SEEK_CUR) < 0)
+            {
+                _fatal("Seek error: %s.", strerror(errno));
+                return(PATCHERROR);
+            } /* if */
+            return(PATCHSUCCESS);
+        } /* if */
+
+        for (pick = 0; pick < mp->basecount; pick++)
+        {
+            if (memcmp(mp->bases[pick].md5, md5result, 16) == 0)
+                break;
+            skipped += mp->bases[pick].deltasize;
+        } /* for */
+    } /* if */
+
+    if ((pick == mp->basecount) && (!mp->hasfallback))
+    {
+        _fatal("[%s] isn't any version this patch knows about!", mp->fname);
+        return(PATCHERROR);
+    } /* if */
+
+    if (fseeko(ar->io, (off_t) skipped, SEEK_CUR) < 0)
+    {
+        _fatal("Seek error: %s.", strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    _current_operation("PATCH %s", final_path_element(mp->fname));
+    if (pick < mp->basecount)
+    {
+        if (extract_delta(ar, mp->bases[pick].deltasize) == PATCHERROR)
+            return(PATCHERROR);
+
+        skipped += mp->bases[pick].deltasize;
+        if (!_do_xdelta("patch --maxmem=%dM \"%s\" \"%s\" \"%s\"", maxxdeltamem, patchtmpfile2, mp->fname, patchtmpfile))
+        {
+            _fatal("xdelta failed.");
+            return(PATCHERROR);
+        } /* if */
+        progress_add(mp->fsize);  /* xdelta wrote the whole new file. */
+
+        unlink(patchtmpfile2);  /* ditch temp delta file... */
+    } /* if */
+
+    else
+    {
+        _log("No delta for this version of [%s]; using the whole file.", mp->fname);
+        skipped = total - mp->fallbacksize;
+
+        io = open_file_for_writing_sized(patchtmpfile, mp->fsize);
+        if (io == NULL)
+        {
+            _fatal("Failed to open [%s]: %s.", patchtmpfile, strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+
+        rc = write_between_files(ar->io, io, mp->fsize, ZLIB_UNCOMPRESS);
+        if ((fclose(io) == EOF) && (rc != PATCHERROR))
+        {
+            _fatal("Error: Couldn't flush output: %s.", strerror(errno));
+            rc = PATCHERROR;
+        } /* if */
+
+        if (rc == PATCHERROR)
+            return(PATCHERROR);
+
+        skipped += mp->fallbacksize;
+    } /* else */
+
+    /* whatever we didn't use. */
+    if (fseeko(ar->io, (off_t) (total - skipped), SEEK_CUR) < 0)
+    {
+        _fatal("Seek error: %s.", strerror(errno));
+        return(PATCHERROR);
+    } /* if */
+
+    _current_operation("VERIFY %s", final_path_element(mp->fname));
+    rc = verify_md5sum(mp->md5, NULL, patchtmpfile, 1);
+    if (rc == PATCHERROR)
+        return(PATCHERROR);
+
+    if (install_file(patchtmpfile, mp->fname, mp->mode) == PATCHERROR)
+        return(PATCHERROR);
+
+    _log("done PATCH.");
+    return(PATCHSUCCESS);
+} /* handle_multipatch_op */
+
+
+/* get a DONE operation from the mojopatch file... */
+static int handle_done_op(SerialArchive *ar, OperationType op, void *d)
+{
+    /*DoneOperation *done = (DoneOperation *) d;*/
+    assert(op == OPERATION_DONE);
+    _log("DONE");
+    /* This might set some global state at some point... */
+    return(PATCHSUCCESS);
+} /* handle_done_op */
+
+
+static int compare_directories(SerialArchive *ar,
+                               const char *base1,
+                               const char *base2)
+{
+    int retval = PATCHERROR;
+    char filebuf1[MAX_PATH];
+    char filebuf2[MAX_PATH]; /* can you feel the stack screaming? */
+    const char *base2checked = *base2 ? base2 : ".";
+    file_list *files1 = old_list_directory(base1);
+    file_list *files2 = NULL;
+    file_list *i;
+
+    /* may be recursive compare on deleted dir. */
+    if (file_exists(base2checked))
+        files2 = new_list_directory(base2checked);
+
+    assert(*base1);
+
+    _current_operation("Examining %s", final_path_element(base2checked));
+    _dlog("Examining %s and %s", base1, base2checked);
+
+    _dlog("(looking for files that need deletion...)");
+
+    /* check for files removed in newer version... */
+    for (i = files1; i != NULL; i = i->next)
+    {
+        _dlog("([%s]...)", i->fname);
+
+        snprintf(filebuf2, sizeof (filebuf2), "%s%s%s", base2,
+                    *base2 ? PATH_SEP : "", i->fname);
+
+        if (!file_exists(filebuf2))
+        {
+            int rc = 0;
+
+            if (in_ignore_list(filebuf2))  /* don't recurse into it, either. */
+                continue;
+
+            snprintf(filebuf1, sizeof (filebuf1), "%s%s%s", base1, PATH_SEP, i->fname);
+            if (!old_file_is_directory(filebuf1))
+                rc = put_delete(ar, filebuf2);
+            else
+            {
+                rc = compare_directories(ar, filebuf1, filebuf2);
+                if (rc != PATCHERROR)
+                    rc = put_delete_dir(ar, filebuf2);
+            } /* else */
+
+            if (rc == PATCHERROR)
+                goto dircompare_done;
+        } /* if */
+    } /* for */
+
+    _dlog("(looking for files that need addition...)");
+
+	/* check for files added in newer version... */
+    for (i = files2; i != NULL; i = i->next)
+    {
+        #if PLATFORM_MACOSX
+        /* !!! FIXME: Make this an option. */
+        if (strcmp(i->fname, ".DS_Store") == 0)
+        {
+            _dlog("...skipped .DS_Store file...");
+            continue;
+        } /* if */
+        #endif
+
+        _dlog("([%s]...)", i->fname);
+
+        snprintf(filebuf1, sizeof (filebuf1), "%s%s%s", base1, PATH_SEP, i->fname);
+        snprintf(filebuf2, sizeof (filebuf2), "%s%s%s", base2,
+                    *base2 ? PATH_SEP : "", i->fname);
+
+        if (in_ignore_list(filebuf2))  /* don't recurse into it, either. */
+            continue;
+
+        if (old_file_exists(filebuf1))  /* exists in both dirs; do compare. */
+        {
+            if (file_is_directory(filebuf2))
+            {
+                    /* probably a bad sign ... */
+                if (!old_file_is_directory(filebuf1))
+                {
+                    _log("%s is a directory, but %s is not!", filebuf2, filebuf1);
+                    if (put_delete(ar, filebuf2) == PATCHERROR)
+                        goto dircompare_done;
+
+                    if (put_add_dir(ar, filebuf2) == PATCHERROR)
+                        goto dircompare_done;
+                } /* if */
+
+                if (compare_directories(ar, filebuf1, filebuf2) == PATCHERROR)
+                    goto dircompare_done;
+            } /* if */
+
+            else  /* new item is not a directory. */
+            {
+                    /* probably a bad sign ... */
+                if (old_file_is_directory(filebuf1))
+                {
+                    _log("Warning: %s is a directory, but %s is not!", filebuf1, filebuf2);
+                    if (put_delete_dir(ar, filebuf2) == PATCHERROR)
+                        goto dircompare_done;
+
+                    if (put_add(ar, filebuf2) == PATCHERROR)
+                        goto dircompare_done;
+                } /* if */
+
+                else
+                {
+                    /* may not put anything if files match... */
+                    if (put_patch(ar, filebuf1, filebuf2) == PATCHERROR)
+                        goto dircompare_done;
+                } /* else */
+            } /* else */
+        } /* if */
+
+        else  /* doesn't exist in second dir; do add. */
+        {
+            if (file_is_directory(filebuf2))
+            {
+                if (put_add_dir(ar, filebuf2) == PATCHERROR)
+                    goto dircompare_done;
+            } /* if */
+
+            else
+            {
+                if (put_add(ar, filebuf2) == PATCHERROR)
+                    goto dircompare_done;
+            } /* else */
+        } /* else */
+    } /* for */
+
+    retval = PATCHSUCCESS;
+
+dircompare_done:
+    free_filelist(files1);
+    free_filelist(files2);
+    return(retval);
+} /* compare_directories */
+
+
+static char *read_whole_file(const char *fname)
+{
+    int i;
+    int rc;
+    FILE *io = NULL;
+    unsigned long long fsize = 0;
+    char *retval = NULL;
+
+    if (!get_file_size(fname, &fsize))
+    {
+        _fatal("Can't get filesize for [%s]...file missing?", fname);
+        return(NULL);
+    } /* if */
+
+    if ( (retval = (char *) malloc((size_t) fsize + 1)) == NULL )
+    {
+        _fatal("Out of memory.");
+        return(NULL);
+    } /* if */
+
+    if ( (io = fopen(fname, "r")) == NULL )
+    {
+        _fatal("Can't open [%s].", fname);
+        free(retval);
+        return(NULL);
+    } /* if */
+
+    rc = fread(retval, fsize, 1, io);
+    fclose(io);
+
+    if (rc != 1)
+    {
+        _fatal("Read on [%s] failed: %s", fname, strerror(errno));
+        free(retval);
+        return(NULL);
+    } /* if */
+
+    /* This considers it an error condition to have a null char in the file. */
+    for (i = 0; i < fsize; i++)
+    {
+        if (retval[i] == '\0')
+        {
+            _fatal("null char in read_whole_file.");
+            free(retval);
+            return(NULL);
+        } /* if */
+    } /* for */
+    retval[fsize] = '\0';
+
+    return(retval);
+} /* read_whole_file */
+
+
+/*
+ * We don't know how much work the patch is until we've written all the ops,
+ *  so the header goes out with (workbytes) at zero and we fill it in here.
+ *  It's the last thing in the header, so it ends at (headerend).
+ */
+static int finish_header(SerialArchive *ar, off_t headerend)
+{
+    off_t workbytespos = headerend - (off_t) (sizeof (unsigned int) * 2);
+
+    _dlog("(%llu bytes of work to apply this patch.)", header.workbytes);
+
+    if ( (headerend < 0) || (fseeko(ar->io, workbytespos, SEEK_SET) < 0) ||
+         (!serialize_uint64(ar, &header.workbytes)) ||
+         (fseek(ar->io, 0, SEEK_END) < 0) )
     {
-        _fatal("failed to open [%s]: %s.", fname, strerror(errno));
+        _fatal("Couldn't update patch header: %s.", strerror(errno));
         return(PATCHERROR);
     } /* if */
 
-    if (md5sum(in, ops.add.md5, debug) == PATCHERROR)
-        goto put_add_done;
+    return(flush_archive(ar));
+} /* finish_header */
 
-    ops.operation = (replace) ? OPERATION_REPLACE : OPERATION_ADD;
-    ops.add.fsize = statbuf.st_size;
-    ops.add.mode = (unsigned int) statbuf.st_mode;
-    make_static_string(ops.add.fname, fname);
 
-    if (!serialize_operation(ar, &ops))
-        goto put_add_done;
+/*
+ * --multibase only walks the first old tree with compare_directories(), so
+ *  this deletes whatever old tree (k) has that neither the new tree nor the
+ *  first old tree do. Deleting what's already gone is harmless.
+ */
+static int put_multibase_deletes(SerialArchive *ar, int k, const char *base)
+{
+    char oldbuf[MAX_PATH];
+    char newbuf[MAX_PATH];
+    file_list *files;
+    file_list *i;
+    int retval = PATCHSUCCESS;
 
-    if (!write_between_files(in, ar->io, ops.add.fsize, ZLIB_COMPRESS))
-        goto put_add_done;
+    snprintf(oldbuf, sizeof (oldbuf), "%s%s%s", multireal1[k],
+             *base ? PATH_SEP : "", base);
+    files = list_directory(oldbuf);
 
-    assert(fgetc(in) == EOF);
-    retval = PATCHSUCCESS;
+    for (i = files; (i != NULL) && (retval != PATCHERROR); i = i->next)
+    {
+        int isdir;
 
-put_add_done:
-    if (in != NULL)
-        fclose(in);
+        snprintf(newbuf, sizeof (newbuf), "%s%s%s", base,
+                 *base ? PATH_SEP : "", i->fname);
+        if (in_ignore_list(newbuf))
+            continue;
+
+        snprintf(oldbuf, sizeof (oldbuf), "%s%s%s%s%s", multireal1[k], PATH_SEP,
+                 base, *base ? PATH_SEP : "", i->fname);
+        isdir = file_is_directory(oldbuf);
+
+        if (file_exists(newbuf))  /* we chdir'd to the new tree. */
+        {
+            if ((isdir) && (file_is_directory(newbuf)))
+                retval = put_multibase_deletes(ar, k, newbuf);
+            continue;
+        } /* if */
+
+        snprintf(oldbuf, sizeof (oldbuf), "%s%s%s%s%s", multireal1[0], PATH_SEP,
+                 base, *base ? PATH_SEP : "", i->fname);
+        if (file_exists(oldbuf))
+            continue;  /* compare_directories() already got it. */
+
+        retval = (isdir) ? put_delete_dir(ar, newbuf) : put_delete(ar, newbuf);
+    } /* for */
+
+    free_filelist(files);
     return(retval);
-} /* put_add */
+} /* put_multibase_deletes */
 
 
-/* get an ADD or REPLACE operation from the mojopatch file... */
-static int handle_add_op(SerialArchive *ar, OperationType op, void *d)
+/* one header and its operations: everything that turns (real1) into dir2. */
+static int put_patch_segment(SerialArchive *ar, const char *real1,
+                             const char *version)
 {
-    AddOperation *add = (AddOperation *) d;
-    assert((op == OPERATION_ADD) || (op == OPERATION_REPLACE));
-    int replace_ok = (op == OPERATION_REPLACE);
-    int retval = PATCHERROR;
-    FILE *io = NULL;
-    int rc;
+    off_t headerend;
+    int retval;
+    int k;
 
-    _current_operation("%s %s", (replace_ok) ? "ADDORREPLACE" : "ADD",
-                          final_path_element(add->fname));
-    _log("%s %s", (replace_ok) ? "ADDORREPLACE" : "ADD", add->fname);
+    make_static_string(header.version, version);
+    header.workbytes = 0;  /* serialize_operation() adds to this. */
+    if (!serialize_header(ar, &header, NULL))
+        return(PATCHERROR);
 
-    if ( (info_only()) || (!confirm()) || (in_ignore_list(add->fname)) )
+    headerend = ftello(ar->io);
+
+    if (!fromsignature)
     {
-        #if USE_ZLIB  /* skip through compressed file... */
-            return(write_between_files_uncompress(ar->io, NULL, add->fsize, 1));
-        #else
-        if (fseek(ar->io, add->fsize, SEEK_CUR) < 0)
-        {
-            _fatal("Seek error: %s.", strerror(errno));
-            return(PATCHERROR);
-        } /* if */
-        #endif
-        return(PATCHSUCCESS);
+        retval = compare_directories(ar, real1, "");
+        for (k = 1; (multibase) && (k < multicount) && (retval != PATCHERROR); k++)
+            retval = put_multibase_deletes(ar, k, "");
     } /* if */
 
-    if (file_exists(add->fname))
+    else
     {
-        if (replace_ok)
-            unlink(add->fname);
-        else
-        {
-            if (file_is_directory(add->fname))
-            {
-                _fatal("Error: [%s] already exists, but it's a directory!", add->fname);
-                return(PATCHERROR);
-            } /* if */
+        /* paths in the signature are relative to the old tree, like this. */
+        retval = load_signature(real1);
+        if (retval != PATCHERROR)
+            retval = compare_directories(ar, ".", "");
+        free_signature();
+    } /* else */
 
-            _log("[%s] already exists...looking at md5sum...", add->fname);
-            _current_operation("VERIFY %s", final_path_element(add->fname));
-            io = fopen(add->fname, "rb");
-            if (io == NULL)
-            {
-                _fatal("Failed to open added file for read: %s.", strerror(errno));
-                goto handle_add_done;
-            } /* if */
-        
-            if (verify_md5sum(add->md5, NULL, io, 1) == PATCHERROR)
-                goto handle_add_done;
+    if (retval != PATCHERROR)
+        retval = put_done(ar);
 
-            _log("Okay; file matches what we expected.");
-            fclose(io);
+    if (retval != PATCHERROR)
+        retval = finish_header(ar, headerend);
 
-            if (fseek(ar->io, add->fsize, SEEK_CUR) < 0)
-            {
-                _fatal("Seek error: %s.", strerror(errno));
-                return(PATCHERROR);
-            } /* if */
+    return(retval);
+} /* put_patch_segment */
 
-            return(PATCHSUCCESS);
-        } /* else */
-    } /* if */
 
-    io = fopen(add->fname, "wb");
-    if (io == NULL)
+static int create_patchfile(void)
+{
+    SerialArchive ar;
+    int retval = PATCHSUCCESS;
+    unsigned long long fsize;
+    const char *singledir[1] = { dir1 };
+    const char *singleversion[1];
+    const char **olddirs = singledir;
+    const char **versions = singleversion;
+    int oldcount = 1;
+    int segments = 1;
+    char **real1 = NULL;
+    char *real2 = NULL;
+    char *real3 = NULL;
+    char *readmefull = NULL;
+    char version[sizeof (header.version)];
+    int i;
+
+    if (header.readmefname[0])  /* user specified a README? */
     {
-        _fatal("Error creating [%s]: %s.", add->fname, strerror(errno));
-        goto handle_add_done;
-    } /* if */
+        const char *ptr = NULL;
+        readmefull = alloca(strlen(header.readmefname) + 1);
 
-    rc = write_between_files(ar->io, io, add->fsize, ZLIB_UNCOMPRESS);
-    if (rc == PATCHERROR)
-        goto handle_add_done;
+        /* header stores filename, not path. Chop it out, but retain orig. */
+        strcpy(readmefull, header.readmefname);
+        ptr = final_path_element(readmefull);
+        if (ptr != readmefull)
+            make_static_string(header.readmefname, ptr);
+    } /* if */
 
-    if (fclose(io) == EOF)
+    if (*header.product == '\0')  /* specified on the commandline. */
     {
-        _fatal("Error: Couldn't flush output: %s.", strerror(errno));
-        goto handle_add_done;
+        _fatal("No product name specified, but it's required!");
+        return(PATCHERROR);
     } /* if */
 
-    chmod(add->fname, (mode_t) add->mode);  /* !!! FIXME: Should this be an error condition? */
-
-    _current_operation("VERIFY %s", final_path_element(add->fname));
-    io = fopen(add->fname, "rb");
-    if (io == NULL)
+    if (*header.identifier == '\0')  /* specified on the commandline. */
     {
-        _fatal("Failed to open added file for read: %s.", strerror(errno));
-        goto handle_add_done;
+        if (!ui_prompt_ny("No identifier specified. Is this intentional?"))
+            return(PATCHERROR);
     } /* if */
-        
-    if (verify_md5sum(add->md5, NULL, io, 1) == PATCHERROR)
-        goto handle_add_done;
 
-    retval = PATCHSUCCESS;
-    _log("done %s.", (replace_ok) ? "ADDORREPLACE" : "ADD");
+    if (multicount > 0)  /* --createmulti gave us a version per old tree. */
+    {
+        olddirs = multidirs;
+        versions = multiversions;
+        oldcount = segments = multicount;
+    } /* if */
 
-handle_add_done:
-    if (io != NULL)
-        fclose(io);
+    else if (*header.version == '\0')  /* specified on the commandline. */
+    {
+        if (!ui_prompt_ny("No version specified. Is this intentional?"))
+            return(PATCHERROR);
+    } /* else if */
 
-    return(retval);
-} /* handle_add_op */
+    if (*header.newversion == '\0')  /* specified on the commandline. */
+    {
+        if (!ui_prompt_ny("No newversion specified. Is this intentional?"))
+            return(PATCHERROR);
+    } /* if */
 
+    strcpy(version, header.version);
+    singleversion[0] = version;
 
-static int handle_replace_op(SerialArchive *ar, OperationType op, void *d)
-{
-    assert(op == OPERATION_REPLACE);
-    return(handle_add_op(ar, op, d));
-} /* handle_replace_op */
+    /* one segment for all of them; it patches from "1.0 or 1.1 or ..." */
+    if (multibase)
+    {
+        *version = '\0';
+        for (i = 0; i < oldcount; i++)
+        {
+            if (*versions[i] == '\0')  /* any version is okay for this one. */
+            {
+                *version = '\0';
+                break;
+            } /* if */
 
+            if ((strlen(version) + strlen(versions[i]) + 5) > sizeof (version))
+            {
+                _fatal("Too many versions to fit in one patch.");
+                return(PATCHERROR);
+            } /* if */
 
-static int put_add_for_wholedir(SerialArchive *ar, const char *base);
+            if (i > 0)
+                strcat(version, " or ");
+            strcat(version, versions[i]);
+        } /* for */
 
+        versions = singleversion;
+        segments = 1;
+    } /* if */
 
-/* put an ADDDIRECTORY operation in the mojopatch file... */
-static int put_add_dir(SerialArchive *ar, const char *fname)
-{
-    Operations ops;
-    struct stat statbuf;
+    /* all of these before we chdir() into the new tree. */
+    real1 = (char **) alloca(sizeof (char *) * oldcount);
+    memset(real1, '\0', sizeof (char *) * oldcount);
+    for (i = 0; i < oldcount; i++)
+    {
+        real1[i] = get_realpath(olddirs[i]);
+        if (real1[i] == NULL)
+        {
+            _fatal("Couldn't get realpath of [%s].", olddirs[i]);
+            retval = PATCHERROR;
+            goto create_patchfile_done;
+        } /* if */
+    } /* for */
 
-    _current_operation("ADDDIRECTORY %s", final_path_element(fname));
-    _log("ADDDIRECTORY %s", fname);
+    real2 = get_realpath(dir2);
+    if (real2 == NULL)
+    {
+        _fatal("Couldn't get realpath of [%s].", dir2);
+        retval = PATCHERROR;
+        goto create_patchfile_done;
+    } /* if */
 
-    if (!confirm())
-        return(PATCHSUCCESS);
+    real3 = get_realpath(patchfile);
+    if (real3 == NULL)
+    {
+        _fatal("Couldn't get realpath of [%s].", patchfile);
+        retval = PATCHERROR;
+        goto create_patchfile_done;
+    } /* if */
 
-    if (in_ignore_list(fname))
-        return(PATCHSUCCESS);
+    if (!appending)
+        unlink(patchfile);  /* just in case. */
 
-    if (stat(fname, &statbuf) == -1)
+    if (!open_serialized_archive(&ar, patchfile, 0, NULL, NULL))
     {
-        _fatal("Couldn't stat %s: %s.", fname, strerror(errno));
-        return(PATCHERROR);
+        _fatal("Couldn't open [%s]: %s.", patchfile, strerror(errno));
+        retval = PATCHERROR;
+        goto create_patchfile_done;
     } /* if */
 
-    ops.operation = OPERATION_ADDDIRECTORY;
-    ops.adddir.mode = (unsigned int) statbuf.st_mode;
-    make_static_string(ops.adddir.fname, fname);
-
-    if (!serialize_operation(ar, &ops))
-        return(PATCHERROR);
+    /*
+     * Later segments copy ADD data out of earlier ones, so we need to read
+     *  back what we wrote. Can't do that with stdout; just compress again.
+     */
+    if ((segments > 1) && (strcmp(patchfile, "-") != 0))
+        newtreereader = fopen(real3, "rb");
 
-    /* must add contents of dir after dir itself... */
-    if (put_add_for_wholedir(ar, fname) == PATCHERROR)
-        return(PATCHERROR);
+    if (multibase)
+    {
+        multireal1 = real1;
+        replace = 1;  /* other versions might have what we ADD already. */
+    } /* if */
 
-    return(PATCHSUCCESS);
-} /* put_add_dir */
+    if (chdir(real2) != 0)
+    {
+        close_serialized_archive(&ar);
+        _fatal("Couldn't chdir to [%s]: %s.", real2, strerror(errno));
+        retval = PATCHERROR;
+        goto create_patchfile_done;
+    } /* if */
 
+    if (readmefull != NULL)
+    {
+        header.readmedata = read_whole_file(readmefull);
+        if (!header.readmedata)
+        {
+            close_serialized_archive(&ar);
+            retval = PATCHERROR;
+            goto create_patchfile_done;
+        } /* if */
+    } /* if */
+    else
+    {
+        header.readmedata = malloc(1);  /* bleh. */
+        header.readmedata[0] = '\0';
+    } /* else */
 
-/* get an ADDDIRECTORY operation from the mojopatch file... */
-static int handle_adddir_op(SerialArchive *ar, OperationType op, void *d)
-{
-    AddDirOperation *adddir = (AddDirOperation *) d;
-    assert(op == OPERATION_ADDDIRECTORY);
-    
-    _current_operation("ADDDIRECTORY %s", final_path_element(adddir->fname));
-    _log("ADDDIRECTORY %s", adddir->fname);
+    for (i = 0; (i < segments) && (retval != PATCHERROR); i++)
+    {
+        if (segments > 1)
+            _log("Patching from version [%s] in [%s]...", versions[i], olddirs[i]);
+        retval = put_patch_segment(&ar, real1[i], versions[i]);
+    } /* for */
 
-    if ( (info_only()) || (!confirm()) || (in_ignore_list(adddir->fname)) )
-        return(PATCHSUCCESS);
+    free(header.readmedata);
+    header.readmedata = NULL;
 
-    if (file_exists(adddir->fname))
+    if (!close_serialized_archive(&ar))
     {
-        if (file_is_directory(adddir->fname))
-        {
-            _log("[%s] already exists.", adddir->fname);
-            return(PATCHSUCCESS);
-        } /* if */
-        else
-        {
-            _fatal("[%s] already exists, but it's a file!", adddir->fname);
-            return(PATCHERROR);
-        } /* else */
+        _fatal("Couldn't close [%s]: %s.", patchfile, strerror(errno));
+        retval = PATCHERROR;
     } /* if */
 
-    if (mkdir(adddir->fname, S_IRWXU) == -1)
+    if (!get_file_size(real3, &fsize))
     {
-        _fatal("Error making directory [%s]: %s.", adddir->fname, strerror(errno));
-        return(PATCHERROR);
+        _fatal("Couldn't get size of [%s]: %s.", patchfile, strerror(errno));
+        retval = PATCHERROR;
     } /* if */
 
-    /* !!! FIXME: Pass this to mkdir? */
-    chmod(adddir->fname, (mode_t) adddir->mode);  /* !!! FIXME: Should this be an error condition? */
+    if (retval == PATCHERROR)
+        _fatal("THE FILE [%s] IS LIKELY INCOMPLETE. DO NOT USE!", patchfile);
+    else
+    {
+        if (!quietonsuccess)
+            ui_success("Patchfile successfully created.");
+        _log("%llu bytes in the file [%s].", fsize, patchfile);
+    } /* else */
 
-    _log("done ADDDIRECTORY.");
-    return(PATCHSUCCESS);
-} /* handle_adddir_op */
+create_patchfile_done:
+    free_newtree();
+    multireal1 = NULL;
+    for (i = 0; i < oldcount; i++)
+        free(real1[i]);
+    free(real2);
+    free(real3);
+    return(retval);
+} /* create_patchfile */
 
 
-/* put add operations for each file in (base). Recurses into subdirs. */
-static int put_add_for_wholedir(SerialArchive *ar, const char *base)
+static int put_signature_dir(SerialArchive *ar, const char *base)
 {
     char filebuf[MAX_PATH];
-    file_list *files = make_filelist(base);
+    file_list *files = list_directory(base);
     file_list *i;
-    int rc = 0;
+    int retval = PATCHSUCCESS;
 
-    for (i = files; i != NULL; i = i->next)
+    for (i = files; (i != NULL) && (retval != PATCHERROR); i = i->next)
     {
+        unsigned int type;
+        unsigned long long siglen = 0;
+        md5_byte_t md5[16];
+        md5_byte_t *digest = md5;
+        const char *fname = filebuf;
+        unsigned long long fsize;
+        FILE *in;
+
         snprintf(filebuf, sizeof (filebuf), "%s%s%s", base, PATH_SEP, i->fname);
+        _dlog("([%s]...)", filebuf);
 
-        /* put_add_dir recurses back into this function. */
         if (file_is_directory(filebuf))
-            rc = put_add_dir(ar, filebuf);
-        else
-            rc = put_add(ar, filebuf);
-
-        if (rc == PATCHERROR)
         {
-            free_filelist(files);
-            return(PATCHERROR);
+            type = SIGENTRY_DIR;
+            if ( (!serialize_uint32(ar, &type)) ||
+                 (!serialize_static_string(ar, filebuf)) )
+                retval = PATCHERROR;
+            else
+                retval = put_signature_dir(ar, filebuf);
+            continue;
         } /* if */
-    } /* for */
-
-    free_filelist(files);
-    return(PATCHSUCCESS);
-} /* put_add_for_wholedir */
-
-/* put a DONE operation in the mojopatch file... */
-static int put_done(SerialArchive *ar)
-{
-    Operations ops;
-
-    _current_operation("DONE");
-    _log("DONE");
-
-    ops.operation = OPERATION_DONE;
-    return(serialize_operation(ar, &ops));
-} /* put_done */
-
 
-static int md5sums_match(const char *fname1, const char *fname2,
-                         md5_byte_t *md5_1, md5_byte_t *md5_2)
-{
-    FILE *in;
+        _current_operation("SIGN %s", final_path_element(filebuf));
+        _log("SIGN %s", filebuf);
+        stats_op_begin("SIGN", filebuf, ar->io);
 
-    in = fopen(fname1, "rb");
-    if (in == NULL)
-        return(0);
+        if ( (!get_file_size(filebuf, &fsize)) ||
+             (md5sum_files(&fname, &digest, 1) == PATCHERROR) )
+        {
+            _fatal("Couldn't read [%s]: %s.", filebuf, strerror(errno));
+            retval = stats_op_end(PATCHERROR);
+            break;
+        } /* if */
 
-    if (md5sum(in, md5_1, 0) == PATCHERROR)
-        return(0);
+        /* xdelta can't sign these in one go; they'll be ADDed instead. */
+        if (fsize <= XDELTA_MAX_FSIZE)
+        {
+            if ( (!_do_xdelta("sign \"%s\" \"%s\"", filebuf, patchtmpfile)) ||
+                 (!get_file_size(patchtmpfile, &siglen)) )
+            {
+                _fatal("there was a problem running xdelta.");
+                retval = stats_op_end(PATCHERROR);
+                break;
+            } /* if */
+        } /* if */
 
-    fclose(in);
+        type = SIGENTRY_FILE;
+        if ( (!serialize_uint32(ar, &type)) ||
+             (!serialize_static_string(ar, filebuf)) ||
+             (!serialize_uint64(ar, &fsize)) ||
+             (!SERIALIZE(ar, md5)) ||
+             (!serialize_uint64(ar, &siglen)) )
+        {
+            retval = stats_op_end(PATCHERROR);
+            break;
+        } /* if */
 
-    in = fopen(fname2, "rb");
-    if (in == NULL)
-        return(0);
+        if (siglen > 0)
+        {
+            in = fopen(patchtmpfile, "rb");
+            if (in == NULL)
+            {
+                _fatal("couldn't read %s: %s.", patchtmpfile, strerror(errno));
+                retval = stats_op_end(PATCHERROR);
+                break;
+            } /* if */
 
-    if (md5sum(in, md5_2, 0) == PATCHERROR)
-        return(0);
+            retval = write_between_files(in, ar->io, siglen, ZLIB_NONE);
+            fclose(in);
+            unlink(patchtmpfile);
+        } /* if */
 
-    fclose(in);
+        stats_op_end(retval);
+    } /* for */
 
-    return(memcmp(md5_1, md5_2, 16) == 0);
-} /* md5sums_match */
+    free_filelist(files);
+    return(retval);
+} /* put_signature_dir */
 
 
-/* put a PATCH operation in the mojopatch file... */
-static int put_patch(SerialArchive *ar, const char *fname1, const char *fname2)
+static int create_signature(void)
 {
-    Operations ops;
-    FILE *deltaio = NULL;
-    int retval = PATCHERROR;
-    struct stat statbuf;
-
-    _current_operation("VERIFY %s", final_path_element(fname2));
-	if (md5sums_match(fname1, fname2, ops.patch.md5_1, ops.patch.md5_2))
-        return(PATCHSUCCESS);
+    SerialArchive ar;
+    int retval = PATCHSUCCESS;
+    unsigned int type = SIGENTRY_END;
+    char sig[sizeof (MOJOSIGNATURESIG)];
+    char *real1 = get_realpath(dir1);
 
-    if (alwaysadd)  /* add it instead of patch it... */
+    if (real1 == NULL)
     {
-        int origreplace = replace;
-        replace = 1;  /* must ADDORREPLACE, as file will definitely exist. */
-        retval = put_add(ar, fname2);
-        replace = origreplace;  /* reset original value. */
-        return(retval);
+        _fatal("Couldn't get realpath of [%s].", dir1);
+        return(PATCHERROR);
     } /* if */
 
-    _current_operation("PATCH %s", final_path_element(fname2));
-    _log("PATCH %s", fname2);
-
-    if (!confirm())
-        return(PATCHSUCCESS);
-
-    if (in_ignore_list(fname2))
-        return(PATCHSUCCESS);
-
-    if (stat(fname2, &statbuf) == -1)
+    ar.reading = 0;
+    ar.io = open_file_for_writing(patchfile);
+    if (ar.io == NULL)
     {
-        _fatal("Couldn't stat %s: %s.", fname2, strerror(errno));
+        free(real1);
+        _fatal("Couldn't open [%s]: %s.", patchfile, strerror(errno));
         return(PATCHERROR);
     } /* if */
 
-    if ( (!_do_xdelta("delta -n --maxmem=%dM \"%s\" \"%s\" \"%s\"", maxxdeltamem, fname1, fname2, patchtmpfile)) ||
-         (!get_file_size(patchtmpfile, &ops.patch.deltasize)) )
+    if (chdir(real1) != 0)
     {
-        /* !!! FIXME: Not necessarily true. */
-        _fatal("there was a problem running xdelta.");
+        fclose(ar.io);
+        _fatal("Couldn't chdir to [%s]: %s.", real1, strerror(errno));
+        free(real1);
         return(PATCHERROR);
     } /* if */
+    free(real1);
 
-    ops.operation = OPERATION_PATCH;
-    ops.patch.mode = (unsigned int) statbuf.st_mode;
-    ops.patch.fsize = statbuf.st_size;
-    make_static_string(ops.patch.fname, fname2);
-    if (!serialize_operation(ar, &ops))
-        return(PATCHERROR);
+    memcpy(sig, MOJOSIGNATURESIG, sizeof (sig));
+    if (!SERIALIZE(&ar, sig))
+        retval = PATCHERROR;
 
-    deltaio = fopen(patchtmpfile, "rb");
-    if (deltaio == NULL)
+    if (retval != PATCHERROR)
+        retval = put_signature_dir(&ar, ".");
+
+    if ((retval != PATCHERROR) && (!serialize_uint32(&ar, &type)))
+        retval = PATCHERROR;
+
+    if ((fclose(ar.io) == EOF) && (retval != PATCHERROR))
     {
-        _fatal("couldn't read %s: %s.", patchtmpfile, strerror(errno));
-        return(PATCHERROR);
+        _fatal("Couldn't close [%s]: %s.", patchfile, strerror(errno));
+        retval = PATCHERROR;
     } /* if */
 
-    retval = write_between_files(deltaio, ar->io,
-                                 ops.patch.deltasize,
-                                 ZLIB_NONE);
+    if (retval == PATCHERROR)
+        _fatal("THE FILE [%s] IS LIKELY INCOMPLETE. DO NOT USE!", patchfile);
+    else if (!quietonsuccess)
+        ui_success("Signature successfully created.");
 
-    assert(fgetc(deltaio) == EOF);
-    fclose(deltaio);
-    unlink(patchtmpfile);
     return(retval);
-} /* put_patch */
+} /* create_signature */
 
 
-/* get a PATCH operation from the mojopatch file... */
-static int handle_patch_op(SerialArchive *ar, OperationType op, void *d)
+/*
+ * The journal lives in the install dir while we apply a patch, and gets a
+ *  line, synced to disk, after every op finishes: the op's index, where the
+ *  next op starts in the patchfile, and the progress so far. If we get
+ *  killed, the next run finds it and picks up after the last op it lists,
+ *  instead of md5summing its way through everything that was already done.
+ *  The first line says which patch it's for, so a stale one is ignored.
+ *  It's deleted when the patch is done.
+ */
+#define JOURNAL_FNAME ".mojopatch.journal"
+#define JOURNAL_SIG "mojopatch journal"
+
+/*
+ * First line of the journal and the staging manifest: which patch segment
+ *  they belong to. Call it at the segment's first op. Fails on a pipe.
+ */
+static int segment_key(SerialArchive *ar, const char *sig,
+                       char *buf, size_t bufsize)
 {
-    PatchOperation *patch = (PatchOperation *) d;
-	md5_byte_t md5result[16];
-    FILE *f = NULL;
-    FILE *deltaio = NULL;
-    int rc;
+    struct stat statbuf;
 
-    assert(op == OPERATION_PATCH);
+    if ((fstat(fileno(ar->io), &statbuf) == -1) || (!S_ISREG(statbuf.st_mode)))
+        return(0);
 
-    _log("PATCH %s", patch->fname);
+    snprintf(buf, bufsize, "%s %llu %lld %lld %llu\n", sig,
+             (unsigned long long) statbuf.st_size, (long long) statbuf.st_mtime,
+             (long long) ftello(ar->io), header.workbytes);
+    return(1);
+} /* segment_key */
 
-    if ( (info_only()) || (!confirm()) || (in_ignore_list(patch->fname)) )
-    {
-        if (fseek(ar->io, patch->deltasize, SEEK_CUR) < 0)
-        {
-            _fatal("Seek error: %s.", strerror(errno));
-            return(PATCHERROR);
-        } /* if */
+
+static int journal_begin(SerialArchive *ar, unsigned int *nextop)
+{
+    char key[256];
+    char buf[256];
+    unsigned int index = 0;
+    long long offset = 0;
+    unsigned long long done = 0;
+    int resume = 0;
+    FILE *io;
+
+    *nextop = 0;
+    if ((nojournal) || (preparing) || (info_only()))
         return(PATCHSUCCESS);
-    } /* if */
 
-    f = fopen(patch->fname, "rb");
-    if (f == NULL)
+    /* can't seek ahead in a pipe, so there's no point. */
+    if (!segment_key(ar, JOURNAL_SIG, key, sizeof (key)))
     {
-        _fatal("Failed to open [%s]: %s.", patch->fname, strerror(errno));
-        return(PATCHERROR);
+        _dlog("Patchfile isn't a regular file; not keeping a journal.");
+        return(PATCHSUCCESS);
     } /* if */
 
-    _current_operation("VERIFY %s", final_path_element(patch->fname));
-    rc = verify_md5sum(patch->md5_1, md5result, f, 0);
-    fclose(f);
-    if (rc == PATCHERROR)
+    io = fopen(JOURNAL_FNAME, "r");
+    if (io != NULL)
     {
-        if (memcmp(patch->md5_2, md5result, sizeof (patch->md5_2)) == 0)
+        if ((fgets(buf, sizeof (buf), io) == NULL) || (strcmp(buf, key) != 0))
+            _log("Ignoring a journal from some other patch.");
+        else
         {
-            _log("Okay; file matches patched md5sum. It's already patched.");
-            if (fseek(ar->io, patch->deltasize, SEEK_CUR) < 0)
+            /* last complete line wins; a torn one means we died writing it. */
+            while (fgets(buf, sizeof (buf), io) != NULL)
             {
-                _fatal("Seek error: %s.", strerror(errno));
-                return(PATCHERROR);
-            } /* if */
-            return(PATCHSUCCESS);
-        } /* if */
-        return(PATCHERROR);
+                if ( (strchr(buf, '\n') != NULL) &&
+                     (sscanf(buf, "%u %lld %llu", &index, &offset, &done) == 3) )
+                    resume = 1;
+            } /* while */
+        } /* else */
+        fclose(io);
     } /* if */
 
-    unlink(patchtmpfile2); /* just in case... */
-
-    _current_operation("PATCH %s", final_path_element(patch->fname));
-    deltaio = fopen(patchtmpfile2, "wb");
-    if (deltaio == NULL)
+    if (resume)
     {
-        _fatal("Failed to open [%s]: %s.", patchtmpfile2, strerror(errno));
-        return(PATCHERROR);
+        if (fseeko(ar->io, (off_t) offset, SEEK_SET) < 0)
+        {
+            _fatal("Seek error: %s.", strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+
+        _log("Resuming after operation %u; the journal says it's done.", index);
+        *nextop = index + 1;
+        progress_done = (done > progress_total) ? progress_total : done;
+        journal = fopen(JOURNAL_FNAME, "a");
     } /* if */
 
-    rc = write_between_files(ar->io, deltaio, patch->deltasize, ZLIB_NONE);
-    fclose(deltaio);
-    if (rc == PATCHERROR)
+    else
     {
-        unlink(patchtmpfile2);
-        return(PATCHERROR);
-    } /* if */
+        journal = fopen(JOURNAL_FNAME, "w");
+        if ((journal != NULL) && (fputs(key, journal) == EOF))
+        {
+            fclose(journal);
+            journal = NULL;
+        } /* if */
+    } /* else */
 
-    if (!_do_xdelta("patch --maxmem=%dM \"%s\" \"%s\" \"%s\"", maxxdeltamem, patchtmpfile2, patch->fname, patchtmpfile))
+    if ((journal == NULL) || (!sync_file(journal)))
     {
-        _fatal("xdelta failed.");
-        return(PATCHERROR);
+        _log("Couldn't write [%s]; can't resume if this gets interrupted.", JOURNAL_FNAME);
+        if (journal != NULL)
+            fclose(journal);
+        journal = NULL;
     } /* if */
 
-    unlink(patchtmpfile2);  /* ditch temp delta file... */
+    return(PATCHSUCCESS);
+} /* journal_begin */
+
+
+/*
+ * (fname) is the op's file. Its data was synced before it went in place,
+ *  but the rename/unlink/mkdir lives in the dir, so sync that before we
+ *  promise a resumed run that it won't have to look at this op again.
+ */
+static int journal_op_done(SerialArchive *ar, unsigned int index,
+                           const char *fname)
+{
+    char dirbuf[STATIC_STRING_SIZE];
+    char *ptr;
+
+    if (journal == NULL)
+        return(PATCHSUCCESS);
 
-    f = fopen(patchtmpfile, "rb");
-    if (f == NULL)
+    /* a DELETE may have found its dir gone already; sync what's left. */
+    make_static_string(dirbuf, fname);
+    do
     {
-        _fatal("Failed to open [%s] for read: %s.", patchtmpfile, strerror(errno));
-        return(PATCHERROR);
-    } /* if */
+        ptr = strrchr(dirbuf, PATH_SEP[0]);
+        if (ptr != NULL)
+            *ptr = '\0';
+        else
+            strcpy(dirbuf, ".");
+    } while ((ptr != NULL) && (!file_exists(dirbuf)));
 
-    _current_operation("VERIFY %s", final_path_element(patch->fname));
-    rc = verify_md5sum(patch->md5_2, NULL, f, 1);
-    fclose(f);
-    if (rc == PATCHERROR)
+    if (!sync_path(dirbuf))
+    {
+        _fatal("Couldn't sync [%s]: %s.", dirbuf, strerror(errno));
         return(PATCHERROR);
+    } /* if */
 
-    if (do_rename(patchtmpfile, patch->fname) == -1)
+    if ( (fprintf(journal, "%u %lld %llu\n", index, (long long) ftello(ar->io),
+                  progress_done) < 0) || (!sync_file(journal)) )
     {
-        _fatal("Error replacing [%s] with tempfile: %s.", patch->fname, strerror(errno));
+        _fatal("Couldn't write [%s]: %s.", JOURNAL_FNAME, strerror(errno));
         return(PATCHERROR);
     } /* if */
 
-    chmod(patch->fname, (mode_t) patch->mode);  /* !!! FIXME: fatal error? */
-
-    _log("done PATCH.");
-    return(PATCHSUCCESS);
-} /* handle_patch_op */
-
-/* get a DONE operation from the mojopatch file... */
-static int handle_done_op(SerialArchive *ar, OperationType op, void *d)
-{
-    /*DoneOperation *done = (DoneOperation *) d;*/
-    assert(op == OPERATION_DONE);
-    _log("DONE");
-    /* This might set some global state at some point... */
     return(PATCHSUCCESS);
-} /* handle_done_op */
+} /* journal_op_done */
 
 
-static int compare_directories(SerialArchive *ar,
-                               const char *base1,
-                               const char *base2)
-{
-    int retval = PATCHERROR;
-    char filebuf1[MAX_PATH];
-    char filebuf2[MAX_PATH]; /* can you feel the stack screaming? */
-    const char *base2checked = *base2 ? base2 : ".";
-    file_list *files1 = make_filelist(base1);
-    file_list *files2 = NULL;
-    file_list *i;
+/* (finished) means the whole patch went in, so we won't need it again. */
+static void journal_end(int finished)
+{
+    if (journal == NULL)
+        return;
 
-    /* may be recursive compare on deleted dir. */
-    if (file_exists(base2checked))
-        files2 = make_filelist(base2checked);
+    fclose(journal);
+    journal = NULL;
+    if (finished)
+        remove(JOURNAL_FNAME);
+} /* journal_end */
 
-    assert(*base1);
 
-    _current_operation("Examining %s", final_path_element(base2checked));
-    _dlog("Examining %s and %s", base1, base2checked);
+/* --prepare: start a fresh staging dir and manifest for this segment. */
+static int stage_begin(SerialArchive *ar)
+{
+    char key[256];
 
-    _dlog("(looking for files that need deletion...)");
+    if (!segment_key(ar, STAGING_SIG, key, sizeof (key)))
+    {
+        _fatal("Can't --prepare from a pipe; --commit has to find the patch again.");
+        return(PATCHERROR);
+    } /* if */
 
-    /* check for files removed in newer version... */
-    for (i = files1; i != NULL; i = i->next)
+    if ((file_exists(STAGING_DIR)) && (!delete_dir_tree(STAGING_DIR)))
+        return(PATCHERROR);
+
+    if (mkdir(STAGING_DIR, S_IRWXU) == -1)
     {
-        _dlog("([%s]...)", i->fname);
+        _fatal("Error making directory [%s]: %s.", STAGING_DIR, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
 
-        snprintf(filebuf2, sizeof (filebuf2), "%s%s%s", base2,
-                    *base2 ? PATH_SEP : "", i->fname);
+    stagemanifest = fopen(STAGING_MANIFEST, "w");
+    if ((stagemanifest == NULL) || (fputs(key, stagemanifest) == EOF))
+    {
+        _fatal("Couldn't write [%s]: %s.", STAGING_MANIFEST, strerror(errno));
+        if (stagemanifest != NULL)
+            fclose(stagemanifest);
+        stagemanifest = NULL;
+        return(PATCHERROR);
+    } /* if */
 
-        if (!file_exists(filebuf2))
-        {
-            int rc = 0;
+    return(PATCHSUCCESS);
+} /* stage_begin */
 
-            snprintf(filebuf1, sizeof (filebuf1), "%s%s%s", base1, PATH_SEP, i->fname);
-            if (!file_is_directory(filebuf1))
-                rc = put_delete(ar, filebuf2);
-            else
-            {
-                rc = compare_directories(ar, filebuf1, filebuf2);
-                if (rc != PATCHERROR)
-                    rc = put_delete_dir(ar, filebuf2);
-            } /* else */
 
-            if (rc == PATCHERROR)
-                goto dircompare_done;
-        } /* if */
-    } /* for */
+/* the "end" line tells --commit that --prepare got all the way through. */
+static int stage_end(int finished)
+{
+    int retval = PATCHSUCCESS;
 
-    _dlog("(looking for files that need addition...)");
+    if (stagemanifest == NULL)
+        return(PATCHSUCCESS);
 
-	/* check for files added in newer version... */
-    for (i = files2; i != NULL; i = i->next)
+    if (finished)
     {
-        #if PLATFORM_MACOSX
-        /* !!! FIXME: Make this an option. */
-        if (strcmp(i->fname, ".DS_Store") == 0)
+        if ((fputs("end\n", stagemanifest) == EOF) || (!sync_file(stagemanifest)))
         {
-            _dlog("...skipped .DS_Store file...");
-            continue;
+            _fatal("Couldn't write [%s]: %s.", STAGING_MANIFEST, strerror(errno));
+            retval = PATCHERROR;
         } /* if */
-        #endif
+    } /* if */
 
-        _dlog("([%s]...)", i->fname);
+    if (fclose(stagemanifest) == EOF)
+        retval = PATCHERROR;
+    stagemanifest = NULL;
+    free_filelist(stagedeletes);
+    stagedeletes = NULL;
+    return(retval);
+} /* stage_end */
 
-        snprintf(filebuf1, sizeof (filebuf1), "%s%s%s", base1, PATH_SEP, i->fname);
-        snprintf(filebuf2, sizeof (filebuf2), "%s%s%s", base2,
-                    *base2 ? PATH_SEP : "", i->fname);
 
-        if (file_exists(filebuf1))  /* exists in both dirs; do compare. */
+/* one line of the manifest. Returns PATCHERROR if it's wrong. */
+static int commit_step(const char *step, unsigned int mode,
+                       unsigned int index, const char *fname)
+{
+    char staged[64];
+
+    _current_operation("%s %s", step, final_path_element(fname));
+    _log("%s %s", step, fname);
+
+    if (strcmp(step, "delete") == 0)
+    {
+        if ((file_exists(fname)) && (remove(fname) == -1))
         {
-            if (file_is_directory(filebuf2))
-            {
-                    /* probably a bad sign ... */
-                if (!file_is_directory(filebuf1))
-                {
-                    _log("%s is a directory, but %s is not!", filebuf2, filebuf1);
-                    if (put_delete(ar, filebuf2) == PATCHERROR)
-                        goto dircompare_done;
+            _fatal("Error removing [%s]: %s.", fname, strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+    } /* if */
 
-                    if (put_add_dir(ar, filebuf2) == PATCHERROR)
-                        goto dircompare_done;
-                } /* if */
+    else if (strcmp(step, "deletedir") == 0)
+    {
+        if ((file_exists(fname)) && (!delete_dir_tree(fname)))
+            return(PATCHERROR);
+    } /* else if */
 
-                if (compare_directories(ar, filebuf1, filebuf2) == PATCHERROR)
-                    goto dircompare_done;
+    else if (strcmp(step, "mkdir") == 0)
+    {
+        if (file_exists(fname))
+        {
+            if (!file_is_directory(fname))
+            {
+                _fatal("[%s] already exists, but it's a file!", fname);
+                return(PATCHERROR);
             } /* if */
+        } /* if */
 
-            else  /* new item is not a directory. */
-            {
-                    /* probably a bad sign ... */
-                if (file_is_directory(filebuf1))
-                {
-                    _log("Warning: %s is a directory, but %s is not!", filebuf1, filebuf2);
-                    if (put_delete_dir(ar, filebuf2) == PATCHERROR)
-                        goto dircompare_done;
+        else if (mkdir(fname, S_IRWXU) == -1)
+        {
+            _fatal("Error making directory [%s]: %s.", fname, strerror(errno));
+            return(PATCHERROR);
+        } /* else if */
 
-                    if (put_add(ar, filebuf2) == PATCHERROR)
-                        goto dircompare_done;
-                } /* if */
+        else
+        {
+            chmod(fname, (mode_t) mode);
+        } /* else */
+    } /* else if */
 
-                else
-                {
-                    /* may not put anything if files match... */
-                    if (put_patch(ar, filebuf1, filebuf2) == PATCHERROR)
-                        goto dircompare_done;
-                } /* else */
-            } /* else */
+    else if (strcmp(step, "install") == 0)
+    {
+        snprintf(staged, sizeof (staged), "%s%s%u", STAGING_DIR, PATH_SEP, index);
+        if (!file_exists(staged))
+        {
+            /* an interrupted --commit already did this one? */
+            if (file_exists(fname))
+                return(PATCHSUCCESS);
+
+            _fatal("[%s] is missing from staging!", staged);
+            return(PATCHERROR);
         } /* if */
 
-        else  /* doesn't exist in second dir; do add. */
+        /* same filesystem, so this is atomic, and it's already chmod'd. */
+        if (rename(staged, fname) == -1)
         {
-            if (file_is_directory(filebuf2))
-            {
-                if (put_add_dir(ar, filebuf2) == PATCHERROR)
-                    goto dircompare_done;
-            } /* if */
-
-            else
-            {
-                if (put_add(ar, filebuf2) == PATCHERROR)
-                    goto dircompare_done;
-            } /* else */
-        } /* else */
-    } /* for */
+            _fatal("Error replacing [%s]: %s.", fname, strerror(errno));
+            return(PATCHERROR);
+        } /* if */
+    } /* else if */
 
-    retval = PATCHSUCCESS;
+    else
+    {
+        _fatal("Bogus line in [%s].", STAGING_MANIFEST);
+        return(PATCHERROR);
+    } /* else */
 
-dircompare_done:
-    free_filelist(files1);
-    free_filelist(files2);
-    return(retval);
-} /* compare_directories */
+    return(PATCHSUCCESS);
+} /* commit_step */
 
 
-static char *read_whole_file(const char *fname)
+/* --commit: do what --prepare staged for this segment, and nothing else. */
+static int commit_staged(SerialArchive *ar)
 {
-    int i;
-    int rc;
-    FILE *io = NULL;
-    unsigned int fsize = 0;
-    char *retval = NULL;
+    char key[256];
+    char buf[MAX_PATH + 64];
+    char step[16];
+    unsigned int mode;
+    unsigned int index;
+    int pos;
+    int finished = 0;
+    int retval = PATCHERROR;
+    FILE *io = fopen(STAGING_MANIFEST, "r");
 
-    if (!get_file_size(fname, &fsize))
+    if ( (io == NULL) || (!segment_key(ar, STAGING_SIG, key, sizeof (key))) ||
+         (fgets(buf, sizeof (buf), io) == NULL) || (strcmp(buf, key) != 0) )
     {
-        _fatal("Can't get filesize for [%s]...file missing?", fname);
-        return(NULL);
+        _fatal("Nothing is staged for this patch. Run it with --prepare first.");
+        goto commit_staged_done;
     } /* if */
 
-    if ( (retval = (char *) malloc(fsize + 1)) == NULL )
-    {
-        _fatal("Out of memory.");
-        return(NULL);
-    } /* if */
+    /* don't start unless --prepare finished, or we'd do half a patch. */
+    while (fgets(buf, sizeof (buf), io) != NULL)
+        finished = (strcmp(buf, "end\n") == 0);
 
-    if ( (io = fopen(fname, "r")) == NULL )
+    if (!finished)
     {
-        _fatal("Can't open [%s].", fname);
-        free(retval);
-        return(NULL);
+        _fatal("Staging is incomplete. Run it with --prepare again.");
+        goto commit_staged_done;
     } /* if */
 
-    rc = fread(retval, fsize, 1, io);
-    fclose(io);
+    rewind(io);
+    if (fgets(buf, sizeof (buf), io) == NULL)  /* skip the key. */
+        goto commit_staged_done;
 
-    if (rc != 1)
+    while (fgets(buf, sizeof (buf), io) != NULL)
     {
-        _fatal("Read on [%s] failed: %s", fname, strerror(errno));
-        free(retval);
-        return(NULL);
-    } /* if */
+        char *ptr = strchr(buf, '\n');
+        if (strcmp(buf, "end\n") == 0)
+            break;
 
-    /* This considers it an error condition to have a null char in the file. */
-    for (i = 0; i < fsize; i++)
-    {
-        if (retval[i] == '\0')
+        if ( (ptr == NULL) ||
+             (sscanf(buf, "%15s %o %u %n", step, &mode, &index, &pos) != 3) )
         {
-            _fatal("null char in read_whole_file.");
-            free(retval);
-            return(NULL);
+            _fatal("Bogus line in [%s].", STAGING_MANIFEST);
+            goto commit_staged_done;
         } /* if */
-    } /* for */
-    retval[fsize] = '\0';
+
+        *ptr = '\0';
+        if (commit_step(step, mode, index, buf + pos) == PATCHERROR)
+            goto commit_staged_done;
+    } /* while */
+
+    retval = PATCHSUCCESS;
+
+commit_staged_done:
+    if (io != NULL)
+        fclose(io);
+
+    if (retval != PATCHERROR)
+    {
+        remove(STAGING_MANIFEST);
+        if (!delete_dir_tree(STAGING_DIR))  /* anything left is junk. */
+            _log("Couldn't clean up [%s].", STAGING_DIR);
+    } /* if */
 
     return(retval);
-} /* read_whole_file */
+} /* commit_staged */
 
 
-static int create_patchfile(void)
+/*
+ * Peek at the op after (ops), and get the old file it'll read coming off
+ *  the disk while we work on this one. We can't see past an ADD, since we
+ *  don't know how long its compressed payload is without inflating it.
+ */
+static int prefetch_next_op(SerialArchive *ar, const Operations *ops)
 {
-    SerialArchive ar;
-    int retval = PATCHSUCCESS;
-    unsigned int fsize;
-    char *real1 = NULL;
-    char *real2 = NULL;
-    char *real3 = NULL;
-    char *readmefull = NULL;
+    const MultiPatchOperation *mp = &ops->multipatch;
+    unsigned long long skip = 0;
+    Operations next;
+    unsigned int i;
+    off_t pos;
 
-    if (header.readmefname[0])  /* user specified a README? */
+    if (info_only())
+        return(PATCHSUCCESS);
+
+    switch (ops->operation)
     {
-        const char *ptr = NULL;
-        readmefull = alloca(strlen(header.readmefname) + 1);
+        case OPERATION_PATCH:
+            skip = ops->patch.deltasize;
+            break;
 
-        /* header stores filename, not path. Chop it out, but retain orig. */
-        strcpy(readmefull, header.readmefname);
-        ptr = final_path_element(readmefull);
-        if (ptr != readmefull)
-            make_static_string(header.readmefname, ptr);
+        case OPERATION_MULTIPATCH:
+            skip = mp->fallbacksize;
+            for (i = 0; i < mp->basecount; i++)
+                skip += mp->bases[i].deltasize;
+            break;
+
+        case OPERATION_DELETE:
+        case OPERATION_DELETEDIRECTORY:
+        case OPERATION_ADDDIRECTORY:
+            break;
+
+        default:  /* ADD, REPLACE, DONE. */
+            return(PATCHSUCCESS);
+    } /* switch */
+
+    pos = ftello(ar->io);
+    if ((pos < 0) || (fseeko(ar->io, pos + (off_t) skip, SEEK_SET) < 0))
+        return(PATCHSUCCESS);  /* reading from a pipe, probably. */
+
+    memset(&next, '\0', sizeof (next));
+    if (serialize_operation(ar, &next))
+    {
+        if (next.operation == OPERATION_PATCH)
+            prefetch_file(next.patch.fname);
+        else if (next.operation == OPERATION_MULTIPATCH)
+            prefetch_file(next.multipatch.fname);
     } /* if */
 
-    if (*header.product == '\0')  /* specified on the commandline. */
+    if (fseeko(ar->io, pos, SEEK_SET) < 0)
     {
-        _fatal("No product name specified, but it's required!");
+        _fatal("Seek error: %s.", strerror(errno));
         return(PATCHERROR);
     } /* if */
 
-    if (*header.identifier == '\0')  /* specified on the commandline. */
+    return(PATCHSUCCESS);
+} /* prefetch_next_op */
+
+
+static int do_patch_operations(SerialArchive *ar)
+{
+    Operations ops;
+    unsigned int index;
+    memset(&ops, '\0', sizeof (ops));
+
+    if (info_only())
+        _log("These are the operations we would perform if patching...");
+
+    progress_begin(header.workbytes);
+
+    if (journal_begin(ar, &index) == PATCHERROR)
+        return(PATCHERROR);
+
+    do
     {
-        if (!ui_prompt_ny("No identifier specified. Is this intentional?"))
+        if (!serialize_operation(ar, &ops))
+        {
+            journal_end(0);
             return(PATCHERROR);
-    } /* if */
+        } /* if */
+
+        assert((ops.operation >= 0) && (ops.operation < OPERATION_TOTAL));
+
+        if (prefetch_next_op(ar, &ops) == PATCHERROR)
+        {
+            journal_end(0);
+            return(PATCHERROR);
+        } /* if */
+
+        /* every op but DONE starts with the same fname field. */
+        if (ops.operation != OPERATION_DONE)
+            stats_op_begin(operation_names[ops.operation], ops.del.fname, ar->io);
+
+        progress_op_begin(&ops);
+        stage_index = index;
+        if (!stats_op_end(operation_handlers[ops.operation](ar, ops.operation, &ops)))
+        {
+            journal_end(0);
+            return(PATCHERROR);
+        } /* if */
+        progress_op_end();
+        drop_stream_cache(ar->io);  /* won't read that part of the patch again. */
+
+        if ( (ops.operation != OPERATION_DONE) &&
+             (journal_op_done(ar, index++, ops.del.fname) == PATCHERROR) )
+        {
+            journal_end(0);
+            return(PATCHERROR);
+        } /* if */
+    } while (ops.operation != OPERATION_DONE);
+
+    journal_end(1);
+    progress_update(1);
+    progress_total = 0;  /* done with this patch; stop driving the UI. */
+    return(PATCHSUCCESS);
+} /* do_patch_operations */
 
-    if (*header.version == '\0')  /* specified on the commandline. */
-    {
-        if (!ui_prompt_ny("No version specified. Is this intentional?"))
-            return(PATCHERROR);
-    } /* if */
 
-    if (*header.newversion == '\0')  /* specified on the commandline. */
-    {
-        if (!ui_prompt_ny("No newversion specified. Is this intentional?"))
-            return(PATCHERROR);
-    } /* if */
+/*
+ * Fill (to) with (from)'s tree, sharing file data instead of copying it
+ *  where the filesystem lets us. The ops only ever replace files (unlink or
+ *  rename), never write into them, so patching the clone leaves (from)
+ *  alone, even though the unchanged files are the same inodes.
+ */
+static int clone_tree(const char *from, const char *to)
+{
+    char filebuf1[MAX_PATH];
+    char filebuf2[MAX_PATH];
+    file_list *files;
+    file_list *i;
+    struct stat statbuf;
+    int rc = PATCHSUCCESS;
 
-    real1 = get_realpath(dir1);
-    if (real1 == NULL)
+    if ((stat(from, &statbuf) == -1) || (mkdir(to, S_IRWXU) == -1))
     {
-        _fatal("Couldn't get realpath of [%s].", dir1);
+        _fatal("Error making directory [%s]: %s.", to, strerror(errno));
         return(PATCHERROR);
     } /* if */
 
-    real2 = get_realpath(dir2);
-    if (real2 == NULL)
+    files = list_directory(from);
+    for (i = files; (i != NULL) && (rc != PATCHERROR); i = i->next)
     {
-        _fatal("Couldn't get realpath of [%s].", dir2);
-        return(PATCHERROR);
-    } /* if */
+        /* our journal, staging, temp files: they belong to the old tree. */
+        if (strncmp(i->fname, ".mojopatch.", 11) == 0)
+            continue;
 
-    real3 = get_realpath(patchfile);
-    if (real3 == NULL)
+        snprintf(filebuf1, sizeof (filebuf1), "%s%s%s", from, PATH_SEP, i->fname);
+        snprintf(filebuf2, sizeof (filebuf2), "%s%s%s", to, PATH_SEP, i->fname);
+        if ((file_is_directory(filebuf1)) && (!file_is_symlink(filebuf1)))
+            rc = clone_tree(filebuf1, filebuf2);
+        else if (!share_file(filebuf1, filebuf2, reflink))
+            rc = PATCHERROR;
+    } /* for */
+    free_filelist(files);
+
+    /* last, so a read-only dir doesn't stop us filling it. */
+    if ((rc != PATCHERROR) && (chmod(to, statbuf.st_mode & 07777) == -1))
     {
-        _fatal("Couldn't get realpath of [%s].", patchfile);
-        return(PATCHERROR);
+        _fatal("Couldn't set permissions on [%s]: %s.", to, strerror(errno));
+        rc = PATCHERROR;
     } /* if */
 
-    if (!appending)
-        unlink(patchfile);  /* just in case. */
+    return(rc);
+} /* clone_tree */
 
-    if (!open_serialized_archive(&ar, patchfile, 0, NULL, NULL))
-    {
-        free(real1);
-        free(real2);
-        free(real3);
-        _fatal("Couldn't open [%s]: %s.", patchfile, strerror(errno));
-        return(PATCHERROR);
-    } /* if */
 
-    if (chdir(real2) != 0)
-    {
-        close_serialized_archive(&ar);
-        free(real1);
-        free(real2);
-        free(real3);
-        _fatal("Couldn't chdir to [%s]: %s.", real2, strerror(errno));
+/*
+ * Move the temp files into the current dir, the tree we're about to patch,
+ *  so do_rename() is a real rename() and not a copy from /tmp, which is
+ *  often tmpfs or another disk. --tempdir wins, though, and we leave
+ *  whatever else is in there alone.
+ */
+static int move_tmp_files(void)
+{
+    file_list *files;
+    file_list *i;
+    int rc;
+    char *dir;
+
+    if (tempdir != NULL)
+        return(PATCHSUCCESS);
+
+    dir = get_realpath(".");
+    if (dir == NULL)
         return(PATCHERROR);
-    } /* if */
-    free(real2);
 
-    if (readmefull != NULL)
+    unlink(patchtmpfile);  /* just in case. */
+    unlink(patchtmpfile2); /* just in case. */
+    rc = calc_tmp_filenames(dir, &patchtmpfile, &patchtmpfile2);
+    free(dir);
+
+    /*
+     * A run that got killed leaves its temp files here, and they have its
+     *  pid in their names, so nothing else would ever clean them up.
+     */
+    files = list_directory(".");
+    for (i = files; i != NULL; i = i->next)
     {
-        header.readmedata = read_whole_file(readmefull);
-        if (!header.readmedata)
+        if (strncmp(i->fname, ".mojopatch.tmp", 14) == 0)
         {
-            close_serialized_archive(&ar);
-            free(real1);
-            free(real3);
-            return(PATCHERROR);
+            _dlog("Deleting stale temp file [%s].", i->fname);
+            remove(i->fname);
         } /* if */
-    } /* if */
-    else
-    {
-        header.readmedata = malloc(1);  /* bleh. */
-        header.readmedata[0] = '\0';
-    } /* else */
-
-    if (!serialize_header(&ar, &header, NULL))
+    } /* for */
+    free_filelist(files);
+    if (!rc)
     {
-        close_serialized_archive(&ar);
-        free(real1);
-        free(real3);
-        free(header.readmedata);
+        _fatal("Internal error: Couldn't find scratch filenames.");
         return(PATCHERROR);
     } /* if */
 
-    free(header.readmedata);
-
-    retval = compare_directories(&ar, real1, "");
+    _dlog("Temp filenames are [%s] and [%s].", patchtmpfile, patchtmpfile2);
+    return(PATCHSUCCESS);
+} /* move_tmp_files */
 
-    free(real1);
 
-    if (retval != PATCHERROR)
-        retval = put_done(&ar);
+/*
+ * Is (outdir) somewhere in the current dir? Then cloning would walk into
+ *  the copy it's building. (outdir) doesn't exist yet, so resolve its
+ *  parent, which has to.
+ */
+static int outdir_in_cwd(void)
+{
+    char *here = get_realpath(".");
+    char *parent = NULL;
+    char *ptr;
+    size_t len;
+    int retval = 1;  /* if we can't tell, assume the worst. */
+
+    parent = (char *) malloc(strlen(outdir) + 2);
+    if ((here == NULL) || (parent == NULL))
+        goto outdir_in_cwd_done;
+
+    strcpy(parent, outdir);
+    ptr = strrchr(parent, PATH_SEP[0]);
+    if (ptr == parent)  /* "/dir" */
+        ptr[1] = '\0';
+    else if (ptr != NULL)
+        *ptr = '\0';
 
-    if (!close_serialized_archive(&ar))
-    {
-        free(real3);
-        _fatal("Couldn't close [%s]: %s.", patchfile, strerror(errno));
-        retval = PATCHERROR;
-    } /* if */
+    ptr = parent;
+    parent = get_realpath(parent);
+    free(ptr);
+    if (parent == NULL)
+        goto outdir_in_cwd_done;
 
-    if (!get_file_size(real3, &fsize))
-    {
-        _fatal("Couldn't get size of [%s]: %s.", patchfile, strerror(errno));
-        retval = PATCHERROR;
-    } /* if */
-    free(real3);
+    /* (parent) being here, or under here, is enough. */
+    len = strlen(here);
+    if ((len > 0) && (here[len - 1] == PATH_SEP[0]))
+        len--;  /* "/" */
 
-    if (retval == PATCHERROR)
-        _fatal("THE FILE [%s] IS LIKELY INCOMPLETE. DO NOT USE!", patchfile);
-    else
-    {
-        if (!quietonsuccess)
-            ui_success("Patchfile successfully created.");
-        _log("%ld bytes in the file [%s].", fsize, patchfile);
-    } /* else */
+    retval = ( (strncmp(parent, here, len) == 0) &&
+               ((parent[len] == '\0') || (parent[len] == PATH_SEP[0])) );
 
+outdir_in_cwd_done:
+    free(here);
+    free(parent);
     return(retval);
-} /* create_patchfile */
+} /* outdir_in_cwd */
 
 
-static int do_patch_operations(SerialArchive *ar,
-                               int do_progress,
-                               long patchfile_size)
+/* for --outdir: clone the install dir into (outdir), and patch that instead. */
+static int make_outdir(void)
 {
-    Operations ops;
-    memset(&ops, '\0', sizeof (ops));
+    static int cloned = 0;
+    char journalfname[MAX_PATH];
 
-    if (info_only())
-        _log("These are the operations we would perform if patching...");
+    if ((outdir == NULL) || (cloned))
+        return(PATCHSUCCESS);
 
-    do
+    if (outdir_in_cwd())
     {
-        ui_pump();
+        _fatal("[%s] is inside the installation; --outdir has to be elsewhere.", outdir);
+        return(PATCHERROR);
+    } /* if */
 
-        if (do_progress)
+    /*
+     * An interrupted run leaves its journal in (outdir), so patch that tree
+     *  again and let journal_begin() decide if it can skip ahead. Anything
+     *  else there isn't ours to patch.
+     */
+    if (file_exists(outdir))
+    {
+        if ( (snprintf(journalfname, sizeof (journalfname), "%s%s%s", outdir,
+                       PATH_SEP, JOURNAL_FNAME) >= (int) sizeof (journalfname)) ||
+             (!file_exists(journalfname)) )
         {
-            long pos = ftell(ar->io);
-            int progress = (int) (((float)pos)/((float)patchfile_size)*100.0f);
-            ui_total_progress((pos == -1) ? -1 : progress);
+            _fatal("[%s] already exists; --outdir wants a fresh directory.", outdir);
+            return(PATCHERROR);
         } /* if */
 
-        if (!serialize_operation(ar, &ops))
-            return(PATCHERROR);
+        _log("Picking up the interrupted patch in [%s]...", outdir);
+    } /* if */
 
-        assert((ops.operation >= 0) && (ops.operation < OPERATION_TOTAL));
-        if (!operation_handlers[ops.operation](ar, ops.operation, &ops))
+    else
+    {
+        _log("Linking current version into [%s]...", outdir);
+        if (clone_tree(".", outdir) == PATCHERROR)
             return(PATCHERROR);
-    } while (ops.operation != OPERATION_DONE);
+    } /* else */
+
+    if (chdir(outdir) == -1)
+    {
+        _fatal("Couldn't chdir to [%s]: %s.", outdir, strerror(errno));
+        return(PATCHERROR);
+    } /* if */
 
+    if (move_tmp_files() == PATCHERROR)
+        return(PATCHERROR);
+
+    /* later segments have to find the new tree, not the old one. */
+    free(installdir);
+    installdir = (char *) malloc(strlen(outdir) + 1);
+    if (installdir == NULL)
+    {
+        _fatal("Out of memory.");
+        return(PATCHERROR);
+    } /* if */
+    strcpy(installdir, outdir);
+
+    cloned = 1;
     return(PATCHSUCCESS);
-} /* do_patch_operations */
+} /* make_outdir */
 
 
 static inline void header_log(const char *str, const char *val)
@@ -2122,7 +5029,12 @@ static inline void header_log(const char *str, const char *val)
 
 static int show_and_install_readme(const char *fname, const char *text)
 {
-    FILE *io = fopen(fname, "wb");
+    FILE *io;
+
+    if (outdir != NULL)  /* may be hardlinked to the old tree's copy. */
+        remove(fname);
+
+    io = fopen(fname, "wb");
     if (io == NULL)
     {
         _fatal("Failed to open [%s] for writing.", fname);
@@ -2165,7 +5077,14 @@ static int chdir_by_identifier(const char *name, const char *str)
     int hasident = ((str != NULL) && (*str));
     int found = 0;
 
-    if (hasident)
+    if (installdir != NULL)  /* user told us where it is; don't go looking. */
+    {
+        strncpy(buf, installdir, sizeof (buf));
+        buf[sizeof (buf) - 1] = '\0';
+        found = 1;
+    } /* if */
+
+    else if (hasident)
     {
         found = locate_product_by_identifier(str, buf, sizeof (buf));
 
@@ -2259,6 +5178,7 @@ static int process_patch_header(SerialArchive *ar, PatchHeader *h)
     header_log("Renamedir: \"%s\".", h->renamedir);
     header_log("UI titlebar: \"%s\".", h->titlebar);
     header_log("Startup msg: \"%s\".", h->startupmsg);
+    _log("Bytes of work to apply: %llu.", h->workbytes);
 
     /* Fill in a default titlebar if needed. */
     if (*h->titlebar == '\0')
@@ -2295,14 +5215,18 @@ static int process_patch_header(SerialArchive *ar, PatchHeader *h)
                 retval = PATCHERROR;
             else if ((rc == ISPATCHABLE_MATCHES) || (rc == ISPATCHABLE_NO))
                 skip_patch = 1;
-            else
+            else if (move_tmp_files() == PATCHERROR)
+                retval = PATCHERROR;
+            else if (!preparing)  /* --commit does these. */
             {
                 assert(rc == ISPATCHABLE_YES);
-                if (!run_script("prepatch"))
+                if (make_outdir() == PATCHERROR)
+                    retval = PATCHERROR;
+                else if (!run_script("prepatch"))
                     retval = PATCHERROR;
                 else if (*h->readmefname)
                     retval = show_and_install_readme(h->readmefname, h->readmedata);
-            } /* else */
+            } /* else if */
         } /* else */
     } /* if */
 
@@ -2337,13 +5261,11 @@ static int do_patching(void)
     int retval = PATCHERROR;
     int installed_patches = 0;
     int skipped_patches = 0;
-    unsigned int file_size = 0;
-    int do_progress = 0;
 
-    ui_total_progress(do_progress ? 0 : -1);
+    ui_total_progress(-1);
     ui_pump();
 
-    if (!open_serialized_archive(&ar, patchfile, 1, &do_progress, &file_size))
+    if (!open_serialized_archive(&ar, patchfile, 1, NULL, NULL))
         return(PATCHERROR);
 
     if ((patchfiledir = get_real_filedir(patchfile)) == NULL)
@@ -2352,9 +5274,6 @@ static int do_patching(void)
         return(PATCHERROR);
     } /* if */
 
-    if (file_size == 0)
-        do_progress = 0;  /* prevent a division by zero. */
-
     while (1)
     {
         int legitEOF = 0;
@@ -2368,7 +5287,28 @@ static int do_patching(void)
             goto do_patching_done;
 
         report_error = 1;
-        if (do_patch_operations(&ar, do_progress, file_size) == PATCHERROR)
+        if ((committing) && (!skip_patch))
+        {
+            if (commit_staged(&ar) == PATCHERROR)
+                goto do_patching_done;
+        } /* if */
+
+        else if ((preparing) && (!skip_patch))
+        {
+            int rc;
+            if (stage_begin(&ar) == PATCHERROR)
+                goto do_patching_done;
+
+            rc = do_patch_operations(&ar);
+            if ((stage_end(rc != PATCHERROR) == PATCHERROR) || (rc == PATCHERROR))
+                goto do_patching_done;
+
+            /* the rest waits for --commit; later patches need the new version. */
+            installed_patches++;
+            break;
+        } /* else if */
+
+        else if (do_patch_operations(&ar) == PATCHERROR)
             goto do_patching_done;
 
         if ((!info_only()) && (!skip_patch))
@@ -2400,6 +5340,9 @@ static int do_patching(void)
             installed_patches++;
             if (!run_script("postpatch"))
                 goto do_patching_done;
+
+            if (committing)  /* --prepare only ever stages one. */
+                break;
         } /* else */
 
         /* !!! FIXME: This loses command line overrides! */
@@ -2414,6 +5357,8 @@ static int do_patching(void)
     {
         if (installed_patches == 0)
             _fatal("No patches were applied to your installation.");
+        else if (preparing)
+            _log("Patch is staged. Run it again with --commit to install it.");
         else if (!quietonsuccess)
             ui_success("Patching successful!");
     } /* if */
@@ -2427,14 +5372,14 @@ do_patching_done:
         if (report_error)
         {
             _fatal("There were problems, so I'm aborting.");
-            if (!info_only())
+            if ((!info_only()) && (!preparing))  /* --prepare never touches it. */
                 _fatal("The product is possibly damaged and requires a fresh installation.");
         } /* if */
     } /* if */
-    else
+    else if (!preparing)
     {
         run_script("patchingdone");
-    } /* else */
+    } /* else if */
 
     free(patchfiledir);
     patchfiledir = NULL;
@@ -2447,6 +5392,9 @@ static int do_usage(const char *argv0)
 {
     _log("");
     _log("USAGE: %s --create <file.mojopatch> <dir1> <dir2>", argv0);
+    _log("   or: %s --create --fromsignature <file.mojopatch> <file.mojosig> <dir2>", argv0);
+    _log("   or: %s --createmulti <file.mojopatch> <dir2> <dir1> <version1> [<dir1> <version1> ...]", argv0);
+    _log("   or: %s --signature <file.mojosig> <dir1>", argv0);
     _log("   or: %s --info <file.mojopatch>", argv0);
     _log("   or: %s <file.mojopatch>", argv0);
     _log("");
@@ -2458,14 +5406,30 @@ static int do_usage(const char *argv0)
     _log("    --replace (specify ADDs overwrite, at create time or override)");
     _log("    --append (creation appends to existing patchfile)");
     _log("    --alwaysadd (put ADDs instead of PATCHs into the patchfile)");
+    _log("    --multibase (--createmulti makes one patch, with a delta per version)");
+    _log("    --fullfallback (--multibase PATCHs also carry the whole new file)");
     _log("    --quietonsuccess (Don't do msgbox on successful finish)");
+    _log("    --installdir (Patch this dir instead of looking for the product)");
+    _log("    --nojournal (Don't keep a journal to resume an interrupted patch)");
+    _log("    --prepare (Build and verify the patched files, but don't install them)");
+    _log("    --commit (Quickly install what --prepare built)");
+    _log("    --outdir (Leave installdir alone; build, or resume building, the new version here)");
+    _log("    --reflink (--outdir clones unchanged files instead of hardlinking)");
     _log("    --startupmsg (msgbox text to show at startup)");
     _log("    --ui (UI driver to use for this run)");
     _log("    --readme (README filename to display/install)");
     _log("    --renamedir (What patched dir should be called)");
     _log("    --zliblevel (compression, 0-9: 0 == fastest, 9 == best)");
+    _log("    --deltaspeed (xdelta matching, auto or 0-3: 0 == smallest, 3 == fastest)");
+    _log("    --indexcache (Keep xdelta's indexes of old files here, to reuse them)");
+    _log("    --tempdir (Scratch files go here, not next to the installation)");
     _log("    --titlebar (What UI's window's titlebar should say)");
-    _log("    --ignore (Ignore specific files/dirs)");
+    _log("    --ignore (Ignore files/dirs: 'path', 'dir/**', '*.log'...)");
+    _log("    --ioengine (File i/o method: auto, stdio, or io_uring)");
+    _log("    --stats (Write a JSON report of where the time went to this file)");
+    _log("    --trace (Write a timeline to this file for chrome://tracing/Perfetto)");
+    _log("    --logfile (Also write the log to this file)");
+    _log("    --loglevel (What goes in --logfile: fatal, info, or debug)");
     _log("    --confirm (Make process confirm each step)");
     _log("    --debug (spew debugging output)");
     _log("");
@@ -2518,8 +5482,29 @@ static int parse_cmdline(int argc, char **argv)
 
         if (strcmp(argv[i], "--create") == 0)
             okay = set_command_or_abort(COMMAND_CREATE);
+        else if (strcmp(argv[i], "--createmulti") == 0)
+        {
+            okay = set_command_or_abort(COMMAND_CREATE);
+            createmulti = 1;
+        } /* else if */
         else if (strcmp(argv[i], "--info") == 0)
             okay = set_command_or_abort(COMMAND_INFO);
+        else if (strcmp(argv[i], "--signature") == 0)
+            okay = set_command_or_abort(COMMAND_SIGNATURE);
+        else if (strcmp(argv[i], "--fromsignature") == 0)
+            fromsignature = 1;
+        else if (strcmp(argv[i], "--multibase") == 0)
+            multibase = 1;
+        else if (strcmp(argv[i], "--fullfallback") == 0)
+            fullfallback = 1;
+        else if (strcmp(argv[i], "--nojournal") == 0)
+            nojournal = 1;
+        else if (strcmp(argv[i], "--prepare") == 0)
+            preparing = 1;
+        else if (strcmp(argv[i], "--commit") == 0)
+            committing = 1;
+        else if (strcmp(argv[i], "--reflink") == 0)
+            reflink = 1;
         else if (strcmp(argv[i], "--confirm") == 0)
             interactive = 1;
         else if (strcmp(argv[i], "--debug") == 0)
@@ -2548,6 +5533,73 @@ static int parse_cmdline(int argc, char **argv)
             make_static_string(header.titlebar, argv[++i]);
         else if (strcmp(argv[i], "--startupmsg") == 0)
             make_static_string(header.startupmsg, argv[++i]);
+        else if (strcmp(argv[i], "--installdir") == 0)
+        {
+            /* made absolute now, since we chdir() around while patching. */
+            free(installdir);
+            installdir = get_realpath(argv[++i]);
+            if (installdir == NULL)
+                return(0);
+        } /* else if */
+        else if (strcmp(argv[i], "--outdir") == 0)
+        {
+            /* doesn't exist yet, so no realpath; just make it absolute. */
+            const char *dir = argv[++i];
+            char *cwd = get_realpath(".");
+            if (cwd == NULL)
+                return(0);
+            free(outdir);
+            outdir = (char *) malloc(strlen(cwd) + strlen(dir) + 2);
+            if (outdir == NULL)
+            {
+                free(cwd);
+                _fatal("Out of memory.");
+                return(0);
+            } /* if */
+            if (*dir == PATH_SEP[0])
+                strcpy(outdir, dir);
+            else
+                sprintf(outdir, "%s%s%s", cwd, PATH_SEP, dir);
+            free(cwd);
+        } /* else if */
+        else if (strcmp(argv[i], "--tempdir") == 0)
+        {
+            free(tempdir);
+            tempdir = get_realpath(argv[++i]);
+            if (tempdir == NULL)
+                return(0);
+        } /* else if */
+        else if (strcmp(argv[i], "--indexcache") == 0)
+        {
+            free(indexcache);
+            indexcache = get_realpath(argv[++i]);
+            if (indexcache == NULL)
+            {
+                _fatal("Couldn't get realpath of [%s].", argv[i]);
+                return(0);
+            } /* if */
+        } /* else if */
+        else if (strcmp(argv[i], "--stats") == 0)
+            statsfile = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0)
+            tracefile = argv[++i];
+        else if (strcmp(argv[i], "--logfile") == 0)
+            logfile = argv[++i];
+        else if (strcmp(argv[i], "--loglevel") == 0)
+        {
+            const char *level = argv[++i];
+            if ((level != NULL) && (strcmp(level, "fatal") == 0))
+                loglevel = LOGLEVEL_FATAL;
+            else if ((level != NULL) && (strcmp(level, "info") == 0))
+                loglevel = LOGLEVEL_INFO;
+            else if ((level != NULL) && (strcmp(level, "debug") == 0))
+                loglevel = LOGLEVEL_DEBUG;
+            else
+            {
+                _fatal("Error: --loglevel must be fatal, info, or debug.");
+                return(do_usage(argv[0]));
+            } /* else */
+        } /* else if */
         else if (strcmp(argv[i], "--ui") == 0)
             i++;  /* (really handled elsewhere.) Just skip ui driver name. */
         else if (strcmp(argv[i], "--zliblevel") == 0)
@@ -2559,6 +5611,19 @@ static int parse_cmdline(int argc, char **argv)
                 return(do_usage(argv[0]));
             } /* if */
         } /* else if */
+        else if (strcmp(argv[i], "--deltaspeed") == 0)
+        {
+            const char *val = argv[++i];
+            if ((val != NULL) && (strcmp(val, "auto") == 0))
+                deltaspeed = -1;
+            else if ((val != NULL) && (val[0] >= '0') && (val[0] <= '3') && (val[1] == '\0'))
+                deltaspeed = val[0] - '0';
+            else
+            {
+                _fatal("deltaspeed must be auto, or between 0 and 3");
+                return(do_usage(argv[0]));
+            } /* else */
+        } /* else if */
         else if (strcmp(argv[i], "--ignore") == 0)
         {
             ignorecount++;
@@ -2566,6 +5631,21 @@ static int parse_cmdline(int argc, char **argv)
             /* !!! FIXME: Check retval. */
             ignorelist[ignorecount-1] = argv[++i];
         } /* else if */
+        else if (strcmp(argv[i], "--ioengine") == 0)
+        {
+            const char *engine = argv[++i];
+            if (engine == NULL)
+            {
+                _fatal("Error: --ioengine needs auto, stdio, or io_uring.");
+                return(do_usage(argv[0]));
+            } /* if */
+
+            if (!set_io_engine(engine))
+            {
+                _fatal("Error: Unknown i/o engine [%s].", engine);
+                return(do_usage(argv[0]));
+            } /* if */
+        } /* else if */
         else
         {
             _fatal("Error: Unknown option [%s].", argv[i]);
@@ -2579,6 +5659,27 @@ static int parse_cmdline(int argc, char **argv)
     if (command == COMMAND_NONE)
         command = COMMAND_DOPATCHING;
 
+    /* without --loglevel, the file gets what the UI does. */
+    if (loglevel < 0)
+        loglevel = (debug) ? LOGLEVEL_DEBUG : LOGLEVEL_INFO;
+
+    if ( ((preparing) || (committing)) &&
+         ((command != COMMAND_DOPATCHING) || ((preparing) && (committing))) )
+    {
+        _fatal("Error: use --prepare, then --commit, when applying a patch.");
+        return(do_usage(argv[0]));
+    } /* if */
+
+    if ( (outdir != NULL) &&
+         ((command != COMMAND_DOPATCHING) || (preparing) || (committing)) )
+    {
+        _fatal("Error: --outdir only works when applying a patch in one go.");
+        return(do_usage(argv[0]));
+    } /* if */
+
+    if (!compile_ignore_list())
+        return(0);
+
     switch (command)
     {
         case COMMAND_INFO:
@@ -2592,6 +5693,53 @@ static int parse_cmdline(int argc, char **argv)
             break;
 
         case COMMAND_CREATE:
+            if (createmulti)
+            {
+                /* patchfile, new tree, then pairs of old tree and version. */
+                if ((nonoptcount < 4) || ((nonoptcount % 2) != 0))
+                {
+                    _fatal("Error: Wrong arguments.");
+                    return(do_usage(argv[0]));
+                } /* if */
+
+                if ((multibase) && (fromsignature))
+                {
+                    _fatal("Error: --multibase needs the old trees, not signatures.");
+                    return(0);
+                } /* if */
+
+                patchfile = nonoptions[0];
+                dir2 = nonoptions[1];
+                multicount = (nonoptcount - 2) / 2;
+                multidirs = (const char **) malloc(sizeof (char *) * multicount);
+                multiversions = (const char **) malloc(sizeof (char *) * multicount);
+                if ((multidirs == NULL) || (multiversions == NULL))
+                {
+                    _fatal("Out of memory.");
+                    return(0);
+                } /* if */
+
+                for (i = 0; i < multicount; i++)
+                {
+                    multidirs[i] = nonoptions[2 + (i * 2)];
+                    multiversions[i] = nonoptions[3 + (i * 2)];
+                    if (strlen(multiversions[i]) >= sizeof (header.version))
+                    {
+                        _fatal("Version [%s] is too long.", multiversions[i]);
+                        return(0);
+                    } /* if */
+                } /* for */
+
+                dir1 = multidirs[0];
+                break;
+            } /* if */
+
+            if ((multibase) || (fullfallback))
+            {
+                _fatal("Error: --multibase needs --createmulti.");
+                return(do_usage(argv[0]));
+            } /* if */
+
             if (nonoptcount != 3)
             {
                 _fatal("Error: Wrong arguments.");
@@ -2603,6 +5751,17 @@ static int parse_cmdline(int argc, char **argv)
             dir2 = nonoptions[2];
             break;
 
+        case COMMAND_SIGNATURE:
+            if (nonoptcount != 2)
+            {
+                _fatal("Error: Wrong arguments.");
+                return(do_usage(argv[0]));
+            } /* if */
+
+            patchfile = nonoptions[0];
+            dir1 = nonoptions[1];
+            break;
+
         default:
             assert(0);
             break;
@@ -2615,8 +5774,22 @@ static int parse_cmdline(int argc, char **argv)
         _dlog("ADDs are %spermitted to REPLACE.", (replace) ? "" : "NOT ");
         _dlog("Created patch will %sbe appended.", (appending) ? "" : "NOT ");
         _dlog("%sse ADDs instead of PATCHs.", (alwaysadd) ? "U" : "Do NOT u");
+        _dlog("Old files %scome from a signature.", (fromsignature) ? "" : "do NOT ");
+        _dlog("Creating patches from (%d) old trees.", (createmulti) ? multicount : 1);
+        _dlog("%sne patch for all old trees.", (multibase) ? "O" : "NOT o");
+        _dlog("Multi-version PATCHs %scarry the whole file.", (fullfallback) ? "" : "do NOT ");
+        _dlog("%seep a journal while patching.", (nojournal) ? "Do NOT k" : "K");
+        _dlog("Apply is %s.", (preparing) ? "--prepare" :
+                              (committing) ? "--commit" : "all at once");
+        _dlog("outdir == [%s].", (outdir) ? outdir : "(null)");
+        _dlog("outdir %sreflinks unchanged files.", (reflink) ? "" : "does NOT ");
         _dlog("%seport success in UI", (quietonsuccess) ? "Don't r" : "R");
         _dlog("zliblevel == (%d).", (int) zliblevel);
+        if (deltaspeed < 0)
+            _dlog("deltaspeed == auto.");
+        else
+            _dlog("deltaspeed == (%d).", deltaspeed);
+        _dlog("i/o engine is [%s].", get_io_engine());
         _dlog("command == (%d).", (int) command);
         _dlog("(%d) nonoptions:", nonoptcount);
         for (i = 0; i < nonoptcount; i++)
@@ -2624,6 +5797,13 @@ static int parse_cmdline(int argc, char **argv)
         _dlog("patchfile == [%s].", (patchfile) ? patchfile : "(null)");
         _dlog("dir1 == [%s].", (dir1) ? dir1 : "(null)");
         _dlog("dir2 == [%s].", (dir2) ? dir2 : "(null)");
+        _dlog("installdir == [%s].", (installdir) ? installdir : "(null)");
+        _dlog("indexcache == [%s].", (indexcache) ? indexcache : "(null)");
+        _dlog("tempdir == [%s].", (tempdir) ? tempdir : "(next to installation)");
+        _dlog("statsfile == [%s].", (statsfile) ? statsfile : "(null)");
+        _dlog("tracefile == [%s].", (tracefile) ? tracefile : "(null)");
+        _dlog("logfile == [%s].", (logfile) ? logfile : "(null)");
+        _dlog("loglevel == (%d).", loglevel);
         for (i = 0; i < ignorecount; i++)
             _dlog("ignoring [%s].", ignorelist[i]);
     } /* if */
@@ -2663,6 +5843,7 @@ static int kickoff_ui(int argc, char **argv)
 int mojopatch_main(int argc, char **argv)
 {
 	time_t starttime = time(NULL);
+    const char *cmdname;
     int retval = PATCHSUCCESS;
 
     /* !!! FIXME: We need to serialize this, so we serialize it as uint32. */
@@ -2681,25 +5862,65 @@ int mojopatch_main(int argc, char **argv)
         return(PATCHERROR);
     } /* if */
 
-    if (!calc_tmp_filenames(&patchtmpfile, &patchtmpfile2))
+    cmdname = (command == COMMAND_CREATE) ? "create" :
+              (command == COMMAND_SIGNATURE) ? "signature" :
+              (command == COMMAND_INFO) ? "info" : "patch";
+
+    /* these open their files now: we chdir() around later, and want to fail early. */
+    if ( (!log_init(logfile, (LogLevel) loglevel)) || (!stats_init(statsfile, cmdname)) ||
+         (!trace_init(tracefile, cmdname)) )
+    {
+        stats_write();
+        log_close();
+        ui_deinit();
+        return(PATCHERROR);
+    } /* if */
+
+    if (!calc_tmp_filenames(tempdir, &patchtmpfile, &patchtmpfile2))
     {
         _fatal("Internal error: Couldn't find scratch filenames.");
+        log_close();
         ui_deinit();
         return(PATCHERROR);
     } /* if */
     _dlog("Temp filenames are [%s] and [%s].", patchtmpfile, patchtmpfile2);
 
+    trace_begin(cmdname, "run", NULL);
     if (command == COMMAND_CREATE)
         retval = create_patchfile();
+    else if (command == COMMAND_SIGNATURE)
+        retval = create_signature();
     else
         retval = do_patching();
+    trace_end();
 
     unlink(patchtmpfile);  /* just in case. */
     unlink(patchtmpfile2); /* just in case. */
 
+    free(installdir);
+    installdir = NULL;
+    free(outdir);
+    outdir = NULL;
+    free(indexcache);
+    indexcache = NULL;
+    free(tempdir);
+    tempdir = NULL;
+    free(multidirs);
+    multidirs = NULL;
+    free(multiversions);
+    multiversions = NULL;
+
+    if (!stats_write())
+        retval = PATCHERROR;
+    if (!trace_close())
+        retval = PATCHERROR;
+
     _log("MojoPatch %s shutting down.", VERSION);
     _dlog("(Total running time: %ld seconds.)", time(NULL) - starttime);
 
+    if (!log_close())
+        retval = PATCHERROR;
+
     ui_deinit();
     return(retval);
 } /* mojopatch_main */
@@ -9,6 +9,8 @@
 #ifndef _INCL_PLATFORM_H_
 #define _INCL_PLATFORM_H_
 
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -50,6 +52,10 @@ typedef struct MOJOPATCH_FILELIST
     struct MOJOPATCH_FILELIST *next;
 } file_list;
 
+/* read_files() hands you each file's data in order; return 0 to abort. */
+typedef int (*file_read_callback)(void *data, int idx,
+                                  const void *buf, size_t len);
+
 typedef enum
 {
     SPAWN_FILENOTFOUND,
@@ -75,15 +81,35 @@ int file_exists(const char *fname);
 int file_is_directory(const char *fname);
 int file_is_symlink(const char *fname);
 file_list *make_filelist(const char *base);  /* must use malloc(). */
-int get_file_size(const char *fname, unsigned int *fsize);
+int get_file_size(const char *fname, unsigned long long *fsize);
 char *get_current_dir(char *buf, size_t bufsize);
 char *get_realpath(const char *path);
 int update_version(const char *ver);
-int calc_tmp_filenames(char **tmp1, char **tmp2);
+/* (dir) == NULL for the system's temp dir. */
+int calc_tmp_filenames(const char *dir, char **tmp1, char **tmp2);
 int locate_product_by_identifier(const char *str, char *buf, size_t bufsize);
 int get_product_version(const char *ident, char *buf, size_t bufsize);
 SpawnResult spawn_xdelta(const char *cmdline);
 SpawnResult spawn_script(const char *scriptname, const char *dstdir);
+int set_io_engine(const char *name);  /* "auto", "stdio" or "io_uring". */
+const char *get_io_engine(void);
+int read_files(const char **fnames, int count,
+               file_read_callback cb, void *data);
+FILE *open_file_for_writing(const char *fname);  /* fclose() when done. */
+/* same, but preallocates (fsize) bytes, if we know it (0 if we don't). */
+FILE *open_file_for_writing_sized(const char *fname, unsigned long long fsize);
+/* page cache hints; all of these are optional, and can't fail. */
+void prefetch_file(const char *fname);  /* we'll be reading this soon. */
+void drop_file_cache(const char *fname);  /* we're done with this. */
+void drop_stream_cache(FILE *io);  /* done with everything before its position. */
+int sync_file(FILE *io);  /* fflush(), then wait for it to hit the disk. */
+int sync_path(const char *fname);  /* same, for a file or dir by name. */
+/* reflink (if asked), else hardlink, else copy (from) to (to). */
+int share_file(const char *from, const char *to, int reflink);
+/* (to) must not exist; it gets (from)'s permissions. */
+int copy_file(const char *from, const char *to);
+double get_monotonic_time(void);  /* seconds, from some arbitrary point. */
+int get_peak_rss(unsigned long *self_kb, unsigned long *children_kb);
 
 #ifdef __cplusplus
 }
@@ -6,6 +6,10 @@
  *  This file written by Ryan C. Gordon.
  */
 
+#if USE_IO_URING || defined(__linux__)
+#define _GNU_SOURCE 1  /* fopencookie(), copy_file_range(), sync_file_range(). */
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -18,9 +22,21 @@
 #include <errno.h>
 #include <assert.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#if USE_IO_URING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
-#if USE_PTHREAD
-#include <pthread.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>  /* FICLONE */
 #endif
 
 #include "platform.h"
@@ -62,6 +78,1146 @@ int file_is_symlink(const char *fname)
 } /* file_is_symlink */
 
 
+/*
+ * Bulk I/O. With USE_IO_URING, reads, writes, opens and stats are queued on
+ *  an io_uring so the disk sees more than one request at a time. Everything
+ *  else (and any kernel that refuses io_uring_setup()) gets plain stdio.
+ */
+
+#define IO_CHUNK_SIZE (128 * 1024)
+
+typedef enum
+{
+    IOENGINE_AUTO,
+    IOENGINE_STDIO,
+    IOENGINE_IO_URING
+} IoEngine;
+
+static IoEngine io_engine = IOENGINE_AUTO;
+static unsigned char io_chunk_buf[IO_CHUNK_SIZE];
+
+/*
+ * Write-behind, so a big apply doesn't push everyone else out of the page
+ *  cache: start writeback on each window as soon as it's full, and once the
+ *  window before it has landed, drop it from the cache. Files smaller than
+ *  a couple of windows never get dropped, so verifying them is still cheap.
+ */
+#define WRITE_BEHIND_WINDOW (8 * 1024 * 1024)
+
+typedef struct
+{
+    off_t started;  /* writeback kicked off up to here. */
+    off_t dropped;  /* out of the page cache up to here. */
+} WriteBehind;
+
+static void write_behind(int fd, WriteBehind *wb, off_t written)
+{
+    #if defined(__linux__)
+    while (written - wb->started >= WRITE_BEHIND_WINDOW)
+    {
+        sync_file_range(fd, wb->started, WRITE_BEHIND_WINDOW,
+                        SYNC_FILE_RANGE_WRITE);
+        wb->started += WRITE_BEHIND_WINDOW;
+    } /* while */
+
+    while (wb->started - wb->dropped >= (2 * WRITE_BEHIND_WINDOW))
+    {
+        sync_file_range(fd, wb->dropped, WRITE_BEHIND_WINDOW,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, wb->dropped, WRITE_BEHIND_WINDOW, POSIX_FADV_DONTNEED);
+        wb->dropped += WRITE_BEHIND_WINDOW;
+    } /* while */
+    #endif
+} /* write_behind */
+
+#if USE_IO_URING
+
+#define URING_ENTRIES 64
+#define URING_READ_SLOTS 16
+#define URING_WRITE_SLOTS 4
+
+typedef struct
+{
+    int file;  /* read_files() index, or -1 if slot is free. */
+    int res;
+    int done;
+    off_t offset;
+    size_t len;
+    unsigned char *buf;
+} URingSlot;
+
+typedef struct
+{
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_local_tail;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    int inflight;
+    int writer_active;
+    URingSlot read_slots[URING_READ_SLOTS];
+    unsigned char *read_bufs;
+} URing;
+
+static URing ring;
+static int ring_state = 0;  /* 0 == untried, 1 == ready, -1 == unavailable. */
+
+
+static int uring_setup(URing *r, unsigned int entries)
+{
+    struct io_uring_params p;
+    unsigned char *sq;
+    unsigned char *cq;
+    int i;
+
+    memset(r, '\0', sizeof (*r));
+    memset(&p, '\0', sizeof (p));
+    r->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return(0);
+
+    r->sq_len = p.sq_off.array + (p.sq_entries * sizeof (unsigned int));
+    r->cq_len = p.cq_off.cqes + (p.cq_entries * sizeof (struct io_uring_cqe));
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    } /* if */
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto uring_setup_failed;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else
+    {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto uring_setup_failed;
+    } /* else */
+
+    r->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *) mmap(NULL, r->sqes_len,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE,
+                                           r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto uring_setup_failed;
+
+    r->read_bufs = (unsigned char *) malloc(URING_READ_SLOTS * IO_CHUNK_SIZE);
+    if (r->read_bufs == NULL)
+        goto uring_setup_failed;
+
+    for (i = 0; i < URING_READ_SLOTS; i++)
+        r->read_slots[i].buf = r->read_bufs + (i * IO_CHUNK_SIZE);
+
+    sq = (unsigned char *) r->sq_ptr;
+    cq = (unsigned char *) r->cq_ptr;
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *) (sq + p.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return(1);
+
+uring_setup_failed:
+    if ((r->sqes != NULL) && (r->sqes != MAP_FAILED))
+        munmap(r->sqes, r->sqes_len);
+    if ((r->cq_ptr != NULL) && (r->cq_ptr != MAP_FAILED) && (r->cq_ptr != r->sq_ptr))
+        munmap(r->cq_ptr, r->cq_len);
+    if ((r->sq_ptr != NULL) && (r->sq_ptr != MAP_FAILED))
+        munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    return(0);
+} /* uring_setup */
+
+
+static void uring_teardown(URing *r)
+{
+    assert(r->inflight == 0);
+    free(r->read_bufs);
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+} /* uring_teardown */
+
+
+/* returns NULL if we aren't using io_uring right now. */
+static URing *get_uring(void)
+{
+    if (io_engine == IOENGINE_STDIO)
+        return(NULL);
+
+    if (ring_state == 0)
+    {
+        ring_state = uring_setup(&ring, URING_ENTRIES) ? 1 : -1;
+        if (ring_state == 1)
+            _dlog("Using io_uring for file i/o.");
+        else
+        {
+            _log("io_uring is unavailable (%s); using stdio.", strerror(errno));
+            io_engine = IOENGINE_STDIO;
+        } /* else */
+    } /* if */
+
+    return((ring_state == 1) ? &ring : NULL);
+} /* get_uring */
+
+
+/* grab the next free submission entry. Caller keeps inflight <= entries. */
+static struct io_uring_sqe *uring_get_sqe(URing *r, void *userdata)
+{
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int idx;
+    struct io_uring_sqe *sqe;
+
+    if ((r->sq_local_tail - head) >= r->sq_entries)
+        return(NULL);
+
+    idx = r->sq_local_tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, '\0', sizeof (*sqe));
+    sqe->user_data = (unsigned long long) (uintptr_t) userdata;
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    r->inflight++;
+    return(sqe);
+} /* uring_get_sqe */
+
+
+/* hand queued entries to the kernel, optionally blocking for completions. */
+static int uring_enter(URing *r, unsigned int wait_nr)
+{
+    unsigned int flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    unsigned int to_submit;
+    int rc;
+
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if ((to_submit == 0) && (wait_nr == 0))
+        return(1);
+
+    do
+    {
+        rc = (int) syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+                           flags, NULL, 0);
+    } while ((rc < 0) && (errno == EINTR));
+
+    if (rc < 0)
+    {
+        _fatal("io_uring_enter failed: %s.", strerror(errno));
+        return(0);
+    } /* if */
+
+    return(1);
+} /* uring_enter */
+
+
+/* submit anything queued and block until one request finishes. */
+static int uring_wait(URing *r, void **userdata, int *res)
+{
+    assert(r->inflight > 0);
+
+    while (1)
+    {
+        unsigned int head = *r->cq_head;
+        unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head != tail)
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            *userdata = (void *) (uintptr_t) cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            r->inflight--;
+            return(1);
+        } /* if */
+
+        if (!uring_enter(r, 1))
+            return(0);
+    } /* while */
+} /* uring_wait */
+
+
+/* stat a directory's entries in batches, and drop the symlinks. */
+static file_list *drop_symlinks_uring(URing *r, DIR *dir, file_list *list)
+{
+    struct statx stx[URING_ENTRIES];
+    file_list *batch[URING_ENTRIES];
+    file_list *retval = NULL;
+    file_list *prev = NULL;
+    int dfd = dirfd(dir);
+    int count;
+    int i;
+
+    while (list != NULL)
+    {
+        for (count = 0; (list != NULL) && (count < URING_ENTRIES); count++)
+        {
+            struct io_uring_sqe *sqe = uring_get_sqe(r, (void *) (intptr_t) count);
+            assert(sqe != NULL);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dfd;
+            sqe->addr = (unsigned long long) (uintptr_t) list->fname;
+            sqe->len = STATX_TYPE;
+            sqe->off = (unsigned long long) (uintptr_t) &stx[count];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            batch[count] = list;
+            list = list->next;
+        } /* for */
+
+        for (i = 0; i < count; i++)
+        {
+            void *ud;
+            int res;
+            if (!uring_wait(r, &ud, &res))
+            {
+                while (count > 0)
+                {
+                    count--;
+                    batch[count]->next = list;
+                    list = batch[count];
+                } /* while */
+
+                if (prev != NULL)
+                    prev->next = list;
+                else
+                    retval = list;
+
+                while (retval != NULL)
+                {
+                    file_list *next = retval->next;
+                    free(retval->fname);
+                    free(retval);
+                    retval = next;
+                } /* while */
+                return(NULL);
+            } /* if */
+
+            if (res < 0)  /* lstat() failing didn't skip the file before. */
+                stx[(intptr_t) ud].stx_mode = 0;
+        } /* for */
+
+        for (i = 0; i < count; i++)
+        {
+            if (S_ISLNK(stx[i].stx_mode))
+            {
+                free(batch[i]->fname);
+                free(batch[i]);
+                continue;
+            } /* if */
+
+            if (retval == NULL)
+                retval = batch[i];
+            else
+                prev->next = batch[i];
+            prev = batch[i];
+            prev->next = NULL;
+        } /* for */
+    } /* while */
+
+    return(retval);
+} /* drop_symlinks_uring */
+
+
+static int read_files_uring(URing *r, const char **fnames, int count,
+                            file_read_callback cb, void *data)
+{
+    int *fds = (int *) alloca(sizeof (int) * count);
+    off_t *fsizes = (off_t *) alloca(sizeof (off_t) * count);
+    off_t *issued = (off_t *) alloca(sizeof (off_t) * count);
+    off_t *delivered = (off_t *) alloca(sizeof (off_t) * count);
+    URingSlot *slots = r->read_slots;
+    int retval = 0;
+    int nextfile = 0;
+    int i;
+
+    assert(count <= URING_ENTRIES);
+
+    /* queue up all the opens at once... */
+    for (i = 0; i < count; i++)
+    {
+        struct io_uring_sqe *sqe = uring_get_sqe(r, (void *) (intptr_t) i);
+        assert(sqe != NULL);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long long) (uintptr_t) fnames[i];
+        sqe->open_flags = O_RDONLY;
+        fds[i] = -1;
+        issued[i] = delivered[i] = 0;
+    } /* for */
+
+    for (i = 0; i < count; i++)
+    {
+        void *ud;
+        int res;
+        if (!uring_wait(r, &ud, &res))
+            goto read_files_uring_done;
+        fds[(intptr_t) ud] = res;  /* -errno on failure. */
+    } /* for */
+
+    for (i = 0; i < count; i++)
+    {
+        struct stat statbuf;
+        if (fds[i] < 0)
+        {
+            _fatal("Failed to open [%s]: %s.", fnames[i], strerror(-fds[i]));
+            goto read_files_uring_done;
+        } /* if */
+
+        if (fstat(fds[i], &statbuf) == -1)
+        {
+            _fatal("Couldn't stat [%s]: %s.", fnames[i], strerror(errno));
+            goto read_files_uring_done;
+        } /* if */
+        fsizes[i] = statbuf.st_size;
+    } /* for */
+
+    for (i = 0; i < URING_READ_SLOTS; i++)
+        slots[i].file = -1;
+
+    while (1)
+    {
+        URingSlot *slot = NULL;
+        void *ud;
+        int delivering;
+
+        /* keep every free slot busy, spread between the files... */
+        for (i = 0; i < URING_READ_SLOTS; i++)
+        {
+            int tries;
+            struct io_uring_sqe *sqe;
+
+            if (slots[i].file != -1)
+                continue;
+
+            for (tries = 0; tries < count; tries++)
+            {
+                nextfile = (nextfile + 1) % count;
+                if (issued[nextfile] < fsizes[nextfile])
+                    break;
+            } /* for */
+
+            if (tries == count)
+                break;  /* everything is already in flight. */
+
+            slot = &slots[i];
+            slot->file = nextfile;
+            slot->done = 0;
+            slot->offset = issued[nextfile];
+            slot->len = IO_CHUNK_SIZE;
+            if (slot->len > (fsizes[nextfile] - issued[nextfile]))
+                slot->len = (size_t) (fsizes[nextfile] - issued[nextfile]);
+            issued[nextfile] += slot->len;
+
+            sqe = uring_get_sqe(r, slot);
+            assert(sqe != NULL);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fds[nextfile];
+            sqe->addr = (unsigned long long) (uintptr_t) slot->buf;
+            sqe->len = (unsigned int) slot->len;
+            sqe->off = (unsigned long long) slot->offset;
+        } /* for */
+
+        if (r->inflight == 0)
+            break;  /* all done. */
+
+        if (!uring_wait(r, &ud, &i))
+            goto read_files_uring_done;
+
+        slot = (URingSlot *) ud;
+        slot->done = 1;
+        if (i != (int) slot->len)
+        {
+            if (i < 0)
+                _fatal("Read error on [%s]: %s.", fnames[slot->file], strerror(-i));
+            else
+                _fatal("Read error on [%s]: file changed size.", fnames[slot->file]);
+            goto read_files_uring_done;
+        } /* if */
+
+        /* hand back finished chunks in file order... */
+        do
+        {
+            delivering = 0;
+            for (i = 0; i < URING_READ_SLOTS; i++)
+            {
+                slot = &slots[i];
+                if ((slot->file == -1) || (!slot->done))
+                    continue;
+                if (slot->offset != delivered[slot->file])
+                    continue;
+
+                if (!cb(data, slot->file, slot->buf, slot->len))
+                    goto read_files_uring_done;
+
+                delivered[slot->file] += slot->len;
+                slot->file = -1;
+                delivering = 1;
+            } /* for */
+        } while (delivering);
+    } /* while */
+
+    retval = 1;
+
+read_files_uring_done:
+    while (r->inflight > 0)  /* kernel still owns these buffers. Drain. */
+    {
+        void *ud;
+        int res;
+        if (!uring_wait(r, &ud, &res))
+            break;
+    } /* while */
+
+    for (i = 0; i < count; i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    } /* for */
+
+    return(retval);
+} /* read_files_uring */
+
+
+typedef struct
+{
+    URing *ring;
+    int fd;
+    int error;  /* errno of first failed write, 0 if none. */
+    off_t offset;
+    WriteBehind wb;
+    URingSlot slots[URING_WRITE_SLOTS];
+    unsigned char *bufs;
+} URingWriter;
+
+
+/* wait for one queued write to land; returns the slot it used. */
+static URingSlot *uring_writer_reap(URingWriter *w)
+{
+    URingSlot *slot;
+    void *ud;
+    int res;
+
+    if (!uring_wait(w->ring, &ud, &res))
+    {
+        w->error = EIO;
+        return(NULL);
+    } /* if */
+
+    slot = (URingSlot *) ud;
+    if (res < 0)
+    {
+        if (!w->error)
+            w->error = -res;
+    } /* if */
+
+    else if ((size_t) res < slot->len)  /* short write; finish it by hand. */
+    {
+        size_t len = slot->len - res;
+        if (pwrite(w->fd, slot->buf + res, len, slot->offset + res) != (ssize_t) len)
+        {
+            if (!w->error)
+                w->error = errno ? errno : EIO;
+        } /* if */
+    } /* else if */
+
+    slot->file = -1;
+    return(slot);
+} /* uring_writer_reap */
+
+
+static ssize_t uring_writer_write(void *cookie, const char *buf, size_t size)
+{
+    URingWriter *w = (URingWriter *) cookie;
+    size_t remain = size;
+    int i;
+
+    while (remain > 0)
+    {
+        URingSlot *slot = NULL;
+        struct io_uring_sqe *sqe;
+
+        if (w->error)
+            break;
+
+        for (i = 0; (slot == NULL) && (i < URING_WRITE_SLOTS); i++)
+        {
+            if (w->slots[i].file == -1)
+                slot = &w->slots[i];
+        } /* for */
+
+        if ((slot == NULL) && ((slot = uring_writer_reap(w)) == NULL))
+            break;
+
+        if (w->error)
+            break;
+
+        slot->file = 0;
+        slot->offset = w->offset;
+        slot->len = (remain > IO_CHUNK_SIZE) ? IO_CHUNK_SIZE : remain;
+        memcpy(slot->buf, buf, slot->len);
+
+        sqe = uring_get_sqe(w->ring, slot);
+        assert(sqe != NULL);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = w->fd;
+        sqe->addr = (unsigned long long) (uintptr_t) slot->buf;
+        sqe->len = (unsigned int) slot->len;
+        sqe->off = (unsigned long long) slot->offset;
+        if (!uring_enter(w->ring, 0))
+            w->error = EIO;
+
+        w->offset += slot->len;
+        buf += slot->len;
+        remain -= slot->len;
+    } /* while */
+
+    /* only what's surely out of the ring; the rest is still in flight. */
+    if (w->offset > (URING_WRITE_SLOTS * IO_CHUNK_SIZE))
+        write_behind(w->fd, &w->wb, w->offset - (URING_WRITE_SLOTS * IO_CHUNK_SIZE));
+
+    if (w->error)
+    {
+        errno = w->error;
+        return(-1);
+    } /* if */
+
+    return((ssize_t) size);
+} /* uring_writer_write */
+
+
+/* stdio needs this for ftello(), too, not just fseeko(). */
+static int uring_writer_seek(void *cookie, off64_t *offset, int whence)
+{
+    URingWriter *w = (URingWriter *) cookie;
+    struct stat statbuf;
+    off_t pos;
+
+    while (w->ring->inflight > 0)  /* so SEEK_END sees everything. */
+        uring_writer_reap(w);
+
+    if (whence == SEEK_SET)
+        pos = *offset;
+    else if (whence == SEEK_CUR)
+        pos = w->offset + *offset;
+    else if ((whence == SEEK_END) && (fstat(w->fd, &statbuf) != -1))
+        pos = statbuf.st_size + *offset;
+    else
+        return(-1);
+
+    if (pos < 0)
+    {
+        errno = EINVAL;
+        return(-1);
+    } /* if */
+
+    w->offset = pos;
+    *offset = pos;
+    return(0);
+} /* uring_writer_seek */
+
+
+static int uring_writer_close(void *cookie)
+{
+    URingWriter *w = (URingWriter *) cookie;
+    int retval = 0;
+
+    while (w->ring->inflight > 0)
+        uring_writer_reap(w);
+
+    if (w->error)
+        retval = -1;
+
+    if ((close(w->fd) == -1) && (retval == 0))
+    {
+        w->error = errno;
+        retval = -1;
+    } /* if */
+
+    errno = w->error;
+    w->ring->writer_active = 0;
+    free(w->bufs);
+    free(w);
+    return(retval);
+} /* uring_writer_close */
+
+
+/* takes ownership of (fd), even on failure. */
+static FILE *open_file_for_writing_uring(URing *r, int fd)
+{
+    cookie_io_functions_t funcs;
+    URingWriter *w;
+    FILE *retval;
+    int i;
+
+    w = (URingWriter *) calloc(1, sizeof (URingWriter));
+    if (w == NULL)
+    {
+        close(fd);
+        return(NULL);
+    } /* if */
+
+    w->bufs = (unsigned char *) malloc(URING_WRITE_SLOTS * IO_CHUNK_SIZE);
+    if (w->bufs == NULL)
+    {
+        close(fd);
+        free(w);
+        return(NULL);
+    } /* if */
+
+    w->fd = fd;
+    w->ring = r;
+    for (i = 0; i < URING_WRITE_SLOTS; i++)
+    {
+        w->slots[i].file = -1;
+        w->slots[i].buf = w->bufs + (i * IO_CHUNK_SIZE);
+    } /* for */
+
+    memset(&funcs, '\0', sizeof (funcs));
+    funcs.write = uring_writer_write;
+    funcs.seek = uring_writer_seek;
+    funcs.close = uring_writer_close;
+    retval = fopencookie(w, "wb", funcs);
+    if (retval == NULL)
+    {
+        close(w->fd);
+        free(w->bufs);
+        free(w);
+        return(NULL);
+    } /* if */
+
+    /* coalesce small fwrite()s into full chunks before they hit the ring. */
+    setvbuf(retval, NULL, _IOFBF, IO_CHUNK_SIZE);
+    r->writer_active = 1;
+    return(retval);
+} /* open_file_for_writing_uring */
+
+#endif  /* USE_IO_URING */
+
+
+int set_io_engine(const char *name)
+{
+    if (strcmp(name, "auto") == 0)
+        io_engine = IOENGINE_AUTO;
+    else if (strcmp(name, "stdio") == 0)
+        io_engine = IOENGINE_STDIO;
+    else if (strcmp(name, "io_uring") == 0)
+    {
+        #if USE_IO_URING
+        io_engine = IOENGINE_IO_URING;
+        #else
+        _log("Not built with io_uring support; using stdio.");
+        io_engine = IOENGINE_STDIO;
+        #endif
+    } /* else if */
+    else
+    {
+        return(0);
+    } /* else */
+
+    return(1);
+} /* set_io_engine */
+
+
+const char *get_io_engine(void)
+{
+    #if USE_IO_URING
+    if (get_uring() != NULL)
+        return("io_uring");
+    #endif
+    return("stdio");
+} /* get_io_engine */
+
+
+static int read_files_stdio(const char **fnames, int count,
+                            file_read_callback cb, void *data)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        size_t br;
+        FILE *in = fopen(fnames[i], "rb");
+        if (in == NULL)
+        {
+            _fatal("Failed to open [%s]: %s.", fnames[i], strerror(errno));
+            return(0);
+        } /* if */
+
+        while ((br = fread(io_chunk_buf, 1, sizeof (io_chunk_buf), in)) > 0)
+        {
+            if (!cb(data, i, io_chunk_buf, br))
+            {
+                fclose(in);
+                return(0);
+            } /* if */
+        } /* while */
+
+        if (ferror(in))
+        {
+            _fatal("Read error on [%s]: %s.", fnames[i], strerror(errno));
+            fclose(in);
+            return(0);
+        } /* if */
+
+        fclose(in);
+    } /* for */
+
+    return(1);
+} /* read_files_stdio */
+
+
+int read_files(const char **fnames, int count,
+               file_read_callback cb, void *data)
+{
+    #if USE_IO_URING
+    URing *r = get_uring();
+    if ((r != NULL) && (!r->writer_active) && (count <= URING_ENTRIES))
+        return(read_files_uring(r, fnames, count, cb, data));
+    #endif
+
+    return(read_files_stdio(fnames, count, cb, data));
+} /* read_files */
+
+
+#if defined(__linux__)
+
+typedef struct
+{
+    int fd;
+    off_t offset;
+    WriteBehind wb;
+} PolicyWriter;
+
+
+static ssize_t policy_writer_write(void *cookie, const char *buf, size_t size)
+{
+    PolicyWriter *w = (PolicyWriter *) cookie;
+    size_t remain = size;
+
+    while (remain > 0)
+    {
+        ssize_t bw = write(w->fd, buf, remain);
+        if (bw == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        } /* if */
+
+        w->offset += bw;
+        buf += bw;
+        remain -= bw;
+    } /* while */
+
+    write_behind(w->fd, &w->wb, w->offset);
+    return((ssize_t) size);
+} /* policy_writer_write */
+
+
+static int policy_writer_seek(void *cookie, off64_t *offset, int whence)
+{
+    PolicyWriter *w = (PolicyWriter *) cookie;
+    off_t pos = lseek(w->fd, (off_t) *offset, whence);
+    if (pos == -1)
+        return(-1);
+
+    w->offset = pos;
+    *offset = pos;
+    return(0);
+} /* policy_writer_seek */
+
+
+static int policy_writer_close(void *cookie)
+{
+    PolicyWriter *w = (PolicyWriter *) cookie;
+    int retval = close(w->fd);
+    free(w);
+    return(retval);
+} /* policy_writer_close */
+
+
+/* takes ownership of (fd), even on failure. */
+static FILE *open_file_for_writing_policy(int fd)
+{
+    cookie_io_functions_t funcs;
+    PolicyWriter *w;
+    FILE *retval;
+
+    w = (PolicyWriter *) calloc(1, sizeof (PolicyWriter));
+    if (w == NULL)
+    {
+        close(fd);
+        return(NULL);
+    } /* if */
+
+    w->fd = fd;
+    memset(&funcs, '\0', sizeof (funcs));
+    funcs.write = policy_writer_write;
+    funcs.seek = policy_writer_seek;
+    funcs.close = policy_writer_close;
+    retval = fopencookie(w, "wb", funcs);
+    if (retval == NULL)
+    {
+        close(fd);
+        free(w);
+        return(NULL);
+    } /* if */
+
+    return(retval);
+} /* open_file_for_writing_policy */
+
+#endif  /* __linux__ */
+
+
+FILE *open_file_for_writing_sized(const char *fname, unsigned long long fsize)
+{
+    FILE *retval;
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        return(NULL);
+
+    /*
+     * Reserve it all up front, so the filesystem can lay it out in one
+     *  piece. KEEP_SIZE, so a failed write doesn't leave a file that
+     *  looks complete. It's only a hint; failure is fine.
+     */
+    #if defined(__linux__)
+    if (fsize > 0)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t) fsize);
+    #endif
+
+    #if USE_IO_URING
+    {
+        URing *r = get_uring();
+        if ((r != NULL) && (!r->writer_active))
+            return(open_file_for_writing_uring(r, fd));
+    }
+    #endif
+
+    #if defined(__linux__)
+    retval = open_file_for_writing_policy(fd);
+    #else
+    retval = fdopen(fd, "wb");
+    if (retval == NULL)
+        close(fd);
+    #endif
+
+    /* big writes, on chunk boundaries, instead of BUFSIZ dribbles. */
+    if (retval != NULL)
+        setvbuf(retval, NULL, _IOFBF, IO_CHUNK_SIZE);
+
+    return(retval);
+} /* open_file_for_writing_sized */
+
+
+FILE *open_file_for_writing(const char *fname)
+{
+    return(open_file_for_writing_sized(fname, 0));
+} /* open_file_for_writing */
+
+
+void prefetch_file(const char *fname)
+{
+    #if defined(POSIX_FADV_WILLNEED)
+    int fd = open(fname, O_RDONLY);
+    if (fd != -1)
+    {
+        /* just the start; readahead keeps up once we're reading it. */
+        posix_fadvise(fd, 0, 16 * 1024 * 1024, POSIX_FADV_WILLNEED);
+        close(fd);
+    } /* if */
+    #endif
+} /* prefetch_file */
+
+
+void drop_file_cache(const char *fname)
+{
+    #if defined(POSIX_FADV_DONTNEED)
+    int fd = open(fname, O_RDONLY);
+    if (fd != -1)
+    {
+        /* dirty pages won't go, but get them on their way to the disk. */
+        #if defined(__linux__)
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        #endif
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    } /* if */
+    #endif
+} /* drop_file_cache */
+
+
+void drop_stream_cache(FILE *io)
+{
+    #if defined(POSIX_FADV_DONTNEED)
+    off_t pos = ftello(io);
+    if (pos > 0)  /* pipes fail here, or in posix_fadvise(). That's fine. */
+        posix_fadvise(fileno(io), 0, pos, POSIX_FADV_DONTNEED);
+    #endif
+} /* drop_stream_cache */
+
+
+int sync_file(FILE *io)
+{
+    if (fflush(io) != 0)
+        return(0);
+
+    #if PLATFORM_MACOSX  /* fsync() there only gets it as far as the drive. */
+    return(fcntl(fileno(io), F_FULLFSYNC) != -1);
+    #else
+    return(fsync(fileno(io)) == 0);
+    #endif
+} /* sync_file */
+
+
+int sync_path(const char *fname)
+{
+    int rc;
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1)
+        return(0);
+
+    #if PLATFORM_MACOSX
+    rc = (fcntl(fd, F_FULLFSYNC) != -1);
+    #else
+    rc = (fsync(fd) == 0);
+    #endif
+
+    close(fd);
+    return(rc);
+} /* sync_path */
+
+
+/*
+ * Copy from (in)'s file position to EOF. The kernel does it where it can:
+ *  copy_file_range() may not even touch the data (reflinks, server-side
+ *  NFS copies), and sendfile() at least skips the trip through userspace.
+ *  Each one picks up from wherever the last one left the file positions.
+ */
+static int copy_fd(int in, int out)
+{
+    char buf[64 * 1024];
+    ssize_t br;
+
+    #if defined(__linux__)
+    while ((br = copy_file_range(in, NULL, out, NULL, 1024 * 1024 * 1024, 0)) > 0)
+        /* keep going. */ ;
+    if (br == 0)
+        return(1);
+
+    while ((br = sendfile(out, in, NULL, 1024 * 1024 * 1024)) > 0)
+        /* keep going. */ ;
+    if (br == 0)
+        return(1);
+    #endif
+
+    while ((br = read(in, buf, sizeof (buf))) > 0)
+    {
+        if (write(out, buf, br) != br)
+            return(0);
+    } /* while */
+
+    return(br == 0);
+} /* copy_fd */
+
+
+int copy_file(const char *from, const char *to)
+{
+    struct stat statbuf;
+    int retval = 0;
+    int in = open(from, O_RDONLY);
+    int out = -1;
+
+    if ((in != -1) && (fstat(in, &statbuf) != -1))
+        out = open(to, O_WRONLY | O_CREAT | O_EXCL, statbuf.st_mode & 07777);
+
+    if (out != -1)
+    {
+        retval = copy_fd(in, out);
+        if (close(out) == -1)
+            retval = 0;
+        if (!retval)
+            unlink(to);
+    } /* if */
+
+    if (in != -1)
+        close(in);
+
+    return(retval);
+} /* copy_file */
+
+
+int share_file(const char *from, const char *to, int reflink)
+{
+    struct stat statbuf;
+
+    if (lstat(from, &statbuf) == -1)
+        return(0);
+
+    if (S_ISLNK(statbuf.st_mode))  /* recreate it; don't share the target. */
+    {
+        char buf[MAXPATHLEN];
+        ssize_t len = readlink(from, buf, sizeof (buf) - 1);
+        if (len == -1)
+            return(0);
+        buf[len] = '\0';
+        return(symlink(buf, to) != -1);
+    } /* if */
+
+    #if defined(FICLONE)
+    if (reflink)
+    {
+        int in = open(from, O_RDONLY);
+        int out = (in == -1) ? -1 : open(to, O_WRONLY | O_CREAT | O_EXCL,
+                                           statbuf.st_mode & 07777);
+        int rc = ((out != -1) && (ioctl(out, FICLONE, in) != -1));
+
+        if (in != -1)
+            close(in);
+        if (out != -1)
+        {
+            close(out);
+            if (rc)
+                return(1);
+            unlink(to);  /* filesystem can't; try a hardlink instead. */
+        } /* if */
+    } /* if */
+    #endif
+
+    if (link(from, to) != -1)
+        return(1);
+
+    /* another filesystem, too many links, etc. Just copy it. */
+    if ((errno == EXDEV) || (errno == EMLINK) || (errno == EPERM))
+        return(copy_file(from, to));
+
+    return(0);
+} /* share_file */
+
+
 /* enumerate contents of (base) directory. */
 file_list *make_filelist(const char *base)
 {
@@ -70,6 +1226,11 @@ file_list *make_filelist(const char *base)
     file_list *prev = NULL;
     DIR *dir;
     struct dirent *ent;
+    #if USE_IO_URING
+    URing *r = get_uring();
+    if ((r != NULL) && (r->writer_active))
+        r = NULL;  /* the writer's completions share the ring; use lstat(). */
+    #endif
 
     errno = 0;
     dir = opendir(base);
@@ -95,6 +1256,9 @@ file_list *make_filelist(const char *base)
          * !!! FIXME: This is a workaround until symlinks are really
          * !!! FIXME:  supported...just pretend they don't exist for now.  :(
          */
+        #if USE_IO_URING
+        if (r == NULL)  /* otherwise, they're batched up after the loop. */
+        #endif
         {
             char buf[MAXPATHLEN];
             snprintf(buf, sizeof (buf), "%s/%s", base, ent->d_name);
@@ -128,12 +1292,17 @@ file_list *make_filelist(const char *base)
         l->next = NULL;
     } /* while */
 
+    #if USE_IO_URING
+    if (r != NULL)
+        retval = drop_symlinks_uring(r, dir, retval);
+    #endif
+
     closedir(dir);
     return(retval);
 } /* make_filelist */
 
 
-int get_file_size(const char *fname, unsigned int *fsize)
+int get_file_size(const char *fname, unsigned long long *fsize)
 {
     struct stat statbuf;
 
@@ -146,7 +1315,7 @@ int get_file_size(const char *fname, unsigned int *fsize)
         return(0);
     } /* if */
 
-    *fsize = statbuf.st_size;
+    *fsize = (unsigned long long) statbuf.st_size;
     return(1);
 } /* get_file_size */
 
@@ -179,6 +1348,26 @@ char *get_realpath(const char *path)
 #if PLATFORM_MACOSX
 #include <ApplicationServices/ApplicationServices.h>
 
+/* don't write through a hardlink into the old tree (--outdir). */
+static int unshare_file(const char *fname)
+{
+    char tmp[MAXPATHLEN];
+    struct stat statbuf;
+
+    if (stat(fname, &statbuf) == -1)
+        return(0);
+
+    if (statbuf.st_nlink <= 1)
+        return(1);
+
+    snprintf(tmp, sizeof (tmp), "%s.mojopatch-tmp", fname);
+    unlink(tmp);
+    if (!copy_file(fname, tmp))
+        return(0);
+
+    return(rename(tmp, fname) != -1);
+} /* unshare_file */
+
 static char *parse_xml(char *ptr, char **tag, char **val)
 {
     char *ptr2;
@@ -304,14 +1493,14 @@ int get_product_version(const char *ident, char *buf, size_t bufsize)
     const char *fname = "Contents/Info.plist";  /* already chdir'd for this. */
     char *mem = NULL;
     char *ptr;
-    unsigned int fsize;
+    unsigned long long fsize;
     int retval = 0;
     FILE *io = NULL;
 
     if ( !get_file_size(fname, &fsize) ) goto parse_info_plist_bailed;
-    if ( (mem = malloc(fsize + 1)) == NULL ) goto parse_info_plist_bailed;
+    if ( (mem = malloc((size_t) fsize + 1)) == NULL ) goto parse_info_plist_bailed;
     if ( (io = fopen(fname, "r")) == NULL ) goto parse_info_plist_bailed;
-    if ( (fread(mem, fsize, 1, io)) != 1 ) goto parse_info_plist_bailed;
+    if ( (fread(mem, (size_t) fsize, 1, io)) != 1 ) goto parse_info_plist_bailed;
     fclose(io);
     io = NULL;
     mem[fsize] = '\0';
@@ -335,7 +1524,7 @@ int get_product_version(const char *ident, char *buf, size_t bufsize)
 
     /* !!! FIXME: this is kinda a lame hack. */
     if ( (io = fopen(fname, "r")) == NULL ) goto parse_info_plist_bailed;
-    if ( (fread(mem, fsize, 1, io)) != 1 ) goto parse_info_plist_bailed;
+    if ( (fread(mem, (size_t) fsize, 1, io)) != 1 ) goto parse_info_plist_bailed;
     fclose(io);
 
     ptr = find_info_plist_version(mem);
@@ -353,9 +1542,12 @@ parse_info_plist_bailed:
 
     return(retval);
 #else
-    _fatal("Not implemented!");  /* !!! FIXME */
+    /*
+     * Plain Unix has no standard place to keep an installed version, so
+     *  report a blank one. Patches built without --version still apply.
+     */
     *buf = '\0';
-    return(0);
+    return(1);
 #endif
 } /* check_product_version */
 
@@ -406,16 +1598,17 @@ int update_version(const char *ver)
     const char *fname = "Contents/Info.plist";  /* already chdir'd for this. */
     char *mem = NULL;
     char *ptr;
-    unsigned int fsize;
+    unsigned long long fsize;
     int retval = 0;
     long writestart;
     long writeend;
     FILE *io = NULL;
 
     if ( !get_file_size(fname, &fsize) ) goto update_version_bailed;
-    if ( (mem = malloc(fsize + 1)) == NULL ) goto update_version_bailed;
+    if ( !unshare_file(fname) ) goto update_version_bailed;
+    if ( (mem = malloc((size_t) fsize + 1)) == NULL ) goto update_version_bailed;
     if ( (io = fopen(fname, "r+")) == NULL ) goto update_version_bailed;
-    if ( (fread(mem, fsize, 1, io)) != 1 ) goto update_version_bailed;
+    if ( (fread(mem, (size_t) fsize, 1, io)) != 1 ) goto update_version_bailed;
     mem[fsize] = '\0';
 
     ptr = find_info_plist_version(mem);
@@ -424,7 +1617,7 @@ int update_version(const char *ver)
     writeend = writestart + strlen(ptr);
     ptr = mem + writeend;
     if ( (fseek(io, 0, SEEK_SET) == -1) ) goto update_version_bailed;
-    if ( (fread(mem, fsize, 1, io)) != 1 ) goto update_version_bailed;
+    if ( (fread(mem, (size_t) fsize, 1, io)) != 1 ) goto update_version_bailed;
     if ( (fseek(io, writestart, SEEK_SET) == -1) ) goto update_version_bailed;
     if ( (fwrite(ver, strlen(ver), 1, io)) != 1 ) goto update_version_bailed;
     if ( (fwrite(ptr, strlen(ptr), 1, io)) != 1 ) goto update_version_bailed;
@@ -454,13 +1647,24 @@ update_version_bailed:
 } /* update_version */
 
 
-int calc_tmp_filenames(char **tmp1, char **tmp2)
+int calc_tmp_filenames(const char *dir, char **tmp1, char **tmp2)
 {
     static char _tmp1[MAXPATHLEN];
     static char _tmp2[MAXPATHLEN];
     pid_t pid = getpid();
-    snprintf(_tmp1, sizeof (_tmp1), "/tmp/mojopatch.tmp1.%d", (int) pid);
-    snprintf(_tmp2, sizeof (_tmp2), "/tmp/mojopatch.tmp2.%d", (int) pid);
+    if (dir == NULL)
+    {
+        snprintf(_tmp1, sizeof (_tmp1), "/tmp/mojopatch.tmp1.%d", (int) pid);
+        snprintf(_tmp2, sizeof (_tmp2), "/tmp/mojopatch.tmp2.%d", (int) pid);
+    } /* if */
+    else if ( (snprintf(_tmp1, sizeof (_tmp1), "%s/.mojopatch.tmp1.%d", dir,
+                        (int) pid) >= (int) sizeof (_tmp1)) ||
+              (snprintf(_tmp2, sizeof (_tmp2), "%s/.mojopatch.tmp2.%d", dir,
+                        (int) pid) >= (int) sizeof (_tmp2)) )
+    {
+        return(0);
+    } /* else if */
+
     *tmp1 = _tmp1;
     *tmp2 = _tmp2;
     return(1);
@@ -468,20 +1672,9 @@ int calc_tmp_filenames(char **tmp1, char **tmp2)
 
 
 static char *basedir = NULL;
-static volatile int thread_alive = 0;
-
-static void *spawn_thread(void *arg)
-{
-    static int rc;
-    rc = system((char *) arg);
-    thread_alive = 0;
-    return(&rc);
-} /* spawn_thread */
-
 
 static SpawnResult spawn_binary(const char *cmd)
 {
-    int *ptr = NULL;
     int rc = 127;
 
 #if !USE_PTHREAD
@@ -495,9 +1688,13 @@ static SpawnResult spawn_binary(const char *cmd)
 
     else if (pid == 0)   /* child process. */
     {
-        ptr = (int *) spawn_thread((void *) cmd);
-        if (ptr) rc = *ptr;
-        exit(rc != 0);
+        rc = system(cmd);
+        /*
+         * _exit(), not exit(): exit() would flush our copies of the parent's
+         *  stdio buffers (dupe log lines) and sync its read streams, which
+         *  moves the file offset it shares with the parent's patchfile.
+         */
+        _exit(rc != 0);
     } /* else if */
 
     else
@@ -510,21 +1707,8 @@ static SpawnResult spawn_binary(const char *cmd)
         return((rc == 0) ? SPAWN_RETURNGOOD : SPAWN_RETURNBAD);
     } /* else */
 #else
-    pthread_t thr;
-
-    thread_alive = 1;
-
-    if (pthread_create(&thr, NULL, spawn_thread, cmd) != 0)
-        return(SPAWN_FAILED);
-
-    while (thread_alive)
-    {
-        ui_pump();
-        usleep(10000);
-    } /* while */
-
-    pthread_join(thr, (void **) &ptr);
-    if (ptr) rc = *ptr;
+    /* the UI has its own thread (see ui.c), so we can just block here. */
+    rc = system(cmd);
     return((rc == 0) ? SPAWN_RETURNGOOD : SPAWN_RETURNBAD);
 #endif
 } /* spawn_binary */
@@ -582,6 +1766,44 @@ char *get_current_dir(char *buf, size_t bufsize)
 } /* get_current_dir */
 
 
+double get_monotonic_time(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return(((double) ts.tv_sec) + (((double) ts.tv_nsec) / 1000000000.0));
+#endif
+    {
+        /* no monotonic clock (older Mac OS X, etc)...wall time will do. */
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return(((double) tv.tv_sec) + (((double) tv.tv_usec) / 1000000.0));
+    }
+} /* get_monotonic_time */
+
+
+int get_peak_rss(unsigned long *self_kb, unsigned long *children_kb)
+{
+    struct rusage ru;
+    unsigned long scale = 1;
+
+    #if PLATFORM_MACOSX
+    scale = 1024;  /* Darwin reports bytes, everyone else kilobytes. */
+    #endif
+
+    if (getrusage(RUSAGE_SELF, &ru) == -1)
+        return(0);
+    *self_kb = ((unsigned long) ru.ru_maxrss) / scale;
+
+    /* the largest child we've waited on, xdelta and friends included. */
+    if (getrusage(RUSAGE_CHILDREN, &ru) == -1)
+        return(0);
+    *children_kb = ((unsigned long) ru.ru_maxrss) / scale;
+
+    return(1);
+} /* get_peak_rss */
+
+
 static void find_basedir(int *argc, char **argv)
 {
     const char *argv0 = argv[0];
@@ -668,6 +1890,12 @@ int main(int argc, char **argv)
     find_basedir(&argc, argv);
     retval = mojopatch_main(argc, argv);
     free(basedir);
+
+    #if USE_IO_URING
+    if (ring_state == 1)
+        uring_teardown(&ring);
+    #endif
+
     return((retval == PATCHSUCCESS) ? 0 : 1);
 } /* unixmain */
 
@@ -106,7 +106,7 @@ file_list *make_filelist(const char *base)
 } /* make_filelist */
 
 
-int get_file_size(const char *fname, unsigned int *fsize)
+int get_file_size(const char *fname, unsigned long long *fsize)
 {
     DWORD FileSz;
     DWORD FileSzHigh;
@@ -122,9 +122,8 @@ int get_file_size(const char *fname, unsigned int *fsize)
     } /* if */
 
     FileSz = GetFileSize(hFil, &FileSzHigh);
-    assert(FileSzHigh == 0);
     CloseHandle(hFil);
-    *fsize = FileSz;
+    *fsize = (((unsigned long long) FileSzHigh) << 32) | FileSz;
     return(1);
 } /* get_file_size */
 
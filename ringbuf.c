@@ -0,0 +1,132 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+/*
+ * This is Dmitry Vyukov's bounded queue: every slot carries a sequence
+ *  number that says whose turn it is, so producers only fight over the
+ *  enqueue position with a compare-and-swap, and never over the slots.
+ *  Uses gcc's __atomic builtins; the acquire/release pairs on the sequence
+ *  numbers are what publish the item data to the other side.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringbuf.h"
+
+typedef struct
+{
+    unsigned long seq;
+    /* item data follows. */
+} RingSlot;
+
+struct RINGBUFFER
+{
+    unsigned char *slots;
+    size_t slotsize;
+    unsigned long mask;
+    size_t itemsize;
+    unsigned long enqueue_pos;
+    char pad[64];  /* keep producers and the consumer off the same line. */
+    unsigned long dequeue_pos;
+};
+
+
+static inline RingSlot *get_slot(RingBuffer *rb, unsigned long pos)
+{
+    return((RingSlot *) (rb->slots + ((pos & rb->mask) * rb->slotsize)));
+} /* get_slot */
+
+
+RingBuffer *ringbuf_create(unsigned int slots, size_t itemsize)
+{
+    RingBuffer *rb;
+    unsigned long count = 2;
+    unsigned long i;
+
+    while (count < slots)
+        count <<= 1;
+
+    rb = (RingBuffer *) malloc(sizeof (RingBuffer));
+    if (rb == NULL)
+        return(NULL);
+
+    memset(rb, '\0', sizeof (RingBuffer));
+    rb->itemsize = itemsize;
+    rb->slotsize = sizeof (RingSlot) + itemsize;
+    rb->slotsize = (rb->slotsize + 7) & ~((size_t) 7);  /* keep seq aligned. */
+    rb->mask = count - 1;
+    rb->slots = (unsigned char *) malloc(rb->slotsize * count);
+    if (rb->slots == NULL)
+    {
+        free(rb);
+        return(NULL);
+    } /* if */
+
+    for (i = 0; i < count; i++)
+        get_slot(rb, i)->seq = i;
+
+    return(rb);
+} /* ringbuf_create */
+
+
+void ringbuf_destroy(RingBuffer *rb)
+{
+    if (rb != NULL)
+    {
+        free(rb->slots);
+        free(rb);
+    } /* if */
+} /* ringbuf_destroy */
+
+
+int ringbuf_push(RingBuffer *rb, const void *item)
+{
+    unsigned long pos = __atomic_load_n(&rb->enqueue_pos, __ATOMIC_RELAXED);
+    RingSlot *slot;
+
+    while (1)
+    {
+        long diff;
+        slot = get_slot(rb, pos);
+        diff = (long) __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (long) pos;
+        if (diff == 0)  /* slot is free for this position; try to claim it. */
+        {
+            /* on failure, this reloads (pos) for us. */
+            if (__atomic_compare_exchange_n(&rb->enqueue_pos, &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } /* if */
+        else if (diff < 0)  /* consumer hasn't freed it yet: we're full. */
+            return(0);
+        else  /* someone beat us to it. */
+            pos = __atomic_load_n(&rb->enqueue_pos, __ATOMIC_RELAXED);
+    } /* while */
+
+    memcpy(slot + 1, item, rb->itemsize);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return(1);
+} /* ringbuf_push */
+
+
+int ringbuf_pop(RingBuffer *rb, void *item)
+{
+    unsigned long pos = rb->dequeue_pos;  /* only we touch this. */
+    RingSlot *slot = get_slot(rb, pos);
+    unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    if ((long) seq - (long) (pos + 1) < 0)
+        return(0);  /* empty, or a producer is still copying in. */
+
+    memcpy(item, slot + 1, rb->itemsize);
+    rb->dequeue_pos = pos + 1;
+    __atomic_store_n(&slot->seq, pos + rb->mask + 1, __ATOMIC_RELEASE);
+    return(1);
+} /* ringbuf_pop */
+
+/* end of ringbuf.c ... */
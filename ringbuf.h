@@ -0,0 +1,39 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#ifndef _INCL_RINGBUF_H_
+#define _INCL_RINGBUF_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A bounded, lock-free queue of fixed-size items. Any number of threads
+ *  can push, one thread pops. Nothing here ever blocks: push fails when
+ *  the queue is full and pop fails when it's empty, and the caller decides
+ *  whether to spin, sleep or drop the item.
+ */
+
+typedef struct RINGBUFFER RingBuffer;
+
+/* (slots) is rounded up to a power of two. NULL if out of memory. */
+RingBuffer *ringbuf_create(unsigned int slots, size_t itemsize);
+void ringbuf_destroy(RingBuffer *rb);
+int ringbuf_push(RingBuffer *rb, const void *item);  /* 0 if full. */
+int ringbuf_pop(RingBuffer *rb, void *item);  /* 0 if empty. */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* include-once blocker. */
+
+/* end of ringbuf.h ... */
@@ -0,0 +1,334 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "platform.h"
+#include "json.h"
+#include "stats.h"
+#include "trace.h"
+
+#define STATS_MAX_OPS 16
+
+typedef struct
+{
+    unsigned int calls;
+    double seconds;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+} PhaseStats;
+
+typedef struct
+{
+    const char *name;  /* static strings only. */
+    unsigned int count;
+    double seconds;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long archive_bytes;
+} OpStats;
+
+typedef struct
+{
+    const char *opname;
+    char *fname;
+    double seconds;
+    unsigned long long archive_bytes;
+} SlowFile;
+
+static const char *phase_names[STATS_PHASE_TOTAL] =
+{
+    "walk", "md5", "xdelta", "compress", "uncompress", "copy"
+};
+
+static char *stats_fname = NULL;
+static FILE *stats_io = NULL;
+static const char *stats_command = NULL;
+static double stats_epoch = 0.0;
+static PhaseStats phases[STATS_PHASE_TOTAL];
+static OpStats ops[STATS_MAX_OPS];
+static int opcount = 0;
+
+/* slowest files, sorted slowest first. */
+static SlowFile slowest[STATS_TOP_FILES];
+static int slowcount = 0;
+
+/* the op that's running right now, if any. */
+static int op_open = 0;  /* even when only tracing. */
+static OpStats *cur_op = NULL;
+static char *cur_fname = NULL;
+static double cur_start = 0.0;
+static off_t cur_archivepos = -1;
+static FILE *cur_archive = NULL;
+static unsigned long long cur_bytes_in = 0;
+static unsigned long long cur_bytes_out = 0;
+
+
+int stats_init(const char *fname, const char *command)
+{
+    if (fname == NULL)
+        return(1);
+
+    stats_io = fopen(fname, "w");
+    if (stats_io == NULL)
+    {
+        _fatal("Couldn't open [%s] for writing stats.", fname);
+        return(0);
+    } /* if */
+
+    stats_fname = (char *) malloc(strlen(fname) + 1);
+    if (stats_fname == NULL)
+    {
+        fclose(stats_io);
+        stats_io = NULL;
+        _fatal("Out of memory.");
+        return(0);
+    } /* if */
+
+    strcpy(stats_fname, fname);
+    stats_command = command;
+    stats_epoch = get_monotonic_time();
+    return(1);
+} /* stats_init */
+
+
+int stats_enabled(void)
+{
+    return(stats_fname != NULL);
+} /* stats_enabled */
+
+
+double stats_start(StatsPhase phase)
+{
+    trace_begin(phase_names[phase], "phase", NULL);
+    return((stats_fname == NULL) ? 0.0 : get_monotonic_time());
+} /* stats_start */
+
+
+void stats_phase(StatsPhase phase, double start,
+                 unsigned long long bytes_in, unsigned long long bytes_out)
+{
+    PhaseStats *ps;
+
+    trace_end();
+    if (stats_fname == NULL)
+        return;
+
+    ps = &phases[phase];
+    ps->calls++;
+    ps->seconds += get_monotonic_time() - start;
+    ps->bytes_in += bytes_in;
+    ps->bytes_out += bytes_out;
+
+    if (cur_op != NULL)
+    {
+        cur_bytes_in += bytes_in;
+        cur_bytes_out += bytes_out;
+    } /* if */
+} /* stats_phase */
+
+
+static OpStats *find_op(const char *opname)
+{
+    int i;
+    for (i = 0; i < opcount; i++)
+    {
+        if (strcmp(ops[i].name, opname) == 0)
+            return(&ops[i]);
+    } /* for */
+
+    if (opcount >= STATS_MAX_OPS)
+        return(NULL);
+
+    ops[opcount].name = opname;
+    return(&ops[opcount++]);
+} /* find_op */
+
+
+void stats_op_begin(const char *opname, const char *fname, FILE *archive)
+{
+    if (op_open)  /* shouldn't happen, but don't lose it. */
+        stats_op_end(1);
+
+    op_open = 1;
+    trace_begin(opname, "op", fname);
+    if (stats_fname == NULL)
+        return;
+
+    cur_op = find_op(opname);
+    if (cur_op == NULL)
+        return;
+
+    cur_fname = (char *) malloc(strlen(fname) + 1);
+    if (cur_fname != NULL)
+        strcpy(cur_fname, fname);
+
+    cur_archive = archive;
+    cur_archivepos = (archive == NULL) ? -1 : ftello(archive);
+    cur_bytes_in = cur_bytes_out = 0;
+    cur_start = get_monotonic_time();
+} /* stats_op_begin */
+
+
+static void note_slow_file(const char *opname, char *fname, double seconds,
+                           unsigned long long archive_bytes)
+{
+    int i;
+
+    if ((slowcount == STATS_TOP_FILES) &&
+        (seconds <= slowest[STATS_TOP_FILES - 1].seconds))
+    {
+        free(fname);
+        return;
+    } /* if */
+
+    if (slowcount == STATS_TOP_FILES)
+        free(slowest[--slowcount].fname);
+
+    for (i = slowcount; (i > 0) && (slowest[i - 1].seconds < seconds); i--)
+        slowest[i] = slowest[i - 1];
+
+    slowest[i].opname = opname;
+    slowest[i].fname = fname;
+    slowest[i].seconds = seconds;
+    slowest[i].archive_bytes = archive_bytes;
+    slowcount++;
+} /* note_slow_file */
+
+
+int stats_op_end(int rc)
+{
+    double seconds;
+    unsigned long long archive_bytes = 0;
+
+    if (!op_open)
+        return(rc);
+
+    op_open = 0;
+    trace_end();
+    if (cur_op == NULL)
+        return(rc);
+
+    seconds = get_monotonic_time() - cur_start;
+    if (cur_archivepos >= 0)
+    {
+        off_t pos = ftello(cur_archive);
+        if (pos > cur_archivepos)
+            archive_bytes = (unsigned long long) (pos - cur_archivepos);
+    } /* if */
+
+    cur_op->count++;
+    cur_op->seconds += seconds;
+    cur_op->bytes_in += cur_bytes_in;
+    cur_op->bytes_out += cur_bytes_out;
+    cur_op->archive_bytes += archive_bytes;
+
+    if (cur_fname != NULL)
+        note_slow_file(cur_op->name, cur_fname, seconds, archive_bytes);
+
+    cur_op = NULL;
+    cur_fname = NULL;
+    cur_archive = NULL;
+    return(rc);
+} /* stats_op_end */
+
+
+static double ratio(unsigned long long num, unsigned long long denom)
+{
+    return((denom == 0) ? 0.0 : ((double) num) / ((double) denom));
+} /* ratio */
+
+
+int stats_write(void)
+{
+    unsigned long self_kb = 0;
+    unsigned long children_kb = 0;
+    FILE *io = stats_io;
+    int i;
+
+    if (stats_fname == NULL)
+        return(1);
+
+    stats_op_end(1);  /* in case we bailed out mid-op. */
+    get_peak_rss(&self_kb, &children_kb);
+
+    fprintf(io, "{\n  \"command\": ");
+    json_string(io, (stats_command != NULL) ? stats_command : "");
+    fprintf(io, ",\n  \"wall_seconds\": %.6f,\n",
+            get_monotonic_time() - stats_epoch);
+    fprintf(io, "  \"peak_rss_kb\": { \"self\": %lu, \"children\": %lu },\n",
+            self_kb, children_kb);
+
+    fprintf(io, "  \"phases\": {\n");
+    for (i = 0; i < STATS_PHASE_TOTAL; i++)
+    {
+        PhaseStats *ps = &phases[i];
+        fprintf(io, "    \"%s\": { \"calls\": %u, \"seconds\": %.6f, "
+                    "\"bytes_in\": %llu, \"bytes_out\": %llu",
+                    phase_names[i], ps->calls, ps->seconds,
+                    ps->bytes_in, ps->bytes_out);
+
+        /* compression ratio is always packed/raw, whichever way we went. */
+        if (i == STATS_PHASE_COMPRESS)
+            fprintf(io, ", \"ratio\": %.4f", ratio(ps->bytes_out, ps->bytes_in));
+        else if (i == STATS_PHASE_UNCOMPRESS)
+            fprintf(io, ", \"ratio\": %.4f", ratio(ps->bytes_in, ps->bytes_out));
+
+        fprintf(io, " }%s\n", (i < STATS_PHASE_TOTAL - 1) ? "," : "");
+    } /* for */
+    fprintf(io, "  },\n");
+
+    fprintf(io, "  \"ops\": {\n");
+    for (i = 0; i < opcount; i++)
+    {
+        OpStats *os = &ops[i];
+        fprintf(io, "    ");
+        json_string(io, os->name);
+        fprintf(io, ": { \"count\": %u, \"seconds\": %.6f, \"bytes_in\": %llu, "
+                    "\"bytes_out\": %llu, \"archive_bytes\": %llu }%s\n",
+                    os->count, os->seconds, os->bytes_in, os->bytes_out,
+                    os->archive_bytes, (i < opcount - 1) ? "," : "");
+    } /* for */
+    fprintf(io, "  },\n");
+
+    fprintf(io, "  \"slowest\": [\n");
+    for (i = 0; i < slowcount; i++)
+    {
+        fprintf(io, "    { \"op\": ");
+        json_string(io, slowest[i].opname);
+        fprintf(io, ", \"file\": ");
+        json_string(io, slowest[i].fname);
+        fprintf(io, ", \"seconds\": %.6f, \"archive_bytes\": %llu }%s\n",
+                slowest[i].seconds, slowest[i].archive_bytes,
+                (i < slowcount - 1) ? "," : "");
+    } /* for */
+    fprintf(io, "  ]\n}\n");
+
+    for (i = 0; i < slowcount; i++)
+        free(slowest[i].fname);
+    slowcount = 0;
+    stats_io = NULL;
+
+    if (fclose(io) == EOF)
+    {
+        _fatal("Couldn't write stats to [%s].", stats_fname);
+        free(stats_fname);
+        stats_fname = NULL;
+        return(0);
+    } /* if */
+
+    _dlog("Wrote stats to [%s].", stats_fname);
+    free(stats_fname);
+    stats_fname = NULL;
+    return(1);
+} /* stats_write */
+
+/* end of stats.c ... */
@@ -0,0 +1,65 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#ifndef _INCL_STATS_H_
+#define _INCL_STATS_H_
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Cost accounting for --stats. Everything here is a no-op until
+ *  stats_init() gets a filename, so it's safe to leave the calls in
+ *  hot paths. Phases and ops are also handed to trace.h, so these are the
+ *  only hooks the rest of the code needs for --trace, too.
+ */
+
+typedef enum
+{
+    STATS_PHASE_WALK = 0,   /* directory listing. */
+    STATS_PHASE_MD5,        /* md5summing. */
+    STATS_PHASE_XDELTA,     /* waiting on the xdelta binary. */
+    STATS_PHASE_COMPRESS,   /* zlib compression (bytes in == raw). */
+    STATS_PHASE_UNCOMPRESS, /* zlib decompression (bytes out == raw). */
+    STATS_PHASE_COPY,       /* uncompressed copies between files. */
+    STATS_PHASE_TOTAL  /* must be last! */
+} StatsPhase;
+
+#define STATS_TOP_FILES 20
+
+int stats_init(const char *fname, const char *command);
+int stats_enabled(void);
+
+/*
+ * Returns a timestamp to hand to stats_phase(), or 0.0 when disabled.
+ *  Every stats_start() needs a matching stats_phase().
+ */
+double stats_start(StatsPhase phase);
+void stats_phase(StatsPhase phase, double start,
+                 unsigned long long bytes_in, unsigned long long bytes_out);
+
+/*
+ * An op is one patchfile operation (ADD, PATCH...) on one file. Phases that
+ *  run while an op is open get charged to it, too. (archive) is the
+ *  patchfile, so we can see how many bytes of it the op used.
+ */
+void stats_op_begin(const char *opname, const char *fname, FILE *archive);
+int stats_op_end(int rc);  /* returns (rc), so you can "return(stats_op_end(x));" */
+
+int stats_write(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* include-once blocker. */
+
+/* end of stats.h ... */
@@ -0,0 +1,297 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if USE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "platform.h"
+#include "json.h"
+#include "trace.h"
+
+#define TRACE_BUFFER_EVENTS 4096
+
+typedef struct
+{
+    const char *name;  /* NULL for end events. */
+    const char *category;
+    char *arg;
+    double ts;
+} TraceEvent;
+
+typedef struct TRACE_BUFFER
+{
+    unsigned int tid;
+    const char *thread_name;
+    int count;
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+    struct TRACE_BUFFER *next;
+} TraceBuffer;
+
+static FILE *trace_io = NULL;
+static char *trace_fname = NULL;
+static const char *trace_command = NULL;
+static double trace_epoch = 0.0;
+static int trace_wrote_event = 0;
+static unsigned int trace_nexttid = 1;
+static TraceBuffer *trace_buffers = NULL;  /* every thread's, for the flush. */
+
+#if USE_PTHREAD
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define TRACE_LOCK() pthread_mutex_lock(&trace_mutex)
+#define TRACE_UNLOCK() pthread_mutex_unlock(&trace_mutex)
+#else
+static TraceBuffer *trace_buffer = NULL;
+#define TRACE_LOCK()
+#define TRACE_UNLOCK()
+#endif
+
+
+int trace_init(const char *fname, const char *command)
+{
+    if (fname == NULL)
+        return(1);
+
+    trace_io = fopen(fname, "w");
+    if (trace_io == NULL)
+    {
+        _fatal("Couldn't open [%s] for writing trace.", fname);
+        return(0);
+    } /* if */
+
+    trace_fname = (char *) malloc(strlen(fname) + 1);
+    if (trace_fname == NULL)
+    {
+        fclose(trace_io);
+        trace_io = NULL;
+        _fatal("Out of memory.");
+        return(0);
+    } /* if */
+
+    #if USE_PTHREAD
+    if (pthread_key_create(&trace_key, NULL) != 0)
+    {
+        fclose(trace_io);
+        trace_io = NULL;
+        free(trace_fname);
+        trace_fname = NULL;
+        _fatal("Couldn't set up per-thread trace buffers.");
+        return(0);
+    } /* if */
+    #endif
+
+    strcpy(trace_fname, fname);
+    trace_command = command;
+    trace_epoch = get_monotonic_time();
+    fputs("[\n", trace_io);
+    trace_thread_name("main");
+    return(1);
+} /* trace_init */
+
+
+int trace_enabled(void)
+{
+    return(trace_io != NULL);
+} /* trace_enabled */
+
+
+/* starts a record in the output; call with the lock held. */
+static void new_record(void)
+{
+    if (trace_wrote_event)
+        fputs(",\n", trace_io);
+    trace_wrote_event = 1;
+} /* new_record */
+
+
+/* call with the lock held. */
+static void flush_buffer(TraceBuffer *buf)
+{
+    int i;
+    for (i = 0; i < buf->count; i++)
+    {
+        TraceEvent *ev = &buf->events[i];
+        new_record();
+        fprintf(trace_io, "{\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+                (ev->name != NULL) ? 'B' : 'E', buf->tid, ev->ts);
+
+        if (ev->name != NULL)
+        {
+            fputs(",\"name\":", trace_io);
+            json_string(trace_io, ev->name);
+            fputs(",\"cat\":", trace_io);
+            json_string(trace_io, ev->category);
+            if (ev->arg != NULL)
+            {
+                fputs(",\"args\":{\"file\":", trace_io);
+                json_string(trace_io, ev->arg);
+                fputc('}', trace_io);
+                free(ev->arg);
+            } /* if */
+        } /* if */
+
+        fputc('}', trace_io);
+    } /* for */
+
+    buf->count = 0;
+} /* flush_buffer */
+
+
+static TraceBuffer *get_buffer(void)
+{
+    TraceBuffer *buf;
+
+    #if USE_PTHREAD
+    buf = (TraceBuffer *) pthread_getspecific(trace_key);
+    #else
+    buf = trace_buffer;
+    #endif
+
+    if (buf != NULL)
+        return(buf);
+
+    buf = (TraceBuffer *) malloc(sizeof (TraceBuffer));
+    if (buf == NULL)
+        return(NULL);
+
+    buf->count = 0;
+    buf->thread_name = NULL;
+
+    TRACE_LOCK();
+    buf->tid = trace_nexttid++;
+    buf->next = trace_buffers;
+    trace_buffers = buf;
+    TRACE_UNLOCK();
+
+    #if USE_PTHREAD
+    pthread_setspecific(trace_key, buf);
+    #else
+    trace_buffer = buf;
+    #endif
+
+    return(buf);
+} /* get_buffer */
+
+
+static void add_event(const char *name, const char *category, const char *arg)
+{
+    TraceBuffer *buf = get_buffer();
+    TraceEvent *ev;
+
+    if (buf == NULL)
+        return;
+
+    if (buf->count == TRACE_BUFFER_EVENTS)
+    {
+        TRACE_LOCK();
+        flush_buffer(buf);
+        TRACE_UNLOCK();
+    } /* if */
+
+    ev = &buf->events[buf->count++];
+    ev->name = name;
+    ev->category = category;
+    ev->arg = NULL;
+    if (arg != NULL)
+    {
+        ev->arg = (char *) malloc(strlen(arg) + 1);
+        if (ev->arg != NULL)
+            strcpy(ev->arg, arg);
+    } /* if */
+
+    /* timestamp last, so the bookkeeping above isn't charged to the event. */
+    ev->ts = (get_monotonic_time() - trace_epoch) * 1000000.0;
+} /* add_event */
+
+
+void trace_begin(const char *name, const char *category, const char *arg)
+{
+    if (trace_io != NULL)
+        add_event(name, category, arg);
+} /* trace_begin */
+
+
+void trace_end(void)
+{
+    if (trace_io != NULL)
+        add_event(NULL, NULL, NULL);
+} /* trace_end */
+
+
+void trace_thread_name(const char *name)
+{
+    TraceBuffer *buf;
+    if (trace_io == NULL)
+        return;
+
+    buf = get_buffer();
+    if (buf != NULL)
+        buf->thread_name = name;
+} /* trace_thread_name */
+
+
+int trace_close(void)
+{
+    TraceBuffer *buf;
+    TraceBuffer *next;
+    int retval = 1;
+
+    if (trace_io == NULL)
+        return(1);
+
+    TRACE_LOCK();
+    for (buf = trace_buffers; buf != NULL; buf = next)
+    {
+        next = buf->next;
+        flush_buffer(buf);
+        if (buf->thread_name != NULL)
+        {
+            new_record();
+            fprintf(trace_io, "{\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                    "\"name\":\"thread_name\",\"args\":{\"name\":", buf->tid);
+            json_string(trace_io, buf->thread_name);
+            fputs("}}", trace_io);
+        } /* if */
+        free(buf);
+    } /* for */
+    trace_buffers = NULL;
+    TRACE_UNLOCK();
+
+    new_record();
+    fprintf(trace_io, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\","
+                      "\"args\":{\"name\":\"mojopatch %s\"}}\n]\n",
+                      (trace_command != NULL) ? trace_command : "");
+
+    #if USE_PTHREAD
+    pthread_key_delete(trace_key);
+    #else
+    trace_buffer = NULL;
+    #endif
+
+    if (fclose(trace_io) == EOF)
+    {
+        _fatal("Couldn't write trace to [%s].", trace_fname);
+        retval = 0;
+    } /* if */
+    else
+    {
+        _dlog("Wrote trace to [%s].", trace_fname);
+    } /* else */
+
+    trace_io = NULL;
+    free(trace_fname);
+    trace_fname = NULL;
+    return(retval);
+} /* trace_close */
+
+/* end of trace.c ... */
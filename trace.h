@@ -0,0 +1,48 @@
+/**
+ * MojoPatch; a tool for updating data in the field.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+#ifndef _INCL_TRACE_H_
+#define _INCL_TRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Timeline output for --trace, in Chrome's trace event format, so you can
+ *  load it in Perfetto or chrome://tracing. Events go into a buffer per
+ *  thread and only hit the disk when a buffer fills up or at trace_close(),
+ *  so leaving tracing on doesn't change the run much.
+ *
+ * Like stats.h, these are all no-ops until trace_init() gets a filename.
+ */
+
+int trace_init(const char *fname, const char *command);
+int trace_enabled(void);
+
+/*
+ * (name) and (category) must be static strings; we keep the pointers.
+ *  (arg) is optional (NULL is fine) and gets copied, so it can be a
+ *  filename or whatever. Every trace_begin() needs a trace_end() on the
+ *  same thread.
+ */
+void trace_begin(const char *name, const char *category, const char *arg);
+void trace_end(void);
+
+/* name the calling thread in the timeline. (name) must be static. */
+void trace_thread_name(const char *name);
+
+int trace_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* include-once blocker. */
+
+/* end of trace.h ... */
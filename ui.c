@@ -13,6 +13,11 @@
 #include "platform.h"
 #include "ui.h"
 
+#if USE_PTHREAD
+#include <pthread.h>
+#include "ringbuf.h"
+#endif
+
 /* stubs for when a driver isn't selected. */
 static void null_ui(void) { assert(0 && "UI call without UI driver!"); }
 static void ui_pump_null(void) { null_ui(); }
@@ -39,41 +44,437 @@ typedef struct
 {
     const char *driver_name;
     int (*initfunc)(void);
+    int threadsafe;  /* may it run on a thread other than main()'s? */
 } UIDrivers;
 
 static UIDrivers ui_drivers[] =
 {
-    { "carbon", ui_init_carbon },
-    { "stdio", ui_init_stdio },  /* should probably always be last. */
-    { NULL, NULL }
+    { "carbon", ui_init_carbon, 0 },  /* Carbon wants the main thread. */
+    { "stdio", ui_init_stdio, 1 },  /* should probably always be last. */
+    { NULL, NULL, 0 }
 };
 
-int ui_init(const char *request_driver)
+/*
+ * (threaded) is -1 to consider every driver, 0 for only the ones that
+ *  must stay on the main thread, and 1 for only the thread-safe ones.
+ */
+static int select_driver(const char *request_driver, int threaded)
 {
     int i;
 
-    if (ui_selected)
-        return(1);
-
-    /* make sure we're in a sane state... */
-    UI_SET_FUNC_POINTERS(null);
-
     if (request_driver != NULL)
     {
         for (i = 0; ui_drivers[i].initfunc != NULL; i++)
         {
             if (strcmp(ui_drivers[i].driver_name, request_driver) == 0)
             {
-                ui_selected = ui_drivers[i].initfunc();
+                if ((threaded == 0) && (ui_drivers[i].threadsafe))
+                    return(0);  /* leave it to the UI thread. */
+                if ((threaded < 0) || (ui_drivers[i].threadsafe == threaded))
+                    ui_selected = ui_drivers[i].initfunc();
                 break;
             } /* if */
         } /* for */
     } /* if */
 
     for (i = 0; (!ui_selected) && (ui_drivers[i].initfunc != NULL); i++)
-        ui_selected = ui_drivers[i].initfunc();
+    {
+        if ((threaded < 0) || (ui_drivers[i].threadsafe == threaded))
+            ui_selected = ui_drivers[i].initfunc();
+    } /* for */
 
     return(ui_selected);
+} /* select_driver */
+
+
+#if USE_PTHREAD
+/*
+ * With threads, a thread-safe driver gets a thread of its own, so the UI
+ *  and the I/O don't slow each other down. Drivers that have to stay on
+ *  the main thread (Carbon) are set up directly and run unthreaded. The ui_* function pointers the app
+ *  sees just queue events for that thread: log lines and status updates
+ *  go in a lock-free queue and return right away, progress is coalesced
+ *  to the latest value, and anything that needs an answer (or a click)
+ *  waits for the UI thread to handle it. The UI thread pumps the driver
+ *  itself, so ui_pump() is a no-op for everyone else.
+ */
+
+#define UI_QUEUE_SLOTS 256
+#define UI_IDLE_USECS 10000
+#define UI_NO_PROGRESS -2  /* (pending_progress has nothing new.) */
+
+typedef enum
+{
+    UIEVENT_LOG,
+    UIEVENT_STATUS,
+    UIEVENT_TITLE,
+    UIEVENT_REQUEST
+} UIEventType;
+
+typedef enum
+{
+    UIREQUEST_FATAL,
+    UIREQUEST_SUCCESS,
+    UIREQUEST_MSGBOX,
+    UIREQUEST_PROMPT_YN,
+    UIREQUEST_PROMPT_NY,
+    UIREQUEST_FILE_PICKER,
+    UIREQUEST_SHOW_README,
+    UIREQUEST_DEINIT
+} UIRequestType;
+
+typedef struct
+{
+    UIRequestType type;
+    const char *str;
+    const char *str2;
+    char *buf;
+    size_t bufsize;
+    int retval;
+    int done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} UIRequest;
+
+typedef struct
+{
+    UIEventType type;
+    int debugging;
+    UIRequest *request;
+    char str[512];
+} UIEvent;
+
+static RingBuffer *ui_queue = NULL;
+static pthread_t ui_thread;
+static int ui_thread_quit = 0;  /* only the UI thread touches this. */
+static int pending_progress = UI_NO_PROGRESS;  /* use atomics on this. */
+static pthread_mutex_t ui_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ui_init_cond = PTHREAD_COND_INITIALIZER;
+static int ui_init_done = 0;
+
+/* the real driver's entry points; only the UI thread calls these. */
+static void (*drv_real_deinit)(void) = NULL;
+static void (*drv_pump)(void) = NULL;
+static void (*drv_add_to_log)(const char *str, int debugging) = NULL;
+static void (*drv_fatal)(const char *str) = NULL;
+static void (*drv_success)(const char *str) = NULL;
+static void (*drv_msgbox)(const char *str) = NULL;
+static void (*drv_total_progress)(int percent) = NULL;
+static void (*drv_status)(const char *str) = NULL;
+static void (*drv_title)(const char *str) = NULL;
+static int (*drv_prompt_yn)(const char *question) = NULL;
+static int (*drv_prompt_ny)(const char *question) = NULL;
+static int (*drv_file_picker)(char *buf, size_t bufsize) = NULL;
+static int (*drv_show_readme)(const char *fname, const char *text) = NULL;
+
+
+static void save_driver(void)
+{
+    drv_real_deinit = ui_real_deinit;
+    drv_pump = ui_pump;
+    drv_add_to_log = ui_add_to_log;
+    drv_fatal = ui_fatal;
+    drv_success = ui_success;
+    drv_msgbox = ui_msgbox;
+    drv_total_progress = ui_total_progress;
+    drv_status = ui_status;
+    drv_title = ui_title;
+    drv_prompt_yn = ui_prompt_yn;
+    drv_prompt_ny = ui_prompt_ny;
+    drv_file_picker = ui_file_picker;
+    drv_show_readme = ui_show_readme;
+} /* save_driver */
+
+
+/* drivers call back into _log() and friends; those can't queue and wait. */
+static inline int on_ui_thread(void)
+{
+    return(pthread_equal(pthread_self(), ui_thread));
+} /* on_ui_thread */
+
+
+static void apply_pending_progress(void)
+{
+    int percent = __atomic_exchange_n(&pending_progress, UI_NO_PROGRESS,
+                                      __ATOMIC_ACQ_REL);
+    if (percent != UI_NO_PROGRESS)
+        drv_total_progress(percent);
+} /* apply_pending_progress */
+
+
+static void run_request(UIRequest *req)
+{
+    apply_pending_progress();  /* so the bar is current behind a dialog. */
+
+    switch (req->type)
+    {
+        case UIREQUEST_FATAL: drv_fatal(req->str); break;
+        case UIREQUEST_SUCCESS: drv_success(req->str); break;
+        case UIREQUEST_MSGBOX: drv_msgbox(req->str); break;
+        case UIREQUEST_PROMPT_YN: req->retval = drv_prompt_yn(req->str); break;
+        case UIREQUEST_PROMPT_NY: req->retval = drv_prompt_ny(req->str); break;
+        case UIREQUEST_FILE_PICKER:
+            req->retval = drv_file_picker(req->buf, req->bufsize);
+            break;
+        case UIREQUEST_SHOW_README:
+            req->retval = drv_show_readme(req->str, req->str2);
+            break;
+        case UIREQUEST_DEINIT:
+            drv_real_deinit();
+            ui_thread_quit = 1;
+            break;
+    } /* switch */
+
+    pthread_mutex_lock(&req->mutex);
+    req->done = 1;
+    pthread_cond_signal(&req->cond);
+    pthread_mutex_unlock(&req->mutex);
+} /* run_request */
+
+
+static int drain_queue(void)
+{
+    UIEvent ev;
+    int count = 0;
+
+    apply_pending_progress();
+
+    while (ringbuf_pop(ui_queue, &ev))
+    {
+        count++;
+        switch (ev.type)
+        {
+            case UIEVENT_LOG: drv_add_to_log(ev.str, ev.debugging); break;
+            case UIEVENT_STATUS: drv_status(ev.str); break;
+            case UIEVENT_TITLE: drv_title(ev.str); break;
+            case UIEVENT_REQUEST: run_request(ev.request); break;
+        } /* switch */
+    } /* while */
+
+    return(count);
+} /* drain_queue */
+
+
+static void *ui_thread_main(void *arg)
+{
+    int selected = select_driver((const char *) arg, 1);
+    if (selected)
+        save_driver();
+
+    pthread_mutex_lock(&ui_init_mutex);
+    ui_init_done = 1;
+    pthread_cond_signal(&ui_init_cond);
+    pthread_mutex_unlock(&ui_init_mutex);
+
+    if (!selected)
+        return(NULL);
+
+    while (!ui_thread_quit)
+    {
+        int busy = drain_queue();
+        drv_pump();
+        if (!busy)
+            usleep(UI_IDLE_USECS);
+    } /* while */
+
+    return(NULL);
+} /* ui_thread_main */
+
+
+static void post_event(UIEventType type, const char *str, int debugging,
+                       UIRequest *request)
+{
+    UIEvent ev;
+    ev.type = type;
+    ev.debugging = debugging;
+    ev.request = request;
+    ev.str[0] = '\0';
+    if (str != NULL)
+    {
+        strncpy(ev.str, str, sizeof (ev.str));
+        ev.str[sizeof (ev.str) - 1] = '\0';
+    } /* if */
+
+    /* full? The UI thread is behind; give it a moment. Never drop lines. */
+    while (!ringbuf_push(ui_queue, &ev))
+        usleep(1000);
+} /* post_event */
+
+
+static int do_request(UIRequestType type, const char *str, const char *str2,
+                      char *buf, size_t bufsize)
+{
+    UIRequest req;
+    memset(&req, '\0', sizeof (req));
+    req.type = type;
+    req.str = str;
+    req.str2 = str2;
+    req.buf = buf;
+    req.bufsize = bufsize;
+    pthread_mutex_init(&req.mutex, NULL);
+    pthread_cond_init(&req.cond, NULL);
+
+    if (on_ui_thread())
+        run_request(&req);
+    else
+    {
+        post_event(UIEVENT_REQUEST, NULL, 0, &req);
+        pthread_mutex_lock(&req.mutex);
+        while (!req.done)
+            pthread_cond_wait(&req.cond, &req.mutex);
+        pthread_mutex_unlock(&req.mutex);
+    } /* else */
+
+    pthread_mutex_destroy(&req.mutex);
+    pthread_cond_destroy(&req.cond);
+    return(req.retval);
+} /* do_request */
+
+
+static void ui_pump_threaded(void)
+{
+    /* no-op: the UI thread pumps. */
+} /* ui_pump_threaded */
+
+
+static void ui_add_to_log_threaded(const char *str, int debugging)
+{
+    if (on_ui_thread())
+        drv_add_to_log(str, debugging);
+    else
+        post_event(UIEVENT_LOG, str, debugging, NULL);
+} /* ui_add_to_log_threaded */
+
+
+static void ui_status_threaded(const char *str)
+{
+    if (on_ui_thread())
+        drv_status(str);
+    else
+        post_event(UIEVENT_STATUS, str, 0, NULL);
+} /* ui_status_threaded */
+
+
+static void ui_title_threaded(const char *str)
+{
+    if (on_ui_thread())
+        drv_title(str);
+    else
+        post_event(UIEVENT_TITLE, str, 0, NULL);
+} /* ui_title_threaded */
+
+
+static void ui_total_progress_threaded(int percent)
+{
+    if (on_ui_thread())
+        drv_total_progress(percent);
+    else  /* only the latest value matters. */
+        __atomic_store_n(&pending_progress, percent, __ATOMIC_RELEASE);
+} /* ui_total_progress_threaded */
+
+
+static void ui_fatal_threaded(const char *str)
+{
+    do_request(UIREQUEST_FATAL, str, NULL, NULL, 0);
+} /* ui_fatal_threaded */
+
+
+static void ui_success_threaded(const char *str)
+{
+    do_request(UIREQUEST_SUCCESS, str, NULL, NULL, 0);
+} /* ui_success_threaded */
+
+
+static void ui_msgbox_threaded(const char *str)
+{
+    do_request(UIREQUEST_MSGBOX, str, NULL, NULL, 0);
+} /* ui_msgbox_threaded */
+
+
+static int ui_prompt_yn_threaded(const char *question)
+{
+    return(do_request(UIREQUEST_PROMPT_YN, question, NULL, NULL, 0));
+} /* ui_prompt_yn_threaded */
+
+
+static int ui_prompt_ny_threaded(const char *question)
+{
+    return(do_request(UIREQUEST_PROMPT_NY, question, NULL, NULL, 0));
+} /* ui_prompt_ny_threaded */
+
+
+static int ui_file_picker_threaded(char *buf, size_t bufsize)
+{
+    return(do_request(UIREQUEST_FILE_PICKER, NULL, NULL, buf, bufsize));
+} /* ui_file_picker_threaded */
+
+
+static int ui_show_readme_threaded(const char *fname, const char *text)
+{
+    return(do_request(UIREQUEST_SHOW_README, fname, text, NULL, 0));
+} /* ui_show_readme_threaded */
+
+
+static void ui_real_deinit_threaded(void)
+{
+    /* the UI thread runs the driver's deinit, then quits. */
+    do_request(UIREQUEST_DEINIT, NULL, NULL, NULL, 0);
+    pthread_join(ui_thread, NULL);
+    ringbuf_destroy(ui_queue);
+    ui_queue = NULL;
+    ui_thread_quit = 0;
+} /* ui_real_deinit_threaded */
+
+
+static int start_ui_thread(const char *request_driver)
+{
+    ui_queue = ringbuf_create(UI_QUEUE_SLOTS, sizeof (UIEvent));
+    if (ui_queue == NULL)
+        return(0);
+
+    ui_init_done = 0;
+    if (pthread_create(&ui_thread, NULL, ui_thread_main,
+                       (void *) request_driver) != 0)
+    {
+        ringbuf_destroy(ui_queue);
+        ui_queue = NULL;
+        return(0);
+    } /* if */
+
+    pthread_mutex_lock(&ui_init_mutex);
+    while (!ui_init_done)
+        pthread_cond_wait(&ui_init_cond, &ui_init_mutex);
+    pthread_mutex_unlock(&ui_init_mutex);
+
+    if (!ui_selected)
+    {
+        pthread_join(ui_thread, NULL);
+        ringbuf_destroy(ui_queue);
+        ui_queue = NULL;
+        return(0);
+    } /* if */
+
+    UI_SET_FUNC_POINTERS(threaded);
+    return(1);
+} /* start_ui_thread */
+#endif
+
+
+int ui_init(const char *request_driver)
+{
+    if (ui_selected)
+        return(1);
+
+    /* make sure we're in a sane state... */
+    UI_SET_FUNC_POINTERS(null);
+
+    #if USE_PTHREAD
+    if (select_driver(request_driver, 0))
+        return(1);  /* main-thread driver; no UI thread for it. */
+    return(start_ui_thread(request_driver));
+    #else
+    return(select_driver(request_driver, -1));
+    #endif
 } /* ui_init */
 
 
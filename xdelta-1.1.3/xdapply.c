@@ -38,6 +38,7 @@ xdp_copy_delta_region    (XdeltaControl     *cont,
 {
   gint i, l = cont->inst_len;
   guint save_written = 0;
+  guint off, len;
 
   for (i = 0; i < l; i += 1)
     {
@@ -52,10 +53,25 @@ xdp_copy_delta_region    (XdeltaControl     *cont,
 
       info = cont->source_info[inst->index];
 
-      if (! handle_copy (info->in, output_stream, inst->offset, inst->length))
+      /* Copies that carry on where the last one left off are one copy. */
+      off = inst->offset;
+      len = inst->length;
+
+      for (; i + 1 < l; i += 1)
+	{
+	  const XdeltaInstruction *next = inst + 1;
+
+	  if (next->index != inst->index || next->offset != off + len)
+	    break;
+
+	  len += next->length;
+	  inst = next;
+	}
+
+      if (! handle_copy (info->in, output_stream, off, len))
 	return FALSE;
 
-      save_written += inst->length;
+      save_written += len;
     }
 
   return TRUE;
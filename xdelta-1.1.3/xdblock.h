@@ -0,0 +1,332 @@
+/* -*- Mode: C;-*-
+ *
+ * This file is part of XDelta - A binary delta generator.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Block size specialized kernels.  xdelta.c includes this once per
+ * supported block size, with XD_BLOCK_SIZE set to its log2, so the
+ * checksum and matching loops see a constant QUERY_SIZE and the compiler
+ * can unroll them, instead of reloading the global every iteration.
+ * There is deliberately no include guard. */
+
+#ifndef XD_BLOCK_SIZE
+#error "define XD_BLOCK_SIZE before including xdblock.h"
+#endif
+
+#define XDB_PASTE2(n,s) n ## _ ## s
+#define XDB_PASTE(n,s)  XDB_PASTE2(n,s)
+#define XDB_FN(n)       XDB_PASTE(n,XD_BLOCK_SIZE)
+
+#define QUERY_SIZE      XD_BLOCK_SIZE
+#define QUERY_SIZE_POW  (1<<QUERY_SIZE)
+#define QUERY_SIZE_MASK (QUERY_SIZE_POW-1)
+
+/* Compute the hash of length len for buf, a single byte array of
+ * values, by first indexing the random array.
+ */
+
+static void
+XDB_FN (init_query_checksum) (const guint8 *buf, XdeltaChecksum *cksum)
+{
+  gint i       = QUERY_SIZE_POW;
+  guint16 low  = 0;
+  guint16 high = 0;
+
+  for (; i != 0; i -= 1)
+    {
+      low  += CHEW(*buf++);
+      high += low;
+    }
+
+  cksum->low  = low;
+  cksum->high = high;
+}
+
+static void
+XDB_FN (checksum_blocks_scalar) (const guint8 *buf, guint count, XdeltaChecksum *out)
+{
+  for (; count != 0; count -= 1, buf += QUERY_SIZE_POW)
+    XDB_FN (init_query_checksum) (buf, out++);
+}
+
+#ifdef XDELTA_SIMD_X86
+/* high is the sum of the running lows, which is each byte's value
+ * weighted by how many lows it is part of: (QUERY_SIZE_POW - i). */
+
+__attribute__ ((target ("sse4.1")))
+static void
+XDB_FN (checksum_blocks_sse41) (const guint8 *buf, guint count, XdeltaChecksum *out)
+{
+  const gint n = QUERY_SIZE_POW;
+  const __m128i w0 = _mm_setr_epi32 (n, n-1, n-2, n-3);
+  const __m128i four = _mm_set1_epi32 (4);
+
+  for (; count >= 4; count -= 4, out += 4)
+    {
+      __m128i lo[4], hi[4];
+      gint b, i;
+
+      for (b = 0; b < 4; b += 1, buf += n)
+	{
+	  __m128i w = w0;
+
+	  lo[b] = hi[b] = _mm_setzero_si128 ();
+
+	  for (i = 0; i < n; i += 4)
+	    {
+	      __m128i c = _mm_setr_epi32 (CHEW (buf[i]),   CHEW (buf[i+1]),
+					  CHEW (buf[i+2]), CHEW (buf[i+3]));
+
+	      lo[b] = _mm_add_epi32 (lo[b], c);
+	      hi[b] = _mm_add_epi32 (hi[b], _mm_mullo_epi32 (c, w));
+	      w = _mm_sub_epi32 (w, four);
+	    }
+	}
+
+      store_checksums4 (hsum4_sse41 (lo), hsum4_sse41 (hi), out);
+    }
+
+  XDB_FN (checksum_blocks_scalar) (buf, count, out);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+XDB_FN (checksum_blocks_avx2) (const guint8 *buf, guint count, XdeltaChecksum *out)
+{
+  const gint n = QUERY_SIZE_POW;
+  const __m256i w0 = _mm256_setr_epi32 (n, n-1, n-2, n-3, n-4, n-5, n-6, n-7);
+  const __m256i eight = _mm256_set1_epi32 (8);
+
+  for (; count >= 4; count -= 4, out += 4)
+    {
+      __m256i lo[4], hi[4];
+      gint b, i;
+
+      for (b = 0; b < 4; b += 1, buf += n)
+	{
+	  __m256i w = w0;
+
+	  lo[b] = hi[b] = _mm256_setzero_si256 ();
+
+	  for (i = 0; i < n; i += 8)
+	    {
+	      __m256i idx = _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i*) (buf + i)));
+	      __m256i c   = _mm256_i32gather_epi32 ((const int*) single_hash32, idx, 4);
+
+	      lo[b] = _mm256_add_epi32 (lo[b], c);
+	      hi[b] = _mm256_add_epi32 (hi[b], _mm256_mullo_epi32 (c, w));
+	      w = _mm256_sub_epi32 (w, eight);
+	    }
+	}
+
+      store_checksums4 (hsum4_avx2 (lo), hsum4_avx2 (hi), out);
+    }
+
+  XDB_FN (checksum_blocks_scalar) (buf, count, out);
+}
+#endif /* XDELTA_SIMD_X86 */
+
+static gboolean
+XDB_FN (compute_copies) (XdeltaGenerator* gen, XdeltaStream* stream)
+{
+  XdeltaChecksum cksum;
+  const XdeltaChecksum *source_cksum;
+  const guint8 *segment_pointer;
+  guint source_offset, segment_index, source_index;
+  const XdeltaBucket* table = gen->table;
+  const guint shift = gen->table_shift;
+  const guint32 anchor_limit = gen->anchor_limit;
+  guint16 old_c, new_c;
+  guint save_page, save_off;
+#ifdef DEBUG_MATCH_PRINT
+  guint i;
+#endif
+  XdeltaPos xpos;
+  gboolean found;
+  gboolean ret = TRUE;
+
+  if (handle_length (stream) < QUERY_SIZE_POW)
+    return TRUE;
+
+  init_pos (stream, &xpos);
+
+  while (XPOS (xpos) <= (handle_length (stream) - QUERY_SIZE_POW))
+    {
+      if (!map_page (stream, &xpos))
+	return FALSE;
+
+      g_assert (xpos.mem_rem > xpos.off);
+
+      segment_index = (xpos.mem_rem - xpos.off);
+
+      if (segment_index < QUERY_SIZE_POW)
+	goto nextpage;
+
+      segment_index -= QUERY_SIZE_POW;
+
+      segment_pointer = xpos.mem + xpos.off;
+
+      XDB_FN (init_query_checksum) (segment_pointer, &cksum);
+
+      for (; ; segment_pointer += 1)
+	{
+#ifdef DEBUG_CKSUM_UPDATE
+	  XdeltaChecksum cktest;
+
+	  XDB_FN (init_query_checksum) (segment_pointer, &cktest);
+
+	  if (cktest.high != cksum.high || cktest.low != cktest.low)
+	    abort ();
+#endif
+
+	  /* A sparse table only has anchors, so only they need looking up. */
+	  if (anchor_limit != 0 && CKSUM_ANCHOR (&cksum) >= anchor_limit)
+	    goto roll;
+
+	  {
+	    const guint32 mix = CKSUM_MIX (&cksum);
+	    const XdeltaBucket *bucket = table + (mix >> shift);
+	    const guint16 fp = (guint16) mix;
+	    guint n = MIN (bucket->count, XDELTA_BUCKET_SLOTS);
+	    guint slot = bucket->count % XDELTA_BUCKET_SLOTS;
+
+	    if (! bucket_may_hold (bucket, fp))
+	      n = 0;
+
+#ifdef DEBUG_MATCH_PRINT
+	    g_print ("%d: searching for match \"", XPOS(xpos));
+	    for (i = 0; i < QUERY_SIZE_POW; i += 1)
+	      {
+		if (isprint (segment_pointer[i]))
+		  g_print ("%c", segment_pointer[i]);
+		else
+		  g_print ("\\0%o", segment_pointer[i]);
+	      }
+	    g_print ("\"... %d candidates\n", n);
+#endif
+
+	    /* Newest first, which is what the old one-entry table kept. */
+	    for (; n != 0; n -= 1)
+	      {
+		guint32 entry;
+
+		slot = (slot == 0) ? XDELTA_BUCKET_SLOTS - 1 : slot - 1;
+
+		if (bucket->fp[slot] != fp)
+		  continue;
+
+		entry         = bucket->entry[slot];
+		source_index  = (entry &  QUERY_SIZE_MASK) - 1;
+		source_offset = (entry >> QUERY_SIZE);
+
+		source_cksum = ((XdeltaSource*)gen->sources->pdata[source_index])->cksums + source_offset;
+
+		if (cksum.high != source_cksum->high ||
+		    cksum.low  != source_cksum->low)
+		  continue;
+
+		save_page = xpos.page;
+		save_off  = xpos.off;
+
+		if (! try_match (gen,
+				 stream,
+				 &xpos,
+				 gen->sources->pdata[source_index],
+				 source_offset << QUERY_SIZE,
+				 &found))
+		  {
+		    ret = FALSE;
+		    goto bail;
+		  }
+
+		if (found)
+		  {
+		    g_assert (xpos.page*xpos.page_size+xpos.off == gen->to_output_pos);
+
+		    goto reenter;
+		  }
+
+		/* Not this one, but another candidate may still match. */
+		xpos.page = save_page;
+		xpos.off  = save_off;
+	      }
+	  }
+
+	roll:
+	  if (segment_index == 0)
+	    goto nextpage;
+
+	  segment_index -= 1;
+	  xpos.off += 1;
+
+	  old_c = CHEW(segment_pointer[0]);
+	  new_c = CHEW(segment_pointer[QUERY_SIZE_POW]);
+
+	  cksum.low -= old_c;
+	  cksum.low += new_c;
+
+	  cksum.high -= old_c << QUERY_SIZE;
+	  cksum.high += cksum.low;
+	}
+
+    nextpage:
+
+      if (xpos.mem_rem < xpos.page_size)
+	break;
+
+      xpos.page += 1;
+      xpos.off = 0;
+
+      if (xpos.page != xpos.mem_page)
+	{
+	  if (! region_insert (gen, &xpos, XPOS (xpos) - gen->to_output_pos))
+	    return FALSE;
+	}
+
+    reenter:
+      (void) 0;
+    }
+
+  xpos.off = gen->to_output_pos % handle_pagesize (stream);
+
+  while (gen->to_output_pos < handle_length (stream))
+    {
+      if (! map_page (stream, &xpos))
+	return FALSE;
+
+      if (! region_insert (gen, &xpos, xpos.mem_rem - xpos.off))
+	ret = FALSE;
+
+      xpos.off = 0;
+      xpos.page += 1;
+    }
+
+bail:
+
+  if (! unmap_page (stream, &xpos))
+      return FALSE;
+
+  return ret;
+}
+
+#undef QUERY_SIZE
+#undef QUERY_SIZE_POW
+#undef QUERY_SIZE_MASK
+#undef XDB_FN
+#undef XDB_PASTE
+#undef XDB_PASTE2
+#undef XD_BLOCK_SIZE
@@ -29,8 +29,14 @@
 #include <stdlib.h>
 #include <ctype.h>
 
+#if USE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 #include "xdelta.h"
 #include "xdeltapriv.h"
+#include "xdmatch.h"
 
 /* $Format: "const guint xdelta_major_version = $ReleaseMajorVersion$;" $ */
 const guint xdelta_major_version = 1;
@@ -46,18 +52,12 @@ static XdeltaControl* control_version_0 (SerialVersion0Control* cont) ;
 static void           control_copy   (XdeltaControl* cont, XdeltaSource* src, guint from, guint to);
 static gboolean       control_add_info (XdeltaControl* cont, XdeltaSource* src, const guint8* md5, guint len);
 
-#ifndef XDELTA_HARDCODE_SIZE
-int QUERY_SIZE = 0;
-int QUERY_SIZE_POW = 0;
-int QUERY_SIZE_MASK = 0;
-#endif
+int QUERY_SIZE      = QUERY_SIZE_DEFAULT;
+int QUERY_SIZE_POW  = 1<<QUERY_SIZE_DEFAULT;
+int QUERY_SIZE_MASK = (1<<QUERY_SIZE_DEFAULT)-1;
 
 int xdp_set_query_size_pow (int size_pow)
 {
-#ifdef XDELTA_HARDCODE_SIZE
-  return XDP_QUERY_HARDCODED;
-#else
-
   int x        = 1;
   int size_log = 0;
 
@@ -71,13 +71,23 @@ int xdp_set_query_size_pow (int size_pow)
 
  good:
 
+  /* Only the sizes xdblock.h is instantiated for. */
+  if (size_log < QUERY_SIZE_MIN || size_log > QUERY_SIZE_MAX)
+    return XDP_QUERY_RANGE;
+
   QUERY_SIZE      = size_log;
   QUERY_SIZE_POW  = size_pow;
   QUERY_SIZE_MASK = size_pow-1;
 
   return 0;
+}
 
-#endif
+static guint index_budget = 0;
+
+void
+xdp_set_index_budget (guint bytes)
+{
+  index_budget = bytes;
 }
 
 int
@@ -100,6 +110,8 @@ xdp_errno (int errval)
       return "query size hardcoded";
     case XDP_QUERY_POW2:
       return "query size must be a power of 2";
+    case XDP_QUERY_RANGE:
+      return "query size must be between 16 and 128";
     }
 
   return g_strerror (errval);
@@ -143,40 +155,289 @@ const guint16 single_hash[256] =
   0x1672, 0xec28, 0x6acb, 0x86cc, 0x186e, 0x9414, 0xd674, 0xd1a5
 };
 
-/* Compute the hash of length len for buf, a single byte array of
- * values, by first indexing the random array.
+/* Generate checksums
+ *
+ * Checksumming the FROM inputs is a large part of delta generation.
+ * The block checksums are independent of each other, so a kernel does
+ * many blocks per call, using SSE4.1 or AVX2 when the CPU has them
+ * (chosen at runtime, with a scalar loop as the fallback).  The kernels
+ * themselves are in xdblock.h, one set per block size.
+ * When built with USE_PTHREAD, mapped pages are cut into chunks that a
+ * small pool of workers checksums while this thread maps the following
+ * pages, and the next source's pages follow straight on.  Mapping stays
+ * on this thread, since the stream handles are not thread safe.
  */
 
+typedef void (* XdeltaChecksumKernel) (const guint8 *buf, guint count, XdeltaChecksum *out);
+
+static XdeltaChecksumKernel checksum_blocks = NULL;
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__i386__) || defined(__x86_64__))
+#define XDELTA_SIMD_X86
+#include <immintrin.h>
+
+/* CHEW, widened so AVX2 can gather it. */
+static guint32 single_hash32[256];
+
+/* Lane i of the result is the sum of v[i]'s lanes. */
+__attribute__ ((target ("sse4.1")))
+static __m128i
+hsum4_sse41 (const __m128i *v)
+{
+  return _mm_hadd_epi32 (_mm_hadd_epi32 (v[0], v[1]), _mm_hadd_epi32 (v[2], v[3]));
+}
+
+__attribute__ ((target ("avx2")))
+static __m128i
+hsum4_avx2 (const __m256i *v)
+{
+  __m256i t = _mm256_hadd_epi32 (_mm256_hadd_epi32 (v[0], v[1]),
+				 _mm256_hadd_epi32 (v[2], v[3]));
+
+  return _mm_add_epi32 (_mm256_castsi256_si128 (t), _mm256_extracti128_si256 (t, 1));
+}
+
 static void
-init_query_checksum (const guint8 *buf, XdeltaChecksum *cksum)
+store_checksums4 (__m128i low, __m128i high, XdeltaChecksum *out)
+{
+  guint32 l[4], h[4];
+  gint i;
+
+  _mm_storeu_si128 ((__m128i*) l, low);
+  _mm_storeu_si128 ((__m128i*) h, high);
+
+  /* Both sums are only kept mod 2^16, as in init_query_checksum. */
+  for (i = 0; i < 4; i += 1)
+    {
+      out[i].low  = l[i];
+      out[i].high = h[i];
+    }
+}
+#endif /* XDELTA_SIMD_X86 */
+
+static void select_block_kernels (void);
+
+/* Blocks per worker job, and how many pages may be mapped and waiting
+ * on the workers at once. */
+#define INDEX_CHUNK_BLOCKS  4096
+#define INDEX_PAGES_AHEAD   4
+#define INDEX_MAX_THREADS   8
+
+typedef struct _IndexPage    IndexPage;
+typedef struct _IndexJob     IndexJob;
+typedef struct _IndexPool    IndexPool;
+
+struct _IndexPage {
+  XdeltaStream *stream;
+  guint         page;
+  const guint8 *mem;
+  guint         jobs_left;
+};
+
+struct _IndexJob {
+  IndexPage      *page;
+  const guint8   *mem;
+  guint           count;
+  XdeltaChecksum *out;
+  IndexJob       *next;
+};
+
+struct _IndexPool {
+  IndexPage  pages[INDEX_PAGES_AHEAD];
+  gint       first_page;
+  gint       page_count;
+  gboolean   failed;
+
+#if USE_PTHREAD
+  pthread_t       threads[INDEX_MAX_THREADS];
+  gint            thread_count;
+  pthread_mutex_t lock;
+  pthread_cond_t  work;  /* a job was queued, or we're quitting. */
+  pthread_cond_t  idle;  /* a page's last job finished. */
+  IndexJob       *head;
+  IndexJob       *tail;
+  gboolean        quit;
+#endif
+};
+
+#if USE_PTHREAD
+#define INDEX_LOCK(p)   pthread_mutex_lock (&(p)->lock)
+#define INDEX_UNLOCK(p) pthread_mutex_unlock (&(p)->lock)
+
+static void*
+index_worker (void* arg)
 {
-  gint i       = QUERY_SIZE_POW;
-  guint16 low  = 0;
-  guint16 high = 0;
+  IndexPool *pool = (IndexPool*) arg;
+  IndexJob  *job;
 
-  for (; i != 0; i -= 1)
+  INDEX_LOCK (pool);
+
+  for (;;)
     {
-      low  += CHEW(*buf++);
-      high += low;
+      while (! pool->head && ! pool->quit)
+	pthread_cond_wait (&pool->work, &pool->lock);
+
+      if (! (job = pool->head))
+	break;
+
+      if (! (pool->head = job->next))
+	pool->tail = NULL;
+
+      INDEX_UNLOCK (pool);
+
+      (* checksum_blocks) (job->mem, job->count, job->out);
+
+      INDEX_LOCK (pool);
+
+      if (--job->page->jobs_left == 0)
+	pthread_cond_broadcast (&pool->idle);
+
+      g_free (job);
     }
 
-  cksum->low  = low;
-  cksum->high = high;
+  INDEX_UNLOCK (pool);
+
+  return NULL;
 }
+#else
+#define INDEX_LOCK(p)
+#define INDEX_UNLOCK(p)
+#endif
 
-/* Generate checksums
- */
+static void
+index_pool_init (IndexPool *pool)
+{
+  memset (pool, 0, sizeof (*pool));
+
+  select_block_kernels ();
+
+#if USE_PTHREAD
+  {
+    glong cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->work, NULL);
+    pthread_cond_init (&pool->idle, NULL);
+
+    /* One CPU gets no workers: we just checksum as we map. */
+    if (cpus > 1)
+      {
+	cpus = MIN (cpus, INDEX_MAX_THREADS);
+
+	for (; pool->thread_count < cpus; pool->thread_count += 1)
+	  {
+	    if (pthread_create (&pool->threads[pool->thread_count], NULL, index_worker, pool) != 0)
+	      break;
+	  }
+      }
+  }
+#endif
+}
 
+static void
+index_queue (IndexPool *pool, IndexPage *page, const guint8 *mem, guint count, XdeltaChecksum *out)
+{
+#if USE_PTHREAD
+  if (pool->thread_count > 0)
+    {
+      IndexJob *job = g_new (IndexJob, 1);
+
+      job->page  = page;
+      job->mem   = mem;
+      job->count = count;
+      job->out   = out;
+      job->next  = NULL;
+
+      INDEX_LOCK (pool);
+
+      page->jobs_left += 1;
+
+      if (pool->tail)
+	pool->tail->next = job;
+      else
+	pool->head = job;
+
+      pool->tail = job;
+
+      pthread_cond_signal (&pool->work);
+
+      INDEX_UNLOCK (pool);
+      return;
+    }
+#endif
+
+  (* checksum_blocks) (mem, count, out);
+}
+
+/* Waits for the oldest mapped page's checksums and unmaps it. */
+static void
+index_retire_page (IndexPool *pool)
+{
+  IndexPage *page = pool->pages + pool->first_page;
+
+  INDEX_LOCK (pool);
+
+#if USE_PTHREAD
+  while (page->jobs_left != 0)
+    pthread_cond_wait (&pool->idle, &pool->lock);
+#endif
+
+  INDEX_UNLOCK (pool);
+
+  if (! handle_unmap_page (page->stream, page->page, &page->mem))
+    pool->failed = TRUE;
+
+  pool->first_page = (pool->first_page + 1) % INDEX_PAGES_AHEAD;
+  pool->page_count -= 1;
+}
+
+/* Waits for everything queued so far. */
 static gboolean
-generate_checksums (XdeltaStream    *stream,
+index_pool_drain (IndexPool *pool)
+{
+  while (pool->page_count > 0)
+    index_retire_page (pool);
+
+  return ! pool->failed;
+}
+
+static gboolean
+index_pool_finish (IndexPool *pool)
+{
+  gboolean ret = index_pool_drain (pool);
+
+#if USE_PTHREAD
+  gint i;
+
+  INDEX_LOCK (pool);
+  pool->quit = TRUE;
+  pthread_cond_broadcast (&pool->work);
+  INDEX_UNLOCK (pool);
+
+  for (i = 0; i < pool->thread_count; i += 1)
+    pthread_join (pool->threads[i], NULL);
+
+  pthread_cond_destroy (&pool->idle);
+  pthread_cond_destroy (&pool->work);
+  pthread_mutex_destroy (&pool->lock);
+#endif
+
+  return ret;
+}
+
+/* Maps each page of STREAM and queues its checksums; they are only
+ * complete after index_pool_drain(). */
+static gboolean
+generate_checksums (IndexPool       *pool,
+		    XdeltaStream    *stream,
 		    XdeltaSource    *source)
 {
   gint total_checksums  = handle_length (stream) / QUERY_SIZE_POW;
   gint checksum_index   = 0;
-  XdeltaChecksum cksum;
   XdeltaChecksum *result;
-  const guint8* segment = NULL, *segment_pointer;
-  gint   segment_len, orig_segment_len;
+  const guint8* segment = NULL;
+  gint   segment_len;
   guint  segment_page = 0;
   guint pages;
 
@@ -195,36 +456,38 @@ generate_checksums (XdeltaStream    *stream,
 
   for (pages = handle_pages (stream); segment_page <= pages; segment_page += 1)
     {
+      IndexPage *page;
+      gint done, chunk;
+
+      if (pool->page_count == INDEX_PAGES_AHEAD)
+	index_retire_page (pool);
+
       segment_len = handle_map_page (stream, segment_page, &segment);
 
       if (segment_len < 0)
 	return FALSE;
 
-      orig_segment_len = segment_len;
+      page = pool->pages + ((pool->first_page + pool->page_count) % INDEX_PAGES_AHEAD);
+      page->stream    = stream;
+      page->page      = segment_page;
+      page->mem       = segment;
+      page->jobs_left = 0;
+      pool->page_count += 1;
 
+      /* note: cheating at the boundaries */
       segment_len >>= QUERY_SIZE;
 
-      for (segment_pointer = segment;
-	   segment_len != 0;
-	   segment_len -= 1, segment_pointer += QUERY_SIZE_POW)
+      for (done = 0; done < segment_len; done += chunk)
 	{
-	  /* note: cheating at the boundaries */
-	  init_query_checksum (segment_pointer, &cksum);
+	  chunk = MIN (segment_len - done, INDEX_CHUNK_BLOCKS);
 
-#ifdef DEBUG_CKSUM
-	  g_print ("New cksum %04x %04x indices %d-%d\n",
-		   cksum.low, cksum.high,
-		   checksum_index * QUERY_SIZE_POW, (checksum_index * QUERY_SIZE_POW) + QUERY_SIZE_POW - 1);
-#endif
+	  index_queue (pool, page, segment + (done << QUERY_SIZE), chunk, result + checksum_index);
 
-	  result[checksum_index++] = cksum;
+	  checksum_index += chunk;
 	}
-
-      if (! handle_unmap_page (stream, segment_page, &segment))
-	return FALSE;
     }
 
-  return TRUE;
+  return ! pool->failed;
 }
 
 /* $Format: "#define XDELTA_REQUIRED_VERSION \"$ReleaseMajorVersion$.$ReleaseMinorVersion$.\"" $ */
@@ -318,11 +581,12 @@ xdp_source_index_read (XdeltaSource    *xs,
 }
 
 static gboolean
-xdp_source_index_internal (XdeltaSource    *init,
+xdp_source_index_internal (IndexPool       *pool,
+			   XdeltaSource    *init,
 			   XdeltaStream    *source_in,
 			   XdeltaOutStream *index_out)
 {
-  if (! generate_checksums (source_in, init))
+  if (! generate_checksums (pool, source_in, init))
     return FALSE;
 
   if (index_out)
@@ -333,6 +597,10 @@ xdp_source_index_internal (XdeltaSource    *init,
       if (! sink)
 	return FALSE;
 
+      /* The index has to be complete before we write it. */
+      if (! index_pool_drain (pool))
+	return FALSE;
+
       if (! (source_in_md5 = handle_checksum_md5 (source_in)))
 	return FALSE;
 
@@ -391,14 +659,42 @@ xdp_source_new (const char      *name,
   return xs;
 }
 
+gboolean
+xdp_source_set_checksums (XdeltaSource         *xs,
+			  const XdeltaChecksum *cksums,
+			  guint                 count)
+{
+  if (count != handle_length (xs->source_in) / QUERY_SIZE_POW)
+    return FALSE;
+
+  xs->ck_count = count;
+  xs->cksums = cksums;
+
+  return TRUE;
+}
+
+const XdeltaChecksum*
+xdp_source_checksums (XdeltaSource    *xs,
+		      guint           *count)
+{
+  (*count) = xs->ck_count;
+
+  return xs->cksums;
+}
+
 static gboolean
-xdp_source_check_index (XdeltaSource    *xs)
+xdp_source_check_index (IndexPool       *pool,
+			XdeltaSource    *xs)
 {
   if (xs->source_index == 0)
     return TRUE;
 
+  /* given by xdp_source_set_checksums. */
+  if (xs->cksums)
+    return TRUE;
+
   if (! xs->index_in)
-    return xdp_source_index_internal (xs, xs->source_in, xs->index_out);
+    return xdp_source_index_internal (pool, xs, xs->source_in, xs->index_out);
   else
     return xdp_source_index_read (xs, xs->index_in);
 }
@@ -421,13 +717,45 @@ xdp_source_add (XdeltaGenerator *gen,
 {
   if (gen->table)
     {
-      g_free ((gpointer)gen->table);
+      g_free (gen->table_mem);
+      gen->table_mem = NULL;
       gen->table = NULL;
     }
 
   g_ptr_array_add (gen->sources, src);
 }
 
+/* Multiplicative hashing of the whole checksum.  The top bits pick a
+ * bucket and the low 16 are the fingerprint; since the multiply is a
+ * bijection, a fingerprint match in a table of 2^16 buckets or more
+ * means the checksums are equal. */
+#define CKSUM_MIX(c) (((((guint32) (c)->high) << 16) | (c)->low) * 0x9E3779B1U)
+
+/* A second, unrelated mix for choosing anchor blocks in a sparse index,
+ * so the anchors spread over all the buckets and fingerprints. */
+#define CKSUM_ANCHOR(c) (((((guint32) (c)->high) << 16) | (c)->low) * 0x85EBCA6BU)
+
+/* Nonzero if any of BUCKET's fingerprints might be FP.  This is the usual
+ * has-a-zero-lane trick, on 16-bit lanes; it can say yes falsely (only
+ * for lanes above a real match), never no. */
+#define FP_LANES       0x0001000100010001ULL
+#define FP_HAS_ZERO(x) (((x) - FP_LANES) & ~(x) & (FP_LANES << 15))
+
+static guint64
+bucket_may_hold (const XdeltaBucket *bucket, guint16 fp)
+{
+  const guint64 rep = fp * FP_LANES;
+  guint64 lo, hi;
+
+  memcpy (&lo, bucket->fp, 8);
+  memcpy (&hi, bucket->fp + 4, 8);
+
+  lo ^= rep;
+  hi ^= rep;
+
+  return FP_HAS_ZERO (lo) | FP_HAS_ZERO (hi);
+}
+
 guint
 c_hash (const XdeltaChecksum* c)
 {
@@ -538,7 +866,7 @@ try_match (XdeltaGenerator *gen,
 {
   XdeltaPos xpos = *xpos_ptr;
   XdeltaPos ypos = src->source_pos;
-  gint rem, remsave;
+  gint rem, same;
   gint match_forward  = 0;
   gint match_backward = 0;
   gint match_forward_max;
@@ -577,14 +905,14 @@ try_match (XdeltaGenerator *gen,
       rem = MIN (xpos.off, ypos.off);
       rem = MIN (match_backward - match_backward_max, rem);
 
-      for (; rem > 0; rem -= 1, match_backward -= 1)
-	{
-	  if (xpos.mem[xpos.off-1] != ypos.mem[ypos.off-1])
-	    goto doneback;
+      same = xdmatch_backward (xpos.mem + xpos.off, ypos.mem + ypos.off, rem);
 
-	  xpos.off -= 1;
-	  ypos.off -= 1;
-	}
+      match_backward -= same;
+      xpos.off       -= same;
+      ypos.off       -= same;
+
+      if (same < rem)
+	goto doneback;
     }
 
 doneback:
@@ -617,53 +945,14 @@ doneback:
       rem = MIN (xpos.mem_rem - xpos.off, ypos.mem_rem - ypos.off);
       rem = MIN (match_forward_max - match_forward, rem);
 
-      /* Do a int-wise comparison if the regions are aligned. */
-      if (rem > (4*sizeof(int)) && (xpos.off % sizeof (int)) == (ypos.off % sizeof(int)))
-	{
-	  gint is;
-	  const int *xi, *yi;
-
-	  for (; xpos.off % sizeof(int); rem -= 1, match_forward += 1)
-	    {
-	      if (xpos.mem[xpos.off] != ypos.mem[ypos.off])
-		goto done;
-
-	      xpos.off += 1;
-	      ypos.off += 1;
-	    }
-
-	  remsave = rem;
-	  rem /= sizeof(int);
-
-	  xi = (const int*) (xpos.mem + xpos.off);
-	  yi = (const int*) (ypos.mem + ypos.off);
-
-	  is = rem;
-
-	  for (; rem > 0 && *xi == *yi; )
-	    {
-	      rem -= 1;
-	      xi += 1;
-	      yi += 1;
-	    }
-
-	  is -= rem;
-
-	  match_forward += is * sizeof(int);
-	  xpos.off      += is * sizeof(int);
-	  ypos.off      += is * sizeof(int);
-
- 	  rem = (rem * sizeof(int)) + (remsave % sizeof(int));
-	}
+      same = xdmatch_forward (xpos.mem + xpos.off, ypos.mem + ypos.off, rem);
 
-      for (; rem > 0; rem -= 1, match_forward += 1)
-	{
-	  if (xpos.mem[xpos.off] != ypos.mem[ypos.off])
-	    goto done;
+      match_forward += same;
+      xpos.off      += same;
+      ypos.off      += same;
 
-	  xpos.off += 1;
-	  ypos.off += 1;
-	}
+      if (same < rem)
+	goto done;
 
       FLIP_FORWARD (xpos);
       FLIP_FORWARD (ypos);
@@ -699,164 +988,79 @@ bail:
   return FALSE;
 }
 
-static gboolean
-compute_copies (XdeltaGenerator* gen, XdeltaStream* stream)
-{
-  XdeltaChecksum cksum;
-  const XdeltaChecksum *source_cksum;
-  const guint8 *segment_pointer;
-  guint source_offset, segment_index, index, prime = gen->table_size;
-  guint source_index;
-  const guint32* table = gen->table;
-  guint16 old_c, new_c;
-  guint save_page, save_off;
-#ifdef DEBUG_MATCH_PRINT
-  guint i;
-#endif
-  XdeltaPos xpos;
-  gboolean found;
-  gboolean ret = TRUE;
-
-  if (handle_length (stream) < QUERY_SIZE_POW)
-    return TRUE;
-
-  init_pos (stream, &xpos);
-
-  while (XPOS (xpos) <= (handle_length (stream) - QUERY_SIZE_POW))
-    {
-      if (!map_page (stream, &xpos))
-	return FALSE;
-
-      g_assert (xpos.mem_rem > xpos.off);
-
-      segment_index = (xpos.mem_rem - xpos.off);
-
-      if (segment_index < QUERY_SIZE_POW)
-	goto nextpage;
-
-      segment_index -= QUERY_SIZE_POW;
-
-      segment_pointer = xpos.mem + xpos.off;
-
-      init_query_checksum (segment_pointer, &cksum);
+/* One set of kernels per supported block size, 16 through 128 bytes.
+ */
 
-      for (; ; segment_pointer += 1)
-	{
-#ifdef DEBUG_CKSUM_UPDATE
-	  XdeltaChecksum cktest;
+#define XD_BLOCK_SIZE 4
+#include "xdblock.h"
+#define XD_BLOCK_SIZE 5
+#include "xdblock.h"
+#define XD_BLOCK_SIZE 6
+#include "xdblock.h"
+#define XD_BLOCK_SIZE 7
+#include "xdblock.h"
 
-	  init_query_checksum (segment_pointer, &cktest);
+typedef struct _XdeltaBlockKernels XdeltaBlockKernels;
 
-	  if (cktest.high != cksum.high || cktest.low != cktest.low)
-	    abort ();
+struct _XdeltaBlockKernels
+{
+  XdeltaChecksumKernel scalar;
+#ifdef XDELTA_SIMD_X86
+  XdeltaChecksumKernel sse41;
+  XdeltaChecksumKernel avx2;
 #endif
+  gboolean (* compute_copies) (XdeltaGenerator* gen, XdeltaStream* stream);
+};
 
-	  index = c_hash (&cksum) % prime;
-
-#ifdef DEBUG_MATCH_PRINT
-	  g_print ("%d: searching for match \"", XPOS(xpos));
-	  for (i = 0; i < QUERY_SIZE_POW; i += 1)
-	    {
-	      if (isprint (segment_pointer[i]))
-		g_print ("%c", segment_pointer[i]);
-	      else
-		g_print ("\\0%o", segment_pointer[i]);
-	    }
-	  g_print ("\"... %s\n", table[index] ? "found" : "notfound");
+#ifdef XDELTA_SIMD_X86
+#define BLOCK_KERNELS(s) { checksum_blocks_scalar_##s, checksum_blocks_sse41_##s, \
+			   checksum_blocks_avx2_##s, compute_copies_##s }
+#else
+#define BLOCK_KERNELS(s) { checksum_blocks_scalar_##s, compute_copies_##s }
 #endif
 
-	  if (table[index])
-	    {
-	      source_index  = (table[index] &  QUERY_SIZE_MASK) - 1;
-	      source_offset = (table[index] >> QUERY_SIZE);
-
-	      source_cksum = ((XdeltaSource*)gen->sources->pdata[source_index])->cksums + source_offset;
-
-	      if (cksum.high == source_cksum->high &&
-		  cksum.low  == source_cksum->low)
-		{
-		  save_page = xpos.page;
-		  save_off  = xpos.off;
-
-		  if (! try_match (gen,
-				   stream,
-				   &xpos,
-				   gen->sources->pdata[source_index],
-				   source_offset << QUERY_SIZE,
-				   &found))
-		    {
-		      ret = FALSE;
-		      goto bail;
-		    }
-
-		  if (found)
-		    {
-		      g_assert (xpos.page*xpos.page_size+xpos.off == gen->to_output_pos);
-
-		      goto reenter;
-		    }
-		  else
-		    {
-		      xpos.page = save_page;
-		      xpos.off  = save_off;
-		    }
-		}
-	    }
-
-	  if (segment_index == 0)
-	    goto nextpage;
-
-	  segment_index -= 1;
-	  xpos.off += 1;
-
-	  old_c = CHEW(segment_pointer[0]);
-	  new_c = CHEW(segment_pointer[QUERY_SIZE_POW]);
-
-	  cksum.low -= old_c;
-	  cksum.low += new_c;
-
-	  cksum.high -= old_c << QUERY_SIZE;
-	  cksum.high += cksum.low;
-	}
-
-    nextpage:
-
-      if (xpos.mem_rem < xpos.page_size)
-	break;
-
-      xpos.page += 1;
-      xpos.off = 0;
-
-      if (xpos.page != xpos.mem_page)
-	{
-	  if (! region_insert (gen, &xpos, XPOS (xpos) - gen->to_output_pos))
-	    return FALSE;
-	}
+static const XdeltaBlockKernels block_kernels[QUERY_SIZE_MAX - QUERY_SIZE_MIN + 1] =
+{
+  BLOCK_KERNELS (4),
+  BLOCK_KERNELS (5),
+  BLOCK_KERNELS (6),
+  BLOCK_KERNELS (7)
+};
 
-    reenter:
-      (void) 0;
-    }
+static const XdeltaBlockKernels*
+current_block_kernels (void)
+{
+  return & block_kernels[QUERY_SIZE - QUERY_SIZE_MIN];
+}
 
-  xpos.off = gen->to_output_pos % handle_pagesize (stream);
+static void
+select_block_kernels (void)
+{
+  const XdeltaBlockKernels *k = current_block_kernels ();
 
-  while (gen->to_output_pos < handle_length (stream))
-    {
-      if (! map_page (stream, &xpos))
-	return FALSE;
+  checksum_blocks = k->scalar;
 
-      if (! region_insert (gen, &xpos, xpos.mem_rem - xpos.off))
-	ret = FALSE;
+#ifdef XDELTA_SIMD_X86
+  {
+    gint i;
 
-      xpos.off = 0;
-      xpos.page += 1;
-    }
+    for (i = 0; i < 256; i += 1)
+      single_hash32[i] = single_hash[i];
 
-bail:
+    __builtin_cpu_init ();
 
-  if (! unmap_page (stream, &xpos))
-      return FALSE;
+    if (__builtin_cpu_supports ("avx2"))
+      checksum_blocks = k->avx2;
+    else if (__builtin_cpu_supports ("sse4.1"))
+      checksum_blocks = k->sse41;
+  }
+#endif
+}
 
-  return ret;
+static gboolean
+compute_copies (XdeltaGenerator* gen, XdeltaStream* stream)
+{
+  return (* current_block_kernels ()->compute_copies) (gen, stream);
 }
 
 static gboolean
@@ -936,15 +1140,55 @@ just_output (XdeltaGenerator *gen,
  *                R_{j+1} = R_j + w(i,k)
  */
 
+#define TABLE_PREFETCH 16
+
+/* Sparse indexes keep one block in 2^ANCHOR_MAX_BITS, at the least. */
+#define ANCHOR_MAX_BITS 10
+
+static guint
+table_size_for (guint entries)
+{
+  guint size = 2;
+
+  /* Aim for 6 entries per bucket, at most. */
+  while (size < (entries / 6))
+    size <<= 1;
+
+  return size;
+}
+
+/* How many bits of CKSUM_ANCHOR have to be zero for a block to go in
+ * the table, so the CKSUM map and table fit index_budget. */
+static guint
+anchor_bits_for (guint total_ck_count)
+{
+  guint bits;
+  gsize cksums = (gsize) total_ck_count * sizeof (XdeltaChecksum);
+
+  if (index_budget == 0)
+    return 0;
+
+  for (bits = 0; bits < ANCHOR_MAX_BITS; bits += 1)
+    {
+      gsize table = (gsize) table_size_for (total_ck_count >> bits) * sizeof (XdeltaBucket);
+
+      if (cksums + table <= index_budget)
+	break;
+    }
+
+  return bits;
+}
+
 static gboolean
 xdp_generate_delta_int (XdeltaGenerator *gen,
 			XdeltaStream    *in,
 			XdeltaOutStream *control_out,
 			XdeltaOutStream *data_out)
 {
-  gint i, j, total_from_ck_count = 0, prime = 0, index = 0;
+  gint i, j, total_from_ck_count = 0;
   gint total_from_len = 0;
-  guint32* table = NULL;
+  guint anchor_bits;
+  XdeltaBucket* table = NULL;
 
   if (QUERY_SIZE == 0)
     {
@@ -986,20 +1230,37 @@ xdp_generate_delta_int (XdeltaGenerator *gen,
     }
   else
     {
-      for (i = 0; i < gen->sources->len; i += 1)
+      IndexPool pool;
+      gboolean indexed = TRUE;
+
+      index_pool_init (&pool);
+
+      for (i = 0; indexed && i < gen->sources->len; i += 1)
 	{
 	  XdeltaSource* xs = (XdeltaSource*)gen->sources->pdata[i];
 
-	  if (! xdp_source_check_index (xs))
-	    return FALSE;
+	  indexed = xdp_source_check_index (&pool, xs);
 
 	  total_from_ck_count += xs->ck_count;
 	}
 
-      prime = g_spaced_primes_closest (total_from_ck_count);
+      /* Always finish, so no worker is left writing into a checksum
+       * array (or holding a page) after we return. */
+      if (! index_pool_finish (&pool) || ! indexed)
+	return FALSE;
+
+      anchor_bits = anchor_bits_for (total_from_ck_count);
+
+      gen->anchor_limit = (anchor_bits == 0) ? 0 : (0x80000000U >> (anchor_bits - 1));
+      gen->table_size   = table_size_for (total_from_ck_count >> anchor_bits);
+      gen->table_shift  = 32;
+
+      for (i = gen->table_size; i > 1; i >>= 1)
+	gen->table_shift -= 1;
 
-      gen->table = table = g_new0 (guint32, prime);
-      gen->table_size = prime;
+      /* Buckets are cache lines, so line them up with the real ones. */
+      gen->table_mem = g_malloc0 (gen->table_size * sizeof (XdeltaBucket) + 63);
+      gen->table = table = (XdeltaBucket*) ((((gsize) gen->table_mem) + 63) & ~((gsize) 63));
 
       for (i = 0; i < gen->sources->len; i += 1)
 	{
@@ -1007,41 +1268,44 @@ xdp_generate_delta_int (XdeltaGenerator *gen,
 
 	  for (j = xs->ck_count-1; j >= 0; j -= 1)
 	    {
-	      index = c_hash (xs->cksums + j) % prime;
+	      const guint32 mix = CKSUM_MIX (xs->cksums + j);
+	      XdeltaBucket *bucket = table + (mix >> gen->table_shift);
+	      guint slot;
+
+	      if (gen->anchor_limit != 0 && CKSUM_ANCHOR (xs->cksums + j) >= gen->anchor_limit)
+		continue;
+
+#ifdef __GNUC__
+	      /* Every insert is a miss; get a few going at once. */
+	      if (j >= TABLE_PREFETCH)
+		__builtin_prefetch (table + (CKSUM_MIX (xs->cksums + j - TABLE_PREFETCH) >> gen->table_shift), 1);
+#endif
+
+	      slot = bucket->count % XDELTA_BUCKET_SLOTS;
 
 #ifdef DEBUG_HASH
 	      gen->hash_entries += 1;
 
-	      if (table[index])
-		{
-		  gen->hash_conflicts += 1;
-
-		  /*regions_similar (gen,
-				   i,
-				   j,
-				   (table[index] & QUERY_SIZE_MASK) - 1,
-				   table[index] >> QUERY_SIZE);*/
-		}
+	      if (bucket->count >= XDELTA_BUCKET_SLOTS)
+		gen->hash_conflicts += 1;
 #endif
 
-	      /* This is the real code */
-	      table[index] = (j << QUERY_SIZE) + 1 + i;
+	      bucket->entry[slot] = (j << QUERY_SIZE) + 1 + i;
+	      bucket->fp[slot]    = (guint16) mix;
+	      bucket->count      += 1;
 	    }
 	}
 
 #ifdef DEBUG_HASH
-      for (i = 0; i < prime; i += 1)
-	{
-	  if (gen->table[i])
-	    gen->hash_fill += 1;
-	}
+      for (i = 0; i < gen->table_size; i += 1)
+	gen->hash_fill += MIN (table[i].count, XDELTA_BUCKET_SLOTS);
 
       g_print ("*** Hash stats:\n");
       g_print ("Hash conflicts: %d\n", gen->hash_conflicts);
       g_print ("Hash real conflicts: %d\n", gen->hash_real_conflicts);
       g_print ("Hash real real conflicts: %d\n", gen->hash_real_real_conflicts);
       g_print ("Hash fill:      %d\n", gen->hash_fill);
-      g_print ("Hash size:      %d\n", gen->table_size);
+      g_print ("Hash size:      %d\n", gen->table_size * XDELTA_BUCKET_SLOTS);
       g_print ("Hash entries:   %d\n", gen->hash_entries);
       g_print ("Hash fill/entries: %f\n", (float)gen->hash_fill/(float)gen->hash_entries);
 #endif
@@ -62,45 +62,50 @@ extern const guint xdelta_major_version;
 extern const guint xdelta_minor_version;
 extern const guint xdelta_micro_version;
 
-/* copy segments are of length 1<<QUERY_SIZE, this must not be greater
- * than 6 due to a space assumption, and also limits the number of
- * sources allowed to (QUERY_SIZE_POW-1).
+/* copy segments are of length 1<<QUERY_SIZE, which must be between
+ * QUERY_SIZE_MIN and QUERY_SIZE_MAX: the checksum and matching kernels
+ * are compiled once for each size in that range (see xdblock.h).  It
+ * also limits the number of sources allowed to (QUERY_SIZE_POW-2).
  *
  * The in-core FROM CKSUM table's size is (FROM_LEN bytes * 4 bytes-per-checksum) / (1<<QUERY_SIZE)
  *
- * The in-core CKSUM HASH table's size is the same size, each checksum has one 32-bit offset+srcindex
+ * The in-core CKSUM HASH table keeps a 32-bit offset+srcindex and a 16-bit fingerprint per
+ * checksum in 64-byte buckets, sized to a power of two at no more than 6 entries per bucket,
+ * so it is roughly 1.3-2.7 times the size of the FROM CKSUM map.
  *
  * With the a value of (QUERY_SIZE = 4) gives a 16 byte block size,
- * gives FROM_LEN/4 bytes for the FROM CKSUM map, and the same for the
- * CKSUM HASH, giving FROM_LEN/2 bytes, in addition to whatever used
- * to cache the FROM inputs.
+ * gives FROM_LEN/4 bytes for the FROM CKSUM map, and FROM_LEN/3 to
+ * 2*FROM_LEN/3 bytes for the CKSUM HASH, in addition to whatever used
+ * to cache the FROM inputs.  Each step up halves both, and makes
+ * matching on large inputs faster, at the cost of missing shorter
+ * copies.
  **/
 #define QUERY_SIZE_DEFAULT  4
+#define QUERY_SIZE_MIN      4
+#define QUERY_SIZE_MAX      7
 
-/* The query size has historically been hard coded.  This gains around
- * 20% in speed, so I've left it the default.  If you're interested in
- * large files, try undefining this (and using the -s argument to
- * Xdelta).
- */
-#define XDELTA_HARDCODE_SIZE
-
-#ifdef XDELTA_HARDCODE_SIZE
-#define QUERY_SIZE          QUERY_SIZE_DEFAULT
-#define QUERY_SIZE_POW      (1<<QUERY_SIZE)
-#define QUERY_SIZE_MASK     (QUERY_SIZE_POW-1)
-#else
 extern int QUERY_SIZE;
 extern int QUERY_SIZE_POW;
 extern int QUERY_SIZE_MASK;
-#endif
 
-#define XDP_QUERY_HARDCODED -7654
+#define XDP_QUERY_HARDCODED -7654  /* no longer returned. */
 #define XDP_QUERY_POW2      -7655
+#define XDP_QUERY_RANGE     -7656
 
-/* Returns  if query size is hard coded. */
+/* Returns XDP_QUERY_POW2 or XDP_QUERY_RANGE for unsupported sizes. */
 int xdp_set_query_size_pow (int size_pow);
 int xdp_blocksize          ();
 
+/* Bounds the memory used for the in-core FROM CKSUM map and CKSUM
+ * HASH together, in bytes; 0, the default, means no bound.  When the
+ * sources need more than this the hash only takes a sample of the
+ * blocks, chosen by their content so the same blocks are picked out
+ * of the TO input, which then only looks those up.  A copy then has to
+ * span one of the sampled blocks to be found, so deltas get larger as
+ * the budget shrinks.
+ */
+void xdp_set_index_budget (guint bytes);
+
 /* An xdelta consists of two pieces of information, the control and
  * data segments.  The control segment consists of instructions,
  * metadata, and some redundent information for validation.  The data
@@ -142,6 +147,19 @@ XdeltaSource*    xdp_source_new           (const char      *name,
 gboolean         xdp_source_index         (XdeltaStream    *source_in,
 					   XdeltaOutStream *index_out);
 
+/* Have SRC use COUNT checksums saved from an earlier delta (see
+ * xdp_source_checksums) instead of indexing its stream.  They must be
+ * of the same stream at the same block size, and outlive SRC.  Returns
+ * false when COUNT is wrong for the stream. */
+gboolean         xdp_source_set_checksums (XdeltaSource    *src,
+					   const XdeltaChecksum *cksums,
+					   guint            count);
+
+/* The checksums SRC was indexed with, once a delta has been generated
+ * against it, or NULL. */
+const XdeltaChecksum* xdp_source_checksums (XdeltaSource    *src,
+					   guint           *count);
+
 /* Add SRC to the generator.  The source will then be used for generating
  * deltas. */
 void             xdp_source_add           (XdeltaGenerator *gen,
@@ -190,6 +208,15 @@ gboolean         xdp_apply_rsync_reply    (XdeltaRsync       *rsync,
 					   XdeltaStream      *reply,
 					   XdeltaStream      *out);
 
+/* Make a delta from FROM to IN knowing only FROM's rsync index (a
+ * cache written by xdp_rsync_index), writing the data to DATA_OUT as
+ * xdp_generate_delta does.  Copies are of whole segments. */
+
+XdeltaControl*   xdp_rsync_delta          (XdeltaRsync       *rsync,
+					   const char        *from_name,
+					   XdeltaStream      *in,
+					   XdeltaOutStream   *data_out);
+
 const char* xdp_errno (int errval);
 
 #endif
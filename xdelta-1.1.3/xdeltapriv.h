@@ -45,6 +45,7 @@
 
 typedef struct _XdeltaPos         XdeltaPos;
 typedef struct _RsyncHash         RsyncHash;
+typedef struct _XdeltaBucket      XdeltaBucket;
 
 #define XPOS(p) (((p).page * (p).page_size) + (p).off)
 
@@ -58,6 +59,20 @@ struct _XdeltaPos {
   guint mem_rem;
 };
 
+/* The FROM checksum hash table is a power-of-two array of these, one
+ * per cache line.  Each keeps the last XDELTA_BUCKET_SLOTS entries that
+ * hashed to it, oldest clobbered first, with a 16-bit fingerprint of
+ * each checksum so a miss is decided from this line alone.  An entry is
+ * (offset/QUERY_SIZE_POW << QUERY_SIZE) + 1 + source index. */
+#define XDELTA_BUCKET_SLOTS 8
+
+struct _XdeltaBucket {
+  guint16 fp[XDELTA_BUCKET_SLOTS]; /* first, so we can test it as 2 words. */
+  guint32 entry[XDELTA_BUCKET_SLOTS];
+  guint32 count; /* entries ever added; the next slot is count % SLOTS. */
+  guint32 pad[3];
+};
+
 #define handle_length(x)    ((* (x)->table->table_handle_length) (x))
 #define handle_pages(x)     ((* (x)->table->table_handle_pages) (x))
 #define handle_pagesize(x)  ((* (x)->table->table_handle_pagesize) (x))
@@ -72,8 +87,14 @@ struct _XdeltaGenerator
 {
   GPtrArray *sources;
 
-  const guint32 *table;
-  guint          table_size;
+  const XdeltaBucket *table;
+  guint          table_size;  /* in buckets, a power of two. */
+  guint          table_shift; /* 32 - log2 (table_size). */
+  gpointer       table_mem;
+
+  /* Nonzero when the index is over budget and only anchor blocks, whose
+   * CKSUM_ANCHOR is below this, are in the table. */
+  guint32        anchor_limit;
 
   guint          to_output_pos;
   guint          data_output_pos;
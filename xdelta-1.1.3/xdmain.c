@@ -23,6 +23,12 @@
  * $Id: xdmain.c,v 1.1 2004/01/05 18:54:22 icculus Exp $
  */
 
+/* Windows of a large file are addressed by 64-bit offset, even where
+ * the delta inside them is not. */
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +36,7 @@
 #include <ctype.h>
 
 #include <fcntl.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 
 #if defined(_WIN32) || defined(__DJGPP__)
@@ -39,8 +46,16 @@
 #ifndef WINHACK
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #define O_BINARY 0
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_copy_file_range
+#define XD_COPY_FILE_RANGE
+#endif
+#endif
+
 #else /* WINHACK */
 
 #include <io.h>
@@ -68,6 +83,13 @@ extern HandleFuncTable xd_handle_table;
 
 #define XD_PAGE_SIZE (1<<20)
 
+/* Applying a delta gathers up to this many copies, or bytes, per
+ * writev, and hands spans this long to copy_file_range. */
+#define XD_GATHER_IOVS     1024
+#define XD_GATHER_BYTES    (4<<20)
+#define XD_GATHER_STAGE    (1<<20)
+#define XD_COPY_RANGE_MIN  (256<<10)
+
 #define XDELTA_110_PREFIX "%XDZ004%"
 #define XDELTA_104_PREFIX "%XDZ003%"
 #define XDELTA_100_PREFIX "%XDZ002%"
@@ -119,6 +141,17 @@ struct _LRU
   guint8* buffer;
 };
 
+/* A window of a file, from --fromrange or --torange.  The delta
+ * inside it has 32-bit lengths; only where it sits is 64-bit. */
+typedef struct _XdRange XdRange;
+
+struct _XdRange
+{
+  gboolean set;
+  off_t    off;
+  guint    len;
+};
+
 typedef struct _XdFileHandle XdFileHandle;
 
 typedef struct {
@@ -167,7 +200,19 @@ struct _XdFileHandle
   gboolean (* out_write) (XdFileHandle* handle, const void* buf, gint nbyte);
   gboolean (* out_close) (XdFileHandle* handle);
 
+#ifndef WINHACK
+  /* copies queued up by xd_handle_copy, for one writev. */
+  struct iovec* gather_iov;
+  gint          gather_count;
+  gsize         gather_bytes;
+  guint8*       gather_stage;  /* literal data the queue points into. */
+  guint         gather_staged;
+#endif
+
   /* for read */
+  const guint8* whole;  /* the whole file, when it could be mapped at once. */
+  gboolean   whole_tried;
+
   GPtrArray *lru_table;
   LRU       *lru_head;  /* most recently used. */
   LRU       *lru_tail;  /* least recently used. */
@@ -190,6 +235,7 @@ struct _XdFileHandle
 
   gint md5_page;
   gint fd;
+  off_t base;  /* where a --fromrange/--torange window starts in fd. */
 };
 
 /* $Format: "static const char xdelta_version[] = \"$ReleaseVersion$\"; " $ */
@@ -206,12 +252,16 @@ struct _Command {
 static gint    delta_command    (gint argc, gchar** argv);
 static gint    patch_command    (gint argc, gchar** argv);
 static gint    info_command     (gint argc, gchar** argv);
+static gint    sign_command     (gint argc, gchar** argv);
+static gint    sigdelta_command (gint argc, gchar** argv);
 
 static const Command commands[] =
 {
   { "delta",    delta_command,    -1 },
   { "patch",    patch_command,    -1 },
   { "info",     info_command,     1 },
+  { "sign",     sign_command,     -1 },
+  { "sigdelta", sigdelta_command, -1 },
   { NULL, NULL, 0 }
 };
 
@@ -225,6 +275,12 @@ static struct option const long_options[] =
   {"quiet",               no_argument, 0, 'q'},
   {"maxmem",              required_argument, 0, 'm'},
   {"blocksize",           required_argument, 0, 's'},
+  {"indexmem",            required_argument, 0, 'i'},
+  {"fromrange",           required_argument, 0, 'F'},
+  {"torange",             required_argument, 0, 'T'},
+  {"append",              no_argument, 0, 'a'},
+  {"indexcache",          required_argument, 0, 'I'},
+  {"frommd5",             required_argument, 0, 'M'},
   {0,0,0,0}
 };
 
@@ -235,6 +291,13 @@ static gint         pristine = FALSE;
 static gint         verbose = FALSE;
 static gint         max_mapped_pages = G_MAXINT;
 static gint         quiet = FALSE;
+static gint         block_size_set = FALSE;
+static XdRange      from_range;
+static XdRange      to_range;
+static gint         append_output = FALSE;
+static const gchar* index_cache = NULL;
+static gboolean     from_md5_set = FALSE;
+static guint8       from_md5[16];
 
 #define xd_error g_warning
 
@@ -254,6 +317,9 @@ help ()
   xd_error ("  delta     Produce a delta from ARG1 to ARG2 producing ARG3\n");
   xd_error ("  info      List details about delta ARG1\n");
   xd_error ("  patch     Apply patch ARG1 using file ARG2 producing ARG3\n");
+  xd_error ("  sign      Write the rsync signature of ARG1 to ARG2\n");
+  xd_error ("  sigdelta  Produce a delta from the file signed in ARG1 to ARG2\n");
+  xd_error ("            producing ARG3, without the file itself\n");
   xd_error ("OPTIONS are:\n");
   xd_error ("  -v, --version      Print version information\n");
   xd_error ("  -V, --verbose      Print verbose error messages\n");
@@ -261,12 +327,69 @@ help ()
   xd_error ("  -n, --noverify     Disable automatic MD5 verification\n");
   xd_error ("  -p, --pristine     Disable automatic GZIP decompression\n");
   xd_error ("  -m, --maxmem=SIZE  Set the buffer size limit, e.g. 640K, 16M\n");
+  xd_error ("  -i, --indexmem=SIZE  Limit the FROM index to SIZE, indexing only some\n");
+  xd_error ("                     blocks if need be, e.g. 64M\n");
   xd_error ("  -[0-9]             ZLIB compress level: 0=none, 1=fast, 6=default, 9=best\n");
-  xd_error ("  -s=BLOCK_SIZE      Sets block size (power of 2), minimum match length\n");
+  xd_error ("  -s=BLOCK_SIZE      Sets block size (power of 2, 16 to 128), minimum match length\n");
   xd_error ("                     In-core memory requirement is (FROM_LEN * 8) / BLOCK_SIZE\n");
+  xd_error ("                     By default it is picked from FROM_LEN\n");
+  xd_error ("  -F, --fromrange=OFF:LEN  Use only LEN bytes of FROM, starting at OFF\n");
+  xd_error ("  -T, --torange=OFF:LEN    Delta only LEN bytes of TO, starting at OFF\n");
+  xd_error ("                     OFF must be a multiple of 1M; the window is read as-is\n");
+  xd_error ("  -a, --append       Patch onto the end of ARG3 instead of replacing it\n");
+  xd_error ("  -I, --indexcache=DIR  Keep FROM indexes in DIR, by FROM's MD5 and block\n");
+  xd_error ("                     size, and use them instead of indexing FROM again\n");
+  xd_error ("  -M, --frommd5=MD5  FROM's MD5 is already known to be MD5, in hex\n");
   exit (2);
 }
 
+static gboolean
+parse_mem_size (const gchar* arg, glong* size)
+{
+  gchar* end = NULL;
+  glong l = strtol (arg, &end, 0);
+
+  if (g_strcasecmp (end, "M") == 0)
+    l <<= 20;
+  else if (g_strcasecmp (end, "K") == 0)
+    l <<= 10;
+  else if (*end != 0)
+    return FALSE;
+
+  if (l < 0)
+    return FALSE;
+
+  *size = l;
+  return TRUE;
+}
+
+static gboolean
+parse_range (const gchar* arg, XdRange* range)
+{
+  gchar* end = NULL;
+  guint64 off, len;
+
+  off = strtoull (arg, &end, 0);
+
+  if (end == arg || *end != ':')
+    return FALSE;
+
+  arg = end + 1;
+  len = strtoull (arg, &end, 0);
+
+  if (end == arg || *end != 0)
+    return FALSE;
+
+  /* windows are mapped, and every length inside xdelta is a gint. */
+  if ((off % XD_PAGE_SIZE) != 0 || len > G_MAXINT)
+    return FALSE;
+
+  range->set = TRUE;
+  range->off = off;
+  range->len = len;
+  return TRUE;
+}
+
 static void
 version ()
 {
@@ -377,7 +500,7 @@ main (gint argc, gchar** argv)
 
   while ((c = getopt_long(argc,
 			  argv,
-			  "+nqphvVs:m:0123456789",
+			  "+nqphvVas:m:i:F:T:I:M:0123456789",
 			  long_options,
 			  &longind)) != EOF)
     {
@@ -396,18 +519,15 @@ main (gint argc, gchar** argv)
 	      {
 		xd_error ("illegal query size: %s\n", xdp_errno (ret));
 	      }
+
+	    block_size_set = (ret == 0);
 	  }
 	  break;
 	case 'm':
 	  {
-	    gchar* end = NULL;
-	    glong l = strtol (optarg, &end, 0);
-
-	    if (end && g_strcasecmp (end, "M") == 0)
-	      l <<= 20;
-	    else if (end && g_strcasecmp (end, "K") == 0)
-	      l <<= 10;
-	    else if (end || l < 0)
+	    glong l;
+
+	    if (! parse_mem_size (optarg, &l))
 	      {
 		xd_error ("illegal maxmem argument %s\n", optarg);
 		return 2;
@@ -426,6 +546,37 @@ main (gint argc, gchar** argv)
 	    max_mapped_pages = l / XD_PAGE_SIZE;
 	  }
 	  break;
+	case 'i':
+	  {
+	    glong l;
+
+	    if (! parse_mem_size (optarg, &l))
+	      {
+		xd_error ("illegal indexmem argument %s\n", optarg);
+		return 2;
+	      }
+
+	    xdp_set_index_budget (l);
+	  }
+	  break;
+	case 'F':
+	case 'T':
+	  if (! parse_range (optarg, (c == 'F') ? &from_range : &to_range))
+	    {
+	      xd_error ("illegal %s argument %s\n", (c == 'F') ? "fromrange" : "torange", optarg);
+	      return 2;
+	    }
+	  break;
+	case 'a': append_output = TRUE; break;
+	case 'I': index_cache = optarg; break;
+	case 'M':
+	  if (strlen (optarg) != 32 || ! edsio_md5_from_string (from_md5, optarg))
+	    {
+	      xd_error ("illegal frommd5 argument %s\n", optarg);
+	      return 2;
+	    }
+	  from_md5_set = TRUE;
+	  break;
 	case 'h': help (); break;
 	case 'v': version (); break;
 	case '0': case '1': case '2': case '3': case '4':
@@ -471,6 +622,7 @@ main (gint argc, gchar** argv)
 
 static gssize xd_handle_map_page (XdFileHandle *fh, guint pgno, const guint8** mem);
 static gboolean xd_handle_unmap_page (XdFileHandle *fh, guint pgno, const guint8** mem);
+static gboolean xd_gather_flush (XdFileHandle *fh);
 
 static gboolean
 xd_fwrite (XdFileHandle* fh, const void* buf, gint nbyte)
@@ -530,7 +682,7 @@ init_table (XdFileHandle* fh)
 }
 
 static XdFileHandle*
-open_common (const char* name, const char* real_name)
+open_common (const char* name, const char* real_name, const XdRange* range)
 {
   XdFileHandle* fh;
 
@@ -556,13 +708,35 @@ open_common (const char* name, const char* real_name)
       return NULL;
     }
 
+  if (range && range->set)
+    {
+      if (range->off + (off_t) range->len > buf.st_size)
+	{
+	  xd_error ("%s is shorter than its window\n", name);
+	  return NULL;
+	}
+    }
+  else if (buf.st_size > G_MAXINT)
+    {
+      xd_error ("%s is too large; delta it in windows with --fromrange and --torange\n", name);
+      return NULL;
+    }
+
   fh = g_new0 (XdFileHandle, 1);
 
   fh->fh.table = & xd_handle_table;
   fh->name = real_name;
   fh->fd = fd;
-  fh->length = buf.st_size;
-  fh->narrow_high = buf.st_size;
+
+  if (range && range->set)
+    {
+      fh->base = range->off;
+      fh->length = range->len;
+    }
+  else
+    fh->length = buf.st_size;
+
+  fh->narrow_high = fh->length;
 
   return fh;
 }
@@ -653,7 +827,7 @@ file_gunzip (const char* name)
 }
 
 static XdFileHandle*
-open_read_noseek_handle (const char* name, gboolean* is_compressed, gboolean will_read, gboolean honor_pristine)
+open_read_noseek_handle (const char* name, gboolean* is_compressed, gboolean will_read, gboolean honor_pristine, const XdRange* range)
 {
   XdFileHandle* fh;
   const char* name0 = name;
@@ -663,7 +837,8 @@ open_read_noseek_handle (const char* name, gboolean* is_compressed, gboolean wil
    * length to (XDELTA_MAX_FILE_LEN-1) and make sure that the end
    * of file condition is set when on the last page.  However, I
    * don't feel like it. */
-  if (honor_pristine && pristine)
+  /* a window is of the file's bytes; a compressed file has none to offer. */
+  if ((honor_pristine && pristine) || (range && range->set))
     *is_compressed = FALSE;
   else
     {
@@ -674,7 +849,7 @@ open_read_noseek_handle (const char* name, gboolean* is_compressed, gboolean wil
   if ((* is_compressed) && ! (name = file_gunzip (name)))
     return NULL;
 
-  if (! (fh = open_common (name, name0)))
+  if (! (fh = open_common (name, name0, range)))
     return NULL;
 
   fh->type = READ_NOSEEK_TYPE;
@@ -711,6 +886,11 @@ xd_read_close (XdFileHandle* fh)
    * still open. On MS-DOS this can lead to filesystem corruption. Close
    * the file before unlinking it.
    */
+#ifndef WINHACK
+  if (fh->whole)
+    munmap ((void*) fh->whole, fh->length);
+#endif
+
   close (fh->fd);
 
   if (fh->cleanup)
@@ -721,12 +901,13 @@ xd_read_close (XdFileHandle* fh)
 }
 
 static XdFileHandle*
-open_read_seek_handle (const char* name, gboolean* is_compressed, gboolean honor_pristine)
+open_read_seek_handle (const char* name, gboolean* is_compressed, gboolean honor_pristine, const XdRange* range)
 {
   XdFileHandle* fh;
   const char* name0 = name;
 
-  if (honor_pristine && pristine)
+  /* a window is of the file's bytes; a compressed file has none to offer. */
+  if ((honor_pristine && pristine) || (range && range->set))
     *is_compressed = FALSE;
   else
     {
@@ -737,7 +918,7 @@ open_read_seek_handle (const char* name, gboolean* is_compressed, gboolean honor
   if ((* is_compressed) && ! (name = file_gunzip (name)))
     return NULL;
 
-  if (! (fh = open_common (name, name0)))
+  if (! (fh = open_common (name, name0, range)))
     return NULL;
 
   fh->type = READ_SEEK_TYPE;
@@ -789,6 +970,9 @@ xd_begin_compression (XdFileHandle* fh)
   if (compress_level == 0)
     return fh->real_length;
 
+  if (! xd_gather_flush (fh))
+    return -1;
+
   if (! (fh->out_close) (fh))
     {
       xd_error ("fclose failed: %s\n", g_strerror (errno));
@@ -901,6 +1085,9 @@ xd_handle_close (XdFileHandle *fh, gint ignore)
 
   if (fh->type == WRITE_TYPE)
     {
+      if (! xd_gather_flush (fh))
+	return FALSE;
+
       if (fh->reset_length_next_write)
 	{
 	  fh->reset_length_next_write = FALSE;
@@ -959,6 +1146,15 @@ xd_handle_checksum_md5 (XdFileHandle *fh)
   return g_memdup (fh->md5, 16);
 }
 
+/* FH's MD5 is already known, so it is never read again for it. */
+static void
+xd_handle_set_md5 (XdFileHandle *fh, const guint8* md5)
+{
+  memcpy (fh->md5, md5, 16);
+  fh->md5_good = TRUE;
+  fh->md5_page = xd_handle_pages (fh) + 1;
+}
+
 static gboolean
 xd_handle_set_pos (XdFileHandle *fh, guint pos)
 {
@@ -1060,11 +1256,10 @@ xd_handle_read (XdFileHandle *fh, guint8 *buf, gsize nbyte)
   return nbyte;
 }
 
-static gboolean
-xd_handle_write (XdFileHandle *fh, const guint8 *buf, gsize nbyte)
+/* The length and MD5 bookkeeping for NBYTE bytes written to FH. */
+static void
+xd_handle_account (XdFileHandle *fh, const guint8 *buf, gsize nbyte)
 {
-  g_assert (fh->type == WRITE_TYPE);
-
   if (fh->reset_length_next_write)
     {
       fh->reset_length_next_write = FALSE;
@@ -1075,24 +1270,186 @@ xd_handle_write (XdFileHandle *fh, const guint8 *buf, gsize nbyte)
   if (! no_verify)
     edsio_md5_update (&fh->ctx, buf, nbyte);
 
+  fh->length += nbyte;
+  fh->real_length += nbyte;
+  fh->narrow_high += nbyte;
+}
+
+static gboolean
+xd_handle_write (XdFileHandle *fh, const guint8 *buf, gsize nbyte)
+{
+  g_assert (fh->type == WRITE_TYPE);
+
+  if (! xd_gather_flush (fh))
+    return FALSE;
+
   if (! (*fh->out_write) (fh, buf, nbyte))
     {
       xd_error ("write failed: %s\n", g_strerror (errno));
       return FALSE;
     }
 
-  fh->length += nbyte;
-  fh->real_length += nbyte;
-  fh->narrow_high += nbyte;
+  xd_handle_account (fh, buf, nbyte);
+
+  return TRUE;
+}
+
+/* Applying a delta is a long run of copies, many of them short.  On
+ * an uncompressed output, xd_handle_copy queues them up instead of
+ * writing each one, pointing into the mapped sources and into a
+ * staging buffer for literal data, and writes the lot with one writev.
+ * Anything else written to the handle flushes the queue first.
+ */
+static gboolean
+xd_gather_flush (XdFileHandle *fh)
+{
+#ifndef WINHACK
+  struct iovec *iov = fh->gather_iov;
+  gint count = fh->gather_count;
+
+  if (count == 0)
+    return TRUE;
+
+  fh->gather_count  = 0;
+  fh->gather_bytes  = 0;
+  fh->gather_staged = 0;
+
+  /* The queue goes straight to the descriptor, behind stdio's back. */
+  if (fflush (fh->out) != 0)
+    {
+      xd_error ("write failed: %s\n", g_strerror (errno));
+      return FALSE;
+    }
+
+  while (count > 0)
+    {
+      gssize done = writev (fh->out_fd, iov, count);
+
+      if (done < 0 && errno == EINTR)
+	continue;
+
+      if (done <= 0)
+	{
+	  xd_error ("write failed: %s\n", g_strerror (errno));
+	  return FALSE;
+	}
+
+      for (; count > 0 && (gsize) done >= iov->iov_len; iov += 1, count -= 1)
+	done -= iov->iov_len;
+
+      if (count > 0)
+	{
+	  iov->iov_base = (guint8*) iov->iov_base + done;
+	  iov->iov_len -= done;
+	}
+    }
+#endif
 
   return TRUE;
 }
 
+#ifndef WINHACK
+static gboolean
+xd_gather_ok (XdFileHandle *fh)
+{
+  if (fh->out_write != &xd_fwrite)
+    return FALSE;
+
+  if (! fh->gather_iov)
+    {
+      fh->gather_iov   = g_new (struct iovec, XD_GATHER_IOVS);
+      fh->gather_stage = g_malloc (XD_GATHER_STAGE);
+    }
+
+  return TRUE;
+}
+
+/* Queues BUF, which has to stay put until the next flush. */
+static gboolean
+xd_gather (XdFileHandle *fh, const guint8 *buf, guint len)
+{
+  struct iovec *last = fh->gather_iov + fh->gather_count - 1;
+
+  xd_handle_account (fh, buf, len);
+
+  if (fh->gather_count > 0 && (const guint8*) last->iov_base + last->iov_len == buf)
+    last->iov_len += len;
+  else
+    {
+      fh->gather_iov[fh->gather_count].iov_base = (void*) buf;
+      fh->gather_iov[fh->gather_count].iov_len  = len;
+      fh->gather_count += 1;
+    }
+
+  fh->gather_bytes += len;
+
+  if (fh->gather_count == XD_GATHER_IOVS || fh->gather_bytes >= XD_GATHER_BYTES)
+    return xd_gather_flush (fh);
+
+  return TRUE;
+}
+
+/* Room for LEN (at most XD_GATHER_STAGE) bytes of literal data. */
+static guint8*
+xd_gather_stage (XdFileHandle *fh, guint len)
+{
+  guint8* buf;
+
+  if (fh->gather_staged + len > XD_GATHER_STAGE && ! xd_gather_flush (fh))
+    return NULL;
+
+  buf = fh->gather_stage + fh->gather_staged;
+  fh->gather_staged += len;
+
+  return buf;
+}
+#endif
+
+#ifdef XD_COPY_FILE_RANGE
+/* Has the kernel copy LEN bytes at OFF in FROM to the end of TO, so
+ * they never come up to user space (and may even be shared, on file
+ * systems that can).  Returns how many bytes were done, which is less
+ * than LEN if the kernel can't do this one. */
+static guint
+xd_copy_range (XdFileHandle *from, XdFileHandle *to, guint off, guint len)
+{
+  static gboolean unsupported = FALSE;
+  loff_t pos = from->base + off;
+  guint done = 0;
+
+  if (unsupported || ! xd_gather_flush (to) || fflush (to->out) != 0)
+    return 0;
+
+  while (done < len)
+    {
+      glong n = syscall (SYS_copy_file_range, from->fd, &pos, to->out_fd, NULL, (gsize) (len - done), 0);
+
+      if (n < 0 && errno == EINTR)
+	continue;
+
+      if (n <= 0)
+	{
+	  /* EBADF is an --append output, which the kernel won't do. */
+	  if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF))
+	    unsupported = TRUE;
+	  break;
+	}
+
+      done += n;
+    }
+
+  return done;
+}
+#endif
+
 static gboolean
 xd_handle_really_close (XdFileHandle *fh)
 {
   g_assert (fh->type == WRITE_TYPE);
 
+  if (! xd_gather_flush (fh))
+    return FALSE;
+
   if (! (* fh->out_close) (fh) || close (fh->out_fd) < 0)
     {
       xd_error ("write failed: %s\n", g_strerror (errno));
@@ -1204,6 +1561,54 @@ make_lru_room (XdFileHandle* fh)
   return TRUE;
 }
 
+/* MD5 is taken as pages are first mapped, for as long as they are
+ * mapped in order. */
+static void
+md5_page_mapped (XdFileHandle* fh, guint pgno, const guint8* mem, guint len)
+{
+  if (pgno != fh->md5_page)
+    return;
+
+  if (! no_verify)
+    edsio_md5_update (&fh->ctx, mem, len);
+  fh->md5_page += 1;
+
+  if (fh->md5_page > xd_handle_pages (fh))
+    edsio_md5_final (fh->md5, &fh->ctx);
+}
+
+#ifndef WINHACK
+/* Where there's the address space, a file is mapped whole, once, and
+ * the kernel's page cache does what the LRU below does for DOS and
+ * Windows: pages are no longer mapped and unmapped one at a time.  The
+ * TO input is read straight through, so it says so; sources are left
+ * to the kernel, except for the copies in xd_handle_copy.  If the
+ * mapping fails, this falls back on the LRU.
+ */
+static void
+xd_handle_map_whole (XdFileHandle *fh)
+{
+  void* mem;
+
+  fh->whole_tried = TRUE;
+
+  if (fh->length == 0)
+    return;
+
+  mem = mmap (NULL, fh->length, PROT_READ, MAP_PRIVATE, fh->fd, fh->base);
+
+  if (mem == MAP_FAILED)
+    return;
+
+#ifdef MADV_SEQUENTIAL
+  if (fh->type == READ_NOSEEK_TYPE)
+    madvise (mem, fh->length, MADV_SEQUENTIAL);
+#endif
+
+  fh->whole = mem;
+}
+#endif
+
 /*#define DEBUG_MAP*/
 
 static gssize
@@ -1218,6 +1623,28 @@ xd_handle_map_page (XdFileHandle *fh, guint pgno, const guint8** mem)
 
   g_assert (fh->type & READ_TYPE);
 
+#ifndef WINHACK
+  if (! fh->whole_tried)
+    xd_handle_map_whole (fh);
+
+  if (fh->whole)
+    {
+      gint on = on_page (fh, pgno);
+
+      if (on < 0)
+	{
+	  xd_error ("unexpected EOF in %s\n", fh->name);
+	  return -1;
+	}
+
+      (*mem) = fh->whole + pgno * XD_PAGE_SIZE;
+
+      md5_page_mapped (fh, pgno, *mem, on);
+
+      return on;
+    }
+#endif
+
   if (fh->lru_table->len < (pgno + 1))
     {
       gint olen = fh->lru_table->len;
@@ -1272,7 +1699,7 @@ xd_handle_map_page (XdFileHandle *fh, guint pgno, const guint8** mem)
 #ifdef WINHACK
 	  lru->buffer = g_malloc (to_map);
 
-	  if (lseek (fh->fd, pgno * XD_PAGE_SIZE, SEEK_SET) < 0)
+	  if (lseek (fh->fd, fh->base + (off_t) pgno * XD_PAGE_SIZE, SEEK_SET) < 0)
 	    {
 	      xd_error ("lseek failed: %s\n", g_strerror (errno));
 	      return -1;
@@ -1284,7 +1711,7 @@ xd_handle_map_page (XdFileHandle *fh, guint pgno, const guint8** mem)
 	      return -1;
 	    }
 #else
-	  if (! (lru->buffer = mmap (NULL, to_map, PROT_READ, MAP_PRIVATE, fh->fd, pgno * XD_PAGE_SIZE)))
+	  if (! (lru->buffer = mmap (NULL, to_map, PROT_READ, MAP_PRIVATE, fh->fd, fh->base + (off_t) pgno * XD_PAGE_SIZE)))
 	    {
 	      xd_error ("mmap failed: %s\n", g_strerror (errno));
 	      return -1;
@@ -1296,15 +1723,7 @@ xd_handle_map_page (XdFileHandle *fh, guint pgno, const guint8** mem)
 	  lru->buffer = (void*) -1;
 	}
 
-      if (pgno == fh->md5_page)
-	{
-	  if (! no_verify)
-	    edsio_md5_update (&fh->ctx, lru->buffer, to_map);
-	  fh->md5_page += 1;
-
-	  if (fh->md5_page > xd_handle_pages (fh))
-	    edsio_md5_final (fh->md5, &fh->ctx);
-	}
+      md5_page_mapped (fh, pgno, lru->buffer, to_map);
     }
 
   (*mem) = lru->buffer;
@@ -1326,6 +1745,12 @@ xd_handle_unmap_page (XdFileHandle *fh, guint pgno, const guint8** mem)
 
   g_assert (fh->type & READ_TYPE);
 
+  if (fh->whole)
+    {
+      (*mem) = NULL;
+      return TRUE;
+    }
+
   g_assert (pgno < fh->lru_table->len);
 
   lru = fh->lru_table->pdata[pgno];
@@ -1360,14 +1785,38 @@ xd_handle_copy (XdFileHandle *from, XdFileHandle *to, guint off, guint len)
 {
   if (from->in)
     {
-      guint8 buf[1024];
+      guint8 buf[1<<14];
 
       /*if (! xd_handle_set_pos (from, off))
 	return FALSE;*/
 
+#ifndef WINHACK
+      if (xd_gather_ok (to))
+	{
+	  while (len > 0)
+	    {
+	      guint r = MIN (XD_GATHER_STAGE, len);
+	      guint8* stage;
+
+	      if (! (stage = xd_gather_stage (to, r)))
+		return FALSE;
+
+	      if (xd_handle_read (from, stage, r) != r)
+		return FALSE;
+
+	      if (! xd_gather (to, stage, r))
+		return FALSE;
+
+	      len -= r;
+	    }
+
+	  return TRUE;
+	}
+#endif
+
       while (len > 0)
 	{
-	  guint r = MIN (1024, len);
+	  guint r = MIN (sizeof (buf), len);
 
 	  if (xd_handle_read (from, buf, r) != r)
 	    return FALSE;
@@ -1380,33 +1829,90 @@ xd_handle_copy (XdFileHandle *from, XdFileHandle *to, guint off, guint len)
     }
   else
     {
-      while (len > 0)
-	{
-	  guint off_page = off / XD_PAGE_SIZE;
-	  guint off_off = off % XD_PAGE_SIZE;
+#ifndef WINHACK
+      if (! from->whole_tried)
+	xd_handle_map_whole (from);
 
-	  gint on = on_page (from, off_page);
-	  guint rem;
-	  guint copy;
+      if (from->whole)
+	{
+	  const guint8* mem = from->whole + off;
 
-	  if (on <= 0)
+	  if (off + len > xd_handle_length (from) || off + len < off)
 	    {
 	      xd_error ("unexpected EOF in %s\n", from->name);
 	      return FALSE;
 	    }
 
-	  rem = on - off_off;
-	  copy = MIN (len, rem);
+#ifdef XD_COPY_FILE_RANGE
+	  if (len >= XD_COPY_RANGE_MIN && to->out_write == &xd_fwrite)
+	    {
+	      guint done = xd_copy_range (from, to, off, len);
 
-	  if (from->copy_pgno != off_page &&
-	      from->copy_page &&
-	      ! xd_handle_unmap_page (from, from->copy_pgno, &from->copy_page))
-	    return FALSE;
+	      /* the MD5 still wants to see it; that's a read, not a copy. */
+	      xd_handle_account (to, mem, done);
+	      mem += done;
+	      len -= done;
+	    }
+#endif
 
-	  from->copy_pgno = off_page;
+#ifdef MADV_WILLNEED
+	  /* Start reading all of it now, not a fault at a time. */
+	  if (len > 0)
+	    {
+	      gsize pagemask = sysconf (_SC_PAGESIZE) - 1;
+	      const guint8* start = (const guint8*) ((gsize) mem & ~pagemask);
 
-	  if (xd_handle_map_page (from, off_page, &from->copy_page) < 0)
-	    return FALSE;
+	      madvise ((void*) start, (mem + len) - start, MADV_WILLNEED);
+	    }
+#endif
+
+	  while (len > 0)
+	    {
+	      guint copy = MIN (len, XD_PAGE_SIZE);
+
+	      if (xd_gather_ok (to))
+		{
+		  if (! xd_gather (to, mem, copy))
+		    return FALSE;
+		}
+	      else if (! xd_handle_write (to, mem, copy))
+		return FALSE;
+
+	      len -= copy;
+	      mem += copy;
+	    }
+
+	  return TRUE;
+	}
+#endif
+
+      while (len > 0)
+	{
+	  guint off_page = off / XD_PAGE_SIZE;
+	  guint off_off = off % XD_PAGE_SIZE;
+
+	  gint on = on_page (from, off_page);
+	  guint rem;
+	  guint copy;
+
+	  if (on <= 0)
+	    {
+	      xd_error ("unexpected EOF in %s\n", from->name);
+	      return FALSE;
+	    }
+
+	  rem = on - off_off;
+	  copy = MIN (len, rem);
+
+	  if (from->copy_pgno != off_page &&
+	      from->copy_page &&
+	      ! xd_handle_unmap_page (from, from->copy_pgno, &from->copy_page))
+	    return FALSE;
+
+	  from->copy_pgno = off_page;
+
+	  if (xd_handle_map_page (from, off_page, &from->copy_page) < 0)
+	    return FALSE;
 
 	  if (! xd_handle_write (to, from->copy_page + off_off, copy))
 	    return FALSE;
@@ -1479,22 +1985,311 @@ ntohl_array (guint32* array, gint len)
     array[i] = g_ntohl(array[i]);
 }
 
+/* Without -s, small inputs keep the 16 byte blocks that find the
+ * shortest copies, and big ones trade those for a smaller index and
+ * fewer, longer matches.
+ */
+static gint
+auto_block_size (guint from_len)
+{
+  if (from_len < (64 << 20))
+    return 16;
+  else if (from_len < (512 << 20))
+    return 32;
+  else if (from_len < (2048U << 20))
+    return 64;
+
+  return 128;
+}
+
+/* Writes the prefix, header and names of a delta to OUT, and starts
+ * its data.  Returns where the data starts, or -1. */
+static gint
+delta_begin (XdFileHandle* out, const char* from_name, const char* to_name, guint32 flags)
+{
+  guint32 header_space[HEADER_WORDS];
+
+  memset (header_space, 0, sizeof (header_space));
+
+  if (! xd_handle_write (out, XDELTA_PREFIX, XDELTA_PREFIX_LEN))
+    return -1;
+
+  /* compute the header */
+  header_space[0] = flags;
+
+  if (compress_level != 0) header_space[0] |= FLAG_PATCH_COMPRESSED;
+
+  header_space[1] = strlen (from_name) << 16 | strlen (to_name);
+  /* end compute the header */
+
+  htonl_array (header_space, HEADER_WORDS);
+
+  if (! xd_handle_write (out, (guint8*) header_space, HEADER_SPACE))
+    return -1;
+
+  if (! xd_handle_write (out, from_name, strlen (from_name)))
+    return -1;
+
+  if (! xd_handle_write (out, to_name, strlen (to_name)))
+    return -1;
+
+  if (! xd_handle_close (out, 0))
+    return -1;
+
+  return xd_begin_compression (out);
+}
+
+/* Writes CONT and the trailer after the data, and closes OUT. */
+static gint
+delta_finish (XdFileHandle* out, XdeltaControl* cont, gint header_offset)
+{
+  gint control_offset;
+
+#if 0
+  serializeio_print_xdeltacontrol_obj (cont, 0);
+#endif
+
+  if (cont->has_data && cont->has_data == cont->source_info_len)
+    {
+      if (! quiet)
+	xd_error ("warning: no matches found in from file, patch will apply without it\n");
+    }
+
+  if (! xd_handle_close (out, 0))
+    return 2;
+
+  if ((control_offset = xd_begin_compression (out)) < 0)
+    return 2;
+
+  if (! xdp_control_write (cont, (FileHandle*) out))
+    return 2;
+
+  if (! xd_end_compression (out))
+    return 2;
+
+  if (! xd_handle_putui (out, control_offset))
+    return 2;
+
+  if (! xd_handle_write (out, XDELTA_PREFIX, XDELTA_PREFIX_LEN))
+    return 2;
+
+  if (! xd_handle_really_close (out))
+    return 2;
+
+  return control_offset != header_offset;
+}
+
+static XdFileHandle*
+open_delta_output (const char* name)
+{
+  // Note: I tried support to patches to stdout, but it broke when
+  // compression was added.  Sigh
+  int fd = open (name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+
+  if (fd < 0)
+    {
+      xd_error ("open %s failed: %s\n", name, g_strerror (errno));
+      return NULL;
+    }
+
+  return open_write_handle (fd, name);
+}
+
+/* An --indexcache entry is FROM's checksums as they are in memory,
+ * after this header, so that reading one is a single mmap.  The magic
+ * number is in native byte order: another machine's entries just miss.
+ */
+#define INDEX_CACHE_MAGIC 0x58644931  /* "XdI1" */
+
+typedef struct _IndexCacheHeader IndexCacheHeader;
+
+struct _IndexCacheHeader
+{
+  guint32 magic;
+  guint32 block_size;
+  guint32 from_len;
+  guint32 ck_count;
+  guint8  from_md5[16];
+};
+
+/* The MD5 of all of NAME, as it is on disk. */
+static gboolean
+file_md5 (const char* name, guint8* md5)
+{
+  EdsioMD5Ctx ctx;
+  guint8 buf[1<<14];
+  size_t n;
+  FILE* in;
+
+  if (! (in = fopen (name, FOPEN_READ_ARG)))
+    {
+      xd_error ("open %s failed: %s\n", name, g_strerror (errno));
+      return FALSE;
+    }
+
+  edsio_md5_init (&ctx);
+
+  while ((n = fread (buf, 1, sizeof (buf), in)) > 0)
+    edsio_md5_update (&ctx, buf, n);
+
+  if (ferror (in))
+    {
+      xd_error ("read %s failed: %s\n", name, g_strerror (errno));
+      fclose (in);
+      return FALSE;
+    }
+
+  fclose (in);
+  edsio_md5_final (md5, &ctx);
+  return TRUE;
+}
+
+static gchar*
+index_cache_name (XdFileHandle* from, guint8* md5_out)
+{
+  const guint8* md5;
+  char md5_str[33];
+
+  if (! (md5 = xd_handle_checksum_md5 (from)))
+    return NULL;
+
+  memcpy (md5_out, md5, 16);
+  edsio_md5_to_string (md5, md5_str);
+  g_free ((void*) md5);
+
+  return g_strdup_printf ("%s/%s-%d.xdi", index_cache, md5_str, xdp_blocksize ());
+}
+
+/* Maps NAME, if it is FROM's index, and hands it to SRC.  Returns the
+ * mapping, to be released by index_cache_unmap, or NULL. */
+static void*
+index_cache_map (const char* name, XdFileHandle* from, const guint8* from_md5,
+		 XdeltaSource* src, guint* map_len)
+{
+  const IndexCacheHeader* head;
+  struct stat buf;
+  void* mem;
+  int fd;
+
+  if ((fd = open (name, O_RDONLY | O_BINARY, 0)) < 0)
+    return NULL;
+
+  if (fstat (fd, &buf) < 0 || buf.st_size < sizeof (IndexCacheHeader))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  (*map_len) = buf.st_size;
+
+#ifdef WINHACK
+  mem = g_malloc (*map_len);
+
+  if (read (fd, mem, *map_len) != *map_len)
+    {
+      g_free (mem);
+      mem = NULL;
+    }
+#else
+  if ((mem = mmap (NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    mem = NULL;
+#endif
+
+  close (fd);
+
+  if (! mem)
+    return NULL;
+
+  head = mem;
+
+  if (head->magic != INDEX_CACHE_MAGIC ||
+      head->block_size != xdp_blocksize () ||
+      head->from_len != xd_handle_length (from) ||
+      memcmp (head->from_md5, from_md5, 16) != 0 ||
+      (*map_len) != sizeof (IndexCacheHeader) + head->ck_count * sizeof (XdeltaChecksum) ||
+      ! xdp_source_set_checksums (src, (const XdeltaChecksum*) (head + 1), head->ck_count))
+    {
+      if (! quiet)
+	xd_error ("warning: ignoring bad cached index %s\n", name);
+
+#ifdef WINHACK
+      g_free (mem);
+#else
+      munmap (mem, *map_len);
+#endif
+      return NULL;
+    }
+
+  if (verbose)
+    xd_error ("using cached index %s\n", name);
+
+  return mem;
+}
+
+static void
+index_cache_unmap (void* mem, guint map_len)
+{
+#ifdef WINHACK
+  g_free (mem);
+#else
+  munmap (mem, map_len);
+#endif
+}
+
+/* Saves the checksums SRC was indexed with.  They go to a temporary
+ * name first, so another delta never maps half of them.  The cache is
+ * only an optimization, so this only warns. */
+static void
+index_cache_save (const char* name, XdFileHandle* from, const guint8* from_md5, XdeltaSource* src)
+{
+  IndexCacheHeader head;
+  const XdeltaChecksum* cksums;
+  gchar* tmp_name;
+  guint count;
+  int fd;
+
+  if (! (cksums = xdp_source_checksums (src, &count)))
+    return;
+
+  memset (&head, 0, sizeof (head));
+  head.magic      = INDEX_CACHE_MAGIC;
+  head.block_size = xdp_blocksize ();
+  head.from_len   = xd_handle_length (from);
+  head.ck_count   = count;
+  memcpy (head.from_md5, from_md5, 16);
+
+  tmp_name = g_strdup_printf ("%s.%d", name, (int) getpid ());
+
+  if ((fd = open (tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0 ||
+      write (fd, &head, sizeof (head)) != sizeof (head) ||
+      write (fd, cksums, count * sizeof (XdeltaChecksum)) != count * sizeof (XdeltaChecksum) ||
+      close (fd) != 0 ||
+      rename (tmp_name, name) != 0)
+    {
+      if (! quiet)
+	xd_error ("warning: can't cache index in %s: %s\n", name, g_strerror (errno));
+
+      unlink (tmp_name);
+    }
+
+  g_free (tmp_name);
+}
+
 static gint
 delta_command (gint argc, gchar** argv)
 {
-  gint patch_out_fd;
-  const char* patch_out_name;
   XdFileHandle *from, *to, *out;
+  gchar* index_name = NULL;
+  guint8 index_md5[16];
+  void* index_map = NULL;
+  guint index_map_len = 0;
   XdeltaGenerator* gen;
   XdeltaSource* src;
   XdeltaControl* cont;
   gboolean from_is_compressed = FALSE, to_is_compressed = FALSE;
-  guint32 control_offset, header_offset;
+  gint header_offset, ret;
   const char* from_name, *to_name;
-  guint32 header_space[HEADER_WORDS];
-  int fd;
-
-  memset (header_space, 0, sizeof (header_space));
+  guint32 flags = 0;
 
   if (argc != 3)
     {
@@ -1502,114 +2297,185 @@ delta_command (gint argc, gchar** argv)
       return 2;
     }
 
+  if (! (from = open_read_seek_handle (argv[0], &from_is_compressed, TRUE, &from_range)))
+    return 2;
+
+  if (! block_size_set)
+    xdp_set_query_size_pow (auto_block_size (xd_handle_length (from)));
+
   if (verbose)
     {
       xd_error ("using block size: %d bytes\n", xdp_blocksize ());
     }
 
+  if (from_md5_set)
+    {
+      if (from_range.set || from_is_compressed)
+	{
+	  xd_error ("--frommd5 is the MD5 of all of FROM, as it is on disk\n");
+	  return 2;
+	}
 
-  if (! (from = open_read_seek_handle (argv[0], &from_is_compressed, TRUE)))
-    return 2;
-
-  if (! (to = open_read_noseek_handle (argv[1], &to_is_compressed, FALSE, TRUE)))
-    return 2;
+      xd_handle_set_md5 (from, from_md5);
+    }
+  else if (index_cache)
+    {
+      /* The index is keyed by FROM's MD5, and nothing has read FROM
+       * yet, so get it the hard way. */
+      if (from_range.set || from_is_compressed)
+	{
+	  xd_error ("--indexcache needs all of an uncompressed FROM\n");
+	  return 2;
+	}
 
-  // Note: I tried support to patches to stdout, but it broke when
-  // compression was added.  Sigh
-  fd = open (argv[2], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+      if (! file_md5 (argv[0], from_md5))
+	return 2;
 
-  if (fd < 0)
-    {
-      xd_error ("open %s failed: %s\n", argv[2], g_strerror (errno));
-      return 2;
+      xd_handle_set_md5 (from, from_md5);
     }
 
-  patch_out_fd = fd;
-  patch_out_name = argv[2];
+  if (index_cache && ! (index_name = index_cache_name (from, index_md5)))
+    return 2;
 
-  from_name = g_basename (argv[0]);
-  to_name = g_basename (argv[1]);
+  if (! (to = open_read_noseek_handle (argv[1], &to_is_compressed, FALSE, TRUE, &to_range)))
+    return 2;
 
-  if (! (out = open_write_handle (patch_out_fd, patch_out_name)))
+  if (! (out = open_delta_output (argv[2])))
     return 2;
 
+  from_name = g_basename (argv[0]);
+  to_name = g_basename (argv[1]);
+
   if (! (gen = xdp_generator_new ()))
     return 2;
 
   if (! (src = xdp_source_new (from_name, (FileHandle*) from, NULL, NULL)))
     return 2;
 
+  if (index_name)
+    index_map = index_cache_map (index_name, from, index_md5, src, &index_map_len);
+
   xdp_source_add (gen, src);
 
-  if (! xd_handle_write (out, XDELTA_PREFIX, XDELTA_PREFIX_LEN))
+  if (no_verify) flags          |= FLAG_NO_VERIFY;
+  if (from_is_compressed) flags |= FLAG_FROM_COMPRESSED;
+  if (to_is_compressed) flags   |= FLAG_TO_COMPRESSED;
+
+  if ((header_offset = delta_begin (out, from_name, to_name, flags)) < 0)
     return 2;
 
-  /* compute the header */
-  header_space[0] = 0;
+  if (! (cont = xdp_generate_delta (gen, (FileHandle*) to, NULL, (FileHandle*) out)))
+    return 2;
 
-  if (no_verify) header_space[0]           |= FLAG_NO_VERIFY;
-  if (from_is_compressed) header_space[0]  |= FLAG_FROM_COMPRESSED;
-  if (to_is_compressed) header_space[0]    |= FLAG_TO_COMPRESSED;
-  if (compress_level != 0) header_space[0] |= FLAG_PATCH_COMPRESSED;
+  ret = delta_finish (out, cont, header_offset);
 
-  header_space[1] = strlen (from_name) << 16 | strlen (to_name);
-  /* end compute the header */
+  if (index_map)
+    index_cache_unmap (index_map, index_map_len);
+  else if (index_name && ret != 2)
+    index_cache_save (index_name, from, index_md5, src);
 
-  htonl_array (header_space, HEADER_WORDS);
+  g_free (index_name);
 
-  if (! xd_handle_write (out, (guint8*) header_space, HEADER_SPACE))
-    return 2;
+  xd_read_close (from);
+  xd_read_close (to);
 
-  if (! xd_handle_write (out, from_name, strlen (from_name)))
-    return 2;
+  return ret;
+}
 
-  if (! xd_handle_write (out, to_name, strlen (to_name)))
+/* Rsync segments are about the square root of the file, which keeps
+ * the signature near 20 * sqrt(FROM_LEN) bytes. */
+static guint
+auto_segment_length (guint from_len)
+{
+  guint seg_len = 512;
+
+  while (seg_len < (64 << 10) && (seg_len * seg_len) < from_len)
+    seg_len <<= 1;
+
+  return seg_len;
+}
+
+static gint
+sign_command (gint argc, gchar** argv)
+{
+  XdFileHandle *from, *out;
+  gboolean from_is_compressed = FALSE;
+
+  if (argc != 2)
+    {
+      xd_error ("usage: %s sign fromfile signaturefile\n", program_name);
+      return 2;
+    }
+
+  /* the delta is against the file's bytes, so never gunzip it. */
+  pristine = TRUE;
+
+  if (! (from = open_read_seek_handle (argv[0], &from_is_compressed, TRUE, &from_range)))
     return 2;
 
-  if (! xd_handle_close (out, 0))
+  if (! (out = open_delta_output (argv[1])))
     return 2;
 
-  if ((header_offset = xd_begin_compression (out)) < 0)
+  if (! xdp_rsync_index ((FileHandle*) from,
+			 auto_segment_length (xd_handle_length (from)),
+			 NULL, (FileHandle*) out))
     return 2;
 
-  if (! (cont = xdp_generate_delta (gen, (FileHandle*) to, NULL, (FileHandle*) out)))
+  xd_read_close (from);
+
+  if (! xd_handle_really_close (out))
     return 2;
 
-#if 0
-  serializeio_print_xdeltacontrol_obj (cont, 0);
-#endif
+  return 0;
+}
 
-  if (cont->has_data && cont->has_data == cont->source_info_len)
+static gint
+sigdelta_command (gint argc, gchar** argv)
+{
+  XdFileHandle *sig, *to, *out;
+  XdeltaRsync* rsync;
+  XdeltaControl* cont;
+  gboolean sig_is_compressed = FALSE, to_is_compressed = FALSE;
+  gint header_offset, ret;
+  const char* from_name, *to_name;
+  guint32 flags = 0;
+
+  if (argc != 3)
     {
-      if (! quiet)
-	xd_error ("warning: no matches found in from file, patch will apply without it\n");
+      xd_error ("usage: %s sigdelta signaturefile tofile patchfile\n", program_name);
+      return 2;
     }
 
-  if (! xd_handle_close (out, 0))
+  if (! (sig = open_read_noseek_handle (argv[0], &sig_is_compressed, TRUE, TRUE, NULL)))
     return 2;
 
-  if ((control_offset = xd_begin_compression (out)) < 0)
+  if (! (rsync = xdp_rsync_index (NULL, 0, (FileHandle*) sig, NULL)))
     return 2;
 
-  if (! xdp_control_write (cont, (FileHandle*) out))
+  if (! (to = open_read_noseek_handle (argv[1], &to_is_compressed, FALSE, TRUE, &to_range)))
     return 2;
 
-  if (! xd_end_compression (out))
+  if (! (out = open_delta_output (argv[2])))
     return 2;
 
-  if (! xd_handle_putui (out, control_offset))
+  from_name = g_basename (argv[0]);
+  to_name = g_basename (argv[1]);
+
+  if (no_verify) flags        |= FLAG_NO_VERIFY;
+  if (to_is_compressed) flags |= FLAG_TO_COMPRESSED;
+
+  if ((header_offset = delta_begin (out, from_name, to_name, flags)) < 0)
     return 2;
 
-  if (! xd_handle_write (out, XDELTA_PREFIX, XDELTA_PREFIX_LEN))
+  if (! (cont = xdp_rsync_delta (rsync, from_name, (FileHandle*) to, (FileHandle*) out)))
     return 2;
 
-  xd_read_close (from);
-  xd_read_close (to);
+  ret = delta_finish (out, cont, header_offset);
 
-  if (! xd_handle_really_close (out))
-    return 2;
+  xd_read_close (sig);
+  xd_read_close (to);
 
-  return control_offset != header_offset;
+  return ret;
 }
 
 static XdeltaPatch*
@@ -1626,7 +2492,7 @@ process_patch (const char* name)
    * It will seek the file, which is not in fact checked in the map/unmap
    * logic above.  This only means that it will not cache pages of this file
    * since it will be read piecewise sequentially. */
-  if (! (patch->patch_in = open_read_noseek_handle (name, &patch->patch_is_compressed, TRUE, TRUE)))
+  if (! (patch->patch_in = open_read_noseek_handle (name, &patch->patch_is_compressed, TRUE, TRUE, NULL)))
     return NULL;
 
   if (xd_handle_read (patch->patch_in, patch->magic_buf, XDELTA_PREFIX_LEN) != XDELTA_PREFIX_LEN)
@@ -1867,7 +2733,9 @@ patch_command (gint argc, gchar** argv)
     }
   else
     {
-      to_out_fd = open (patch->to_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+      /* --append builds a windowed file up a window at a time. */
+      to_out_fd = open (patch->to_name, O_WRONLY | O_CREAT | O_BINARY |
+			(append_output ? O_APPEND : O_TRUNC), 0666);
 
       if (to_out_fd < 0)
 	{
@@ -1886,7 +2754,7 @@ patch_command (gint argc, gchar** argv)
       XdFileHandle* from_in;
       gboolean from_is_compressed = FALSE;
 
-      if (! (from_in = open_read_seek_handle (patch->from_name, &from_is_compressed, TRUE)))
+      if (! (from_in = open_read_seek_handle (patch->from_name, &from_is_compressed, TRUE, &from_range)))
 	return 2;
 
       if (from_is_compressed != ((patch->patch_flags & FLAG_FROM_COMPRESSED) && 1))
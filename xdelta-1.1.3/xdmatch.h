@@ -0,0 +1,120 @@
+/* -*- Mode: C;-*-
+ *
+ * This file is part of XDelta - A binary delta generator.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _XDMATCH_H_
+#define _XDMATCH_H_
+
+/* Match extension for try_match().  These compare two contiguous
+ * mapped spans a word (or an SSE2 vector) at a time, whatever their
+ * alignment, and only look at single bytes to find the mismatch inside
+ * the word that differs.  Page edges are the caller's problem.  Plain C
+ * types, so bench/matchbench.c can use this without glib. */
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)
+#define XDMATCH_WORDS
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define XDMATCH_FIRST_DIFF(d) (__builtin_clzll (d) >> 3)
+#define XDMATCH_LAST_DIFF(d)  (__builtin_ctzll (d) >> 3)
+#else
+#define XDMATCH_FIRST_DIFF(d) (__builtin_ctzll (d) >> 3)
+#define XDMATCH_LAST_DIFF(d)  (__builtin_clzll (d) >> 3)
+#endif
+#endif
+
+/* How many of the LEN bytes at X and Y are equal, from the front. */
+static inline int
+xdmatch_forward (const unsigned char *x, const unsigned char *y, int len)
+{
+  int n = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+  for (; n + 16 <= len; n += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i*) (x + n));
+      __m128i b = _mm_loadu_si128 ((const __m128i*) (y + n));
+      int diff = _mm_movemask_epi8 (_mm_cmpeq_epi8 (a, b)) ^ 0xffff;
+
+      if (diff)
+	return n + __builtin_ctz (diff);
+    }
+#endif
+
+#ifdef XDMATCH_WORDS
+  for (; n + 8 <= len; n += 8)
+    {
+      unsigned long long a, b;
+
+      memcpy (&a, x + n, 8);
+      memcpy (&b, y + n, 8);
+
+      if (a != b)
+	return n + XDMATCH_FIRST_DIFF (a ^ b);
+    }
+#endif
+
+  for (; n < len && x[n] == y[n]; n += 1)
+    ;
+
+  return n;
+}
+
+/* How many of the LEN bytes before X and Y are equal, from the back. */
+static inline int
+xdmatch_backward (const unsigned char *x, const unsigned char *y, int len)
+{
+  int n = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+  for (; n + 16 <= len; n += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i*) (x - n - 16));
+      __m128i b = _mm_loadu_si128 ((const __m128i*) (y - n - 16));
+      int diff = _mm_movemask_epi8 (_mm_cmpeq_epi8 (a, b)) ^ 0xffff;
+
+      if (diff)
+	return n + (__builtin_clz (diff) - 16);
+    }
+#endif
+
+#ifdef XDMATCH_WORDS
+  for (; n + 8 <= len; n += 8)
+    {
+      unsigned long long a, b;
+
+      memcpy (&a, x - n - 8, 8);
+      memcpy (&b, y - n - 8, 8);
+
+      if (a != b)
+	return n + XDMATCH_LAST_DIFF (a ^ b);
+    }
+#endif
+
+  for (; n < len && x[-n-1] == y[-n-1]; n += 1)
+    ;
+
+  return n;
+}
+
+#endif /* _XDMATCH_H_ */
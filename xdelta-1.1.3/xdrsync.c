@@ -108,7 +108,7 @@ xdp_rsync_index_int (XdeltaStream      *str,
     return NULL;
 
   {
-    XdeltaRsync* rsync = g_new (XdeltaRsync, 1);
+    XdeltaRsync* rsync = g_new0 (XdeltaRsync, 1);
 
     rsync->seg_len = seg_len;
     rsync->file_len = handle_length (str);
@@ -168,7 +168,8 @@ xdp_rsync_index (XdeltaStream      *str,
       if (! (rsync = xdp_rsync_read_index (cache_in)))
 	return NULL;
 
-      if (seg_len != rsync->seg_len ||
+      /* a SEG_LEN of 0 takes whatever the cache was made with. */
+      if ((seg_len != 0 && seg_len != rsync->seg_len) ||
 	  (str && ! check_stream_integrity (str, rsync->file_md5, rsync->file_len)))
 	{
 	  xd_generate_void_event (EC_XdInvalidRsyncCache);
@@ -441,3 +442,281 @@ xdp_apply_rsync_reply (XdeltaRsync       *rsync,
 
   return TRUE;
 }
+
+/* Rsync delta: FROM is known only by its rsync index, so the copies
+ * from it are its whole segments, found by rolling the segment
+ * checksum over IN one byte at a time, and the rest of IN is data.
+ * Unlike xdp_rsync_request, a segment may be copied any number of
+ * times.  The result is an ordinary delta against FROM: source 0 is
+ * the patch data and source 1 is FROM.
+ */
+
+typedef struct _RsyncDelta RsyncDelta;
+
+struct _RsyncDelta
+{
+  XdeltaControl *cont;
+  guint          data_pos;
+  gboolean       used[2];
+  gboolean       sequential[2];
+  guint          position[2];
+};
+
+static void
+rsync_delta_copy (RsyncDelta* rd, guint index, guint offset, guint length)
+{
+  GArray* insts = rd->cont->inst_array;
+  XdeltaInstruction i;
+
+  if (length == 0)
+    return;
+
+  if (rd->position[index] != offset)
+    rd->sequential[index] = FALSE;
+
+  rd->used[index] = TRUE;
+  rd->position[index] = offset + length;
+
+  if (insts->len > 0)
+    {
+      XdeltaInstruction* oi = & g_array_index (insts, XdeltaInstruction, insts->len-1);
+
+      if (oi->index == index && (oi->offset + oi->length) == offset)
+	{
+	  oi->length += length;
+	  return;
+	}
+    }
+
+  i.index = index;
+  i.offset = offset;
+  i.length = length;
+
+  g_array_append_val (insts, i);
+}
+
+static gboolean
+rsync_delta_data (RsyncDelta* rd, XdeltaStream* in, XdeltaOutStream* data_out, guint from, guint to)
+{
+  if (to <= from)
+    return TRUE;
+
+  if (! handle_copy (in, data_out, from, to - from))
+    return FALSE;
+
+  rsync_delta_copy (rd, 0, rd->data_pos, to - from);
+  rd->data_pos += to - from;
+
+  return TRUE;
+}
+
+static void
+rsync_seek (XdeltaPos* pos, guint abs)
+{
+  pos->page = abs / pos->page_size;
+  pos->off  = abs % pos->page_size;
+}
+
+/* The segment at OPOS ends at NPOS, on the same page or the next
+ * one.  Take its checksum, or its MD5. */
+static gboolean
+rsync_segment (XdeltaStream* in, XdeltaPos* opos, XdeltaPos* npos, guint seg_len,
+	       XdeltaChecksum* cksum, guint8* md5)
+{
+  EdsioMD5Ctx ctx;
+  guint first;
+
+  if (! map_page (in, opos) || ! map_page (in, npos))
+    return FALSE;
+
+  first = MIN (seg_len, opos->mem_rem - opos->off);
+
+  if (md5)
+    {
+      edsio_md5_init (& ctx);
+      edsio_md5_update (& ctx, opos->mem + opos->off, first);
+      edsio_md5_update (& ctx, npos->mem, seg_len - first);
+      edsio_md5_final (md5, & ctx);
+    }
+  else
+    {
+      memset (cksum, 0, sizeof (*cksum));
+      init_long_checksum (opos->mem + opos->off, first, cksum);
+      init_long_checksum (npos->mem, seg_len - first, cksum);
+    }
+
+  return TRUE;
+}
+
+static SerialRsyncIndexElt*
+rsync_find (XdeltaRsync* rsync, XdeltaStream* in, XdeltaPos* opos, XdeltaPos* npos,
+	    const XdeltaChecksum* cksum)
+{
+  SerialRsyncIndexElt* elt;
+  gboolean md5_computed = FALSE;
+  guint8 md5[16];
+
+  for (elt = rsync->table[c_hash (cksum) % rsync->table_size]; elt; elt = elt->next)
+    {
+      if (elt->cksum.high != cksum->high ||
+	  elt->cksum.low  != cksum->low)
+	continue;
+
+      if (! md5_computed)
+	{
+	  if (! rsync_segment (in, opos, npos, rsync->seg_len, NULL, md5))
+	    return NULL;
+
+	  md5_computed = TRUE;
+	}
+
+      if (memcmp (md5, elt->md5, 16) == 0)
+	return elt;
+    }
+
+  return NULL;
+}
+
+XdeltaControl*
+xdp_rsync_delta (XdeltaRsync       *rsync,
+		 const char        *from_name,
+		 XdeltaStream      *in,
+		 XdeltaOutStream   *data_out)
+{
+  const guint seg_len = rsync->seg_len;
+  const guint len = handle_length (in);
+  const guint8* in_md5;
+  const guint8* data_md5;
+  XdeltaControl* cont;
+  RsyncDelta rd;
+  guint pos = 0, data_from = 0;
+  gint i;
+
+  memset (&rd, 0, sizeof (rd));
+
+  cont = rd.cont = control_new ();
+  rd.sequential[0] = rd.sequential[1] = TRUE;
+
+  if (seg_len > 0 && len >= seg_len && rsync->index_len > 0)
+    {
+      XdeltaPos opos, npos;
+      XdeltaChecksum cksum;
+
+      if (! xdp_rsync_hash (rsync))
+	return NULL;
+
+      g_assert (seg_len < handle_pagesize (in));
+
+      init_pos (in, &opos);
+      init_pos (in, &npos);
+
+      rsync_seek (&npos, seg_len);
+
+      if (! rsync_segment (in, &opos, &npos, seg_len, &cksum, NULL))
+	return NULL;
+
+      for (;;)
+	{
+	  SerialRsyncIndexElt* elt = rsync_find (rsync, in, &opos, &npos, &cksum);
+	  guint16 old_c, new_c;
+
+	  if (elt)
+	    {
+	      if (! rsync_delta_data (&rd, in, data_out, data_from, pos))
+		return NULL;
+
+	      rsync_delta_copy (&rd, 1, (elt - rsync->index) * seg_len, seg_len);
+
+	      data_from = pos += seg_len;
+
+	      if (len - pos < seg_len)
+		break;
+
+	      rsync_seek (&opos, pos);
+	      rsync_seek (&npos, pos + seg_len);
+
+	      if (! rsync_segment (in, &opos, &npos, seg_len, &cksum, NULL))
+		return NULL;
+
+	      continue;
+	    }
+
+	  if (len - pos == seg_len)
+	    break;
+
+	  if (! map_page (in, &opos) || ! map_page (in, &npos))
+	    return NULL;
+
+	  old_c = CHEW (opos.mem[opos.off]);
+	  new_c = CHEW (npos.mem[npos.off]);
+
+	  cksum.low -= old_c;
+	  cksum.low += new_c;
+
+	  cksum.high -= old_c * seg_len;
+	  cksum.high += cksum.low;
+
+	  opos.off += 1;
+	  npos.off += 1;
+	  pos += 1;
+
+	  FLIP_FORWARD (opos);
+	  FLIP_FORWARD (npos);
+	}
+
+      if (! unmap_page (in, &opos) || ! unmap_page (in, &npos))
+	return NULL;
+    }
+
+  if (! rsync_delta_data (&rd, in, data_out, data_from, len))
+    return NULL;
+
+  if (! handle_close (data_out, 0))
+    return NULL;
+
+  if (! (in_md5 = handle_checksum_md5 (in)))
+    return NULL;
+
+  if (! (data_md5 = handle_checksum_md5 (data_out)))
+    return NULL;
+
+  cont->has_data = rd.used[0];
+  cont->to_len = len;
+  memcpy (cont->to_md5, in_md5, 16);
+
+  for (i = 0; i < 2; i += 1)
+    {
+      XdeltaSourceInfo* si;
+      gint j;
+
+      if (! rd.used[i])
+	continue;
+
+      si = g_new0 (XdeltaSourceInfo, 1);
+
+      si->name = (i == 0) ? "(patch data)" : from_name;
+      si->len = (i == 0) ? handle_length (data_out) : rsync->file_len;
+      si->isdata = (i == 0);
+      si->sequential = rd.sequential[i];
+
+      memcpy (si->md5, (i == 0) ? data_md5 : rsync->file_md5, 16);
+
+      /* sources are numbered by the ones actually used. */
+      for (j = 0; j < cont->inst_array->len; j += 1)
+	{
+	  XdeltaInstruction* inst = & g_array_index (cont->inst_array, XdeltaInstruction, j);
+
+	  if (inst->index == i)
+	    inst->index = cont->source_info_array->len;
+	}
+
+      g_ptr_array_add (cont->source_info_array, si);
+    }
+
+  cont->inst = &g_array_index (cont->inst_array, XdeltaInstruction, 0);
+  cont->inst_len = cont->inst_array->len;
+  cont->source_info = (XdeltaSourceInfo**) cont->source_info_array->pdata;
+  cont->source_info_len = cont->source_info_array->len;
+
+  return cont;
+}